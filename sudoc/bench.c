@@ -0,0 +1,408 @@
+// clock_gettime
+#define _POSIX_C_SOURCE 199309L
+
+#include "include/matrix.h"
+#include "include/simd.h"
+#include "include/optimizer.h"
+#include <string.h>
+#include <time.h>
+
+// Micro-benchmarks of the matrix kernels.
+//
+// usage: bench [output.json] [--quick]
+//
+// Times GEMMs (square shapes and the layers of build_nn2, forward and
+// backward), convolutions (forward and both gradients) and elementwise ops.
+// Every case reports its time percentiles, GFLOP/s and the bytes it has to
+// move at least (operands read once, results written once), and the results
+// are also written as JSON to compare runs when kernels change.
+// SUDOC_NUM_THREADS sets the thread count, --quick shortens every case.
+
+// a case runs until both limits are reached
+#define BENCH_MIN_TIME 0.25
+#define BENCH_MIN_REPS 10
+#define BENCH_MAX_REPS 10000
+
+typedef void (*BenchFunc)(void *ctx);
+
+typedef struct
+{
+    char name[48];
+    char shape[48];
+    double flops;
+    double bytes;
+    int reps;
+    double min, p50, p90, p99, max; // seconds
+} BenchResult;
+
+static BenchResult *results = NULL;
+static int num_results = 0;
+static double min_time = BENCH_MIN_TIME;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+// times func(ctx) and records the result
+static void bench_run(const char *name, const char *shape, double flops, double bytes, BenchFunc func, void *ctx)
+{
+    // warm up the caches, the arena and the thread pool
+    func(ctx);
+    func(ctx);
+
+    double *times = malloc(sizeof(double) * BENCH_MAX_REPS);
+    if (times == NULL)
+        errx(EXIT_FAILURE, "bench: failed to allocate the timings\n");
+
+    int reps = 0;
+    double total = 0.0;
+    while (reps < BENCH_MAX_REPS && (reps < BENCH_MIN_REPS || total < min_time))
+    {
+        double start = now();
+        func(ctx);
+        times[reps] = now() - start;
+        total += times[reps++];
+    }
+    qsort(times, reps, sizeof(double), compare_doubles);
+
+    results = realloc(results, sizeof(BenchResult) * (num_results + 1));
+    if (results == NULL)
+        errx(EXIT_FAILURE, "bench: failed to allocate the results\n");
+
+    BenchResult *r = &results[num_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    snprintf(r->shape, sizeof(r->shape), "%s", shape);
+    r->flops = flops;
+    r->bytes = bytes;
+    r->reps = reps;
+    r->min = times[0];
+    r->p50 = percentile(times, reps, 0.5);
+    r->p90 = percentile(times, reps, 0.9);
+    r->p99 = percentile(times, reps, 0.99);
+    r->max = times[reps - 1];
+    free(times);
+
+    printf("%-26s %-24s %9.3f %9.3f %9.3f %9.2f %9.2f\n", r->name, r->shape,
+           r->p50 * 1e3, r->p90 * 1e3, r->p99 * 1e3, flops / r->p50 * 1e-9, bytes / r->p50 * 1e-9);
+}
+
+static void random_matrix(float *data, int n)
+{
+    for (int i = 0; i < n; i++)
+        data[i] = (float)rand() / RAND_MAX * 2.0f - 1.0f;
+}
+
+#pragma region gemm
+
+typedef struct
+{
+    Matrix *a, *b, *bias, *c;
+    bool trans_a, trans_b;
+    int activation; // -1 for a plain product
+} GemmCase;
+
+static void gemm_run(void *ctx)
+{
+    GemmCase *g = ctx;
+    if (g->activation < 0)
+        matrix_multiply_ex(g->a, g->trans_a, g->b, g->trans_b, 1.0f, 0.0f, g->c);
+    else
+        matrix_multiply_fused(g->a, g->trans_a, g->b, g->trans_b, g->bias, g->activation, g->c);
+}
+
+// c (M, N) = op(a) * op(b) with a K deep product
+static void bench_gemm(const char *name, int M, int N, int K, bool trans_a, bool trans_b, int activation)
+{
+    GemmCase g = {
+        trans_a ? matrix_init(K, M, NULL) : matrix_init(M, K, NULL),
+        trans_b ? matrix_init(N, K, NULL) : matrix_init(K, N, NULL),
+        activation < 0 ? NULL : matrix_init(1, N, NULL),
+        matrix_init(M, N, NULL),
+        trans_a, trans_b, activation};
+    random_matrix(g.a->data, g.a->size);
+    random_matrix(g.b->data, g.b->size);
+    if (g.bias != NULL)
+        random_matrix(g.bias->data, g.bias->size);
+
+    char shape[48];
+    snprintf(shape, sizeof(shape), "%dx%dx%d%s%s", M, N, K, trans_a ? " At" : "", trans_b ? " Bt" : "");
+    double bytes = sizeof(float) * ((double)M * K + (double)K * N + (double)M * N + (g.bias != NULL ? N : 0));
+    bench_run(name, shape, 2.0 * M * N * K, bytes, gemm_run, &g);
+
+    matrix_destroy(g.a);
+    matrix_destroy(g.b);
+    if (g.bias != NULL)
+        matrix_destroy(g.bias);
+    matrix_destroy(g.c);
+}
+
+// forward and backward products of a fully connected layer, as in layer.c
+static void bench_fc_layer(const char *layer, int batch, int in, int out)
+{
+    char name[48];
+    snprintf(name, sizeof(name), "%s.forward", layer);
+    bench_gemm(name, batch, out, in, false, true, ACTIVATION_RELU);
+    snprintf(name, sizeof(name), "%s.weights_grad", layer);
+    bench_gemm(name, out, in, batch, true, false, -1);
+    snprintf(name, sizeof(name), "%s.input_grad", layer);
+    bench_gemm(name, batch, in, out, false, false, -1);
+}
+
+#pragma endregion gemm
+
+#pragma region convolution
+
+typedef struct
+{
+    Matrix4 *weights, *input, *output;
+    int stride, padding;
+} ConvCase;
+
+static void conv_forward(void *ctx)
+{
+    ConvCase *c = ctx;
+    matrix4_convolve(c->weights, c->input, c->output, c->stride, c->padding);
+}
+
+static void conv_weights_grad(void *ctx)
+{
+    ConvCase *c = ctx;
+    matrix4_convolve_weights_grad(c->input, c->output, c->weights, c->stride, c->padding);
+}
+
+static void conv_input_grad(void *ctx)
+{
+    ConvCase *c = ctx;
+    matrix4_grad_input_convolve(c->weights, c->output, c->input, c->stride, c->padding);
+}
+
+// the three convolutions of a layer, the gradients reuse the forward buffers
+static void bench_conv(const char *layer, int batch, int in_channels, int size, int out_channels,
+                       int kernel, int stride, int padding)
+{
+    int out_size = (size + 2 * padding - kernel) / stride + 1;
+    ConvCase c = {
+        matrix4_init(out_channels, in_channels, kernel, kernel, NULL),
+        matrix4_init(batch, in_channels, size, size, NULL),
+        matrix4_init(batch, out_channels, out_size, out_size, NULL),
+        stride, padding};
+    random_matrix(c.weights->data, c.weights->size);
+    random_matrix(c.input->data, c.input->size);
+    random_matrix(c.output->data, c.output->size);
+
+    char name[48], shape[48];
+    snprintf(shape, sizeof(shape), "%dx%dx%d^2 %dk%d s%d", batch, in_channels, size, out_channels, kernel, stride);
+    double flops = 2.0 * batch * out_channels * out_size * out_size * in_channels * kernel * kernel;
+    double bytes = sizeof(float) * ((double)c.weights->size + c.input->size + c.output->size);
+
+    snprintf(name, sizeof(name), "%s.forward", layer);
+    bench_run(name, shape, flops, bytes, conv_forward, &c);
+    snprintf(name, sizeof(name), "%s.weights_grad", layer);
+    bench_run(name, shape, flops, bytes, conv_weights_grad, &c);
+    snprintf(name, sizeof(name), "%s.input_grad", layer);
+    bench_run(name, shape, flops, bytes, conv_input_grad, &c);
+
+    matrix4_destroy(c.weights);
+    matrix4_destroy(c.input);
+    matrix4_destroy(c.output);
+}
+
+#pragma endregion convolution
+
+#pragma region elementwise
+
+typedef struct
+{
+    Matrix *a, *b, *c;
+} ElementwiseCase;
+
+static void add_run(void *ctx)
+{
+    ElementwiseCase *e = ctx;
+    matrix_add(e->a, e->b, e->c);
+}
+
+static void multiply_run(void *ctx)
+{
+    ElementwiseCase *e = ctx;
+    matrix_elementwise_multiply(e->a, e->b, e->c);
+}
+
+static void sigmoid_run(void *ctx)
+{
+    ElementwiseCase *e = ctx;
+    matrix_activate(e->a, ACTIVATION_SIGMOID, e->c);
+}
+
+static void bench_elementwise(int rows, int cols)
+{
+    ElementwiseCase e = {matrix_init(rows, cols, NULL), matrix_init(rows, cols, NULL), matrix_init(rows, cols, NULL)};
+    random_matrix(e.a->data, e.a->size);
+    random_matrix(e.b->data, e.b->size);
+
+    char shape[48];
+    snprintf(shape, sizeof(shape), "%dx%d", rows, cols);
+    double n = (double)rows * cols;
+    bench_run("add", shape, n, sizeof(float) * 3 * n, add_run, &e);
+    bench_run("elementwise_multiply", shape, n, sizeof(float) * 3 * n, multiply_run, &e);
+    bench_run("sigmoid", shape, n, sizeof(float) * 2 * n, sigmoid_run, &e);
+
+    matrix_destroy(e.a);
+    matrix_destroy(e.b);
+    matrix_destroy(e.c);
+}
+
+#pragma endregion elementwise
+
+#pragma region optimizer
+
+typedef struct
+{
+    Matrix *params, *gradient;
+    Optimizer optimizer;
+    OptimizerState state;
+} OptimizerCase;
+
+// the SGD update as two matrix operations, the way the layers used to do
+// it. The gradient is scaled in place by -1 rather than by the learning rate
+// so that it does not vanish to denormals over the repetitions.
+static void sgd_two_pass_run(void *ctx)
+{
+    OptimizerCase *o = ctx;
+    matrix_multiply_scalar(o->gradient, -1.0f);
+    matrix_add(o->params, o->gradient, o->params);
+}
+
+static void optimizer_run(void *ctx)
+{
+    OptimizerCase *o = ctx;
+    optimizer_begin_step(&o->optimizer);
+    optimizer_step(&o->optimizer, o->params->data, o->gradient->data, o->params->size, &o->state, true);
+}
+
+static void bench_optimizer(const char *layer, int rows, int cols)
+{
+    OptimizerCase o = {0};
+    o.params = matrix_init(rows, cols, NULL);
+    o.gradient = matrix_init(rows, cols, NULL);
+    random_matrix(o.params->data, o.params->size);
+    random_matrix(o.gradient->data, o.gradient->size);
+
+    char shape[48], name[48];
+    snprintf(shape, sizeof(shape), "%dx%d", rows, cols);
+    double n = (double)rows * cols;
+    snprintf(name, sizeof(name), "%s.sgd_two_pass", layer);
+    bench_run(name, shape, 2 * n, sizeof(float) * 5 * n, sgd_two_pass_run, &o);
+    random_matrix(o.gradient->data, o.gradient->size);
+
+    // bytes: the parameters and the state are read and written, the gradient read
+    const char *names[] = {"sgd", "momentum", "nesterov", "adamw"};
+    Optimizer optimizers[] = {
+        optimizer_sgd(0.001f),
+        optimizer_momentum(0.001f, 0.9f, false),
+        optimizer_momentum(0.001f, 0.9f, true),
+        optimizer_adamw(0.001f, 0.9f, 0.999f, 1e-8f, 0.01f),
+    };
+    int moments[] = {0, 1, 1, 2};
+    for (int i = 0; i < 4; i++)
+    {
+        o.optimizer = optimizers[i];
+        o.state = (OptimizerState){0};
+        snprintf(name, sizeof(name), "%s.%s", layer, names[i]);
+        bench_run(name, shape, 2 * n, sizeof(float) * (3 + 2 * moments[i]) * n, optimizer_run, &o);
+        optimizer_state_reset(&o.state);
+    }
+
+    matrix_destroy(o.params);
+    matrix_destroy(o.gradient);
+}
+
+#pragma endregion optimizer
+
+static void write_json(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL)
+        errx(EXIT_FAILURE, "bench: cannot write %s\n", filename);
+
+    fprintf(fp, "{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"results\": [\n",
+            simd_kernels()->name, matrix_get_num_threads());
+    for (int i = 0; i < num_results; i++)
+    {
+        BenchResult *r = &results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"shape\": \"%s\", \"flops\": %.0f, \"bytes\": %.0f, \"reps\": %d, "
+                    "\"min_ms\": %.6f, \"p50_ms\": %.6f, \"p90_ms\": %.6f, \"p99_ms\": %.6f, \"max_ms\": %.6f, "
+                    "\"gflops\": %.4f, \"gbytes_per_s\": %.4f}%s\n",
+                r->name, r->shape, r->flops, r->bytes, r->reps,
+                r->min * 1e3, r->p50 * 1e3, r->p90 * 1e3, r->p99 * 1e3, r->max * 1e3,
+                r->flops / r->p50 * 1e-9, r->bytes / r->p50 * 1e-9, i + 1 < num_results ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = "bench.json";
+    bool quick = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else
+            output = argv[i];
+    }
+    if (quick)
+        min_time = BENCH_MIN_TIME / 10;
+
+    srand(42);
+    printf("kernels: %s, threads: %d\n", simd_kernels()->name, matrix_get_num_threads());
+    printf("%-26s %-24s %9s %9s %9s %9s %9s\n", "case", "shape", "p50 ms", "p90 ms", "p99 ms", "GFLOP/s", "GB/s");
+
+    // square GEMMs
+    int squares[] = {64, 128, 256, 512};
+    for (int i = 0; i < 4; i++)
+        bench_gemm("gemm", squares[i], squares[i], squares[i], false, false, -1);
+
+    // layers of build_nn2, for one cell and a whole grid
+    int batches[] = {1, 81};
+    for (int i = 0; i < 2; i++)
+    {
+        bench_fc_layer("nn2.fc0", batches[i], 28 * 28, 256);
+        bench_fc_layer("nn2.fc1", batches[i], 256, 256);
+        bench_fc_layer("nn2.fc2", batches[i], 256, 128);
+        bench_fc_layer("nn2.fc3", batches[i], 128, 10);
+    }
+
+    // the convolution of the test CNN, its commented second layer and a wider one
+    bench_conv("cnn.conv0", 32, 1, 28, 8, 3, 2, 1);
+    bench_conv("cnn.conv1", 32, 8, 14, 16, 3, 2, 1);
+    bench_conv("conv3x3", 8, 32, 32, 32, 3, 1, 1);
+
+    bench_elementwise(81, 784);
+    bench_elementwise(1024, 1024);
+
+    // update of the largest weights of build_nn2
+    bench_optimizer("nn2.fc0", 256, 28 * 28);
+
+    write_json(output);
+    printf("results written to %s\n", output);
+
+    free(results);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "matrix.h"
+
+// Counters of the calling thread's workspace arena
+typedef struct
+{
+    long requests;       // temporaries handed out
+    long reused;         // requests served from a free list (mallocs avoided)
+    long allocations;    // requests that had to allocate a new matrix
+    long live;           // temporaries currently handed out
+    size_t pooled_bytes; // data owned by the arena, in use or free
+} ArenaStats;
+
+void matrix_arena_begin();
+void matrix_arena_end();
+Matrix *matrix_arena_get(int dim1, int dim2);
+Matrix4 *matrix4_arena_get(int dim1, int dim2, int dim3, int dim4, int layout);
+void matrix_arena_put(Matrix *m);
+void matrix4_arena_put(Matrix4 *m);
+ArenaStats matrix_arena_stats();
+void matrix_arena_reset_stats();
+void matrix_arena_release();
@@ -8,6 +8,7 @@
 #include <dirent.h>
 
 #include "../include/matrix.h"
+#include "../include/linalg.h"
 #include "../include/utils.h"
 
 typedef float pixel_t;
@@ -236,6 +237,7 @@ int *CV_CONVEX_HULL(int *points, int npoints, int *nconvex);
 int *CV_GET_RECT_FROM_CONTOUR(int *points, int n);
 int *CV_FIND_SUDOKU_RECT(const Image *src1, const Image *src2);
 
+Image *CV_WARP_PERSPECTIVE(const Image *src, const Mat3 *M, Tupple dsize, Tupple offset, Uint32 background);
 Image *CV_TRANSFORM(const Image *src, const Matrix *M, Tupple dsize, Tupple origin, Uint32 background);
 Image *CV_ROTATE(const Image *src, float angle, bool resize, Uint32 background);
 Image *CV_SCALE(const Image *src, float scale, Uint32 background);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include "matrix.h"
+
+// batches decoded ahead of the one being trained on
+#define DATALOADER_PREFETCH 4
+
+// Writes the sample_size values of the sample into dst. Called from the
+// loader threads, concurrently for different samples.
+typedef void (*DataLoaderRead)(void *ctx, int sample, float *dst);
+
+// A batch of the ring, see dataloader_next
+typedef struct
+{
+    Matrix *inputs; // (batch_size, sample_size)
+    Matrix *labels; // (batch_size, num_classes), one-hot
+    long index;     // number of the batch since the start, -1 while empty
+    bool ready;
+} DataBatch;
+
+struct DataLoader
+{
+    int num_samples;
+    int sample_size;
+    int num_classes;
+    const int *labels; // class of every sample
+    int batch_size;
+    int batches_per_epoch;
+
+    DataLoaderRead read;
+    void *ctx;
+
+    // shuffled sample order of the even and odd epochs
+    int *order[2];
+    unsigned long rng;
+
+    DataBatch *ring;
+    int ring_size;
+    long next_fill;    // next batch for a loader thread
+    long next_consume; // next batch for dataloader_next
+    long shuffled;     // epochs whose order is ready
+
+    pthread_mutex_t lock;
+    pthread_cond_t batch_free;
+    pthread_cond_t batch_ready;
+    bool stopping;
+
+    pthread_t *threads;
+    int num_threads;
+};
+typedef struct DataLoader DataLoader;
+
+DataLoader *dataloader_init(int num_samples, int sample_size, const int *labels, int num_classes,
+                            int batch_size, DataLoaderRead read, void *ctx,
+                            int prefetch, int num_threads, unsigned long seed);
+DataBatch *dataloader_next(DataLoader *loader);
+void dataloader_destroy(DataLoader *loader);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdlib.h>
+#include <err.h>
+#include <stdbool.h>
+#include "threadpool.h"
+#include "simd.h"
+
+// Register tile computed by the micro-kernel (rows x columns of C)
+#define GEMM_MR 4
+#define GEMM_NR 8
+
+// Cache blocking: an (MC x KC) block of A stays in L2, a (KC x NR) panel of B
+// stays in L1 and a (KC x NC) block of B stays in L3
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 1024
+
+// Products with fewer multiply-adds than this run on a single thread
+#define GEMM_PARALLEL_MIN_WORK (64 * 64 * 64)
+
+// Bias and activation applied to each tile of C as it is written back:
+//   C = act(alpha * op(A) * op(B) + beta * C + bias)
+typedef struct
+{
+    const float *bias; // NULL for no bias
+    bool bias_rows;    // bias[i] is added to row i, otherwise bias[j] to column j
+    int activation;    // one of ActivationKind, ACTIVATION_CUSTOM is not supported
+} GemmEpilogue;
+
+void sgemm(bool transA, bool transB, int M, int N, int K,
+           float alpha, const float *A, int lda,
+           const float *B, int ldb,
+           float beta, float *C, int ldc);
+void sgemm_fused(bool transA, bool transB, int M, int N, int K,
+                 float alpha, const float *A, int lda,
+                 const float *B, int ldb,
+                 float beta, float *C, int ldc,
+                 const GemmEpilogue *epilogue);
+void sgemm_mixed(bool transA, bool transB, int M, int N, int K,
+                 float alpha, const void *A, int storageA, int lda,
+                 const void *B, int storageB, int ldb,
+                 float beta, float *C, int ldc,
+                 const GemmEpilogue *epilogue);
+void sgemm_release_buffers();
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "matrix.h"
+#include "arena.h"
+#include "optimizer.h"
 
 // Fully connected layer
 struct FCLayer
@@ -10,6 +12,9 @@ struct FCLayer
     int input_size;
     int output_size;
 
+    // built-in activations use vectorized kernels, the function pointers
+    // are only called for ACTIVATION_CUSTOM
+    int activation; // one of ActivationKind
     float (*activation_func)(float);
     float (*d_activation_func)(float);
 
@@ -19,18 +24,52 @@ struct FCLayer
     Matrix *deltas;
     Matrix *weights_gradient;
     Matrix *biases_gradient;
+
+    // optimizer state of the weights and the biases, see optimizer.h
+    OptimizerState weights_state;
+    OptimizerState biases_state;
+
+    // fp16 / bf16 copy of the weights read by the forward pass (NULL to read
+    // the fp32 ones), see fc_layer_set_weight_storage. Set weights16_stale
+    // whenever weights change so the next forward pass converts them again.
+    Matrix16 *weights16;
+    bool weights16_stale;
+
+    // magnitude pruning, see fc_layer_prune. prune_mask is 0 for the pruned
+    // weights and 1 for the others (NULL when the layer is dense). Above
+    // FC_SPARSE_MIN_SPARSITY the forward pass reads the CSR copy of the
+    // weights, rebuilt like weights16 when sparse_stale is set.
+    float sparsity;
+    Matrix *prune_mask;
+    SparseMatrix *sparse_weights;
+    bool sparse_stale;
 };
 
 typedef struct FCLayer FCLayer;
 
+// fraction of pruned weights from which the forward pass uses the CSR
+// weights. With 784x256 weights the sparse product catches up with the dense
+// GEMM around 0.2 and is twice as fast at 0.5, for batches of 1 and 81 rows;
+// the margin covers CPUs where the GEMM fares better.
+#define FC_SPARSE_MIN_SPARSITY 0.5f
+
 Matrix *fc_weight_init(int dim1, int dim2);
 Matrix *fc_bias_init(int dim1, int dim2);
 FCLayer *fc_layer_init(
     int input_size, int output_size, int batch_size,
     float (*activation_func)(float), float (*d_activation_func)(float),
     char *name);
+void fc_layer_set_weight_storage(FCLayer *layer, int storage);
+void fc_layer_prune(FCLayer *layer, float sparsity);
+void fc_layer_set_batch_size(FCLayer *layer, int batch_size);
 Matrix *fc_layer_forward(FCLayer *layer, Matrix *input);
+Matrix *fc_layer_infer(FCLayer *layer, Matrix *input, Matrix *dst);
+void fc_layer_release_training(FCLayer *layer);
+void fc_layer_refresh_weights(FCLayer *layer);
 Matrix *fc_layer_backward(FCLayer *layer, Matrix *prev_Z, Matrix *prev_deltas, float learning_rate);
+Matrix *fc_layer_gradients(FCLayer *layer, Matrix *prev_Z, Matrix *prev_deltas);
+void fc_layer_update(FCLayer *layer, float learning_rate);
+void fc_layer_apply(FCLayer *layer, Optimizer *optimizer);
 void fc_layer_print(FCLayer *layer);
 void fc_layer_destroy(FCLayer *layer);
 
@@ -51,6 +90,7 @@ struct ConvLayer
     int stride;
     int padding;
 
+    int activation; // one of ActivationKind, see FCLayer
     float (*activation_func)(float);
     float (*d_activation_func)(float);
 
@@ -61,6 +101,24 @@ struct ConvLayer
     Matrix4 *outgrad;
     Matrix4 *weights_gradient;
     Matrix *biases_gradient;
+    OptimizerState weights_state;
+    OptimizerState biases_state;
+
+    // Winograd F(2x2, 3x3) transform of the weights, only for 3x3 stride 1
+    // kernels (NULL otherwise). Set winograd_stale whenever weights change so
+    // the next forward pass recomputes it.
+    Matrix4 *winograd_weights;
+    bool winograd_stale;
+
+    // 16-bit copy of the weights, see FCLayer
+    Matrix16 *weights16;
+    bool weights16_stale;
+
+    // weights packed by matrix4_blocked_weights for the blocked layout of the
+    // activations (NULL for NCHW), rebuilt like winograd_weights when
+    // blocked_stale is set.
+    Matrix4 *blocked_weights;
+    bool blocked_stale;
 };
 typedef struct ConvLayer ConvLayer;
 
@@ -71,13 +129,23 @@ ConvLayer *conv_layer_init(
     int n_filters, int kernel_size, int stride, int padding, int batch_size,
     float (*activation_func)(float), float (*d_activation_func)(float),
     char *name);
+void conv_layer_set_layout(ConvLayer *layer, int layout);
+void conv_layer_set_weight_storage(ConvLayer *layer, int storage);
 Matrix4 *conv_layer_forward(ConvLayer *layer, Matrix4 *input);
+void conv_layer_refresh_weights(ConvLayer *layer);
 Matrix4 *conv_layer_backward(ConvLayer *layer, Matrix4 *previous_activations, Matrix4 *previous_deltas, float learning_rate);
+Matrix4 *conv_layer_gradients(ConvLayer *layer, Matrix4 *previous_activations, Matrix4 *previous_deltas);
+void conv_layer_update(ConvLayer *layer, float learning_rate);
+void conv_layer_apply(ConvLayer *layer, Optimizer *optimizer);
 void conv_layer_print(ConvLayer *layer);
 void conv_layer_destroy(ConvLayer *layer);
 
 // activations
+int activation_kind(float (*activation_func)(float), float (*d_activation_func)(float));
 float sigmoid(float x);
+// The derivatives take the output y of the activation, the value the layers
+// keep in activations, not its input x: d_sigmoid(y) = y * (1 - y) with
+// y = sigmoid(x). For relu and leaky_relu both give the same result.
 float d_sigmoid(float x);
 float relu(float x);
 float d_relu(float x);
@@ -90,6 +158,10 @@ struct ActivationLayer
 {
     int input_size;
     int batch_size;
+
+    // set for the (softmax, d_softmax) pair: the forward pass writes the
+    // probabilities in place and the loss gradient is directly p - y
+    bool softmax_cross_entropy;
     Matrix *(*activation_func)(Matrix *);
     Matrix *(*d_activation_func)(Matrix *);
     float (*loss_func)(Matrix *);
@@ -102,8 +174,12 @@ typedef struct ActivationLayer ActivationLayer;
 ActivationLayer *activation_layer_init(
     int input_size, int batch_size,
     Matrix *(*activation_func)(Matrix *), Matrix *(*d_activation_func)(Matrix *));
+void activation_layer_set_batch_size(ActivationLayer *layer, int batch_size);
 Matrix *activation_layer_forward(ActivationLayer *layer, Matrix *input);
+Matrix *activation_layer_infer(ActivationLayer *layer, Matrix *input, Matrix *dst);
+void activation_layer_release_training(ActivationLayer *layer);
 Matrix *activation_layer_backward(ActivationLayer *layer, Matrix *previous_deltas);
+Matrix *activation_layer_loss_backward(ActivationLayer *layer, Matrix *labels);
 void activation_layer_destroy(ActivationLayer *layer);
 
 struct FlattenLayer
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdbool.h>
+#include "matrix.h"
+
+/*
+Fixed-size linear algebra for image geometry.
+
+Homographies are always 3x3 and estimating one from 4 point pairs is always
+an 8x8 system, so instead of heap allocated Matrix objects these types live
+on the stack and every loop has a constant trip count the compiler unrolls.
+
+    Mat3 H;
+    if (!mat3_homography(src, dst, &H))
+        ... // degenerate quadrilateral
+    Vec2 p = mat3_map(&H, x, y);
+
+Systems are solved in double precision, like matrix_solve().
+*/
+
+// 3x3 matrix, m[row][col]
+typedef struct
+{
+    float m[3][3];
+} Mat3;
+
+// 8x8 system matrix, m[row][col]
+typedef struct
+{
+    double m[8][8];
+} Mat8;
+
+typedef struct
+{
+    float x;
+    float y;
+} Vec2;
+
+static inline Mat3 mat3_identity()
+{
+    Mat3 a = {{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}};
+    return a;
+}
+
+// row major array of 9 values
+static inline Mat3 mat3_from_array(const float *values)
+{
+    Mat3 a;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            a.m[i][j] = values[i * 3 + j];
+    return a;
+}
+
+static inline Mat3 mat3_from_matrix(const Matrix *M)
+{
+    Mat3 a;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            a.m[i][j] = M->data[i * M->stride + j];
+    return a;
+}
+
+// copies a into the 3x3 matrix dst, allocated when NULL
+static inline Matrix *mat3_to_matrix(const Mat3 *a, Matrix *dst)
+{
+    if (dst == NULL)
+        dst = matrix_init(3, 3, NULL);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            dst->data[i * dst->stride + j] = a->m[i][j];
+    return dst;
+}
+
+static inline Mat3 mat3_mul(const Mat3 *a, const Mat3 *b)
+{
+    Mat3 c;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            c.m[i][j] = a->m[i][0] * b->m[0][j] + a->m[i][1] * b->m[1][j] + a->m[i][2] * b->m[2][j];
+    return c;
+}
+
+static inline double mat3_det(const Mat3 *a)
+{
+    const float(*m)[3] = a->m;
+    return (double)m[0][0] * ((double)m[1][1] * m[2][2] - (double)m[1][2] * m[2][1]) -
+           (double)m[0][1] * ((double)m[1][0] * m[2][2] - (double)m[1][2] * m[2][0]) +
+           (double)m[0][2] * ((double)m[1][0] * m[2][1] - (double)m[1][1] * m[2][0]);
+}
+
+// inverse through the adjugate, returns false when a is singular
+static inline bool mat3_inverse(const Mat3 *a, Mat3 *dst)
+{
+    const float(*m)[3] = a->m;
+    double det = mat3_det(a);
+    if (det == 0.0)
+        return false;
+
+    double inv = 1.0 / det;
+    Mat3 r;
+    r.m[0][0] = ((double)m[1][1] * m[2][2] - (double)m[1][2] * m[2][1]) * inv;
+    r.m[0][1] = ((double)m[0][2] * m[2][1] - (double)m[0][1] * m[2][2]) * inv;
+    r.m[0][2] = ((double)m[0][1] * m[1][2] - (double)m[0][2] * m[1][1]) * inv;
+    r.m[1][0] = ((double)m[1][2] * m[2][0] - (double)m[1][0] * m[2][2]) * inv;
+    r.m[1][1] = ((double)m[0][0] * m[2][2] - (double)m[0][2] * m[2][0]) * inv;
+    r.m[1][2] = ((double)m[0][2] * m[1][0] - (double)m[0][0] * m[1][2]) * inv;
+    r.m[2][0] = ((double)m[1][0] * m[2][1] - (double)m[1][1] * m[2][0]) * inv;
+    r.m[2][1] = ((double)m[0][1] * m[2][0] - (double)m[0][0] * m[2][1]) * inv;
+    r.m[2][2] = ((double)m[0][0] * m[1][1] - (double)m[0][1] * m[1][0]) * inv;
+    *dst = r;
+    return true;
+}
+
+// maps the point (x, y) through the homography h
+static inline Vec2 mat3_map(const Mat3 *h, float x, float y)
+{
+    const float(*m)[3] = h->m;
+    float w = m[2][0] * x + m[2][1] * y + m[2][2];
+    Vec2 p = {(m[0][0] * x + m[0][1] * y + m[0][2]) / w,
+              (m[1][0] * x + m[1][1] * y + m[1][2]) / w};
+    return p;
+}
+
+// solves a x = b in place in b with partial pivoting, a is overwritten.
+// Returns false when a is singular.
+static inline bool mat8_solve(Mat8 *a, double *b)
+{
+    double(*m)[8] = a->m;
+    for (int k = 0; k < 8; k++)
+    {
+        int pivot = k;
+        for (int i = k + 1; i < 8; i++)
+            if (fabs(m[i][k]) > fabs(m[pivot][k]))
+                pivot = i;
+        if (m[pivot][k] == 0.0)
+            return false;
+
+        if (pivot != k)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                double t = m[k][j];
+                m[k][j] = m[pivot][j];
+                m[pivot][j] = t;
+            }
+            double t = b[k];
+            b[k] = b[pivot];
+            b[pivot] = t;
+        }
+
+        for (int i = k + 1; i < 8; i++)
+        {
+            double f = m[i][k] / m[k][k];
+            for (int j = k; j < 8; j++)
+                m[i][j] -= f * m[k][j];
+            b[i] -= f * b[k];
+        }
+    }
+
+    for (int i = 7; i >= 0; i--)
+    {
+        for (int j = i + 1; j < 8; j++)
+            b[i] -= m[i][j] * b[j];
+        b[i] /= m[i][i];
+    }
+    return true;
+}
+
+// homography h mapping the 4 points src onto dst (h[2][2] = 1).
+// Returns false when 3 of the points are aligned.
+static inline bool mat3_homography(const Tupple *src, const Tupple *dst, Mat3 *h)
+{
+    Mat8 a;
+    double b[8];
+    for (int p = 0; p < 4; p++)
+    {
+        double x = src[p].x, y = src[p].y, u = dst[p].x, v = dst[p].y;
+        double rows[2][8] = {
+            {x, y, 1, 0, 0, 0, -u * x, -u * y},
+            {0, 0, 0, x, y, 1, -v * x, -v * y},
+        };
+        for (int j = 0; j < 8; j++)
+        {
+            a.m[2 * p][j] = rows[0][j];
+            a.m[2 * p + 1][j] = rows[1][j];
+        }
+        b[2 * p] = u;
+        b[2 * p + 1] = v;
+    }
+
+    if (!mat8_solve(&a, b))
+        return false;
+
+    for (int i = 0; i < 8; i++)
+        h->m[i / 3][i % 3] = b[i];
+    h->m[2][2] = 1.0f;
+    return true;
+}
@@ -13,18 +13,30 @@ typedef struct
 
 Tupple T(int x, int y);
 
+#include "threadpool.h"
+#include "gemm.h"
+
+// storage of matrices is aligned on a cache line (and the widest vectors)
+#define MATRIX_ALIGNMENT 64
+
+// elementwise ops on at least twice this many elements use the thread pool
+#define MATRIX_PARALLEL_MIN_SIZE (1 << 15)
+
 // 2D matrix utils
 struct Matrix
 {
     int dim1; // number of rows
     int dim2; // number of columns
-    int size; // size of 1D array
+    int size; // number of elements (dim1 * dim2)
     float *data;
+    int stride; // distance between two rows in data (dim2 unless view)
+    bool owner; // false for views, which share the data of another matrix
 };
 
 typedef struct Matrix Matrix;
-#define MAT(matrix, i, j) (matrix->data[(i)*matrix->dim2 + (j)])
+#define MAT(matrix, i, j) (matrix->data[(i)*matrix->stride + (j)])
 Matrix *matrix_init(int dim1, int dim2, float *datap);
+Matrix matrix_view(Matrix *m, int row0, int col0, int rows, int cols);
 Matrix *matrix_copy(Matrix *m, Matrix *dst);
 void matrix_zero(Matrix *m);
 float m_get(Matrix *m, int i, int j);
@@ -36,19 +48,39 @@ Matrix *matrix_add_bias(Matrix *m1, Matrix *m2, Matrix *dst);
 Matrix *matrix_sum_rows(Matrix *m1, Matrix *dst);
 Matrix *matrix_subtract(Matrix *m1, Matrix *m2, Matrix *dst);
 Matrix *matrix_multiply(Matrix *m1, Matrix *m2, Matrix *dst);
+Matrix *matrix_multiply_ex(Matrix *m1, bool trans1, Matrix *m2, bool trans2, float alpha, float beta, Matrix *dst);
+Matrix *matrix_multiply_fused(Matrix *m1, bool trans1, Matrix *m2, bool trans2, Matrix *bias, int activation, Matrix *dst);
 Matrix *matrix_transpose(Matrix *m);
 Matrix *matrix_elementwise_multiply(Matrix *m1, Matrix *m2, Matrix *dst);
 void matrix_multiply_scalar(Matrix *m, float s);
 void matrix_map_function(Matrix *m, float (*func)(float));
+Matrix *matrix_activate(Matrix *m, int kind, Matrix *dst);
+Matrix *matrix_activate_derivative(Matrix *m, int kind, Matrix *dst);
 bool matrix_element_wise_equal(Matrix *m1, Matrix *m2);
 void matrix_destroy(Matrix *m);
 void matrix_print(Matrix *m);
 void matrix_printshape(Matrix *m);
+int matrix_lu_decompose(Matrix *m, double *lu, int *perm);
+void matrix_lu_solve(const double *lu, const int *perm, int n, float *b, int stride, double *scratch);
 float matrix_det(Matrix *m);
 Matrix *matrix_inverse(Matrix *m);
+Matrix *matrix_solve(Matrix *A, Matrix *b, Matrix *dst);
 Matrix *matrix_transformation(const Tupple *src, const Tupple *dst);
 
 // 4D matrix utils
+
+// Memory layouts of a Matrix4. The dimensions are always the logical
+// (batch, channels, height, width), only the order of the data changes.
+// NCHW8C / NCHW16C store channels in blocks of 8 / 16 contiguous values
+// (one vector register) per pixel, padded with zero channels.
+enum Matrix4Layout
+{
+    MATRIX4_NCHW,
+    MATRIX4_NHWC,
+    MATRIX4_NCHW8C,
+    MATRIX4_NCHW16C,
+};
+
 struct Matrix4
 {
     int dim1;
@@ -56,12 +88,22 @@ struct Matrix4
     int dim3;
     int dim4;
     int size;
+    int layout;
     float *data;
+    bool owner; // false for views, which share the data of another matrix
 };
 
 typedef struct Matrix4 Matrix4;
-#define MAT4(matrix, i, j, k, l) (matrix->data[(i)*matrix->dim2 * matrix->dim3 * matrix->dim4 + (j)*matrix->dim3 * matrix->dim4 + (k)*matrix->dim4 + (l)])
+#define MAT4(matrix, i, j, k, l) (matrix->data[matrix4_offset(matrix, i, j, k, l)])
 Matrix4 *matrix4_init(int dim1, int dim2, int dim3, int dim4, float *datap);
+Matrix4 *matrix4_init_layout(int dim1, int dim2, int dim3, int dim4, int layout);
+Matrix4 matrix4_slice(Matrix4 *m, int index);
+Matrix4 matrix4_batch_view(Matrix4 *m, int index, int count);
+Matrix matrix4_flatten_view(Matrix4 *m);
+Matrix4 matrix4_unflatten_view(Matrix *m, int channels, int height, int width);
+int matrix4_channel_block(int layout);
+int matrix4_offset(Matrix4 *m, int i, int j, int k, int l);
+Matrix4 *matrix4_reorder(Matrix4 *m, int layout, Matrix4 *dst);
 Matrix4 *matrix4_copy(Matrix4 *m, Matrix4 *dst);
 void matrix4_zero(Matrix4 *m);
 float m4_get(Matrix4 *m, int dim1, int dim2, int dim3, int dim4);
@@ -70,8 +112,17 @@ void m4_set(Matrix4 *m, int dim1, int dim2, int dim3, int dim4, float value);
 Matrix4 *matrix4_add(Matrix4 *m1, Matrix4 *m2, Matrix4 *dst);
 Matrix4 *matrix4_subtract(Matrix4 *m1, Matrix4 *m2, Matrix4 *dst);
 Matrix4 *matrix4_transpose(Matrix4 *m);
+void matrix4_im2col(Matrix4 *input, int index, int kernel_height, int kernel_width, int stride, int padding, float *col);
+void matrix4_col2im(const float *col, Matrix4 *dst, int index, int kernel_height, int kernel_width, int stride, int padding);
 Matrix4 *matrix4_convolve(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding);
-Matrix4 *matrix4_convolve_transpose(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding);
+Matrix4 *matrix4_convolve_fused(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding, Matrix *bias, int activation);
+Matrix4 *matrix4_convolve_direct(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding);
+Matrix4 *matrix4_blocked_weights(Matrix4 *weights, int layout, Matrix4 *dst);
+Matrix4 *matrix4_convolve_blocked_fused(Matrix4 *packed, Matrix4 *input, Matrix4 *dst, int stride, int padding, Matrix *bias, int activation);
+Matrix4 *matrix4_winograd_weights(Matrix4 *weights, Matrix4 *dst);
+Matrix4 *matrix4_convolve_winograd(Matrix4 *transformed, Matrix4 *input, Matrix4 *dst, int padding);
+Matrix4 *matrix4_convolve_winograd_fused(Matrix4 *transformed, Matrix4 *input, Matrix4 *dst, int padding, Matrix *bias, int activation);
+Matrix4 *matrix4_convolve_weights_grad(Matrix4 *input, Matrix4 *grad_output, Matrix4 *dst, int stride, int padding);
 Matrix4 *matrix4_grad_input_convolve(Matrix4 *weights, Matrix4 *grad_output, Matrix4 *dst, int stride, int padding);
 Matrix4 *matrix4_add_bias(Matrix4 *m1, Matrix *bias, Matrix4 *dst);
 Matrix *matrix4_flatten(Matrix4 *m, Matrix *dst);
@@ -80,7 +131,54 @@ Matrix *matrix4_sum_channels(Matrix4 *m1, Matrix *dst);
 Matrix4 *matrix4_elementwise_multiply(Matrix4 *m1, Matrix4 *m2, Matrix4 *dst);
 void matrix4_multiply_scalar(Matrix4 *m, float s);
 void matrix4_map_function(Matrix4 *m, float (*func)(float));
+Matrix4 *matrix4_activate(Matrix4 *m, int kind, Matrix4 *dst);
+Matrix4 *matrix4_activate_derivative(Matrix4 *m, int kind, Matrix4 *dst);
 bool matrix4_element_wise_equal(Matrix4 *m1, Matrix4 *m2);
 void matrix4_destroy(Matrix4 *m);
 void matrix4_print(Matrix4 *m);
-void matrix4_printshape(Matrix4 *m);
\ No newline at end of file
+void matrix4_printshape(Matrix4 *m);
+
+// 16-bit weights
+
+// Read-only copy of weights in 16-bit floats (fp16 or bf16), half the size
+// of the fp32 ones. The kernels widen it to fp32 before computing.
+struct Matrix16
+{
+    int dim1;
+    int dim2;
+    int dim3; // 1 for 2D weights
+    int dim4; // 1 for 2D weights
+    int size;
+    int storage; // one of FloatStorage, FP16 or BF16
+    uint16_t *data;
+};
+
+typedef struct Matrix16 Matrix16;
+Matrix16 *matrix16_init(int dim1, int dim2, int dim3, int dim4, int storage);
+Matrix16 *matrix16_convert(Matrix16 *m, const float *src);
+float *matrix16_widen(Matrix16 *m, float *dst);
+void matrix16_destroy(Matrix16 *m);
+Matrix *matrix_multiply_fused16(Matrix *m1, Matrix16 *weights, Matrix *bias, int activation, Matrix *dst);
+Matrix4 *matrix4_convolve_fused16(Matrix16 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding, Matrix *bias, int activation);
+
+// sparse matrix utils
+
+// batches with at least this many rows are transposed by the sparse product
+#define SPARSE_MIN_ROWS 4
+
+// Compressed sparse row matrix: the non-zero elements of row i are
+// values[row_ptr[i]..row_ptr[i + 1]), in the columns col_idx[...]
+struct SparseMatrix
+{
+    int dim1;
+    int dim2;
+    int nnz; // number of non-zero elements
+    int *row_ptr;
+    int *col_idx;
+    float *values;
+};
+
+typedef struct SparseMatrix SparseMatrix;
+SparseMatrix *sparse_matrix_from_dense(Matrix *m);
+void sparse_matrix_destroy(SparseMatrix *m);
+Matrix *matrix_multiply_sparse_fused(Matrix *m1, SparseMatrix *weights, Matrix *bias, int activation, Matrix *dst);
@@ -20,27 +20,59 @@ CNN *cnn_init(ConvLayer **conv_layers, int num_conv_layers,
               ActivationLayer *output_layer);
 Matrix *cnn_forward(CNN *network, Matrix4 *input);
 void cnn_backward(CNN *network, Matrix4 *input, Matrix *predictions, Matrix *labels, float learning_rate);
+void cnn_gradients(CNN *network, Matrix4 *input, Matrix *labels);
+void cnn_update(CNN *network, float learning_rate);
+void cnn_optimize(CNN *network, Optimizer *optimizer);
 double cnn_train_batch(CNN *network, Matrix4 *input, Matrix *expected, float learning_rate);
 void cnn_destroy(CNN *network);
+void cnn_set_weight_storage(CNN *network, int storage);
 void conv_layer_save_weigths(const char *filename, ConvLayer *layer);
 bool conv_layer_load_weights(const char *filename, ConvLayer *layer);
 void cnn_save(CNN *network, const char *basename);
 bool cnn_load(CNN *network, const char *basename);
 
+// Inference plan of an NN, see nn_compile_inference
+struct NNPlan
+{
+    int max_batch;
+    int width; // widest layer output, the row length of the buffers
+
+    // every layer reads one buffer and writes the other, as a contiguous
+    // (rows, layer outputs) matrix
+    Matrix *buffers[2];
+
+    // view on the buffer holding the output of the last nn_infer
+    Matrix output;
+};
+typedef struct NNPlan NNPlan;
+
 struct NN
 {
     FCLayer **fc_layers;
     int num_fc_layers;
     ActivationLayer *output_layer;
+
+    // set by nn_compile_inference, NULL while the network can be trained
+    NNPlan *plan;
 };
 typedef struct NN NN;
 
 NN *nn_init(FCLayer **fc_layer, int num_fc_layers, ActivationLayer *output_layer);
+NN *build_nn2(int batchsize);
 Matrix *nn_forward(NN *network, Matrix *input);\
 int *nn_predict(NN *network, Matrix *input);
+void nn_set_batch_size(NN *network, int batch_size);
+void nn_predict_batch(NN *network, Matrix *inputs, int n, int *labels, float *confidences);
+void nn_compile_inference(NN *network, int max_batch);
+Matrix *nn_infer(NN *network, Matrix *input);
 void nn_backward(NN *network, Matrix *input, Matrix *predictions, Matrix *labels, float learning_rate);
+void nn_gradients(NN *network, Matrix *input, Matrix *labels);
+void nn_update(NN *network, float learning_rate);
+void nn_optimize(NN *network, Optimizer *optimizer);
 double nn_train_batch(NN *network, Matrix *input, Matrix *expected, float learning_rate);
 void nn_destroy(NN *network);
+void nn_set_weight_storage(NN *network, int storage);
+void nn_prune(NN *network, const float *sparsity);
 
 void fc_layer_save_weights(const char *filename, FCLayer *layer);
 bool fc_layer_load_weights(const char *filename, FCLayer *layer);
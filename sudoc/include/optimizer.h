@@ -0,0 +1,47 @@
+#pragma once
+
+#include "matrix.h"
+
+// parameters updated per thread by optimizer_step
+#define OPTIMIZER_MIN_CHUNK 4096
+
+enum OptimizerKind
+{
+    OPTIMIZER_SGD,
+    OPTIMIZER_MOMENTUM,
+    OPTIMIZER_NESTEROV,
+    OPTIMIZER_ADAM,
+};
+
+// Update rule of the parameters, see optimizer.c
+struct Optimizer
+{
+    int kind; // one of OptimizerKind
+    float learning_rate;
+    float momentum; // momentum of OPTIMIZER_MOMENTUM and OPTIMIZER_NESTEROV
+    float beta1;
+    float beta2;
+    float epsilon;
+    float weight_decay; // decoupled, 0 for none
+
+    long step; // steps started by optimizer_begin_step
+    SimdOptimizerStep coefficients;
+};
+typedef struct Optimizer Optimizer;
+
+// State of an optimizer for a parameter tensor, kept by the layer owning it:
+// the velocity of the momentum kinds, the two moments of Adam. Allocated on
+// the first step.
+typedef struct
+{
+    float *moments[2];
+} OptimizerState;
+
+Optimizer optimizer_sgd(float learning_rate);
+Optimizer optimizer_momentum(float learning_rate, float momentum, bool nesterov);
+Optimizer optimizer_adam(float learning_rate, float beta1, float beta2, float epsilon);
+Optimizer optimizer_adamw(float learning_rate, float beta1, float beta2, float epsilon, float weight_decay);
+void optimizer_begin_step(Optimizer *optimizer);
+void optimizer_step(Optimizer *optimizer, float *params, const float *gradient, int size,
+                    OptimizerState *state, bool decays);
+void optimizer_state_reset(OptimizerState *state);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include "neuralnet.h"
+
+// Largest magnitude of a quantized value, the range is symmetric
+#define QUANTIZE_MAX 127
+
+// Fully connected layer with int8 weights and inputs
+struct QFCLayer
+{
+    int input_size;
+    int output_size;
+
+    int activation; // one of ActivationKind
+    float (*activation_func)(float); // only for ACTIVATION_CUSTOM
+
+    int8_t *weights;      // (output_size, input_size), w[o][k] = weights[o][k] * weight_scales[o]
+    float *weight_scales; // one per output, all equal with per-layer scales
+    float *biases;        // kept in fp32, added after the rescale
+    float input_scale;    // x = q * input_scale, calibrated on sample inputs
+};
+typedef struct QFCLayer QFCLayer;
+
+// int8 copy of an NN
+struct QNN
+{
+    QFCLayer *layers;
+    int num_layers;
+    Matrix *(*output_func)(Matrix *); // output activation, applied in fp32
+};
+typedef struct QNN QNN;
+
+// Accuracy of an int8 network against the fp32 one on the same samples
+typedef struct
+{
+    int samples;
+    float fp32_accuracy;
+    float int8_accuracy;
+    float agreement;    // fraction of samples where both predict the same class
+    float max_abs_diff; // largest difference between two outputs
+} QuantizeReport;
+
+QNN *qnn_quantize(NN *network, Matrix *calibration, bool per_channel);
+Matrix *qnn_forward(QNN *network, Matrix *input);
+int *qnn_predict(QNN *network, Matrix *input);
+QuantizeReport qnn_evaluate(QNN *network, NN *reference, Matrix *inputs, const int *labels);
+void qnn_save(QNN *network, const char *basename);
+QNN *qnn_load(const char *basename, Matrix *(*output_func)(Matrix *));
+void qnn_destroy(QNN *network);
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Instruction sets with a dedicated kernel table, from slowest to fastest
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_LEVEL_COUNT,
+};
+
+// Activation functions with dedicated kernels. ACTIVATION_CUSTOM stands for
+// a function pointer applied one element at a time.
+enum ActivationKind
+{
+    ACTIVATION_IDENTITY,
+    ACTIVATION_RELU,
+    ACTIVATION_LEAKY_RELU,
+    ACTIVATION_SIGMOID,
+    ACTIVATION_CUSTOM,
+};
+
+// Storage formats of weights. 16-bit values are only converted to and from
+// fp32, all arithmetic is done in fp32.
+enum FloatStorage
+{
+    FLOAT_STORAGE_FP32,
+    FLOAT_STORAGE_FP16, // IEEE 754 half precision
+    FLOAT_STORAGE_BF16, // bfloat16, the upper 16 bits of an fp32
+};
+
+// Reductions accumulate in this many lanes whatever the vector width: lane k
+// sums a[k], a[k + LANES], ... in order, then the lanes are added by halves.
+// Every level therefore adds the same numbers in the same order.
+#define SIMD_REDUCE_LANES 16
+
+// Coefficients of the optimizer kernels for one step, see optimizer.c
+typedef struct
+{
+    float learning_rate;
+    float momentum; // decay of the velocity, or beta1 of Adam
+    float beta2;
+    float epsilon;
+    float decay;       // decoupled weight decay, parameters are scaled by it first
+    float step_size;   // learning_rate / (1 - beta1^t)
+    float correction2; // 1 / (1 - beta2^t)
+} SimdOptimizerStep;
+
+// Unary kernel over contiguous float arrays of length n
+typedef void (*SimdUnaryKernel)(const float *a, float *dst, int n);
+
+// Elementwise kernels over contiguous float arrays of length n.
+// dst may alias any of the inputs.
+typedef struct
+{
+    const char *name;
+    void (*add)(const float *a, const float *b, float *dst, int n);
+    void (*sub)(const float *a, const float *b, float *dst, int n);
+    void (*mul)(const float *a, const float *b, float *dst, int n);
+    void (*add_scalar)(const float *a, float s, float *dst, int n);
+    void (*mul_scalar)(const float *a, float s, float *dst, int n);
+
+    // exp and activations, derivatives take the output of the activation
+    // reductions in the SIMD_REDUCE_LANES order
+    float (*sum)(const float *a, int n);
+    float (*dot)(const float *a, const float *b, int n);
+
+    SimdUnaryKernel exp;
+    SimdUnaryKernel activate[ACTIVATION_CUSTOM];
+    SimdUnaryKernel derivative[ACTIVATION_CUSTOM];
+
+    // conversions between fp32 and 16-bit storage, rounding to nearest even
+    void (*from_fp16)(const uint16_t *a, float *dst, int n);
+    void (*to_fp16)(const float *a, uint16_t *dst, int n);
+    void (*from_bf16)(const uint16_t *a, float *dst, int n);
+    void (*to_bf16)(const float *a, uint16_t *dst, int n);
+
+    // exact int8 dot product, n * 127 * 127 must fit in an int32
+    int32_t (*dot_i8)(const int8_t *a, const int8_t *b, int n);
+
+    // sparse row times a block of SIMD_REDUCE_LANES columns:
+    // acc[r] += values[p] * x[index[p] * stride + r] for p < n in order
+    void (*sparse_axpy)(const float *values, const int *index, int n, const float *x, int stride, float *acc);
+
+    // fused optimizer steps, reading every gradient once: param, grad and
+    // the state (velocity, Adam moments) are updated in place
+    void (*sgd_step)(float *param, const float *grad, int n, const SimdOptimizerStep *s);
+    void (*momentum_step)(float *param, const float *grad, float *velocity, int n, const SimdOptimizerStep *s);
+    void (*nesterov_step)(float *param, const float *grad, float *velocity, int n, const SimdOptimizerStep *s);
+    void (*adam_step)(float *param, const float *grad, float *m, float *v, int n, const SimdOptimizerStep *s);
+} SimdKernels;
+
+// Scalar reference of the exp kernels: Cephes style range reduction
+// exp(x) = 2^n * exp(r) with a degree 7 polynomial for exp(r). Inputs are
+// clamped to [-87, 88] so 2^n stays a normal float. Relative error < 1e-7.
+static inline float simd_exp(float x)
+{
+    x = x < 88.0f ? x : 88.0f;
+    x = x > -87.0f ? x : -87.0f;
+
+    // n = floor(x / ln(2) + 1/2)
+    float t = x * 1.44269504088896341f + 0.5f;
+    float n = (float)(int32_t)t;
+    n = n > t ? n - 1.0f : n;
+
+    // r = x - n * ln(2), ln(2) split in two for precision
+    float r = x - n * 0.693359375f;
+    r = r - n * -2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * (r * r) + r;
+    p = p + 1.0f;
+
+    int32_t bits = ((int32_t)n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(float));
+    return p * scale;
+}
+
+// Scalar reference of the activation kernels
+static inline float simd_activate(int kind, float x)
+{
+    switch (kind)
+    {
+    case ACTIVATION_RELU:
+        return x > 0.0f ? x : 0.0f;
+    case ACTIVATION_LEAKY_RELU:
+        return x > 0.0f ? x : 0.1f * x;
+    case ACTIVATION_SIGMOID:
+        return 1.0f / (1.0f + simd_exp(-x));
+    default:
+        return x;
+    }
+}
+
+// Scalar reference of the derivative kernels, y is the output of the activation
+static inline float simd_derivative(int kind, float y)
+{
+    switch (kind)
+    {
+    case ACTIVATION_RELU:
+        return y > 0.0f ? 1.0f : 0.0f;
+    case ACTIVATION_LEAKY_RELU:
+        return y > 0.0f ? 1.0f : 0.1f;
+    case ACTIVATION_SIGMOID:
+        return y * (1.0f - y);
+    default:
+        return 1.0f;
+    }
+}
+
+// Scalar reference of from_fp16 (exact, NaNs are made quiet)
+static inline float simd_fp16_to_fp32(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa != 0 ? 0x400000 : 0) | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else
+    {
+        // subnormal half, normal float
+        exponent = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+
+    float f;
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+// Scalar reference of to_fp16: overflows give infinities, tiny values
+// give subnormals, NaNs keep the top of their payload and are made quiet
+static inline uint16_t simd_fp32_to_fp16(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(float));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7fffffff;
+
+    if (abs > 0x7f800000)
+        return sign | 0x7e00 | ((abs >> 13) & 0x3ff);
+    if (abs >= 0x477ff000) // rounds above 65504
+        return sign | 0x7c00;
+    if (abs >= 0x38800000) // normal half
+        return sign | ((abs + 0xfff + ((abs >> 13) & 1) - 0x38000000) >> 13);
+    if (abs <= 0x33000000) // rounds to zero
+        return sign;
+
+    int shift = 126 - (int)(abs >> 23);
+    uint32_t mantissa = (abs & 0x7fffff) | 0x800000;
+    uint32_t result = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (result & 1)))
+        result++;
+    return sign | result;
+}
+
+// Scalar reference of from_bf16 (exact)
+static inline float simd_bf16_to_fp32(uint16_t h)
+{
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+// Scalar reference of to_bf16, NaNs are made quiet
+static inline uint16_t simd_fp32_to_bf16(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(float));
+
+    if ((bits & 0x7fffffff) > 0x7f800000)
+        return (bits >> 16) | 0x40;
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+// Scalar references of the optimizer kernels, for one element
+static inline float simd_sgd_update(float p, float g, const SimdOptimizerStep *s)
+{
+    return p * s->decay - s->learning_rate * g;
+}
+
+static inline float simd_momentum_update(float p, float g, float *velocity, const SimdOptimizerStep *s)
+{
+    *velocity = s->momentum * *velocity + g;
+    return p * s->decay - s->learning_rate * *velocity;
+}
+
+// the step looks ahead along the new velocity: g + momentum * velocity
+static inline float simd_nesterov_update(float p, float g, float *velocity, const SimdOptimizerStep *s)
+{
+    *velocity = s->momentum * *velocity + g;
+    return p * s->decay - s->learning_rate * (g + s->momentum * *velocity);
+}
+
+static inline float simd_adam_update(float p, float g, float *m, float *v, const SimdOptimizerStep *s)
+{
+    *m = s->momentum * *m + (1.0f - s->momentum) * g;
+    *v = s->beta2 * *v + (1.0f - s->beta2) * (g * g);
+    return p * s->decay - (s->step_size * *m) / (sqrtf(*v * s->correction2) + s->epsilon);
+}
+
+const SimdKernels *simd_kernels();
+int simd_level();
+bool simd_supported(int level);
+void simd_set_level(int level);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Upper bound of the thread count of the pool
+#define THREADPOOL_MAX_THREADS 256
+
+// Body of a parallel loop, called on the sub-range [begin, end) of the loop
+typedef void (*ParallelTask)(void *ctx, int begin, int end);
+
+void threadpool_parallel_for(int n, int min_chunk, ParallelTask task, void *ctx);
+bool threadpool_in_worker();
+
+void matrix_set_num_threads(int num_threads);
+int matrix_get_num_threads();
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "matrix.h"
+#include "layer.h"
+#include "neuralnet.h"
+
+// gradient elements summed per thread by the reduction
+#define TRAINER_REDUCE_MIN_CHUNK 4096
+
+// Data-parallel training of an NN or a CNN, see trainer.c
+struct Trainer
+{
+    // the network being trained, one of nn and cnn is set
+    NN *nn;
+    CNN *cnn;
+
+    int batch_size;
+    int num_shards;
+
+    // update rule of the steps, SGD unless trainer_set_optimizer changes it
+    Optimizer optimizer;
+
+    // replica s runs the rows of shard s. Replicas share the parameters of
+    // the network and replica 0 its gradients, the others have their own.
+    NN **nn_replicas;
+    CNN **cnn_replicas;
+
+    double *losses; // summed loss of every shard
+    float **shard_gradients;
+
+    // batch of the step being run
+    Matrix *input;
+    Matrix4 *input4;
+    Matrix *labels;
+};
+typedef struct Trainer Trainer;
+
+Trainer *trainer_init_nn(NN *network, int batch_size, int num_shards);
+Trainer *trainer_init_cnn(CNN *network, int batch_size, int num_shards);
+void trainer_set_optimizer(Trainer *trainer, Optimizer optimizer);
+double trainer_nn_train_batch(Trainer *trainer, Matrix *input, Matrix *labels, float learning_rate);
+double trainer_cnn_train_batch(Trainer *trainer, Matrix4 *input, Matrix *labels, float learning_rate);
+void trainer_destroy(Trainer *trainer);
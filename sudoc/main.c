@@ -222,22 +222,6 @@ void convert_step(int i, Image *image_surface, UserInterface *ui)
     g_free(filename);
 }
 
-NN *build_nn2(int batchsize)
-{
-    // define the layers
-    FCLayer **fc_layers = malloc(sizeof(FCLayer) * 4);
-    fc_layers[0] = fc_layer_init(28 * 28, 256, batchsize, relu, d_relu, "fc0");
-    fc_layers[1] = fc_layer_init(256, 256, batchsize, relu, d_relu, "fc1");
-    fc_layers[2] = fc_layer_init(256, 128, batchsize, relu, d_relu, "fc2");
-    fc_layers[3] = fc_layer_init(128, 10, batchsize, relu, d_relu, "fc3");
-
-    ActivationLayer *output_layer = activation_layer_init(10, batchsize, softmax, d_softmax);
-    int num_fc_layers = 4;
-
-    NN *network = nn_init(fc_layers, num_fc_layers, output_layer);
-    return network;
-}
-
 // same as to_cells8 but working
 void to_cells8(int sudoku[][9], int new_sudoku[][9])
 {
@@ -324,10 +308,13 @@ void on_output_button_clicked(GtkButton *button, gpointer user_data)
     dst[3] = H;
 
     // -------------------- Transform --------------------
-    Matrix *M = matrix_transformation(src, dst);
-    Image *tf = CV_TRANSFORM(p2, M, T(dsize, dsize), T(0, 0), CV_RGB(0, 0, 0));
+    // maps the straightened grid back onto the picture
+    Mat3 M;
+    if (!mat3_homography(src, dst, &M) || !mat3_inverse(&M, &M))
+        errx(EXIT_FAILURE, "the corners of the grid are aligned");
+    Image *tf = CV_WARP_PERSPECTIVE(p2, &M, T(dsize, dsize), T(0, 0), CV_RGB(0, 0, 0));
     convert_step(8, tf, ui);
-    Image *tf2 = CV_TRANSFORM(image, M, T(dsize, dsize), T(0, 0), CV_RGB(0, 0, 0));
+    Image *tf2 = CV_WARP_PERSPECTIVE(image, &M, T(dsize, dsize), T(0, 0), CV_RGB(0, 0, 0));
     convert_step(9, tf2, ui);
 
     CV_SAVE(tf, "tests/out/test_cv_full_transformed.png");
@@ -337,24 +324,24 @@ void on_output_button_clicked(GtkButton *button, gpointer user_data)
     // -------------------- Load model --------------------
 
     init_rand();
-    int batchsize = 1;
+    int batchsize = 81; // the whole grid in one forward pass
 
     NN *network = build_nn2(batchsize);
-    Matrix *input = matrix_init(batchsize, 28 * 28, NULL);
 
     bool loaded = nn_load(network, "weights");
     if (!loaded)
     {
         printf("Failed to load the weights \n");
     }
+    // the network is only used for inference from here on
+    nn_compile_inference(network, batchsize);
 
-    int *max_index = nn_predict(network, input);
-
-    // list of 81 Matrices
     int sudoku[9][9];
     int new_sudoku[9][9];
 
     // -------------------- Get blocks --------------------
+    // every cell is a row of a single (81, 28 * 28) batch
+    Matrix *cells = matrix_init(81, 28 * 28, NULL);
     for (int i = 0; i < 9; i++)
     {
         for (int j = 0; j < 9; j++)
@@ -366,21 +353,23 @@ void on_output_button_clicked(GtkButton *button, gpointer user_data)
             int h = bsize;
 
             Image *block = CV_COPY_REGION(tf, x + p, y + p, x + w - p, y + h - p);
-            Matrix *b = CV_IMG_TO_MAT(block, NULL);
-
-            int *prediction = nn_predict(network, b);
-            sudoku[i][j] = prediction[0];
+            Matrix row = matrix_view(cells, i * 9 + j, 0, 1, 28 * 28);
+            CV_IMG_TO_MAT(block, &row);
 
             // char path[100];
             //  snprintf(path, 100, "tests/out/box2/test_cv_full_%d_%d.png", i + 1, j + 1);
 
             // CV_SAVE(block, path);
             CV_FREE(&block);
-            FREE(prediction);
-            matrix_destroy(b);
         }
     }
 
+    int digits[81];
+    nn_predict_batch(network, cells, 81, digits, NULL);
+    for (int i = 0; i < 81; i++)
+        sudoku[i / 9][i % 9] = digits[i];
+    matrix_destroy(cells);
+
     int sudoku2[][9] =
         {{0, 2, 0, 0, 0, 0, 6, 0, 9},
          {8, 5, 7, 0, 6, 4, 2, 0, 0},
@@ -487,16 +476,12 @@ void on_output_button_clicked(GtkButton *button, gpointer user_data)
     CV_FREE(&p2);
     CV_FREE(&tf2);
 
-    matrix_destroy(M);
-
     FREE(points);
     FREE(src);
     FREE(dst);
 
     // free the memory
     nn_destroy(network);
-    matrix_destroy(input);
-    FREE(max_index);
 
     // -------------------- Assert --------------------
 
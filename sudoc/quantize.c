@@ -0,0 +1,98 @@
+#include "include/utils.h"
+#include "include/matrix.h"
+#include "include/layer.h"
+#include "include/neuralnet.h"
+#include "include/quantize.h"
+#include "include/cv.h"
+#include <string.h>
+
+// Post-training int8 quantization of the digit network.
+//
+// usage: quantize [weights] [output] [--per-layer]
+//
+// Calibrates the int8 network on cell images of train_data/<digit>, reports
+// its accuracy against the fp32 network on other samples and saves it.
+
+#define CALIBRATION_SAMPLES 200
+#define EVALUATION_SAMPLES 1000
+
+int main(int argc, char **argv)
+{
+    const char *weights = argc > 1 ? argv[1] : "weights";
+    const char *output = argc > 2 ? argv[2] : "weights-int8";
+    bool per_channel = !(argc > 3 && strcmp(argv[3], "--per-layer") == 0);
+
+    init_rand();
+    int batchsize = 1;
+
+    NN *network = build_nn2(batchsize);
+    if (!nn_load(network, weights))
+    {
+        printf("Failed to load the weights from %s\n", weights);
+        return 1;
+    }
+
+    int data_count[10];
+    char **filepaths[10];
+    for (int i = 0; i < 10; i++)
+    {
+        char path[100];
+        snprintf(path, sizeof(path), "train_data/%d", i);
+        filepaths[i] = CV_LIST_DIR(path, &data_count[i]);
+        if (data_count[i] == 0)
+        {
+            printf("No samples in %s\n", path);
+            return 1;
+        }
+    }
+
+    // random samples, the first ones calibrate and the others evaluate
+    int num_samples = CALIBRATION_SAMPLES + EVALUATION_SAMPLES;
+    Matrix *samples = matrix_init(num_samples, 28 * 28, NULL);
+    int *labels = malloc(sizeof(int) * num_samples);
+    Matrix *image = matrix_init(1, 28 * 28, NULL);
+
+    for (int i = 0; i < num_samples; i++)
+    {
+        int digit = rand() % 10;
+        int file = rand() % data_count[digit];
+
+        CV_LOAD_MAT(filepaths[digit][file], image, 1, 1);
+        memcpy(&samples->data[i * samples->stride], image->data, sizeof(float) * image->size);
+        labels[i] = digit;
+    }
+
+    Matrix calibration = matrix_view(samples, 0, 0, CALIBRATION_SAMPLES, samples->dim2);
+    Matrix evaluation = matrix_view(samples, CALIBRATION_SAMPLES, 0, EVALUATION_SAMPLES, samples->dim2);
+
+    QNN *quantized = qnn_quantize(network, &calibration, per_channel);
+    QuantizeReport report = qnn_evaluate(quantized, network, &evaluation, &labels[CALIBRATION_SAMPLES]);
+
+    long parameters = 0;
+    for (int i = 0; i < quantized->num_layers; i++)
+        parameters += (long)quantized->layers[i].input_size * quantized->layers[i].output_size;
+
+    printf("Scales: %s\n", per_channel ? "per channel" : "per layer");
+    printf("Weights: %ld bytes fp32, %ld bytes int8\n", parameters * (long)sizeof(float), parameters);
+    printf("Accuracy fp32: %f \n", report.fp32_accuracy);
+    printf("Accuracy int8: %f (%+f)\n", report.int8_accuracy, report.int8_accuracy - report.fp32_accuracy);
+    printf("Same prediction: %f, max output difference: %f (%d samples)\n", report.agreement, report.max_abs_diff, report.samples);
+
+    qnn_save(quantized, output);
+    printf("Saved to %s\n", output);
+
+    // free the memory
+    qnn_destroy(quantized);
+    nn_destroy(network);
+    matrix_destroy(samples);
+    matrix_destroy(image);
+    free(labels);
+    for (int i = 0; i < 10; i++)
+    {
+        for (int j = 0; j < data_count[i]; j++)
+            free(filepaths[i][j]);
+        free(filepaths[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include "../include/arena.h"
+
+/*
+Workspace arena for Matrix and Matrix4 temporaries.
+
+Layers need the same scratch shapes (dZ, softmax buffers, im2col columns...)
+at every batch, so instead of a malloc/free pair per temporary the buffers
+are kept in free lists keyed by shape and handed out again on the next call.
+
+    Matrix *tmp = matrix_arena_get(rows, cols); // content is unspecified
+    ...
+    matrix_arena_put(tmp);
+
+matrix_arena_begin() / matrix_arena_end() delimit a scope: temporaries taken
+inside the scope and not put back are returned to the free lists when it
+ends. Nothing is ever freed until matrix_arena_release(). The arena state is
+per thread, temporaries must be put back by the thread that got them.
+*/
+
+// A pooled matrix, either in the live list or in the free list of its class
+typedef struct ArenaEntry
+{
+    struct ArenaEntry *next;
+    void *matrix;
+    int class;
+    int depth; // scope that holds the matrix
+} ArenaEntry;
+
+// Shape of a class of interchangeable matrices
+typedef struct
+{
+    int kind; // 2 for Matrix, 4 for Matrix4
+    int dims[4];
+    int layout;
+    ArenaEntry *free;
+} ArenaClass;
+
+static __thread ArenaClass *classes = NULL;
+static __thread int num_classes = 0;
+static __thread int capacity = 0;
+
+static __thread ArenaEntry *live = NULL;
+static __thread int depth = 0;
+static __thread ArenaStats stats = {0};
+
+static int arena_class(int kind, int dim1, int dim2, int dim3, int dim4, int layout)
+{
+    for (int i = 0; i < num_classes; i++)
+    {
+        ArenaClass *c = &classes[i];
+        if (c->kind == kind && c->dims[0] == dim1 && c->dims[1] == dim2 &&
+            c->dims[2] == dim3 && c->dims[3] == dim4 && c->layout == layout)
+            return i;
+    }
+
+    if (num_classes == capacity)
+    {
+        capacity = capacity == 0 ? 16 : capacity * 2;
+        classes = realloc(classes, sizeof(ArenaClass) * capacity);
+        if (classes == NULL)
+            errx(EXIT_FAILURE, "matrix_arena: failed to allocate the free lists\n");
+    }
+
+    ArenaClass c = {kind, {dim1, dim2, dim3, dim4}, layout, NULL};
+    classes[num_classes] = c;
+    return num_classes++;
+}
+
+// pops a matrix of the class from its free list or allocates a new one
+static void *arena_get(int class)
+{
+    ArenaClass *c = &classes[class];
+    ArenaEntry *entry = c->free;
+
+    stats.requests++;
+    stats.live++;
+
+    if (entry != NULL)
+    {
+        c->free = entry->next;
+        stats.reused++;
+    }
+    else
+    {
+        entry = malloc(sizeof(ArenaEntry));
+        if (entry == NULL)
+            errx(EXIT_FAILURE, "matrix_arena: failed to allocate an entry\n");
+
+        entry->class = class;
+        if (c->kind == 2)
+        {
+            Matrix *m = matrix_init(c->dims[0], c->dims[1], NULL);
+            stats.pooled_bytes += sizeof(float) * m->size;
+            entry->matrix = m;
+        }
+        else
+        {
+            Matrix4 *m = matrix4_init_layout(c->dims[0], c->dims[1], c->dims[2], c->dims[3], c->layout);
+            stats.pooled_bytes += sizeof(float) * m->size;
+            entry->matrix = m;
+        }
+        stats.allocations++;
+    }
+
+    entry->depth = depth;
+    entry->next = live;
+    live = entry;
+
+    return entry->matrix;
+}
+
+static void arena_put(void *matrix, const char *name)
+{
+    ArenaEntry **link = &live;
+    while (*link != NULL && (*link)->matrix != matrix)
+        link = &(*link)->next;
+
+    if (*link == NULL)
+        errx(EXIT_FAILURE, "%s: matrix does not come from the arena\n", name);
+
+    ArenaEntry *entry = *link;
+    *link = entry->next;
+
+    ArenaClass *c = &classes[entry->class];
+    entry->next = c->free;
+    c->free = entry;
+    stats.live--;
+}
+
+/// @brief Opens a scope, temporaries not put back are reclaimed by the matching matrix_arena_end.
+void matrix_arena_begin()
+{
+    depth++;
+}
+
+/// @brief Closes the innermost scope and returns its temporaries to the free lists.
+void matrix_arena_end()
+{
+    if (depth == 0)
+        errx(EXIT_FAILURE, "matrix_arena_end: no scope to end\n");
+
+    while (live != NULL && live->depth == depth)
+        arena_put(live->matrix, "matrix_arena_end");
+
+    depth--;
+}
+
+/// @brief Returns a temporary matrix, reusing a previous one of the same shape if possible.
+/// @param dim1 number of rows
+/// @param dim2 number of columns
+/// @return a matrix whose content is unspecified
+Matrix *matrix_arena_get(int dim1, int dim2)
+{
+    return arena_get(arena_class(2, dim1, dim2, 1, 1, 0));
+}
+
+/// @brief Returns a temporary 4D matrix, reusing a previous one of the same shape if possible.
+/// @param layout one of Matrix4Layout
+/// @return a matrix whose content is unspecified
+Matrix4 *matrix4_arena_get(int dim1, int dim2, int dim3, int dim4, int layout)
+{
+    return arena_get(arena_class(4, dim1, dim2, dim3, dim4, layout));
+}
+
+/// @brief Gives a temporary back to the arena, it must not be used anymore.
+/// @param m a matrix returned by matrix_arena_get
+void matrix_arena_put(Matrix *m)
+{
+    arena_put(m, "matrix_arena_put");
+}
+
+/// @brief Gives a temporary 4D matrix back to the arena, it must not be used anymore.
+/// @param m a matrix returned by matrix4_arena_get
+void matrix4_arena_put(Matrix4 *m)
+{
+    arena_put(m, "matrix4_arena_put");
+}
+
+/// @brief Returns the counters of the calling thread's arena.
+ArenaStats matrix_arena_stats()
+{
+    return stats;
+}
+
+/// @brief Resets the request counters (live and pooled_bytes are kept).
+void matrix_arena_reset_stats()
+{
+    stats.requests = 0;
+    stats.reused = 0;
+    stats.allocations = 0;
+}
+
+/// @brief Frees every pooled matrix of the calling thread. No temporary may be live.
+void matrix_arena_release()
+{
+    if (live != NULL)
+        errx(EXIT_FAILURE, "matrix_arena_release: temporaries are still in use\n");
+
+    for (int i = 0; i < num_classes; i++)
+    {
+        ArenaEntry *entry = classes[i].free;
+        while (entry != NULL)
+        {
+            ArenaEntry *next = entry->next;
+            if (classes[i].kind == 2)
+                matrix_destroy(entry->matrix);
+            else
+                matrix4_destroy(entry->matrix);
+            free(entry);
+            entry = next;
+        }
+    }
+
+    free(classes);
+    classes = NULL;
+    num_classes = 0;
+    capacity = 0;
+    stats.pooled_bytes = 0;
+}
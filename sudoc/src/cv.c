@@ -2787,62 +2787,63 @@ int *CV_FIND_SUDOKU_RECT(const Image *src1, const Image *src2)
 
 /// @brief Apply a perspective transform to an image
 /// @param src Source image.
-/// @param M 3x3 perspective transformation matrix.
+/// @param M 3x3 perspective transformation, from destination to source coordinates.
 /// @param dsize Size of the output image.
 /// @param offset Offset of the transformation in the destination image.
 /// @param background Background color in the destination image.
 /// @return Destination image.
-Image *CV_TRANSFORM(const Image *src, const Matrix *M, Tupple dsize, Tupple offset, Uint32 background)
+Image *CV_WARP_PERSPECTIVE(const Image *src, const Mat3 *M, Tupple dsize, Tupple offset, Uint32 background)
 {
     ASSERT_IMG(src);
 
     Image *dst = CV_INIT(src->c, dsize.x, dsize.y);
+    const float(*m)[3] = M->m;
 
-    ASSERT_MAT(M);
-    if (M->dim1 != 3 || M->dim2 != 3)
+    for (int y = 0; y < dst->h; y++)
     {
-        DEBUG_INFO;
-        ERRX("Matrix must be 3x3");
-    }
+        // the terms of the row are computed once
+        int yt = y - offset.y;
+        float row_x = m[0][1] * yt + m[0][2];
+        float row_y = m[1][1] * yt + m[1][2];
+        float row_w = m[2][1] * yt + m[2][2];
 
-    float m11 = MAT(M, 0, 0);
-    float m12 = MAT(M, 0, 1);
-    float m13 = MAT(M, 0, 2);
-
-    float m21 = MAT(M, 1, 0);
-    float m22 = MAT(M, 1, 1);
-    float m23 = MAT(M, 1, 2);
-
-    float m31 = MAT(M, 2, 0);
-    float m32 = MAT(M, 2, 1);
-    float m33 = MAT(M, 2, 2);
-
-    for (int c = 0; c < dst->c; c++)
-    {
-        for (int y = 0; y < dst->h; y++)
+        for (int x = 0; x < dst->w; x++)
         {
-            for (int x = 0; x < dst->w; x++)
-            {
-                int xt = x - offset.x;
-                int yt = y - offset.y;
-
-                float x1 = (m11 * xt + m12 * yt + m13) / (m31 * xt + m32 * yt + m33);
-                float y1 = (m21 * xt + m22 * yt + m23) / (m31 * xt + m32 * yt + m33);
-
-                int x2 = (int)x1;
-                int y2 = (int)y1;
-
-                if (x1 < 0 || x1 >= src->w || y1 < 0 || y1 >= src->h)
-                    PIXEL(dst, c, y, x) = CV_COLOR(background, c);
-                else
-                    PIXEL(dst, c, y, x) = PIXEL(src, c, y2, x2);
-            }
+            int xt = x - offset.x;
+            float w = m[2][0] * xt + row_w;
+            float x1 = (m[0][0] * xt + row_x) / w;
+            float y1 = (m[1][0] * xt + row_y) / w;
+
+            // one mapping for every channel
+            bool inside = x1 >= 0 && x1 < src->w && y1 >= 0 && y1 < src->h;
+            for (int c = 0; c < dst->c; c++)
+                PIXEL(dst, c, y, x) = inside ? PIXEL(src, c, (int)y1, (int)x1) : CV_COLOR(background, c);
         }
     }
 
     return dst;
 }
 
+/// @brief Apply a perspective transform to an image
+/// @param src Source image.
+/// @param M 3x3 perspective transformation matrix.
+/// @param dsize Size of the output image.
+/// @param offset Offset of the transformation in the destination image.
+/// @param background Background color in the destination image.
+/// @return Destination image.
+Image *CV_TRANSFORM(const Image *src, const Matrix *M, Tupple dsize, Tupple offset, Uint32 background)
+{
+    ASSERT_MAT(M);
+    if (M->dim1 != 3 || M->dim2 != 3)
+    {
+        DEBUG_INFO;
+        ERRX("Matrix must be 3x3");
+    }
+
+    Mat3 m = mat3_from_matrix(M);
+    return CV_WARP_PERSPECTIVE(src, &m, dsize, offset, background);
+}
+
 /// @brief Rotate an image
 /// @param src Source image
 /// @param angle Angle of rotation in degrees
@@ -2860,7 +2861,7 @@ Image *CV_ROTATE(const Image *src, float angle, bool resize, Uint32 background)
         sin(rad), cos(rad), src->h / 2.0f,
         0, 0, 1};
 
-    Matrix *M = matrix_init(3, 3, m);
+    Mat3 M = mat3_from_array(m);
 
     int w = src->w;
     int h = src->h;
@@ -2874,11 +2875,7 @@ Image *CV_ROTATE(const Image *src, float angle, bool resize, Uint32 background)
     Tupple dsize = {w, h};
     Tupple offset = {w / 2.0f, h / 2.0f};
 
-    Image *dst = CV_TRANSFORM(src, M, dsize, offset, background);
-
-    matrix_destroy(M);
-
-    return dst;
+    return CV_WARP_PERSPECTIVE(src, &M, dsize, offset, background);
 }
 
 /// @brief Scale an image
@@ -2895,16 +2892,12 @@ Image *CV_SCALE(const Image *src, float factor, Uint32 background)
         0, 1.0f / factor, 0,
         0, 0, 1};
 
-    Matrix *M = matrix_init(3, 3, m);
+    Mat3 M = mat3_from_array(m);
 
     Tupple dsize = {src->w * factor, src->h * factor};
     Tupple offset = {0, 0};
 
-    Image *dst = CV_TRANSFORM(src, M, dsize, offset, background);
-
-    matrix_destroy(M);
-
-    return dst;
+    return CV_WARP_PERSPECTIVE(src, &M, dsize, offset, background);
 }
 
 /// @brief Resize an image to a given size
@@ -2927,15 +2920,11 @@ Image *CV_RESIZE(const Image *src, Tupple dsize, Uint32 background)
         0, ix, 0,
         0, 0, 1};
 
-    Matrix *M = matrix_init(3, 3, m);
+    Mat3 M = mat3_from_array(m);
 
     Tupple offset = {0, 0};
 
-    Image *dst = CV_TRANSFORM(src, M, dsize, offset, background);
-
-    matrix_destroy(M);
-
-    return dst;
+    return CV_WARP_PERSPECTIVE(src, &M, dsize, offset, background);
 }
 
 /// @brief Zoom in/out an image without changing the image size
@@ -2954,16 +2943,12 @@ Image *CV_ZOOM(const Image *src, float factor, Uint32 background)
         0, factor, (1 - factor) * src->h / 2.0f,
         0, 0, 1};
 
-    Matrix *M = matrix_init(3, 3, m);
+    Mat3 M = mat3_from_array(m);
 
     Tupple dsize = {src->h, src->w};
     Tupple offset = {0, 0};
 
-    Image *dst = CV_TRANSFORM(src, M, dsize, offset, background);
-
-    matrix_destroy(M);
-
-    return dst;
+    return CV_WARP_PERSPECTIVE(src, &M, dsize, offset, background);
 }
 
 /// @brief Translate an image
@@ -2980,15 +2965,11 @@ Image *CV_TRANSLATE(const Image *src, Tupple offset, Uint32 background)
         0, 1, offset.y,
         0, 0, 1};
 
-    Matrix *M = matrix_init(3, 3, m);
+    Mat3 M = mat3_from_array(m);
 
     Tupple dsize = {src->w, src->h};
 
-    Image *dst = CV_TRANSFORM(src, M, dsize, offset, background);
-
-    matrix_destroy(M);
-
-    return dst;
+    return CV_WARP_PERSPECTIVE(src, &M, dsize, offset, background);
 }
 
 #pragma endregion Transform
@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <string.h>
+#include "../include/dataloader.h"
+
+/*
+Background loading of training batches.
+
+Decoding the samples costs more than training on them, so loader threads
+decode, normalize and pack the next batches into a ring of matrices while
+the current one trains:
+
+    DataLoader *loader = dataloader_init(n, 28 * 28, labels, 10, 64, read, ctx,
+                                         DATALOADER_PREFETCH, 2, seed);
+    for (int epoch = 0; epoch < epochs; epoch++)
+        for (int b = 0; b < loader->batches_per_epoch; b++)
+        {
+            DataBatch *batch = dataloader_next(loader);
+            nn_train_batch(network, batch->inputs, batch->labels, learning_rate);
+        }
+    dataloader_destroy(loader);
+
+Every epoch visits the samples in a new random order, the num_samples %
+batch_size left over are not seen during that epoch. The order only depends
+on the seed: batches are handed out in sequence whatever the number of
+threads and the time they take.
+*/
+
+// splitmix64, the loader does not share the state of rand()
+static uint64_t next_random(unsigned long *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Fisher-Yates shuffle of the order of the next epoch, under lock
+static void shuffle_epoch(DataLoader *loader)
+{
+    int *order = loader->order[loader->shuffled % 2];
+    for (int i = 0; i < loader->num_samples; i++)
+        order[i] = i;
+    for (int i = loader->num_samples - 1; i > 0; i--)
+    {
+        int j = next_random(&loader->rng) % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    loader->shuffled++;
+}
+
+static void fill_batch(DataLoader *loader, DataBatch *batch)
+{
+    long epoch = batch->index / loader->batches_per_epoch;
+    const int *order = &loader->order[epoch % 2][(batch->index % loader->batches_per_epoch) * loader->batch_size];
+
+    matrix_zero(batch->labels);
+    for (int i = 0; i < loader->batch_size; i++)
+    {
+        int sample = order[i];
+        loader->read(loader->ctx, sample, &batch->inputs->data[i * batch->inputs->stride]);
+        MAT(batch->labels, i, loader->labels[sample]) = 1.0f;
+    }
+}
+
+static void *loader_main(void *arg)
+{
+    DataLoader *loader = arg;
+
+    pthread_mutex_lock(&loader->lock);
+    while (true)
+    {
+        // the next batch goes into the slot freed by the batch ring_size
+        // before it. The ring never spans more than two epochs, so the
+        // order of an epoch can replace the one of two epochs before.
+        DataBatch *batch = NULL;
+        while (!loader->stopping)
+        {
+            batch = &loader->ring[loader->next_fill % loader->ring_size];
+            if (batch->index == -1)
+                break;
+            pthread_cond_wait(&loader->batch_free, &loader->lock);
+        }
+        if (loader->stopping)
+            break;
+
+        batch->index = loader->next_fill++;
+        if (batch->index / loader->batches_per_epoch == loader->shuffled)
+            shuffle_epoch(loader);
+
+        pthread_mutex_unlock(&loader->lock);
+        fill_batch(loader, batch);
+        pthread_mutex_lock(&loader->lock);
+
+        batch->ready = true;
+        pthread_cond_broadcast(&loader->batch_ready);
+    }
+    pthread_mutex_unlock(&loader->lock);
+
+    return NULL;
+}
+
+/// @brief Starts loader threads filling batches of a shuffled dataset.
+/// @param num_samples number of samples, at least batch_size
+/// @param sample_size number of values of a sample
+/// @param labels class of every sample, in [0, num_classes)
+/// @param read decodes a sample, see DataLoaderRead
+/// @param prefetch number of batches loaded ahead, DATALOADER_PREFETCH by
+/// default, at most the batches of an epoch minus one
+/// @param num_threads number of loader threads
+/// @param seed seed of the shuffling
+/// @return the loader, to free with dataloader_destroy
+DataLoader *dataloader_init(int num_samples, int sample_size, const int *labels, int num_classes,
+                            int batch_size, DataLoaderRead read, void *ctx,
+                            int prefetch, int num_threads, unsigned long seed)
+{
+    if (batch_size <= 0 || num_samples < batch_size)
+        errx(EXIT_FAILURE, "dataloader_init: cannot make batches of %d out of %d samples\n", batch_size, num_samples);
+    if (prefetch < 0 || num_threads <= 0)
+        errx(EXIT_FAILURE, "dataloader_init: invalid prefetch %d or thread count %d\n", prefetch, num_threads);
+
+    DataLoader *loader = malloc(sizeof(DataLoader));
+    if (loader == NULL)
+        errx(EXIT_FAILURE, "dataloader_init: failed to allocate the loader\n");
+
+    loader->num_samples = num_samples;
+    loader->sample_size = sample_size;
+    loader->num_classes = num_classes;
+    loader->labels = labels;
+    loader->batch_size = batch_size;
+    loader->batches_per_epoch = num_samples / batch_size;
+    loader->read = read;
+    loader->ctx = ctx;
+    loader->rng = seed;
+
+    // the batch being trained on keeps its slot until the next call
+    loader->ring_size = prefetch + 1;
+    if (loader->ring_size > loader->batches_per_epoch)
+        loader->ring_size = loader->batches_per_epoch;
+
+    loader->order[0] = malloc(sizeof(int) * num_samples);
+    loader->order[1] = malloc(sizeof(int) * num_samples);
+    loader->ring = malloc(sizeof(DataBatch) * loader->ring_size);
+    loader->threads = malloc(sizeof(pthread_t) * num_threads);
+    if (loader->order[0] == NULL || loader->order[1] == NULL || loader->ring == NULL || loader->threads == NULL)
+        errx(EXIT_FAILURE, "dataloader_init: failed to allocate the ring\n");
+
+    for (int i = 0; i < loader->ring_size; i++)
+    {
+        loader->ring[i].inputs = matrix_init(batch_size, sample_size, NULL);
+        loader->ring[i].labels = matrix_init(batch_size, num_classes, NULL);
+        loader->ring[i].index = -1;
+        loader->ring[i].ready = false;
+    }
+
+    loader->next_fill = 0;
+    loader->next_consume = 0;
+    loader->shuffled = 0;
+    loader->stopping = false;
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->batch_free, NULL);
+    pthread_cond_init(&loader->batch_ready, NULL);
+
+    loader->num_threads = num_threads;
+    for (int i = 0; i < num_threads; i++)
+        if (pthread_create(&loader->threads[i], NULL, loader_main, loader) != 0)
+            errx(EXIT_FAILURE, "dataloader_init: failed to start loader thread %d\n", i);
+
+    return loader;
+}
+
+/// @brief Waits for the next batch, epochs follow each other without end.
+/// @return the batch, valid until the next call (its slot is then refilled)
+DataBatch *dataloader_next(DataLoader *loader)
+{
+    pthread_mutex_lock(&loader->lock);
+
+    if (loader->next_consume > 0)
+    {
+        DataBatch *previous = &loader->ring[(loader->next_consume - 1) % loader->ring_size];
+        previous->index = -1;
+        previous->ready = false;
+        pthread_cond_broadcast(&loader->batch_free);
+    }
+
+    DataBatch *batch = &loader->ring[loader->next_consume % loader->ring_size];
+    while (batch->index != loader->next_consume || !batch->ready)
+        pthread_cond_wait(&loader->batch_ready, &loader->lock);
+    loader->next_consume++;
+
+    pthread_mutex_unlock(&loader->lock);
+    return batch;
+}
+
+/// @brief Stops the loader threads and frees the ring.
+void dataloader_destroy(DataLoader *loader)
+{
+    pthread_mutex_lock(&loader->lock);
+    loader->stopping = true;
+    pthread_cond_broadcast(&loader->batch_free);
+    pthread_mutex_unlock(&loader->lock);
+
+    // a thread filling a batch finishes it first
+    for (int i = 0; i < loader->num_threads; i++)
+        pthread_join(loader->threads[i], NULL);
+
+    for (int i = 0; i < loader->ring_size; i++)
+    {
+        matrix_destroy(loader->ring[i].inputs);
+        matrix_destroy(loader->ring[i].labels);
+    }
+
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->batch_free);
+    pthread_cond_destroy(&loader->batch_ready);
+
+    free(loader->order[0]);
+    free(loader->order[1]);
+    free(loader->ring);
+    free(loader->threads);
+    free(loader);
+}
@@ -0,0 +1,488 @@
+#include "../include/gemm.h"
+
+/*
+Packed, cache-blocked single precision GEMM (row major):
+
+    C = alpha * op(A) * op(B) + beta * C
+
+where op(X) is X or its transpose, op(A) has shape (M x K), op(B) has shape
+(K x N) and C has shape (M x N). lda, ldb and ldc are the row strides of each
+operand as stored in memory, so transposed operands are read in place.
+
+The loops follow the usual Goto/BLIS structure: B is cut into (KC x NC)
+blocks packed as NR-wide column panels, A is cut into (MC x KC) blocks packed
+as MR-tall row panels, and the micro-kernel computes one (MR x NR) tile of C
+in registers while streaming both panels contiguously. Partial tiles at the
+edges are zero padded during packing so the micro-kernel never branches.
+
+sgemm_fused() also takes an epilogue (bias and activation) that the
+micro-kernel applies on its last K block, before the tile leaves the
+registers, so layers do not need extra passes over their output.
+
+sgemm_mixed() reads A and/or B stored as fp16 or bf16 (weights kept in 16
+bits to halve their memory traffic). The blocks are widened to fp32 right
+before packing, so the micro-kernel and its accumulators are unchanged.
+*/
+
+// packing buffers, allocated once per thread and reused across calls
+static __thread float *pack_a = NULL;
+static __thread float *pack_b = NULL;
+
+// fp32 copy of a 16-bit block before packing, allocated on first use
+static __thread float *widen_buf = NULL;
+
+static void gemm_alloc_buffers()
+{
+    if (pack_a == NULL)
+        pack_a = malloc(sizeof(float) * GEMM_MC * GEMM_KC);
+    if (pack_b == NULL)
+        pack_b = malloc(sizeof(float) * GEMM_KC * GEMM_NC);
+    if (pack_a == NULL || pack_b == NULL)
+        errx(EXIT_FAILURE, "sgemm: failed to allocate packing buffers");
+}
+
+/// @brief Frees the packing buffers of the calling thread (reallocated on the next call).
+void sgemm_release_buffers()
+{
+    free(pack_a);
+    free(pack_b);
+    free(widen_buf);
+    pack_a = NULL;
+    pack_b = NULL;
+    widen_buf = NULL;
+}
+
+// address of element offset of an operand stored as storage
+static const void *element_at(const void *X, int storage, long offset)
+{
+    size_t size = storage == FLOAT_STORAGE_FP32 ? sizeof(float) : sizeof(uint16_t);
+    return (const char *)X + offset * size;
+}
+
+/// @brief Converts a (rows x cols) block stored in 16 bits to fp32.
+/// @return the block in widen_buf, with a row stride of cols
+static const float *widen_block(const void *X, int storage, int rows, int cols, int ld)
+{
+    if (widen_buf == NULL)
+        widen_buf = malloc(sizeof(float) * GEMM_KC * GEMM_NC);
+    if (widen_buf == NULL)
+        errx(EXIT_FAILURE, "sgemm: failed to allocate packing buffers");
+
+    const SimdKernels *k = simd_kernels();
+    const uint16_t *src = X;
+    for (int i = 0; i < rows; i++)
+    {
+        if (storage == FLOAT_STORAGE_FP16)
+            k->from_fp16(&src[(long)i * ld], &widen_buf[i * cols], cols);
+        else
+            k->from_bf16(&src[(long)i * ld], &widen_buf[i * cols], cols);
+    }
+
+    return widen_buf;
+}
+
+/// @brief Packs an (mc x kc) block of op(A) into MR-tall row panels.
+/// A points to element (0, 0) of the block as stored in memory.
+static void pack_block_a(bool trans, int mc, int kc, const float *A, int lda, float *dst)
+{
+    for (int ir = 0; ir < mc; ir += GEMM_MR)
+    {
+        int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+        for (int p = 0; p < kc; p++)
+        {
+            if (trans)
+                for (int i = 0; i < mr; i++)
+                    dst[i] = A[p * lda + ir + i];
+            else
+                for (int i = 0; i < mr; i++)
+                    dst[i] = A[(ir + i) * lda + p];
+            for (int i = mr; i < GEMM_MR; i++)
+                dst[i] = 0.0f;
+            dst += GEMM_MR;
+        }
+    }
+}
+
+/// @brief Packs a (kc x nc) block of op(B) into NR-wide column panels.
+/// B points to element (0, 0) of the block as stored in memory.
+static void pack_block_b(bool trans, int kc, int nc, const float *B, int ldb, float *dst)
+{
+    for (int jr = 0; jr < nc; jr += GEMM_NR)
+    {
+        int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+        for (int p = 0; p < kc; p++)
+        {
+            if (trans)
+                for (int j = 0; j < nr; j++)
+                    dst[j] = B[(jr + j) * ldb + p];
+            else
+                for (int j = 0; j < nr; j++)
+                    dst[j] = B[p * ldb + jr + j];
+            for (int j = nr; j < GEMM_NR; j++)
+                dst[j] = 0.0f;
+            dst += GEMM_NR;
+        }
+    }
+}
+
+/// @brief Applies an activation known at compile time to the (mr x nr)
+/// part of a tile, so the activation is chosen once per tile.
+static inline __attribute__((always_inline)) void activate_tile(float acc[GEMM_MR][GEMM_NR], int mr, int nr,
+                                                                const int activation)
+{
+    for (int i = 0; i < mr; i++)
+        for (int j = 0; j < nr; j++)
+            acc[i][j] = simd_activate(activation, acc[i][j]);
+}
+
+/// @brief Computes an (MR x NR) tile of C from packed panels of A and B.
+/// Only the top-left (mr x nr) part of the tile is written back.
+/// The epilogue (or NULL) is applied with bias indices offset by (row, col),
+/// on the accumulators before the tile is stored.
+static void gemm_micro_kernel(int kc, const float *a, const float *b,
+                              float *C, int ldc, int mr, int nr,
+                              float alpha, float beta,
+                              const GemmEpilogue *ep, int row, int col)
+{
+    float acc[GEMM_MR][GEMM_NR] = {{0}};
+
+    for (int p = 0; p < kc; p++)
+    {
+        for (int i = 0; i < GEMM_MR; i++)
+        {
+            float ai = a[i];
+            for (int j = 0; j < GEMM_NR; j++)
+                acc[i][j] += ai * b[j];
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    for (int i = 0; i < mr; i++)
+    {
+        if (beta == 0.0f)
+            for (int j = 0; j < nr; j++)
+                acc[i][j] = alpha * acc[i][j];
+        else
+            for (int j = 0; j < nr; j++)
+                acc[i][j] = alpha * acc[i][j] + beta * C[i * ldc + j];
+    }
+
+    if (ep != NULL && ep->bias != NULL)
+    {
+        for (int i = 0; i < mr; i++)
+            for (int j = 0; j < nr; j++)
+                acc[i][j] += ep->bias_rows ? ep->bias[row + i] : ep->bias[col + j];
+    }
+
+    if (ep != NULL)
+    {
+        switch (ep->activation)
+        {
+        case ACTIVATION_RELU:
+            activate_tile(acc, mr, nr, ACTIVATION_RELU);
+            break;
+        case ACTIVATION_LEAKY_RELU:
+            activate_tile(acc, mr, nr, ACTIVATION_LEAKY_RELU);
+            break;
+        case ACTIVATION_SIGMOID:
+            activate_tile(acc, mr, nr, ACTIVATION_SIGMOID);
+            break;
+        }
+    }
+
+    for (int i = 0; i < mr; i++)
+        for (int j = 0; j < nr; j++)
+            C[i * ldc + j] = acc[i][j];
+}
+
+// bias of element (i, j) of the epilogue, ep not NULL
+static inline float epilogue_bias(const GemmEpilogue *ep, int i, int j)
+{
+    return ep->bias == NULL ? 0.0f : ep->bias[ep->bias_rows ? i : j];
+}
+
+/// @brief Applies the epilogue to an (M x N) block of C, for products
+/// with an empty K that neither kernel computes.
+static void gemm_epilogue(int M, int N, float *C, int ldc, const GemmEpilogue *ep)
+{
+    if (ep == NULL)
+        return;
+
+    for (int i = 0; i < M; i++)
+        for (int j = 0; j < N; j++)
+        {
+            C[i * ldc + j] = simd_activate(ep->activation, C[i * ldc + j] + epilogue_bias(ep, i, j));
+        }
+}
+
+/// @brief Scales C by beta (used when K == 0). beta == 0 clears C without reading it.
+static void gemm_scale(int M, int N, float beta, float *C, int ldc)
+{
+    for (int i = 0; i < M; i++)
+        for (int j = 0; j < N; j++)
+            C[i * ldc + j] = beta == 0.0f ? 0.0f : beta * C[i * ldc + j];
+}
+
+/// @brief Row-by-row product for skinny op(A) (fewer rows than a register tile).
+/// Packing B would cost as much as the product itself, so B is streamed in
+/// place instead: row-wise axpy for plain B, contiguous dot products for B^T.
+/// The epilogue (or NULL) is applied to every output before it is stored
+/// (dot products) or while its row is still in L1 (axpy).
+static void gemm_small_m(bool transA, bool transB, int M, int N, int K,
+                         float alpha, const float *A, int lda,
+                         const float *B, int ldb,
+                         float beta, float *C, int ldc,
+                         const GemmEpilogue *ep)
+{
+    for (int i = 0; i < M; i++)
+    {
+        float *c = &C[i * ldc];
+
+        if (transB)
+        {
+            // a row of A is contiguous unless transA: the vectorized dot
+            // reads the (N, K) weights of a dense layer 8x faster than the
+            // scalar loop and 2.5x faster than an axpy over their transpose
+            const SimdKernels *simd = simd_kernels();
+            for (int j = 0; j < N; j++)
+            {
+                const float *b = &B[j * ldb];
+                float sum = 0.0f;
+                if (!transA)
+                    sum = simd->dot(&A[i * lda], b, K);
+                else
+                    for (int k = 0; k < K; k++)
+                        sum += A[k * lda + i] * b[k];
+                float value = beta == 0.0f ? alpha * sum : alpha * sum + beta * c[j];
+                if (ep != NULL)
+                    value = simd_activate(ep->activation, value + epilogue_bias(ep, i, j));
+                c[j] = value;
+            }
+            continue;
+        }
+
+        for (int j = 0; j < N; j++)
+            c[j] = beta == 0.0f ? 0.0f : beta * c[j];
+
+        for (int k = 0; k < K; k++)
+        {
+            float aik = alpha * (transA ? A[k * lda + i] : A[i * lda + k]);
+            const float *b = &B[k * ldb];
+            for (int j = 0; j < N; j++)
+                c[j] += aik * b[j];
+        }
+
+        if (ep != NULL)
+            for (int j = 0; j < N; j++)
+                c[j] = simd_activate(ep->activation, c[j] + epilogue_bias(ep, i, j));
+    }
+}
+
+/// @brief Single threaded product, see sgemm_mixed.
+static void sgemm_serial(bool transA, bool transB, int M, int N, int K,
+                         float alpha, const void *A, int storageA, int lda,
+                         const void *B, int storageB, int ldb,
+                         float beta, float *C, int ldc,
+                         const GemmEpilogue *epilogue)
+{
+    if (M <= 0 || N <= 0)
+        return;
+
+    if (K <= 0)
+    {
+        gemm_scale(M, N, beta, C, ldc);
+        gemm_epilogue(M, N, C, ldc, epilogue);
+        return;
+    }
+
+    // 16-bit operands always go through packing, where they are widened
+    if (M < GEMM_MR && storageA == FLOAT_STORAGE_FP32 && storageB == FLOAT_STORAGE_FP32)
+    {
+        gemm_small_m(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, epilogue);
+        return;
+    }
+
+    gemm_alloc_buffers();
+
+    for (int jc = 0; jc < N; jc += GEMM_NC)
+    {
+        int nc = N - jc < GEMM_NC ? N - jc : GEMM_NC;
+
+        for (int pc = 0; pc < K; pc += GEMM_KC)
+        {
+            int kc = K - pc < GEMM_KC ? K - pc : GEMM_KC;
+
+            // the first K block applies beta, the following ones accumulate
+            // and the last one applies the epilogue
+            float beta_block = pc == 0 ? beta : 1.0f;
+            const GemmEpilogue *ep = pc + kc == K ? epilogue : NULL;
+
+            const void *b_block = element_at(B, storageB, transB ? (long)jc * ldb + pc : (long)pc * ldb + jc);
+            if (storageB == FLOAT_STORAGE_FP32)
+                pack_block_b(transB, kc, nc, b_block, ldb, pack_b);
+            else if (transB)
+                pack_block_b(true, kc, nc, widen_block(b_block, storageB, nc, kc, ldb), kc, pack_b);
+            else
+                pack_block_b(false, kc, nc, widen_block(b_block, storageB, kc, nc, ldb), nc, pack_b);
+
+            for (int ic = 0; ic < M; ic += GEMM_MC)
+            {
+                int mc = M - ic < GEMM_MC ? M - ic : GEMM_MC;
+
+                const void *a_block = element_at(A, storageA, transA ? (long)pc * lda + ic : (long)ic * lda + pc);
+                if (storageA == FLOAT_STORAGE_FP32)
+                    pack_block_a(transA, mc, kc, a_block, lda, pack_a);
+                else if (transA)
+                    pack_block_a(true, mc, kc, widen_block(a_block, storageA, kc, mc, lda), mc, pack_a);
+                else
+                    pack_block_a(false, mc, kc, widen_block(a_block, storageA, mc, kc, lda), kc, pack_a);
+
+                for (int jr = 0; jr < nc; jr += GEMM_NR)
+                {
+                    int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                    for (int ir = 0; ir < mc; ir += GEMM_MR)
+                    {
+                        int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                        gemm_micro_kernel(kc, &pack_a[ir * kc], &pack_b[jr * kc],
+                                          &C[(ic + ir) * ldc + jc + jr], ldc,
+                                          mr, nr, alpha, beta_block,
+                                          ep, ic + ir, jc + jr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Arguments of a product split between the threads of the pool
+typedef struct
+{
+    bool transA, transB;
+    int M, N, K;
+    float alpha;
+    const void *A;
+    int storageA;
+    int lda;
+    const void *B;
+    int storageB;
+    int ldb;
+    float beta;
+    float *C;
+    int ldc;
+    const GemmEpilogue *epilogue;
+    int tile; // rows or columns per unit of the parallel loop
+} GemmTask;
+
+// epilogue of the sub-product starting at (row, col) of C
+static const GemmEpilogue *epilogue_at(const GemmEpilogue *ep, int row, int col, GemmEpilogue *shifted)
+{
+    if (ep == NULL || ep->bias == NULL)
+        return ep;
+
+    *shifted = *ep;
+    shifted->bias += ep->bias_rows ? row : col;
+    return shifted;
+}
+
+// computes the columns [begin * tile, end * tile) of C
+static void gemm_columns(void *ctx, int begin, int end)
+{
+    GemmTask *t = ctx;
+    int j0 = begin * t->tile;
+    int j1 = end * t->tile < t->N ? end * t->tile : t->N;
+
+    GemmEpilogue shifted;
+    const void *b = element_at(t->B, t->storageB, t->transB ? (long)j0 * t->ldb : j0);
+    sgemm_serial(t->transA, t->transB, t->M, j1 - j0, t->K,
+                 t->alpha, t->A, t->storageA, t->lda, b, t->storageB, t->ldb,
+                 t->beta, &t->C[j0], t->ldc,
+                 epilogue_at(t->epilogue, 0, j0, &shifted));
+}
+
+// computes the rows [begin * tile, end * tile) of C
+static void gemm_rows(void *ctx, int begin, int end)
+{
+    GemmTask *t = ctx;
+    int i0 = begin * t->tile;
+    int i1 = end * t->tile < t->M ? end * t->tile : t->M;
+
+    GemmEpilogue shifted;
+    const void *a = element_at(t->A, t->storageA, t->transA ? i0 : (long)i0 * t->lda);
+    sgemm_serial(t->transA, t->transB, i1 - i0, t->N, t->K,
+                 t->alpha, a, t->storageA, t->lda, t->B, t->storageB, t->ldb,
+                 t->beta, &t->C[i0 * t->ldc], t->ldc,
+                 epilogue_at(t->epilogue, i0, 0, &shifted));
+}
+
+/// @brief Single precision matrix multiply: C = alpha * op(A) * op(B) + beta * C
+/// Large products are split over the thread pool along the largest dimension
+/// of C, each thread packing its own blocks.
+/// @param transA use the transpose of A
+/// @param transB use the transpose of B
+/// @param M number of rows of op(A) and C
+/// @param N number of columns of op(B) and C
+/// @param K number of columns of op(A) and rows of op(B)
+/// @param alpha scale of the product
+/// @param A pointer to the first element of A
+/// @param lda row stride of A as stored
+/// @param B pointer to the first element of B
+/// @param ldb row stride of B as stored
+/// @param beta scale of the previous content of C (C is not read when beta == 0)
+/// @param C pointer to the first element of C
+/// @param ldc row stride of C
+void sgemm(bool transA, bool transB, int M, int N, int K,
+           float alpha, const float *A, int lda,
+           const float *B, int ldb,
+           float beta, float *C, int ldc)
+{
+    sgemm_fused(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, NULL);
+}
+
+/// @brief sgemm followed by a bias and an activation, applied to each tile of C
+/// while it is still in registers: C = act(alpha * op(A) * op(B) + beta * C + bias)
+/// @param epilogue bias and activation, NULL for a plain sgemm
+void sgemm_fused(bool transA, bool transB, int M, int N, int K,
+                 float alpha, const float *A, int lda,
+                 const float *B, int ldb,
+                 float beta, float *C, int ldc,
+                 const GemmEpilogue *epilogue)
+{
+    sgemm_mixed(transA, transB, M, N, K,
+                alpha, A, FLOAT_STORAGE_FP32, lda, B, FLOAT_STORAGE_FP32, ldb,
+                beta, C, ldc, epilogue);
+}
+
+/// @brief sgemm_fused with A and B stored as fp32, fp16 or bf16. Products
+/// and sums are computed in fp32 whatever the storage.
+/// @param storageA one of FloatStorage, A is a uint16_t array unless fp32
+/// @param storageB one of FloatStorage, B is a uint16_t array unless fp32
+void sgemm_mixed(bool transA, bool transB, int M, int N, int K,
+                 float alpha, const void *A, int storageA, int lda,
+                 const void *B, int storageB, int ldb,
+                 float beta, float *C, int ldc,
+                 const GemmEpilogue *epilogue)
+{
+    if ((long)M * N * K < GEMM_PARALLEL_MIN_WORK || threadpool_in_worker())
+    {
+        sgemm_serial(transA, transB, M, N, K, alpha, A, storageA, lda, B, storageB, ldb,
+                     beta, C, ldc, epilogue);
+        return;
+    }
+
+    GemmTask task = {transA, transB, M, N, K, alpha, A, storageA, lda, B, storageB, ldb,
+                     beta, C, ldc, epilogue, 0};
+
+    // split along the largest side of C, in whole register tiles, keeping at
+    // least a few tiles per thread so that packing stays amortized
+    if (N >= M)
+    {
+        task.tile = GEMM_NR;
+        threadpool_parallel_for((N + GEMM_NR - 1) / GEMM_NR, 4, gemm_columns, &task);
+    }
+    else
+    {
+        task.tile = GEMM_MR;
+        threadpool_parallel_for((M + GEMM_MR - 1) / GEMM_MR, 8, gemm_rows, &task);
+    }
+}
@@ -30,6 +30,7 @@ FCLayer *fc_layer_init(
 
     layer->input_size = input_size;
     layer->output_size = output_size;
+    layer->activation = activation_kind(activation_func, d_activation_func);
     layer->activation_func = activation_func;
     layer->d_activation_func = d_activation_func;
 
@@ -44,25 +45,164 @@ FCLayer *fc_layer_init(
     // initialize matrices for backprop
     layer->weights_gradient = matrix_init(output_size, input_size, NULL);
     layer->biases_gradient = matrix_init(1, output_size, NULL);
+    layer->weights_state = (OptimizerState){0};
+    layer->biases_state = (OptimizerState){0};
+
+    layer->weights16 = NULL;
+    layer->weights16_stale = true;
+
+    layer->sparsity = 0.0f;
+    layer->prune_mask = NULL;
+    layer->sparse_weights = NULL;
+    layer->sparse_stale = true;
 
     return layer;
 }
 
+// sets the format of the weights read by the forward pass, one of FloatStorage
+// 16-bit storage halves the weight traffic of inference, the products are
+// still accumulated in fp32. The fp32 weights stay the reference: backward
+// passes, saving and loading use them and the 16-bit copy follows.
+void fc_layer_set_weight_storage(FCLayer *layer, int storage)
+{
+    if (layer->weights16 != NULL)
+        matrix16_destroy(layer->weights16);
+    layer->weights16 = NULL;
+    layer->weights16_stale = true;
+
+    if (storage != FLOAT_STORAGE_FP32)
+        layer->weights16 = matrix16_init(layer->output_size, layer->input_size, 1, 1, storage);
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// zeroes the fraction sparsity of the weights with the smallest magnitude
+// and keeps them at zero during the next backward passes. Pruning again
+// after some training moves the mask to the new smallest weights, 0 makes
+// the layer dense again (the pruned weights restart from zero).
+void fc_layer_prune(FCLayer *layer, float sparsity)
+{
+    if (sparsity < 0.0f || sparsity >= 1.0f)
+        errx(EXIT_FAILURE, "fc_layer_prune: sparsity must be in [0, 1), got %f\n", sparsity);
+
+    layer->sparsity = sparsity;
+    layer->sparse_stale = true;
+    if (sparsity == 0.0f)
+    {
+        if (layer->prune_mask != NULL)
+            matrix_destroy(layer->prune_mask);
+        layer->prune_mask = NULL;
+        return;
+    }
+
+    if (layer->prune_mask == NULL)
+        layer->prune_mask = matrix_init(layer->output_size, layer->input_size, NULL);
+
+    // the threshold is the magnitude of the last weight to prune
+    int size = layer->weights->size;
+    int pruned = (int)(sparsity * size);
+    float *magnitudes = malloc(sizeof(float) * size);
+    if (magnitudes == NULL)
+        errx(EXIT_FAILURE, "fc_layer_prune: failed to allocate %d floats\n", size);
+    for (int i = 0; i < size; i++)
+        magnitudes[i] = fabsf(layer->weights->data[i]);
+    qsort(magnitudes, size, sizeof(float), compare_floats);
+    float threshold = pruned > 0 ? magnitudes[pruned - 1] : -1.0f;
+    free(magnitudes);
+
+    // ties with the threshold are pruned too
+    for (int i = 0; i < size; i++)
+    {
+        bool keep = fabsf(layer->weights->data[i]) > threshold;
+        layer->prune_mask->data[i] = keep ? 1.0f : 0.0f;
+        if (!keep)
+            layer->weights->data[i] = 0.0f;
+    }
+    layer->weights16_stale = true;
+}
+
+// reallocates the activations and deltas for batches of batch_size rows
+void fc_layer_set_batch_size(FCLayer *layer, int batch_size)
+{
+    if (layer->activations == NULL)
+        errx(EXIT_FAILURE, "fc_layer_set_batch_size: the training buffers were released\n");
+    if (layer->activations->dim1 == batch_size)
+        return;
+
+    matrix_destroy(layer->activations);
+    matrix_destroy(layer->deltas);
+    layer->activations = matrix_init(batch_size, layer->output_size, NULL);
+    layer->deltas = matrix_init(batch_size, layer->input_size, NULL);
+}
+
+// converts the CSR or 16-bit copy read by the forward pass again if the
+// weights changed. Afterwards forward passes only read the layer, so that
+// several threads can run them at once.
+void fc_layer_refresh_weights(FCLayer *layer)
+{
+    if (layer->sparsity >= FC_SPARSE_MIN_SPARSITY && (layer->sparse_stale || layer->sparse_weights == NULL))
+    {
+        if (layer->sparse_weights != NULL)
+            sparse_matrix_destroy(layer->sparse_weights);
+        layer->sparse_weights = sparse_matrix_from_dense(layer->weights);
+        layer->sparse_stale = false;
+    }
+    if (layer->weights16 != NULL && layer->weights16_stale)
+    {
+        matrix16_convert(layer->weights16, layer->weights->data);
+        layer->weights16_stale = false;
+    }
+}
+
 // forward pass for an input of shape: (batch_size, input_size)
 Matrix *fc_layer_forward(FCLayer *layer, Matrix *input)
 {
-    // calculate activations
-    Matrix *WT = matrix_transpose(layer->weights);
-    matrix_multiply(input, WT, layer->activations);
-    matrix_add_bias(layer->activations, layer->biases, layer->activations);
-    matrix_map_function(layer->activations, layer->activation_func);
+    return fc_layer_infer(layer, input, layer->activations);
+}
+
+// forward pass into dst, of shape (rows of input, output_size), instead of
+// the activations of the layer. Only reads the weights, which lets an
+// inference plan share its buffers between layers.
+Matrix *fc_layer_infer(FCLayer *layer, Matrix *input, Matrix *dst)
+{
+    // calculate activations: act(input * weights^T + biases) in one pass,
+    // weights are read in place
+    bool custom = layer->activation == ACTIVATION_CUSTOM;
+    int activation = custom ? ACTIVATION_IDENTITY : layer->activation;
+    fc_layer_refresh_weights(layer);
+    if (layer->sparsity >= FC_SPARSE_MIN_SPARSITY)
+        matrix_multiply_sparse_fused(input, layer->sparse_weights, layer->biases, activation, dst);
+    else if (layer->weights16 != NULL)
+        matrix_multiply_fused16(input, layer->weights16, layer->biases, activation, dst);
+    else
+        matrix_multiply_fused(input, false, layer->weights, true, layer->biases, activation, dst);
+    if (custom)
+        matrix_map_function(dst, layer->activation_func);
 
-    matrix_destroy(WT);
+    return dst;
+}
 
-    return layer->activations;
+// frees the buffers only used by training (activations, deltas, gradients
+// and optimizer state), for layers that only run fc_layer_infer from now on
+void fc_layer_release_training(FCLayer *layer)
+{
+    Matrix **buffers[] = {&layer->activations, &layer->deltas, &layer->weights_gradient, &layer->biases_gradient};
+    for (int i = 0; i < 4; i++)
+    {
+        if (*buffers[i] != NULL)
+            matrix_destroy(*buffers[i]);
+        *buffers[i] = NULL;
+    }
+    optimizer_state_reset(&layer->weights_state);
+    optimizer_state_reset(&layer->biases_state);
 }
 
-// backward pass for an input of shape: (batch_size, input_size)
+// backward pass for an input of shape: (batch_size, input_size), computes
+// the gradients then updates the weights
 //
 // previous_activations: activations of the previous layer (input)
 // previous_deltas: deltas of the next layer (output)
@@ -70,32 +210,61 @@ Matrix *fc_layer_forward(FCLayer *layer, Matrix *input)
 
 Matrix *fc_layer_backward(FCLayer *layer, Matrix *prev_activations, Matrix *prev_deltas, float learning_rate)
 {
-    Matrix *dZ = matrix_copy(layer->activations, NULL);
-    matrix_map_function(dZ, layer->d_activation_func);
+    Matrix *deltas = fc_layer_gradients(layer, prev_activations, prev_deltas);
+    fc_layer_update(layer, learning_rate);
+    return deltas;
+}
+
+// gradients of the weights and biases, summed over the batch, and deltas
+// of the previous layer, without changing the weights
+Matrix *fc_layer_gradients(FCLayer *layer, Matrix *prev_activations, Matrix *prev_deltas)
+{
+    if (layer->weights_gradient == NULL)
+        errx(EXIT_FAILURE, "fc_layer_gradients: the training buffers were released\n");
+
+    Matrix *dZ = matrix_arena_get(layer->activations->dim1, layer->activations->dim2);
+    if (layer->activation == ACTIVATION_CUSTOM)
+    {
+        matrix_copy(layer->activations, dZ);
+        matrix_map_function(dZ, layer->d_activation_func);
+    }
+    else
+        matrix_activate_derivative(layer->activations, layer->activation, dZ);
     matrix_elementwise_multiply(dZ, prev_deltas, dZ);
 
-    Matrix *prev_activationsT = matrix_transpose(prev_activations);
-    Matrix *dW = matrix_multiply(prev_activationsT, dZ, NULL);
-    Matrix *db = matrix_sum_rows(dZ, NULL);
+    // gradients are computed directly in the (output_size, input_size)
+    // layout of the weights: dW = dZ^T * prev_activations
+    matrix_multiply_ex(dZ, true, prev_activations, false, 1.0f, 0.0f, layer->weights_gradient);
+    matrix_sum_rows(dZ, layer->biases_gradient);
     matrix_multiply(dZ, layer->weights, layer->deltas);
 
-    // update weights and biases
-    matrix_multiply_scalar(dW, -learning_rate);
-    matrix_multiply_scalar(db, -learning_rate);
-    Matrix *dWT = matrix_transpose(dW);
-    matrix_add(layer->weights, dWT, layer->weights);
-    matrix_add(layer->biases, db, layer->biases);
-
-    // free memory
-    matrix_destroy(dZ);
-    matrix_destroy(dW);
-    matrix_destroy(db);
-    matrix_destroy(dWT);
-    matrix_destroy(prev_activationsT);
+    matrix_arena_put(dZ);
 
     return layer->deltas;
 }
 
+// SGD step with the gradients of fc_layer_gradients
+void fc_layer_update(FCLayer *layer, float learning_rate)
+{
+    Optimizer sgd = optimizer_sgd(learning_rate);
+    optimizer_begin_step(&sgd);
+    fc_layer_apply(layer, &sgd);
+}
+
+// step of the optimizer with the gradients of fc_layer_gradients, the
+// gradients are left unchanged
+void fc_layer_apply(FCLayer *layer, Optimizer *optimizer)
+{
+    optimizer_step(optimizer, layer->weights->data, layer->weights_gradient->data, layer->weights->size,
+                   &layer->weights_state, true);
+    optimizer_step(optimizer, layer->biases->data, layer->biases_gradient->data, layer->biases->size,
+                   &layer->biases_state, false);
+    if (layer->prune_mask != NULL)
+        matrix_elementwise_multiply(layer->weights, layer->prune_mask, layer->weights);
+    layer->weights16_stale = true;
+    layer->sparse_stale = true;
+}
+
 void fc_layer_print(FCLayer *layer)
 {
     printf("input_size: %d, output_size: %d\n", layer->input_size, layer->output_size);
@@ -110,10 +279,13 @@ void fc_layer_destroy(FCLayer *layer)
 {
     matrix_destroy(layer->weights);
     matrix_destroy(layer->biases);
-    matrix_destroy(layer->activations);
-    matrix_destroy(layer->deltas);
-    matrix_destroy(layer->weights_gradient);
-    matrix_destroy(layer->biases_gradient);
+    fc_layer_release_training(layer);
+    if (layer->weights16 != NULL)
+        matrix16_destroy(layer->weights16);
+    if (layer->prune_mask != NULL)
+        matrix_destroy(layer->prune_mask);
+    if (layer->sparse_weights != NULL)
+        sparse_matrix_destroy(layer->sparse_weights);
     free(layer);
 }
 
@@ -160,6 +332,7 @@ ConvLayer *conv_layer_init(
     layer->stride = stride;
     layer->padding = padding;
 
+    layer->activation = activation_kind(activation_func, d_activation_func);
     layer->activation_func = activation_func;
     layer->d_activation_func = d_activation_func;
 
@@ -174,48 +347,183 @@ ConvLayer *conv_layer_init(
     // initialize gradients
     layer->weights_gradient = matrix4_init(n_filters, input_depth, kernel_size, kernel_size, NULL);
     layer->biases_gradient = matrix_init(n_filters, 1, NULL);
+    layer->weights_state = (OptimizerState){0};
+    layer->biases_state = (OptimizerState){0};
+
+    // 3x3 stride 1 kernels use the Winograd convolution
+    layer->winograd_weights = NULL;
+    layer->winograd_stale = true;
+    if (kernel_size == 3 && stride == 1)
+        layer->winograd_weights = matrix4_init(4, 4, n_filters, input_depth, NULL);
+
+    layer->weights16 = NULL;
+    layer->weights16_stale = true;
+
+    layer->blocked_weights = NULL;
+    layer->blocked_stale = true;
 
     return layer;
 }
 
+// stores the activations of the layer in another Matrix4 layout
+// blocked layouts (NCHW8C / NCHW16C) use the direct blocked convolution and
+// are only supported for inference: chained blocked layers pass their
+// activations to each other without any reorder
+void conv_layer_set_layout(ConvLayer *layer, int layout)
+{
+    if (layer->activations->layout == layout)
+        return;
+
+    Matrix4 *activations = layer->activations;
+    layer->activations = matrix4_init_layout(activations->dim1, activations->dim2, activations->dim3, activations->dim4, layout);
+    matrix4_destroy(activations);
+
+    if (layer->blocked_weights != NULL)
+        matrix4_destroy(layer->blocked_weights);
+    layer->blocked_weights = NULL;
+    layer->blocked_stale = true;
+    if (layout != MATRIX4_NCHW)
+        layer->blocked_weights = matrix4_blocked_weights(layer->weights, layout, NULL);
+}
+
+// sets the format of the weights read by the forward pass, see
+// fc_layer_set_weight_storage. 16-bit weights go through the im2col GEMM,
+// instead of Winograd for 3x3 kernels; blocked layouts keep fp32 weights.
+void conv_layer_set_weight_storage(ConvLayer *layer, int storage)
+{
+    if (layer->weights16 != NULL)
+        matrix16_destroy(layer->weights16);
+    layer->weights16 = NULL;
+    layer->weights16_stale = true;
+
+    Matrix4 *w = layer->weights;
+    if (storage != FLOAT_STORAGE_FP32)
+        layer->weights16 = matrix16_init(w->dim1, w->dim2, w->dim3, w->dim4, storage);
+}
+
+// converts the blocked, 16-bit or Winograd copy read by the forward pass
+// again if the weights changed, see fc_layer_refresh_weights
+void conv_layer_refresh_weights(ConvLayer *layer)
+{
+    if (layer->blocked_weights != NULL)
+    {
+        if (layer->blocked_stale)
+            matrix4_blocked_weights(layer->weights, layer->activations->layout, layer->blocked_weights);
+        layer->blocked_stale = false;
+    }
+    else if (layer->weights16 != NULL && layer->weights16_stale)
+    {
+        matrix16_convert(layer->weights16, layer->weights->data);
+        layer->weights16_stale = false;
+    }
+    else if (layer->weights16 == NULL && layer->winograd_weights != NULL && layer->winograd_stale)
+    {
+        matrix4_winograd_weights(layer->weights, layer->winograd_weights);
+        layer->winograd_stale = false;
+    }
+}
+
 // forward pass for an input of shape: (batch_size, depth, height, width)
 Matrix4 *conv_layer_forward(ConvLayer *layer, Matrix4 *input)
 {
-    // calculate activations
-    matrix4_convolve(layer->weights, input, layer->activations, layer->stride, layer->padding);
-    matrix4_add_bias(layer->activations, layer->biases, layer->activations);
-    matrix4_map_function(layer->activations, layer->activation_func);
+    // calculate activations, the bias and built-in activations are fused
+    // into the convolution
+    bool custom = layer->activation == ACTIVATION_CUSTOM;
+    int activation = custom ? ACTIVATION_IDENTITY : layer->activation;
+    if (layer->activations->layout != MATRIX4_NCHW)
+    {
+        Matrix4 *reordered = NULL;
+        if (input->layout != layer->activations->layout)
+        {
+            reordered = matrix4_arena_get(input->dim1, input->dim2, input->dim3, input->dim4, layer->activations->layout);
+            input = matrix4_reorder(input, layer->activations->layout, reordered);
+        }
+
+        conv_layer_refresh_weights(layer);
+        matrix4_convolve_blocked_fused(layer->blocked_weights, input, layer->activations, layer->stride, layer->padding, layer->biases, activation);
+
+        if (reordered != NULL)
+            matrix4_arena_put(reordered);
+    }
+    else if (layer->weights16 != NULL)
+    {
+        conv_layer_refresh_weights(layer);
+        matrix4_convolve_fused16(layer->weights16, input, layer->activations, layer->stride, layer->padding, layer->biases, activation);
+    }
+    else if (layer->winograd_weights != NULL)
+    {
+        conv_layer_refresh_weights(layer);
+        matrix4_convolve_winograd_fused(layer->winograd_weights, input, layer->activations, layer->padding, layer->biases, activation);
+    }
+    else
+        matrix4_convolve_fused(layer->weights, input, layer->activations, layer->stride, layer->padding, layer->biases, activation);
+
+    if (custom)
+        matrix4_map_function(layer->activations, layer->activation_func);
 
     return layer->activations;
 }
 
-// backward pass
+// backward pass, computes the gradients then updates the weights
 Matrix4 *conv_layer_backward(ConvLayer *layer, Matrix4 *previous_activations, Matrix4 *previous_deltas, float learning_rate)
 {
+    Matrix4 *deltas = conv_layer_gradients(layer, previous_activations, previous_deltas);
+    conv_layer_update(layer, learning_rate);
+    return deltas;
+}
+
+// gradients of the weights and biases and deltas of the previous layer,
+// without changing the weights, see fc_layer_gradients
+Matrix4 *conv_layer_gradients(ConvLayer *layer, Matrix4 *previous_activations, Matrix4 *previous_deltas)
+{
+    if (layer->activations->layout != MATRIX4_NCHW)
+        errx(EXIT_FAILURE, "conv_layer_gradients: %s does not use the NCHW layout\n", layer->name);
+
     // calculate deltas
-    Matrix4 *dZ = matrix4_copy(layer->activations, NULL);
-    matrix4_map_function(dZ, layer->d_activation_func);
+    Matrix4 *activations = layer->activations;
+    Matrix4 *dZ = matrix4_arena_get(activations->dim1, activations->dim2, activations->dim3, activations->dim4, activations->layout);
+    if (layer->activation == ACTIVATION_CUSTOM)
+    {
+        matrix4_copy(activations, dZ);
+        matrix4_map_function(dZ, layer->d_activation_func);
+    }
+    else
+        matrix4_activate_derivative(activations, layer->activation, dZ);
     matrix4_elementwise_multiply(dZ, previous_deltas, dZ);
 
     // calculate gradients
-    matrix4_convolve_transpose(layer->weights_gradient, previous_activations, dZ, layer->stride, layer->padding);
+    matrix4_convolve_weights_grad(previous_activations, dZ, layer->weights_gradient, layer->stride, layer->padding);
     matrix4_sum_channels(dZ, layer->biases_gradient);
 
-    // update weights and biases
-    matrix4_multiply_scalar(layer->weights_gradient, -learning_rate);
-    matrix_multiply_scalar(layer->biases_gradient, -learning_rate);
-    matrix4_add(layer->weights, layer->weights_gradient, layer->weights);
-    matrix_add(layer->biases, layer->biases_gradient, layer->biases);
-    
-    // calculate deltas for previous layer
+    // calculate deltas for previous layer, with the weights of the forward pass
     matrix4_grad_input_convolve(layer->weights, dZ, layer->deltas, layer->stride, layer->padding);
 
     // free
-    matrix4_destroy(dZ);
+    matrix4_arena_put(dZ);
 
     return layer->deltas;
 }
 
+// SGD step with the gradients of conv_layer_gradients
+void conv_layer_update(ConvLayer *layer, float learning_rate)
+{
+    Optimizer sgd = optimizer_sgd(learning_rate);
+    optimizer_begin_step(&sgd);
+    conv_layer_apply(layer, &sgd);
+}
+
+// step of the optimizer, see fc_layer_apply
+void conv_layer_apply(ConvLayer *layer, Optimizer *optimizer)
+{
+    optimizer_step(optimizer, layer->weights->data, layer->weights_gradient->data, layer->weights->size,
+                   &layer->weights_state, true);
+    optimizer_step(optimizer, layer->biases->data, layer->biases_gradient->data, layer->biases->size,
+                   &layer->biases_state, false);
+    layer->winograd_stale = true;
+    layer->weights16_stale = true;
+    layer->blocked_stale = true;
+}
+
 // print layer info
 void conv_layer_print(ConvLayer *layer)
 {
@@ -236,6 +544,14 @@ void conv_layer_destroy(ConvLayer *layer)
     matrix4_destroy(layer->outgrad);
     matrix4_destroy(layer->weights_gradient);
     matrix_destroy(layer->biases_gradient);
+    optimizer_state_reset(&layer->weights_state);
+    optimizer_state_reset(&layer->biases_state);
+    if (layer->winograd_weights != NULL)
+        matrix4_destroy(layer->winograd_weights);
+    if (layer->weights16 != NULL)
+        matrix16_destroy(layer->weights16);
+    if (layer->blocked_weights != NULL)
+        matrix4_destroy(layer->blocked_weights);
     free(layer);
 }
 
@@ -243,14 +559,28 @@ void conv_layer_destroy(ConvLayer *layer)
 
 #pragma region activations
 
+// returns the kind of a pair of activation functions, ACTIVATION_CUSTOM when
+// they are not one of the built-in pairs
+int activation_kind(float (*activation_func)(float), float (*d_activation_func)(float))
+{
+    if (activation_func == relu && d_activation_func == d_relu)
+        return ACTIVATION_RELU;
+    if (activation_func == leaky_relu && d_activation_func == d_leaky_relu)
+        return ACTIVATION_LEAKY_RELU;
+    if (activation_func == sigmoid && d_activation_func == d_sigmoid)
+        return ACTIVATION_SIGMOID;
+    return ACTIVATION_CUSTOM;
+}
+
 float sigmoid(float x)
 {
     return 1 / (1 + exp(-x));
 }
 
+// derivatives take the output of the activation, like the layers store it
 float d_sigmoid(float x)
 {
-    return sigmoid(x) * (1 - sigmoid(x));
+    return x * (1 - x);
 }
 
 float relu(float x)
@@ -273,36 +603,36 @@ float d_leaky_relu(float x)
     return x > 0 ? 1 : 0.1;
 }
 
-Matrix *softmax(Matrix *m1)
+// softmax of each row of src into dst (may alias src), with the vectorized exp
+static void softmax_rows(Matrix *src, Matrix *dst)
 {
-    Matrix *dst = matrix_init(m1->dim1, m1->dim2, NULL);
-    Matrix *m1norm = matrix_copy(m1, NULL);
+    const SimdKernels *simd = simd_kernels();
 
-    // max normalized m1
-    for (int i = 0; i < m1->dim1; i++)
+    for (int i = 0; i < src->dim1; i++)
     {
-        float max = m1->data[i * m1->dim2];
-        for (int j = 0; j < m1->dim2; j++)
-        {
-            if (m1->data[i * m1->dim2 + j] > max)
-                max = m1->data[i * m1->dim2 + j];
-        }
-        for (int j = 0; j < m1->dim2; j++)
-        {
-            m1norm->data[i * m1->dim2 + j] -= max;
-        }
-    }
+        float *in = &src->data[i * src->stride];
+        float *out = &dst->data[i * dst->stride];
+
+        float max = in[0];
+        for (int j = 1; j < src->dim2; j++)
+            if (in[j] > max)
+                max = in[j];
+
+        // exp(x - max) <= 1 never overflows
+        simd->add_scalar(in, -max, out, src->dim2);
+        simd->exp(out, out, src->dim2);
 
-    for (int i = 0; i < m1norm->dim1; i++)
-    {
         float sum = 0;
-        for (int j = 0; j < m1norm->dim2; j++)
-            sum += exp(m1norm->data[i * m1norm->dim2 + j]);
-        for (int j = 0; j < m1norm->dim2; j++)
-            dst->data[i * m1norm->dim2 + j] = exp(m1norm->data[i * m1norm->dim2 + j]) / sum;
+        for (int j = 0; j < src->dim2; j++)
+            sum += out[j];
+        simd->mul_scalar(out, 1.0f / sum, out, src->dim2);
     }
+}
 
-    matrix_destroy(m1norm);
+Matrix *softmax(Matrix *m1)
+{
+    Matrix *dst = matrix_init(m1->dim1, m1->dim2, NULL);
+    softmax_rows(m1, dst);
     return dst;
 }
 
@@ -322,6 +652,7 @@ ActivationLayer *activation_layer_init(
     ActivationLayer *layer = malloc(sizeof(ActivationLayer));
     layer->input_size = input_size;
     layer->batch_size = batch_size;
+    layer->softmax_cross_entropy = activation_func == softmax && d_activation_func == d_softmax;
     layer->activation_func = activation_func;
     layer->d_activation_func = d_activation_func;
     layer->activations = matrix_init(batch_size, input_size, NULL);
@@ -329,12 +660,54 @@ ActivationLayer *activation_layer_init(
     return layer;
 }
 
+void activation_layer_set_batch_size(ActivationLayer *layer, int batch_size)
+{
+    if (layer->activations == NULL)
+        errx(EXIT_FAILURE, "activation_layer_set_batch_size: the training buffers were released\n");
+    if (layer->batch_size == batch_size)
+        return;
+
+    layer->batch_size = batch_size;
+    matrix_destroy(layer->activations);
+    matrix_destroy(layer->deltas);
+    layer->activations = matrix_init(batch_size, layer->input_size, NULL);
+    layer->deltas = matrix_init(batch_size, layer->input_size, NULL);
+}
+
 Matrix *activation_layer_forward(ActivationLayer *layer, Matrix *input)
 {
+    if (layer->activations == NULL)
+        errx(EXIT_FAILURE, "activation_layer_forward: the training buffers were released\n");
+    if (input->dim1 != layer->activations->dim1 || input->dim2 != layer->activations->dim2)
+        errx(EXIT_FAILURE, "activation_layer_forward: input dimensions do not match\n");
+
+    return activation_layer_infer(layer, input, layer->activations);
+}
+
+// forward pass into dst, of the shape of input, see fc_layer_infer
+Matrix *activation_layer_infer(ActivationLayer *layer, Matrix *input, Matrix *dst)
+{
+    if (layer->softmax_cross_entropy)
+    {
+        softmax_rows(input, dst);
+        return dst;
+    }
+
     Matrix *activations = layer->activation_func(input);
-    matrix_copy(activations, layer->activations);
+    matrix_copy(activations, dst);
     matrix_destroy(activations);
-    return layer->activations;
+    return dst;
+}
+
+// frees the activations and deltas, see fc_layer_release_training
+void activation_layer_release_training(ActivationLayer *layer)
+{
+    if (layer->activations != NULL)
+        matrix_destroy(layer->activations);
+    if (layer->deltas != NULL)
+        matrix_destroy(layer->deltas);
+    layer->activations = NULL;
+    layer->deltas = NULL;
 }
 
 Matrix *activation_layer_backward(ActivationLayer *layer, Matrix *previous_deltas)
@@ -345,10 +718,24 @@ Matrix *activation_layer_backward(ActivationLayer *layer, Matrix *previous_delta
     return layer->deltas;
 }
 
+// gradient of the loss with respect to the input of the layer, from the
+// activations of the last forward pass and the expected outputs
+Matrix *activation_layer_loss_backward(ActivationLayer *layer, Matrix *labels)
+{
+    // softmax and cross-entropy derivatives simplify to p - y
+    if (layer->softmax_cross_entropy)
+        return matrix_subtract(layer->activations, labels, layer->deltas);
+
+    Matrix *loss_deltas = matrix_subtract(layer->activations, labels, matrix_arena_get(labels->dim1, labels->dim2));
+    Matrix *deltas = activation_layer_backward(layer, loss_deltas);
+    matrix_arena_put(loss_deltas);
+
+    return deltas;
+}
+
 void activation_layer_destroy(ActivationLayer *layer)
 {
-    matrix_destroy(layer->activations);
-    matrix_destroy(layer->deltas);
+    activation_layer_release_training(layer);
     free(layer);
 }
 
@@ -390,30 +777,92 @@ void flatten_layer_destroy(FlattenLayer *layer)
 
 #pragma region loss
 
-double cross_entropy_loss(Matrix *predictions, Matrix *labels)
+/*
+Losses are computed per sample in parallel, each sample in a fixed order,
+and the samples are then added with a fixed pairwise tree: the result does
+not depend on the number of threads.
+*/
+
+// Arguments of a loss split over the samples of the batch
+typedef struct
+{
+    Matrix *predictions;
+    Matrix *labels;
+    double *per_sample;
+} LossTask;
+
+static double pairwise_sum(const double *values, int n)
+{
+    if (n <= 0)
+        return 0;
+    if (n == 1)
+        return values[0];
+
+    int half = n / 2;
+    return pairwise_sum(values, half) + pairwise_sum(&values[half], n - half);
+}
+
+static void cross_entropy_samples(void *ctx, int begin, int end)
 {
-    double loss = 0;
-    for (int i = 0; i < predictions->dim1; i++)
+    LossTask *t = ctx;
+    for (int i = begin; i < end; i++)
     {
-        for (int j = 0; j < predictions->dim2; j++)
-        {
-            loss += labels->data[i * predictions->dim2 + j] * log(predictions->data[i * predictions->dim2 + j]);
-        }
+        const float *p = &t->predictions->data[i * t->predictions->stride];
+        const float *y = &t->labels->data[i * t->labels->stride];
+
+        // one-hot labels only need the log of the expected class
+        double loss = 0;
+        for (int j = 0; j < t->predictions->dim2; j++)
+            if (y[j] != 0)
+                loss += y[j] * log(p[j]);
+        t->per_sample[i] = loss;
     }
-    return -loss / predictions->dim1;
 }
 
-double mean_squared_error(Matrix *predictions, Matrix *labels)
+static void squared_error_samples(void *ctx, int begin, int end)
 {
-    double loss = 0;
-    for (int i = 0; i < predictions->dim1; i++)
+    LossTask *t = ctx;
+    const SimdKernels *simd = simd_kernels();
+    Matrix *diff = matrix_arena_get(1, t->predictions->dim2);
+
+    for (int i = begin; i < end; i++)
     {
-        for (int j = 0; j < predictions->dim2; j++)
-        {
-            loss += pow(labels->data[i * predictions->dim2 + j] - predictions->data[i * predictions->dim2 + j], 2);
-        }
+        simd->sub(&t->labels->data[i * t->labels->stride], &t->predictions->data[i * t->predictions->stride],
+                  diff->data, diff->dim2);
+        t->per_sample[i] = simd->dot(diff->data, diff->data, diff->dim2);
     }
-    return loss / predictions->dim1;
+
+    matrix_arena_put(diff);
+}
+
+// runs a per sample loss over the batch and returns the sum of the samples
+static double batch_loss(Matrix *predictions, Matrix *labels, ParallelTask samples, const char *name)
+{
+    if (predictions->dim1 != labels->dim1 || predictions->dim2 != labels->dim2)
+        errx(EXIT_FAILURE, "%s: matrix dimensions do not match\n", name);
+
+    // the per sample losses are doubles, held in a pooled buffer of twice
+    // as many floats (the arena data is aligned for any type)
+    Matrix *buffer = matrix_arena_get(1, 2 * predictions->dim1);
+    double *per_sample = (double *)buffer->data;
+
+    LossTask task = {predictions, labels, per_sample};
+    threadpool_parallel_for(predictions->dim1, MATRIX_PARALLEL_MIN_SIZE / (predictions->dim2 + 1) + 1, samples, &task);
+
+    double loss = pairwise_sum(per_sample, predictions->dim1);
+    matrix_arena_put(buffer);
+
+    return loss;
+}
+
+double cross_entropy_loss(Matrix *predictions, Matrix *labels)
+{
+    return -batch_loss(predictions, labels, cross_entropy_samples, "cross_entropy_loss") / predictions->dim1;
+}
+
+double mean_squared_error(Matrix *predictions, Matrix *labels)
+{
+    return batch_loss(predictions, labels, squared_error_samples, "mean_squared_error") / predictions->dim1;
 }
 
 #pragma endregion loss
\ No newline at end of file
@@ -1,7 +1,34 @@
+#include <stdint.h>
+#include <string.h>
 #include "../include/matrix.h"
+#include "../include/gemm.h"
+#include "../include/simd.h"
+#include "../include/arena.h"
+#include "../include/linalg.h"
 
 void malloc_error() { errx(EXIT_FAILURE, "Error allocating memory"); }
 
+// Returns n zeroed floats aligned on MATRIX_ALIGNMENT bytes. The pointer given
+// by calloc is stored just before the aligned block so it can be freed.
+static float *aligned_floats(int n)
+{
+    size_t offset = MATRIX_ALIGNMENT + sizeof(void *);
+    char *raw = calloc(1, sizeof(float) * n + offset);
+    if (raw == NULL)
+        malloc_error();
+
+    uintptr_t aligned = ((uintptr_t)raw + offset) & ~(uintptr_t)(MATRIX_ALIGNMENT - 1);
+    ((void **)aligned)[-1] = raw;
+
+    return (float *)aligned;
+}
+
+static void aligned_free(float *data)
+{
+    if (data != NULL)
+        free(((void **)data)[-1]);
+}
+
 Tupple T(int x, int y)
 {
     Tupple t = {x, y};
@@ -40,21 +67,114 @@ Matrix *matrix_init(int dim1, int dim2, float *datap)
 
     m->dim1 = dim1;
     m->dim2 = dim2;
+    m->stride = dim2;
+    m->owner = true;
 
     m->size = dim1 * dim2;
+
+    // the data is filled with zeroes
+    m->data = aligned_floats(m->size);
+
+    // copy provided data to the new matrix
     if (datap != NULL)
-    {
-        // copy provided data to the new matrix
-        m->data = malloc(m->size * sizeof(m->data));
         for (int i = 0; i < m->size; i++)
             m->data[i] = datap[i];
-    }
+
+    return m;
+}
+
+// Arguments of an elementwise kernel split over the thread pool
+typedef struct
+{
+    void (*binary)(const float *a, const float *b, float *dst, int n);
+    void (*scalar)(const float *a, float s, float *dst, int n);
+    SimdUnaryKernel unary;
+    const float *a;
+    const float *b;
+    float s;
+    float *dst;
+} ElementwiseTask;
+
+static void elementwise_range(void *ctx, int begin, int end)
+{
+    ElementwiseTask *t = ctx;
+    if (t->binary != NULL)
+        t->binary(&t->a[begin], &t->b[begin], &t->dst[begin], end - begin);
+    else if (t->scalar != NULL)
+        t->scalar(&t->a[begin], t->s, &t->dst[begin], end - begin);
     else
+        t->unary(&t->a[begin], &t->dst[begin], end - begin);
+}
+
+// Runs a binary kernel over n contiguous elements, on several threads when large
+static void parallel_binary(void (*kernel)(const float *, const float *, float *, int),
+                            const float *a, const float *b, float *dst, int n)
+{
+    ElementwiseTask task = {kernel, NULL, NULL, a, b, 0.0f, dst};
+    threadpool_parallel_for(n, MATRIX_PARALLEL_MIN_SIZE, elementwise_range, &task);
+}
+
+// Same as parallel_binary with a scalar second operand
+static void parallel_scalar(void (*kernel)(const float *, float, float *, int),
+                            const float *a, float s, float *dst, int n)
+{
+    ElementwiseTask task = {NULL, kernel, NULL, a, NULL, s, dst};
+    threadpool_parallel_for(n, MATRIX_PARALLEL_MIN_SIZE, elementwise_range, &task);
+}
+
+// Same as parallel_binary with a single operand
+static void parallel_unary(SimdUnaryKernel kernel, const float *a, float *dst, int n)
+{
+    ElementwiseTask task = {NULL, NULL, kernel, a, NULL, 0.0f, dst};
+    threadpool_parallel_for(n, MATRIX_PARALLEL_MIN_SIZE, elementwise_range, &task);
+}
+
+// Returns the activation or derivative kernel of a kind
+static SimdUnaryKernel activation_kernel(int kind, bool derivative, const char *name)
+{
+    if (kind < 0 || kind >= ACTIVATION_CUSTOM)
+        errx(EXIT_FAILURE, "%s: activation %d has no kernel\n", name, kind);
+
+    const SimdKernels *simd = simd_kernels();
+    return derivative ? simd->derivative[kind] : simd->activate[kind];
+}
+
+// true when the rows of the matrix follow each other in memory
+static bool contiguous(Matrix *m)
+{
+    return m->stride == m->dim2 || m->dim1 == 1;
+}
+
+// Applies an elementwise kernel to whole matrices: in a single call when the
+// data is contiguous, row by row for views
+static void apply_binary(void (*kernel)(const float *, const float *, float *, int),
+                         Matrix *m1, Matrix *m2, Matrix *dst)
+{
+    if (contiguous(m1) && contiguous(m2) && contiguous(dst))
     {
-        // fill the data of the matrix with zeroes
-        m->data = calloc(m->size, sizeof(float));
+        parallel_binary(kernel, m1->data, m2->data, dst->data, dst->size);
+        return;
     }
-    return m;
+
+    for (int i = 0; i < dst->dim1; i++)
+        kernel(&m1->data[i * m1->stride], &m2->data[i * m2->stride], &dst->data[i * dst->stride], dst->dim2);
+}
+
+/// @brief Returns a view on a block of a matrix. The view shares the data of
+/// the matrix (nothing is copied) and must not be destroyed.
+/// @param m pointer to the matrix
+/// @param row0 first row of the block
+/// @param col0 first column of the block
+/// @param rows number of rows of the block
+/// @param cols number of columns of the block
+/// @return the view
+Matrix matrix_view(Matrix *m, int row0, int col0, int rows, int cols)
+{
+    if (row0 < 0 || col0 < 0 || rows < 0 || cols < 0 || row0 + rows > m->dim1 || col0 + cols > m->dim2)
+        errx(EXIT_FAILURE, "matrix_view: block out of range\n");
+
+    Matrix view = {rows, cols, rows * cols, &m->data[row0 * m->stride + col0], m->stride, false};
+    return view;
 }
 
 /// @brief Copies the data from a matrix to a new one
@@ -73,8 +193,9 @@ Matrix *matrix_copy(Matrix *m, Matrix *dst)
         errx(EXIT_FAILURE, "Error: matrix_copy: dimensions mismatch");
     }
 
-    for (int i = 0; i < m->dim1 * m->dim2; i++)
-        dst->data[i] = m->data[i];
+    for (int i = 0; i < m->dim1; i++)
+        for (int j = 0; j < m->dim2; j++)
+            dst->data[i * dst->stride + j] = m->data[i * m->stride + j];
 
     return dst;
 }
@@ -83,8 +204,9 @@ Matrix *matrix_copy(Matrix *m, Matrix *dst)
 /// @param m a pointer to the matrix
 void matrix_zero(Matrix *m)
 {
-    for (int i = 0; i < m->size; i++)
-        m->data[i] = 0;
+    for (int i = 0; i < m->dim1; i++)
+        for (int j = 0; j < m->dim2; j++)
+            m->data[i * m->stride + j] = 0;
 }
 
 /// @brief Gets a value from a row major matrix
@@ -99,7 +221,7 @@ float m_get(Matrix *m, int i, int j)
         errx(EXIT_FAILURE, "m_get: out of range");
     }
 
-    return m->data[i * m->dim2 + j];
+    return m->data[i * m->stride + j];
 }
 
 /// @brief Sets a value into a row major matrix
@@ -112,7 +234,7 @@ void m_set(Matrix *m, int dim1, int dim2, float value)
     if (dim1 < 0 || dim1 >= m->dim1 || dim2 < 0 || dim2 >= m->dim2)
         errx(EXIT_FAILURE, "m_set: out of range");
 
-    m->data[dim1 * m->dim2 + dim2] = value;
+    m->data[dim1 * m->stride + dim2] = value;
 }
 
 /// @brief Adds two matrices and returns the result.
@@ -131,34 +253,50 @@ Matrix *matrix_add(Matrix *m1, Matrix *m2, Matrix *dst)
         errx(EXIT_FAILURE, "matrix_add: matrix dimensions do not match\n");
     }
 
-    for (int i = 0; i < dst->dim1; i++)
-        for (int j = 0; j < dst->dim2; j++)
-            dst->data[i * dst->dim2 + j] = m1->data[i * dst->dim2 + j] + m2->data[i * dst->dim2 + j];
+    apply_binary(simd_kernels()->add, m1, m2, dst);
 
     return dst;
 }
 
+// Arguments of a reduction split over the thread pool
+typedef struct
+{
+    Matrix *m;
+    Matrix4 *m4;
+    Matrix *dst;
+    int *indices;
+} ReduceTask;
+
+// argmax of the rows [begin, end)
+static void argmax_rows(void *ctx, int begin, int end)
+{
+    ReduceTask *t = ctx;
+    Matrix *m = t->m;
+
+    for (int i = begin; i < end; i++)
+    {
+        const float *row = &m->data[i * m->stride];
+        int idx = 0;
+        for (int j = 1; j < m->dim2; j++)
+            if (row[j] > row[idx])
+                idx = j;
+
+        t->indices[i] = idx;
+    }
+}
+
 /// @brief returns the maximum index from the matrix'
+/// Rows are split over the thread pool, ties go to the first index.
 /// @param m a pointer to the matrix
 /// @return the max index array
 int *matrix_argmax(Matrix *m)
 {
     int *max_index = malloc(m->dim1 * sizeof(int));
-    for (int i = 0; i < m->dim1; i++)
-    {
-        float max = m->data[i * m->dim2];
-        int idx = 0;
-        for (int j = 0; j < m->dim2; j++)
-        {
-            if (m->data[i * m->dim2 + j] > max)
-            {
-                max = m->data[i * m->dim2 + j];
-                idx = j;
-            }
-        }
+    if (max_index == NULL)
+        malloc_error();
 
-        max_index[i] = idx;
-    }
+    ReduceTask task = {m, NULL, NULL, max_index};
+    threadpool_parallel_for(m->dim1, MATRIX_PARALLEL_MIN_SIZE / (m->dim2 + 1) + 1, argmax_rows, &task);
 
     return max_index;
 }
@@ -179,14 +317,30 @@ Matrix *matrix_add_bias(Matrix *m1, Matrix *m2, Matrix *dst)
         errx(EXIT_FAILURE, "matrix_add_bias: matrix dimensions do not match\n");
     }
 
-    for (int j = 0; j < dst->dim2; j++)
-        for (int i = 0; i < dst->dim1; i++)
-            dst->data[i * dst->dim2 + j] = dst->data[i * dst->dim2 + j] + m2->data[j];
+    const SimdKernels *simd = simd_kernels();
+    for (int i = 0; i < dst->dim1; i++)
+        simd->add(&m1->data[i * m1->stride], m2->data, &dst->data[i * dst->stride], dst->dim2);
 
     return dst;
 }
 
+// sums the columns [begin, end) over every row, rows are added in order
+static void sum_rows_columns(void *ctx, int begin, int end)
+{
+    ReduceTask *t = ctx;
+    Matrix *m = t->m;
+    float *sum = &t->dst->data[begin];
+    const SimdKernels *simd = simd_kernels();
+
+    for (int j = 0; j < end - begin; j++)
+        sum[j] = 0.0f;
+    for (int i = 0; i < m->dim1; i++)
+        simd->add(sum, &m->data[i * m->stride + begin], sum, end - begin);
+}
+
 /// @brief Sums the rows of a matrix and returns the result.
+/// Each column is summed in row order, columns are split over the thread pool,
+/// so the result does not depend on the number of threads.
 /// @param m1 pointer to the matrix
 /// @param dst pointer to the destination matrix
 /// @return a pointer to the result matrix
@@ -195,18 +349,14 @@ Matrix *matrix_sum_rows(Matrix *m1, Matrix *dst)
     if (dst == NULL)
         dst = matrix_init(1, m1->dim2, NULL);
 
-    if (m1->dim2 != dst->dim2)
+    if (m1->dim2 != dst->dim2 || dst->dim1 != 1)
     {
         printf("m1->dim1: %d m1->dim2: %d dst->dim1: %d dst->dim2: %d\n", m1->dim1, m1->dim2, dst->dim1, dst->dim2);
         errx(EXIT_FAILURE, "matrix_sum_rows: matrix dimensions do not match\n");
     }
 
-    for (int j = 0; j < dst->dim2; j++)
-    {
-        dst->data[j] = 0.0;
-        for (int i = 0; i < dst->dim1; i++)
-            dst->data[j] += m1->data[i * m1->dim2 + j];
-    }
+    ReduceTask task = {m1, NULL, dst, NULL};
+    threadpool_parallel_for(m1->dim2, MATRIX_PARALLEL_MIN_SIZE / (m1->dim1 + 1) + 1, sum_rows_columns, &task);
 
     return dst;
 }
@@ -228,13 +378,8 @@ Matrix *matrix_subtract(Matrix *m1, Matrix *m2, Matrix *dst)
         errx(EXIT_FAILURE, "matrix_subtract: matrix dimensions do not match\n");
     }
 
-    for (int i = 0; i < dst->dim1; i++)
-    {
-        for (int j = 0; j < dst->dim2; j++)
-        {
-            dst->data[i * dst->dim2 + j] = m1->data[i * dst->dim2 + j] - m2->data[i * dst->dim2 + j];
-        }
-    }
+    apply_binary(simd_kernels()->sub, m1, m2, dst);
+
     return dst;
 }
 
@@ -258,26 +403,89 @@ Matrix *matrix_multiply(Matrix *m1, Matrix *m2, Matrix *dst)
         errx(EXIT_FAILURE, "matrix_multiply: matrix dimensions do not match, expected output to be (%i, %i)\n", m1->dim1, m2->dim2);
     }
 
-    for (int i = 0; i < dst->dim1; i++)
+    return matrix_multiply_ex(m1, false, m2, false, 1.0f, 0.0f, dst);
+}
+
+// shared by matrix_multiply_ex and matrix_multiply_fused
+static Matrix *multiply(Matrix *m1, bool trans1, Matrix *m2, bool trans2, float alpha, float beta, Matrix *dst,
+                        const GemmEpilogue *epilogue, int bias_size, const char *name)
+{
+    int rows = trans1 ? m1->dim2 : m1->dim1;
+    int inner = trans1 ? m1->dim1 : m1->dim2;
+    int inner2 = trans2 ? m2->dim2 : m2->dim1;
+    int cols = trans2 ? m2->dim1 : m2->dim2;
+
+    if (dst == NULL)
     {
-        for (int j = 0; j < dst->dim2; j++)
-        {
-            dst->data[i * dst->dim2 + j] = 0.0;
-            for (int k = 0; k < m1->dim2; k++)
-                dst->data[i * dst->dim2 + j] += m1->data[i * m1->dim2 + k] * m2->data[k * m2->dim2 + j];
-        }
+        dst = matrix_init(rows, cols, NULL);
+        beta = 0.0f;
+    }
+
+    if (inner != inner2 || dst->dim1 != rows || dst->dim2 != cols)
+    {
+        printf("op(m1): (%d, %d) op(m2): (%d, %d) dst: (%d, %d)\n", rows, inner, inner2, cols, dst->dim1, dst->dim2);
+        errx(EXIT_FAILURE, "%s: matrix dimensions do not match, expected output to be (%i, %i)\n", name, rows, cols);
     }
+
+    if (epilogue != NULL && epilogue->bias != NULL && bias_size != cols)
+        errx(EXIT_FAILURE, "%s: bias size does not match the %i columns\n", name, cols);
+
+    sgemm_fused(trans1, trans2, rows, cols, inner,
+                alpha, m1->data, m1->stride,
+                m2->data, m2->stride,
+                beta, dst->data, dst->stride,
+                epilogue);
+
     return dst;
 }
 
+/// @brief Computes dst = alpha * op(m1) * op(m2) + beta * dst, where op(m) is m
+/// or its transpose. Transposed operands are read in place, nothing is copied.
+/// @param m1 pointer to the first matrix
+/// @param trans1 use the transpose of m1
+/// @param m2 pointer to the second matrix
+/// @param trans2 use the transpose of m2
+/// @param alpha scale of the product
+/// @param beta scale of the previous content of dst (ignored when dst is NULL)
+/// @param dst a pointer to the destination matrix
+/// @return a pointer to the result matrix
+Matrix *matrix_multiply_ex(Matrix *m1, bool trans1, Matrix *m2, bool trans2, float alpha, float beta, Matrix *dst)
+{
+    return multiply(m1, trans1, m2, trans2, alpha, beta, dst, NULL, 0, "matrix_multiply_ex");
+}
+
+/// @brief Computes dst = act(op(m1) * op(m2) + bias) in a single pass over dst:
+/// the bias and the activation are applied by the GEMM to each tile of dst
+/// while it is still in registers.
+/// @param m1 pointer to the first matrix
+/// @param trans1 use the transpose of m1
+/// @param m2 pointer to the second matrix
+/// @param trans2 use the transpose of m2
+/// @param bias contiguous matrix with one value per column of dst, or NULL
+/// @param activation one of ActivationKind
+/// @param dst a pointer to the destination matrix (overwritten)
+/// @return a pointer to the result matrix
+Matrix *matrix_multiply_fused(Matrix *m1, bool trans1, Matrix *m2, bool trans2, Matrix *bias, int activation, Matrix *dst)
+{
+    if (bias != NULL && bias->stride != bias->dim2 && bias->dim1 != 1)
+        errx(EXIT_FAILURE, "matrix_multiply_fused: bias must be contiguous\n");
+
+    GemmEpilogue epilogue = {bias == NULL ? NULL : bias->data, false, activation};
+    return multiply(m1, trans1, m2, trans2, 1.0f, 0.0f, dst, &epilogue, bias == NULL ? 0 : bias->size, "matrix_multiply_fused");
+}
+
 /// @brief Multiplies a matrix by a scalar and returns the result.
 /// @param m pointer to the matrix
 /// @param s the scalar
 void matrix_multiply_scalar(Matrix *m, float s)
 {
-    for (int i = 0; i < m->dim1; i++)
-        for (int j = 0; j < m->dim2; j++)
-            m->data[i * m->dim2 + j] *= s;
+    const SimdKernels *simd = simd_kernels();
+
+    if (contiguous(m))
+        parallel_scalar(simd->mul_scalar, m->data, s, m->data, m->size);
+    else
+        for (int i = 0; i < m->dim1; i++)
+            simd->mul_scalar(&m->data[i * m->stride], s, &m->data[i * m->stride], m->dim2);
 }
 
 /// @brief Applies a function to each element of a matrix.
@@ -287,14 +495,55 @@ void matrix_map_function(Matrix *m, float(f)(float))
 {
     for (int i = 0; i < m->dim1; i++)
         for (int j = 0; j < m->dim2; j++)
-            m->data[i * m->dim2 + j] = f(m->data[i * m->dim2 + j]);
+            m->data[i * m->stride + j] = f(m->data[i * m->stride + j]);
+}
+
+// shared by matrix_activate and matrix_activate_derivative
+static Matrix *activate(Matrix *m, int kind, bool derivative, Matrix *dst, const char *name)
+{
+    SimdUnaryKernel kernel = activation_kernel(kind, derivative, name);
+
+    if (dst == NULL)
+        dst = matrix_init(m->dim1, m->dim2, NULL);
+
+    if (m->dim1 != dst->dim1 || m->dim2 != dst->dim2)
+        errx(EXIT_FAILURE, "%s: matrix dimensions do not match\n", name);
+
+    if (contiguous(m) && contiguous(dst))
+        parallel_unary(kernel, m->data, dst->data, dst->size);
+    else
+        for (int i = 0; i < dst->dim1; i++)
+            kernel(&m->data[i * m->stride], &dst->data[i * dst->stride], dst->dim2);
+
+    return dst;
+}
+
+/// @brief Applies a built-in activation with its vectorized kernel.
+/// @param m pointer to the matrix
+/// @param kind one of ActivationKind, except ACTIVATION_CUSTOM
+/// @param dst pointer to the destination matrix, may be m
+/// @return a pointer to the result matrix
+Matrix *matrix_activate(Matrix *m, int kind, Matrix *dst)
+{
+    return activate(m, kind, false, dst, "matrix_activate");
+}
+
+/// @brief Computes the derivative of a built-in activation from its output.
+/// @param m pointer to the output of the activation
+/// @param kind one of ActivationKind, except ACTIVATION_CUSTOM
+/// @param dst pointer to the destination matrix, may be m
+/// @return a pointer to the result matrix
+Matrix *matrix_activate_derivative(Matrix *m, int kind, Matrix *dst)
+{
+    return activate(m, kind, true, dst, "matrix_activate_derivative");
 }
 
 /// @brief Frees the memory allocated for a matrix.
 /// @param m pointer to the matrix
 void matrix_destroy(Matrix *m)
 {
-    free(m->data);
+    if (m->owner)
+        aligned_free(m->data);
     free(m);
 }
 
@@ -310,7 +559,7 @@ Matrix *matrix_transpose(Matrix *m)
 
     for (int i = 0; i < m->dim1; i++)
         for (int j = 0; j < m->dim2; j++)
-            t->data[j * t->dim2 + i] = m->data[i * m->dim2 + j];
+            t->data[j * t->stride + i] = m->data[i * m->stride + j];
 
     return t;
 }
@@ -328,10 +577,7 @@ Matrix *matrix_elementwise_multiply(Matrix *m1, Matrix *m2, Matrix *dst)
     if (m1->dim1 != m2->dim1 || m1->dim2 != m2->dim2 || dst->dim1 != m1->dim1 || dst->dim2 != m1->dim2)
         errx(EXIT_FAILURE, "matrix_elementwise_multiply: matrix dimensions do not match\n");
 
-    for (int i = 0; i < dst->size; i++)
-    {
-        dst->data[i] = m1->data[i] * m2->data[i];
-    }
+    apply_binary(simd_kernels()->mul, m1, m2, dst);
 
     return dst;
 }
@@ -345,9 +591,10 @@ bool matrix_element_wise_equal(Matrix *m1, Matrix *m2)
     if (m1->dim1 != m2->dim1 || m1->dim2 != m2->dim2)
         errx(EXIT_FAILURE, "matrix_element_wise_equal: matrix dimensions do not match\n");
 
-    for (int i = 0; i < m1->size; i++)
-        if (m1->data[i] != m2->data[i])
-            return false;
+    for (int i = 0; i < m1->dim1; i++)
+        for (int j = 0; j < m1->dim2; j++)
+            if (m1->data[i * m1->stride + j] != m2->data[i * m2->stride + j])
+                return false;
 
     return true;
 }
@@ -361,9 +608,9 @@ void matrix_print(Matrix *m)
     {
         printf("[");
         for (int j = 0; j < m->dim2 - 1; j++)
-            printf("%f ", m->data[i * m->dim2 + j]);
+            printf("%f ", m->data[i * m->stride + j]);
 
-        printf("%f]\n", m->data[i * m->dim2 + m->dim2 - 1]);
+        printf("%f]\n", m->data[i * m->stride + m->dim2 - 1]);
     }
 }
 
@@ -374,39 +621,155 @@ void matrix_printshape(Matrix *m)
     printf("dim1:%i, dim2:%i\n", m->dim1, m->dim2);
 }
 
-/// @brief Computes the determinant of a matrix.
-/// @param m pointer to the matrix
-/// @return the determinant of the matrix
-float matrix_det(Matrix *m)
+/*
+Determinant, inverse and linear solves all go through an LU decomposition
+with partial pivoting (P A = L U), computed in double precision. The factors
+live in scratch memory provided by the caller; the matrix_* wrappers below
+keep it on the stack for matrices up to MATRIX_LU_STACK x MATRIX_LU_STACK
+(homographies are 8x8 and 3x3) and only allocate once for larger ones.
+*/
+
+#define MATRIX_LU_STACK 16
+
+/// @brief Computes the LU decomposition of a square matrix with partial pivoting.
+/// @param m pointer to the square matrix (n x n)
+/// @param lu scratch of n * n doubles, receives L (unit diagonal, below) and U (above)
+/// @param perm scratch of n ints, receives the row of m used for every row of LU
+/// @return the sign of the permutation (1 or -1), 0 if the matrix is singular
+int matrix_lu_decompose(Matrix *m, double *lu, int *perm)
 {
     if (m->dim1 != m->dim2)
-        errx(EXIT_FAILURE, "matrix_det: matrix is not square\n");
+        errx(EXIT_FAILURE, "matrix_lu_decompose: matrix is not square\n");
 
-    if (m->dim1 == 1)
-        return m->data[0];
+    int n = m->dim1;
+    int sign = 1;
 
-    if (m->dim1 == 2)
-        return m->data[0] * m->data[3] - m->data[1] * m->data[2];
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+            lu[i * n + j] = m->data[i * m->stride + j];
+    for (int i = 0; i < n; i++)
+        perm[i] = i;
 
-    float det = 0;
-
-    for (int i = 0; i < m->dim1; i++)
+    for (int k = 0; k < n; k++)
     {
-        Matrix *sub = matrix_init(m->dim1 - 1, m->dim2 - 1, NULL);
-        for (int j = 1; j < m->dim1; j++)
+        // the largest pivot of the column keeps the elimination stable
+        int pivot = k;
+        for (int i = k + 1; i < n; i++)
+            if (fabs(lu[i * n + k]) > fabs(lu[pivot * n + k]))
+                pivot = i;
+
+        if (lu[pivot * n + k] == 0.0)
+            return 0;
+
+        if (pivot != k)
         {
-            for (int k = 0; k < m->dim2; k++)
+            for (int j = 0; j < n; j++)
             {
-                if (k < i)
-                    sub->data[(j - 1) * (m->dim2 - 1) + k] = m->data[j * m->dim2 + k];
-                else if (k > i)
-                    sub->data[(j - 1) * (m->dim2 - 1) + k - 1] = m->data[j * m->dim2 + k];
+                double tmp = lu[k * n + j];
+                lu[k * n + j] = lu[pivot * n + j];
+                lu[pivot * n + j] = tmp;
             }
+            int tmp = perm[k];
+            perm[k] = perm[pivot];
+            perm[pivot] = tmp;
+            sign = -sign;
+        }
+
+        double *row_k = &lu[k * n];
+        for (int i = k + 1; i < n; i++)
+        {
+            double *row_i = &lu[i * n];
+            double factor = row_i[k] / row_k[k];
+            row_i[k] = factor;
+            for (int j = k + 1; j < n; j++)
+                row_i[j] -= factor * row_k[j];
         }
-        det += pow(-1, i) * m->data[i] * matrix_det(sub);
-        matrix_destroy(sub);
     }
 
+    return sign;
+}
+
+/// @brief Solves LU x = P b in place from a decomposition of matrix_lu_decompose.
+/// @param lu the factors of an (n x n) matrix
+/// @param perm the permutation of the decomposition
+/// @param n size of the system
+/// @param b right hand side (strided by stride), overwritten by the solution
+/// @param stride distance between two consecutive elements of b
+/// @param scratch n doubles
+void matrix_lu_solve(const double *lu, const int *perm, int n, float *b, int stride, double *scratch)
+{
+    for (int i = 0; i < n; i++)
+        scratch[i] = b[perm[i] * stride];
+
+    // forward substitution with the unit lower triangle
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < i; j++)
+            scratch[i] -= lu[i * n + j] * scratch[j];
+
+    // back substitution with the upper triangle
+    for (int i = n - 1; i >= 0; i--)
+    {
+        for (int j = i + 1; j < n; j++)
+            scratch[i] -= lu[i * n + j] * scratch[j];
+        scratch[i] /= lu[i * n + i];
+    }
+
+    for (int i = 0; i < n; i++)
+        b[i * stride] = scratch[i];
+}
+
+// Scratch memory of an LU decomposition, on the stack for small matrices
+typedef struct
+{
+    double stack_lu[MATRIX_LU_STACK * MATRIX_LU_STACK];
+    double stack_x[MATRIX_LU_STACK];
+    int stack_perm[MATRIX_LU_STACK];
+    double *lu;
+    double *x;
+    int *perm;
+} LUScratch;
+
+static void lu_scratch_init(LUScratch *s, int n)
+{
+    if (n <= MATRIX_LU_STACK)
+    {
+        s->lu = s->stack_lu;
+        s->x = s->stack_x;
+        s->perm = s->stack_perm;
+        return;
+    }
+
+    // one block for everything, perm is stored after the doubles
+    s->lu = malloc(sizeof(double) * (n * n + n) + sizeof(int) * n);
+    if (s->lu == NULL)
+        malloc_error();
+    s->x = &s->lu[n * n];
+    s->perm = (int *)&s->x[n];
+}
+
+static void lu_scratch_destroy(LUScratch *s)
+{
+    if (s->lu != s->stack_lu)
+        free(s->lu);
+}
+
+/// @brief Computes the determinant of a matrix.
+/// @param m pointer to the matrix
+/// @return the determinant of the matrix
+float matrix_det(Matrix *m)
+{
+    if (m->dim1 != m->dim2)
+        errx(EXIT_FAILURE, "matrix_det: matrix is not square\n");
+
+    LUScratch scratch;
+    lu_scratch_init(&scratch, m->dim1);
+
+    double det = matrix_lu_decompose(m, scratch.lu, scratch.perm);
+    for (int i = 0; i < m->dim1 && det != 0.0; i++)
+        det *= scratch.lu[i * m->dim1 + i];
+
+    lu_scratch_destroy(&scratch);
+
     return det;
 }
 
@@ -418,103 +781,73 @@ Matrix *matrix_inverse(Matrix *m)
     if (m->dim1 != m->dim2)
         errx(EXIT_FAILURE, "matrix_inverse: matrix is not square\n");
 
-    float det = matrix_det(m);
-    if (det == 0)
-        errx(EXIT_FAILURE, "matrix_inverse: matrix is not invertible\n");
+    int n = m->dim1;
+    LUScratch scratch;
+    lu_scratch_init(&scratch, n);
 
-    Matrix *inv = matrix_init(m->dim1, m->dim2, NULL);
+    if (matrix_lu_decompose(m, scratch.lu, scratch.perm) == 0)
+        errx(EXIT_FAILURE, "matrix_inverse: matrix is not invertible\n");
 
-    for (int i = 0; i < m->dim1; i++)
+    // solve A x = e_j for every column of the identity
+    Matrix *inv = matrix_init(n, n, NULL);
+    for (int j = 0; j < n; j++)
     {
-        for (int j = 0; j < m->dim2; j++)
-        {
-            Matrix *sub = matrix_init(m->dim1 - 1, m->dim2 - 1, NULL);
-            for (int k = 0; k < m->dim1; k++)
-            {
-                for (int l = 0; l < m->dim2; l++)
-                {
-                    if (k < i && l < j)
-                        sub->data[k * (m->dim2 - 1) + l] = m->data[k * m->dim2 + l];
-                    else if (k < i && l > j)
-                        sub->data[k * (m->dim2 - 1) + l - 1] = m->data[k * m->dim2 + l];
-                    else if (k > i && l < j)
-                        sub->data[(k - 1) * (m->dim2 - 1) + l] = m->data[k * m->dim2 + l];
-                    else if (k > i && l > j)
-                        sub->data[(k - 1) * (m->dim2 - 1) + l - 1] = m->data[k * m->dim2 + l];
-                }
-            }
-            inv->data[j * m->dim2 + i] = pow(-1, i + j) * matrix_det(sub) / det;
-            matrix_destroy(sub);
-        }
+        inv->data[j * n + j] = 1.0f;
+        matrix_lu_solve(scratch.lu, scratch.perm, n, &inv->data[j], n, scratch.x);
     }
 
+    lu_scratch_destroy(&scratch);
+
     return inv;
 }
 
-/// @brief Solve a linear system of equations.
-/// @param A pointer to the coefficient matrix
-/// @param b pointer to the right hand side vector
-/// @return a pointer to the solution vector
-Matrix *matrix_solve(Matrix *A, Matrix *b)
+/// @brief Solve a linear system of equations A X = B.
+/// @param A pointer to the square coefficient matrix (n x n)
+/// @param b pointer to the right hand side (n x k), one system per column
+/// @param dst pointer to the solution (n x k), may be b
+/// @return a pointer to the solution
+Matrix *matrix_solve(Matrix *A, Matrix *b, Matrix *dst)
 {
-    Matrix *h = matrix_init(8, 1, NULL);
-    Matrix *A_inv = matrix_inverse(A);
+    if (A->dim1 != A->dim2 || b->dim1 != A->dim1)
+        errx(EXIT_FAILURE, "matrix_solve: matrix dimensions do not match\n");
 
-    matrix_multiply(A_inv, b, h);
+    if (dst == NULL)
+        dst = matrix_init(b->dim1, b->dim2, NULL);
+
+    if (dst->dim1 != b->dim1 || dst->dim2 != b->dim2)
+        errx(EXIT_FAILURE, "matrix_solve: matrix dimensions do not match\n");
+
+    int n = A->dim1;
+    LUScratch scratch;
+    lu_scratch_init(&scratch, n);
+
+    if (matrix_lu_decompose(A, scratch.lu, scratch.perm) == 0)
+        errx(EXIT_FAILURE, "matrix_solve: matrix is not invertible\n");
 
-    matrix_destroy(A_inv);
+    if (dst != b)
+        matrix_copy(b, dst);
+    for (int j = 0; j < dst->dim2; j++)
+        matrix_lu_solve(scratch.lu, scratch.perm, n, &dst->data[j], dst->stride, scratch.x);
+
+    lu_scratch_destroy(&scratch);
 
-    return h;
+    return dst;
 }
 
 /// @brief Computes the perspective transformation matrix.
 /// @param src array of 4 source points
 /// @param dst array of 4 destination points
-/// @return a pointer to the perspective transformation matrix (3x3)
+/// @return a pointer to the perspective transformation matrix (3x3), mapping dst onto src
 Matrix *matrix_transformation(const Tupple *src, const Tupple *dst)
 {
     if (src == NULL || dst == NULL)
         errx(EXIT_FAILURE, "matrix_transformation: src or dst is NULL\n");
 
-    float a[64] = {
-        src[0].x, src[0].y, 1, 0, 0, 0, -dst[0].x * src[0].x, -dst[0].x * src[0].y,
-        0, 0, 0, src[0].x, src[0].y, 1, -dst[0].y * src[0].x, -dst[0].y * src[0].y,
-        src[1].x, src[1].y, 1, 0, 0, 0, -dst[1].x * src[1].x, -dst[1].x * src[1].y,
-        0, 0, 0, src[1].x, src[1].y, 1, -dst[1].y * src[1].x, -dst[1].y * src[1].y,
-        src[2].x, src[2].y, 1, 0, 0, 0, -dst[2].x * src[2].x, -dst[2].x * src[2].y,
-        0, 0, 0, src[2].x, src[2].y, 1, -dst[2].y * src[2].x, -dst[2].y * src[2].y,
-        src[3].x, src[3].y, 1, 0, 0, 0, -dst[3].x * src[3].x, -dst[3].x * src[3].y,
-        0, 0, 0, src[3].x, src[3].y, 1, -dst[3].y * src[3].x, -dst[3].y * src[3].y};
-
-    float b[8] = {
-        dst[0].x,
-        dst[0].y,
-        dst[1].x,
-        dst[1].y,
-        dst[2].x,
-        dst[2].y,
-        dst[3].x,
-        dst[3].y,
-    };
-
-    Matrix *A = matrix_init(8, 8, a);
-    Matrix *B = matrix_init(8, 1, b);
-    Matrix *M = matrix_solve(A, B);
-
-    float m[9] = {
-        M->data[0], M->data[1], M->data[2],
-        M->data[3], M->data[4], M->data[5],
-        M->data[6], M->data[7], 1};
-
-    Matrix *H = matrix_init(3, 3, m);
-    Matrix *H_inv = matrix_inverse(H);
-
-    matrix_destroy(M);
-    matrix_destroy(A);
-    matrix_destroy(B);
-    matrix_destroy(H);
-
-    return H_inv;
+    Mat3 H;
+    if (!mat3_homography(src, dst, &H) || !mat3_inverse(&H, &H))
+        errx(EXIT_FAILURE, "matrix_transformation: matrix is not invertible\n");
+
+    return mat3_to_matrix(&H, NULL);
 }
 
 #pragma endregion matrix
@@ -550,61 +883,256 @@ Matrix4 *matrix4_init(int dim1, int dim2, int dim3, int dim4, float *datap)
     m->dim4 = dim4;
 
     m->size = dim1 * dim2 * dim3 * dim4;
+    m->layout = MATRIX4_NCHW;
+    m->owner = true;
+    m->data = aligned_floats(m->size);
 
     if (datap != NULL)
     {
-        m->data = calloc(m->size, sizeof(float));
         for (int i = 0; i < m->size; i++)
         {
             // initialize data from datap
             m->data[i] = datap[i];
         }
     }
-    else
-    {
-        m->data = calloc(m->size, sizeof(float));
-        if (m->data == NULL)
-            malloc_error();
-    }
 
     return m;
 }
 
-// Function: matrix4_zero
-// ----------------------
-// Reset all values in a 4-dimensional matrix to zero.
+// checks that a function which only knows the NCHW layout gets an NCHW matrix
+static void assert_nchw(Matrix4 *m, const char *name)
+{
+    if (m->layout != MATRIX4_NCHW)
+        errx(EXIT_FAILURE, "%s: only the NCHW layout is supported\n", name);
+}
+
+// Function: matrix4_slice
+// -----------------------
+// Returns a view on one element of the batch, of shape (1, dim2, dim3, dim4).
+// The view shares the data of the matrix and must not be destroyed.
 //
 // Parameters:
 //   m - pointer to the matrix
+//   index - index in the batch
+//
+// Returns:
+//   the view
 //
 
-void matrix4_zero(Matrix4 *m)
+Matrix4 matrix4_slice(Matrix4 *m, int index)
 {
-    for (int i = 0; i < m->size; i++)
-        m->data[i] = 0.0f;
+    if (index < 0 || index >= m->dim1)
+        errx(EXIT_FAILURE, "matrix4_slice: index out of bounds\n");
+
+    return matrix4_batch_view(m, index, 1);
 }
 
-// Function: matrix4_copy
-// ----------------------
-// Copies a 4-dimensional matrix.
+// Function: matrix4_batch_view
+// ----------------------------
+// Returns a view on count consecutive elements of the batch, of shape
+// (count, dim2, dim3, dim4), see matrix4_slice.
 //
 // Parameters:
 //   m - pointer to the matrix
-//   dst - pointer to the destination matrix
+//   index - index of the first element in the batch
+//   count - number of elements
+//
+// Returns:
+//   the view
 //
 
-Matrix4 *matrix4_copy(Matrix4 *m, Matrix4 *dst)
+Matrix4 matrix4_batch_view(Matrix4 *m, int index, int count)
 {
+    if (index < 0 || count < 0 || index + count > m->dim1)
+        errx(EXIT_FAILURE, "matrix4_batch_view: elements [%d, %d) out of bounds\n", index, index + count);
+
+    // the batch is the outermost dimension of every layout
+    int size = m->size / m->dim1;
+    Matrix4 view = *m;
+    view.dim1 = count;
+    view.size = size * count;
+    view.data = &m->data[index * size];
+    view.owner = false;
+
+    return view;
+}
 
-    if (dst == NULL)
-        dst = matrix4_init(m->dim1, m->dim2, m->dim3, m->dim4, NULL);
+// Function: matrix4_flatten_view
+// ------------------------------
+// Same as matrix4_flatten without copying: returns a (dim1, dim2 * dim3 * dim4)
+// view sharing the data of an NCHW matrix.
+//
 
-    if (m->dim1 != dst->dim1 || m->dim2 != dst->dim2 || m->dim3 != dst->dim3 || m->dim4 != dst->dim4)
-    {
-        errx(EXIT_FAILURE, "matrix4_copy: matrix dimensions do not match\n");
-    }
+Matrix matrix4_flatten_view(Matrix4 *m)
+{
+    assert_nchw(m, "matrix4_flatten_view");
 
-    for (int i = 0; i < m->size; i++)
+    int features = m->dim2 * m->dim3 * m->dim4;
+    Matrix view = {m->dim1, features, m->size, m->data, features, false};
+
+    return view;
+}
+
+// Function: matrix4_unflatten_view
+// --------------------------------
+// Same as matrix4_unflatten without copying: returns an NCHW view of shape
+// (dim1, channels, height, width) sharing the data of a contiguous matrix.
+//
+
+Matrix4 matrix4_unflatten_view(Matrix *m, int channels, int height, int width)
+{
+    if (m->dim2 != channels * height * width || m->stride != m->dim2)
+        errx(EXIT_FAILURE, "matrix4_unflatten_view: matrix dimensions do not match\n");
+
+    Matrix4 view = {m->dim1, channels, height, width, m->size, MATRIX4_NCHW, m->data, false};
+
+    return view;
+}
+
+// Function: matrix4_init_layout
+// -----------------------------
+// Initializes a zeroed 4-dimensional matrix stored in a given layout.
+// Dimensions are always the logical (batch, channels, height, width); channel
+// blocked layouts round the channels up to a whole number of blocks, the
+// padding channels are kept at zero.
+//
+// Parameters:
+//   dim1 - batch size
+//   dim2 - number of channels
+//   dim3 - height
+//   dim4 - width
+//   layout - one of Matrix4Layout
+//
+// Returns:
+//   pointer to the matrix
+//
+
+Matrix4 *matrix4_init_layout(int dim1, int dim2, int dim3, int dim4, int layout)
+{
+    int block = matrix4_channel_block(layout);
+    int channels = (dim2 + block - 1) / block * block;
+
+    Matrix4 *m = matrix4_init(dim1, channels, dim3, dim4, NULL);
+    m->dim2 = dim2;
+    m->layout = layout;
+
+    return m;
+}
+
+// Function: matrix4_channel_block
+// -------------------------------
+// Returns the number of channels stored contiguously by a layout
+// (1 for the unblocked layouts).
+//
+
+int matrix4_channel_block(int layout)
+{
+    switch (layout)
+    {
+    case MATRIX4_NCHW8C:
+        return 8;
+    case MATRIX4_NCHW16C:
+        return 16;
+    default:
+        return 1;
+    }
+}
+
+// Function: matrix4_offset
+// ------------------------
+// Returns the position of the logical element (i, j, k, l) in the data array,
+// whatever the layout of the matrix.
+//
+
+int matrix4_offset(Matrix4 *m, int i, int j, int k, int l)
+{
+    switch (m->layout)
+    {
+    case MATRIX4_NHWC:
+        return ((i * m->dim3 + k) * m->dim4 + l) * m->dim2 + j;
+    case MATRIX4_NCHW8C:
+    case MATRIX4_NCHW16C:
+    {
+        int block = matrix4_channel_block(m->layout);
+        int blocks = (m->dim2 + block - 1) / block;
+        return (((i * blocks + j / block) * m->dim3 + k) * m->dim4 + l) * block + j % block;
+    }
+    default:
+        return ((i * m->dim2 + j) * m->dim3 + k) * m->dim4 + l;
+    }
+}
+
+// Function: matrix4_reorder
+// -------------------------
+// Copies a 4-dimensional matrix into another layout.
+//
+// Parameters:
+//   m - pointer to the matrix
+//   layout - layout of the result
+//   dst - pointer to the destination matrix (must have the given layout)
+//
+// Returns:
+//   pointer to the resulting matrix
+//
+
+Matrix4 *matrix4_reorder(Matrix4 *m, int layout, Matrix4 *dst)
+{
+    if (dst == NULL)
+        dst = matrix4_init_layout(m->dim1, m->dim2, m->dim3, m->dim4, layout);
+
+    if (m->dim1 != dst->dim1 || m->dim2 != dst->dim2 || m->dim3 != dst->dim3 || m->dim4 != dst->dim4 || dst->layout != layout)
+        errx(EXIT_FAILURE, "matrix4_reorder: matrix dimensions do not match\n");
+
+    if (m->layout == layout)
+        return matrix4_copy(m, dst);
+
+    // keeps the padding channels of blocked layouts at zero
+    matrix4_zero(dst);
+
+    for (int i = 0; i < m->dim1; i++)
+        for (int j = 0; j < m->dim2; j++)
+            for (int k = 0; k < m->dim3; k++)
+                for (int l = 0; l < m->dim4; l++)
+                    dst->data[matrix4_offset(dst, i, j, k, l)] = m->data[matrix4_offset(m, i, j, k, l)];
+
+    return dst;
+}
+
+// Function: matrix4_zero
+// ----------------------
+// Reset all values in a 4-dimensional matrix to zero.
+//
+// Parameters:
+//   m - pointer to the matrix
+//
+
+void matrix4_zero(Matrix4 *m)
+{
+    for (int i = 0; i < m->size; i++)
+        m->data[i] = 0.0f;
+}
+
+// Function: matrix4_copy
+// ----------------------
+// Copies a 4-dimensional matrix.
+//
+// Parameters:
+//   m - pointer to the matrix
+//   dst - pointer to the destination matrix
+//
+
+Matrix4 *matrix4_copy(Matrix4 *m, Matrix4 *dst)
+{
+
+    if (dst == NULL)
+        dst = matrix4_init_layout(m->dim1, m->dim2, m->dim3, m->dim4, m->layout);
+
+    if (m->dim1 != dst->dim1 || m->dim2 != dst->dim2 || m->dim3 != dst->dim3 || m->dim4 != dst->dim4 || m->layout != dst->layout)
+    {
+        errx(EXIT_FAILURE, "matrix4_copy: matrix dimensions do not match\n");
+    }
+
+    for (int i = 0; i < m->size; i++)
         dst->data[i] = m->data[i];
 
     return dst;
@@ -629,7 +1157,7 @@ float m4_get(Matrix4 *m, int i, int j, int k, int l)
         errx(EXIT_FAILURE, "m4_get: index out of bounds\n");
     }
 
-    return m->data[i * m->dim2 * m->dim3 * m->dim4 + j * m->dim3 * m->dim4 + k * m->dim4 + l];
+    return m->data[matrix4_offset(m, i, j, k, l)];
 }
 
 // Function: m4_set
@@ -652,7 +1180,7 @@ void m4_set(Matrix4 *m, int i, int j, int k, int l, float value)
         errx(EXIT_FAILURE, "m4_set: index out of bounds\n");
     }
 
-    m->data[i * m->dim2 * m->dim3 * m->dim4 + j * m->dim3 * m->dim4 + k * m->dim4 + l] = value;
+    m->data[matrix4_offset(m, i, j, k, l)] = value;
 }
 
 // Function: matrix4_add
@@ -670,17 +1198,17 @@ Matrix4 *matrix4_add(Matrix4 *m1, Matrix4 *m2, Matrix4 *dst)
 {
     if (dst == NULL)
     {
-        dst = matrix4_init(m1->dim1, m1->dim2, m1->dim3, m1->dim4, NULL);
+        dst = matrix4_init_layout(m1->dim1, m1->dim2, m1->dim3, m1->dim4, m1->layout);
     }
 
     if (m1->dim1 != m2->dim1 || m1->dim2 != m2->dim2 || m1->dim3 != m2->dim3 || m1->dim4 != m2->dim4 ||
-        m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4)
+        m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4 ||
+        m1->layout != m2->layout || m1->layout != dst->layout)
     {
         errx(EXIT_FAILURE, "matrix4_add: matrix dimensions do not match\n");
     }
 
-    for (int i = 0; i < m1->size; i++)
-        dst->data[i] = m1->data[i] + m2->data[i];
+    parallel_binary(simd_kernels()->add, m1->data, m2->data, dst->data, dst->size);
 
     return dst;
 }
@@ -702,29 +1230,59 @@ Matrix4 *matrix4_add_bias(Matrix4 *m1, Matrix *bias, Matrix4 *dst)
 {
     if (dst == NULL)
     {
-        dst = matrix4_init(m1->dim1, m1->dim2, m1->dim3, m1->dim4, NULL);
+        dst = matrix4_init_layout(m1->dim1, m1->dim2, m1->dim3, m1->dim4, m1->layout);
     }
 
-    if (m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4 || m1->dim2 != bias->dim1)
+    if (m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4 || m1->dim2 != bias->dim1 || m1->layout != dst->layout)
     {
         errx(EXIT_FAILURE, "matrix4_sum_bias: matrix dimensions do not match\n");
     }
 
-    for (int i = 0; i < m1->dim1; i++)
+    const SimdKernels *simd = simd_kernels();
+    int plane = m1->dim3 * m1->dim4;
+
+    // one bias value per (batch, channel) plane
+    if (m1->layout == MATRIX4_NCHW)
     {
-        for (int j = 0; j < m1->dim2; j++)
+        for (int i = 0; i < m1->dim1; i++)
         {
-            for (int k = 0; k < m1->dim3; k++)
+            for (int j = 0; j < m1->dim2; j++)
             {
-                for (int l = 0; l < m1->dim4; l++)
-                {
-                    dst->data[i * m1->dim2 * m1->dim3 * m1->dim4 + j * m1->dim3 * m1->dim4 + k * m1->dim4 + l] =
-                        m1->data[i * m1->dim2 * m1->dim3 * m1->dim4 + j * m1->dim3 * m1->dim4 + k * m1->dim4 + l] + bias->data[j];
-                }
+                int offset = (i * m1->dim2 + j) * plane;
+                simd->add_scalar(&m1->data[offset], MAT(bias, j, 0), &dst->data[offset], plane);
             }
         }
+        return dst;
+    }
+
+    // the other layouts add the bias vector (padded to whole blocks) per pixel
+    int block = m1->layout == MATRIX4_NHWC ? m1->dim2 : matrix4_channel_block(m1->layout);
+    int blocks = (m1->dim2 + block - 1) / block;
+    Matrix *padded_buffer = matrix_arena_get(blocks, block);
+    float *padded = padded_buffer->data;
+    for (int j = 0; j < blocks * block; j++)
+        padded[j] = j < m1->dim2 ? MAT(bias, j, 0) : 0.0f;
+
+    // channels last: every pixel holds the whole bias vector
+    if (m1->layout == MATRIX4_NHWC)
+    {
+        for (int p = 0; p < m1->dim1 * plane; p++)
+            simd->add(&m1->data[p * m1->dim2], padded, &dst->data[p * m1->dim2], m1->dim2);
+    }
+    // channel blocks: every pixel of a block holds one slice of the bias
+    else
+    {
+        for (int i = 0; i < m1->dim1; i++)
+            for (int b = 0; b < blocks; b++)
+                for (int p = 0; p < plane; p++)
+                {
+                    int offset = ((i * blocks + b) * plane + p) * block;
+                    simd->add(&m1->data[offset], &padded[b * block], &dst->data[offset], block);
+                }
     }
 
+    matrix_arena_put(padded_buffer);
+
     return dst;
 }
 
@@ -750,9 +1308,11 @@ Matrix *matrix4_flatten(Matrix4 *m, Matrix *dst)
     {
         errx(EXIT_FAILURE, "matrix4_flatten: matrix dimensions do not match\n");
     }
+    assert_nchw(m, "matrix4_flatten");
 
-    for (int i = 0; i < m->size; i++)
-        dst->data[i] = m->data[i];
+    for (int i = 0; i < dst->dim1; i++)
+        for (int j = 0; j < dst->dim2; j++)
+            dst->data[i * dst->stride + j] = m->data[i * dst->dim2 + j];
 
     return dst;
 }
@@ -770,15 +1330,40 @@ Matrix *matrix4_flatten(Matrix4 *m, Matrix *dst)
 
 Matrix4 *matrix4_unflatten(Matrix *m, Matrix4 *dst)
 {
-    for (int i = 0; i < m->size; i++)
-        dst->data[i] = m->data[i];
+    if (m->dim1 != dst->dim1 || m->dim2 != dst->dim2 * dst->dim3 * dst->dim4)
+        errx(EXIT_FAILURE, "matrix4_unflatten: matrix dimensions do not match\n");
+    assert_nchw(dst, "matrix4_unflatten");
+
+    for (int i = 0; i < m->dim1; i++)
+        for (int j = 0; j < m->dim2; j++)
+            dst->data[i * m->dim2 + j] = m->data[i * m->stride + j];
 
     return dst;
 }
 
+// sums the channels [begin, end): each plane with the sum kernel, then the
+// images in batch order
+static void sum_channels_range(void *ctx, int begin, int end)
+{
+    ReduceTask *t = ctx;
+    Matrix4 *m = t->m4;
+    int plane = m->dim3 * m->dim4;
+    const SimdKernels *simd = simd_kernels();
+
+    for (int j = begin; j < end; j++)
+    {
+        float sum = 0.0f;
+        for (int i = 0; i < m->dim1; i++)
+            sum += simd->sum(&m->data[(i * m->dim2 + j) * plane], plane);
+        t->dst->data[j] = sum;
+    }
+}
+
 // Function: matrix4_sum_channels
 // ---------------------------------
 // Calculates the bias gradient from 4d delta matrix.
+// Channels are split over the thread pool and every channel is summed in a
+// fixed order, so the result does not depend on the number of threads.
 //
 // Parameters:
 //   m1 - pointer to the 4-dimensional matrix
@@ -799,20 +1384,15 @@ Matrix *matrix4_sum_channels(Matrix4 *m, Matrix *dst)
     {
         errx(EXIT_FAILURE, "matrix4_sum_channels: matrix dimensions do not match\n");
     }
+    assert_nchw(m, "matrix4_sum_channels");
 
-    for (int i = 0; i < m->dim1; i++)
-    {
-        for (int j = 0; j < m->dim2; j++)
-        {
-            for (int k = 0; k < m->dim3; k++)
-            {
-                for (int l = 0; l < m->dim4; l++)
-                {
-                    dst->data[j] += m->data[i * m->dim2 * m->dim3 * m->dim4 + j * m->dim3 * m->dim4 + k * m->dim4 + l];
-                }
-            }
-        }
-    }
+    // the bias gradient is a contiguous (channels, 1) matrix
+    if (dst->dim2 != 1 || dst->stride != 1)
+        errx(EXIT_FAILURE, "matrix4_sum_channels: destination must be a column\n");
+
+    ReduceTask task = {NULL, m, dst, NULL};
+    int per_channel = m->dim1 * m->dim3 * m->dim4;
+    threadpool_parallel_for(m->dim2, MATRIX_PARALLEL_MIN_SIZE / (per_channel + 1) + 1, sum_channels_range, &task);
 
     return dst;
 }
@@ -832,17 +1412,17 @@ Matrix4 *matrix4_subtract(Matrix4 *m1, Matrix4 *m2, Matrix4 *dst)
 {
     if (dst == NULL)
     {
-        dst = matrix4_init(m1->dim1, m1->dim2, m1->dim3, m1->dim4, NULL);
+        dst = matrix4_init_layout(m1->dim1, m1->dim2, m1->dim3, m1->dim4, m1->layout);
     }
 
     if (m1->dim1 != m2->dim1 || m1->dim2 != m2->dim2 || m1->dim3 != m2->dim3 || m1->dim4 != m2->dim4 ||
-        m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4)
+        m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4 ||
+        m1->layout != m2->layout || m1->layout != dst->layout)
     {
         errx(EXIT_FAILURE, "matrix4_subtract: matrix dimensions do not match\n");
     }
 
-    for (int i = 0; i < m1->size; i++)
-        dst->data[i] = m1->data[i] - m2->data[i];
+    parallel_binary(simd_kernels()->sub, m1->data, m2->data, dst->data, dst->size);
 
     return dst;
 }
@@ -907,202 +1487,994 @@ Matrix4 *matrix4_elementwise_multiply(Matrix4 *m1, Matrix4 *m2, Matrix4 *dst)
 {
     if (dst == NULL)
     {
-        dst = matrix4_init(m1->dim1, m1->dim2, m1->dim3, m1->dim4, NULL);
+        dst = matrix4_init_layout(m1->dim1, m1->dim2, m1->dim3, m1->dim4, m1->layout);
     }
 
     if (m1->dim1 != m2->dim1 || m1->dim2 != m2->dim2 || m1->dim3 != m2->dim3 || m1->dim4 != m2->dim4 ||
-        m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4)
+        m1->dim1 != dst->dim1 || m1->dim2 != dst->dim2 || m1->dim3 != dst->dim3 || m1->dim4 != dst->dim4 ||
+        m1->layout != m2->layout || m1->layout != dst->layout)
     {
         errx(EXIT_FAILURE, "matrix4_elementwise_multiply: matrix dimensions do not match\n");
     }
 
-    for (int i = 0; i < dst->size; i++)
-    {
-        dst->data[i] = m1->data[i] * m2->data[i];
-    }
+    parallel_binary(simd_kernels()->mul, m1->data, m2->data, dst->data, dst->size);
 
     return dst;
 }
 
-// Function: matrix4_convolve
-// --------------------------
-// Convolves a 4D matrix with a 4D kernel.
+// Function: matrix4_im2col
+// ------------------------
+// Lowers one image of a batch to a column matrix so that a convolution
+// becomes a single matrix product. Row (c, n, o) of the result holds the input
+// values seen by kernel tap (n, o) of channel c at every output position,
+// padded positions are zero.
 //
 // Parameters:
-//   weights - pointer to the weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
 //   input - pointer to the matrix of shape: (batch_size, in_channels, height, width)
-//   dst - pointer to the destination matrix
+//   index - index of the image in the batch
+//   kernel_height, kernel_width - size of the kernel
 //   stride - stride of the convolution
 //   padding - padding of the convolution
-// Returns:
-//   pointer to the resulting matrix
+//   col - destination of shape: (in_channels * kernel_height * kernel_width, out_height * out_width)
+//
 
-Matrix4 *matrix4_convolve(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding)
+void matrix4_im2col(Matrix4 *input, int index, int kernel_height, int kernel_width, int stride, int padding, float *col)
 {
-
-    int batch_size = input->dim1;
     int in_channels = input->dim2;
     int height = input->dim3;
     int width = input->dim4;
 
-    int out_channels = weights->dim1;
-    int kernel_height = weights->dim3;
-    int kernel_width = weights->dim4;
-
     int out_height = (height + 2 * padding - kernel_height) / stride + 1;
     int out_width = (width + 2 * padding - kernel_width) / stride + 1;
 
-    if (dst == NULL)
-    {
-        dst = matrix4_init(batch_size, out_channels, out_height, out_width, NULL);
-    }
-
-    if (weights->dim2 != in_channels)
-    {
-        printf("weights: %d %d %d %d\n", weights->dim1, weights->dim2, weights->dim3, weights->dim4);
-        printf("input: %d %d %d %d\n", input->dim1, input->dim2, input->dim3, input->dim4);
-        errx(EXIT_FAILURE, "matrix4_convolve: input channels do not match\n");
-    }
-
-    if (dst->dim1 != batch_size || dst->dim2 != out_channels || dst->dim3 != out_height || dst->dim4 != out_width)
-    {
-        errx(EXIT_FAILURE, "matrix4_convolve: output dimensions do not match\n");
-    }
+    assert_nchw(input, "matrix4_im2col");
 
-    // optimized convolution using strides and padding
+    float *image = &input->data[index * in_channels * height * width];
 
-    for (int i = 0; i < batch_size; i++)
+    for (int m = 0; m < in_channels; m++)
     {
-        for (int j = 0; j < out_channels; j++)
+        for (int n = 0; n < kernel_height; n++)
         {
-            for (int k = 0; k < out_height; k++)
+            for (int o = 0; o < kernel_width; o++)
             {
-                for (int l = 0; l < out_width; l++)
+                for (int k = 0; k < out_height; k++)
                 {
-                    for (int m = 0; m < in_channels; m++)
+                    int x = k * stride + n - padding;
+                    float *row = &col[k * out_width];
+
+                    if (x < 0 || x >= height)
                     {
-                        for (int n = 0; n < kernel_height; n++)
-                        {
-                            for (int o = 0; o < kernel_width; o++)
-                            {
-                                int x = k * stride + n - padding;
-                                int y = l * stride + o - padding;
+                        for (int l = 0; l < out_width; l++)
+                            row[l] = 0.0f;
+                        continue;
+                    }
 
-                                if (x >= 0 && x < height && y >= 0 && y < width)
-                                {
-                                    dst->data[i * out_channels * out_height * out_width + j * out_height * out_width + k * out_width + l] +=
-                                        weights->data[j * in_channels * kernel_height * kernel_width + m * kernel_height * kernel_width + n * kernel_width + o] *
-                                        input->data[i * in_channels * height * width + m * height * width + x * width + y];
-                                }
-                            }
-                        }
+                    float *src = &image[m * height * width + x * width];
+                    for (int l = 0; l < out_width; l++)
+                    {
+                        int y = l * stride + o - padding;
+                        row[l] = y >= 0 && y < width ? src[y] : 0.0f;
                     }
                 }
+                col += out_height * out_width;
             }
         }
     }
-
-    return dst;
 }
 
-// Function: matrix4_convolve_transpose
-// ------------------------------------
-// Convolves a 4D matrix with a 180 degrees transposed 4D kernel.
-//
-// Parameters:
-//   weights - pointer to the weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
-//   input - pointer to the matrix of shape: (batch_size, in_channels, height, width)
-//   dst - pointer to the destination matrix
-//   stride - stride of the convolution
-//   padding - padding of the convolution
-// Returns:
-//   pointer to the resulting matrix
-
-Matrix4 *matrix4_convolve_transpose(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding)
+// Arguments of the blocked convolution, split over (image, output block)
+typedef struct
 {
-    // Transpose by 180 degrees the weights
-    Matrix4 *weights_t = matrix4_transpose(weights);
-    Matrix4 *weights_tt = matrix4_transpose(weights_t);
-    dst = matrix4_convolve(weights_tt, input, dst, stride, padding);
-    matrix4_destroy(weights_t);
-    matrix4_destroy(weights_tt);
-    return dst;
-}
-
-// Function: matrix4_grad_input_convolve
-// -------------------------------------
-// Computes the gradient of the input of a convolution.
-//
-// Parameters:
-//   weights - pointer to the weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
-//   grad_output - pointer to the gradient of the output of shape: (batch_size, out_channels, out_height, out_width)
-//   dst - pointer to the destination matrix
-//   stride - stride of the convolution
-//   padding - padding of the convolution
-// Returns:
-//   pointer to the resulting matrix
-
-Matrix4 *matrix4_grad_input_convolve(Matrix4 *weights, Matrix4 *grad_output, Matrix4 *dst, int stride, int padding)
+    Matrix4 *input;
+    Matrix4 *dst;
+    const float *packed;
+    int kernel_height;
+    int kernel_width;
+    int stride;
+    int padding;
+    int out_channels;
+    int out_blocks;
+    const float *bias; // out_channels values, NULL for no bias
+    int activation;
+} BlockedConvTask;
+
+// Computes the output blocks [begin, end) of (batch_size * out_blocks)
+static inline __attribute__((always_inline)) void convolve_blocked_range(BlockedConvTask *t, int begin, int end, const int block)
 {
+    Matrix4 *input = t->input;
+    int in_channels = input->dim2;
+    int height = input->dim3;
+    int width = input->dim4;
+    int in_blocks = (in_channels + block - 1) / block;
 
-    int batch_size = grad_output->dim1;
-    int out_channels = grad_output->dim2;
-    int out_height = grad_output->dim3;
-    int out_width = grad_output->dim4;
-
-    int num_filters = weights->dim1;
-    int channels = weights->dim2;
-    int filter_height = weights->dim3;
-    int filter_width = weights->dim4;
-
-    int height = dst->dim3;
-    int width = dst->dim4;
+    int kernel_height = t->kernel_height;
+    int kernel_width = t->kernel_width;
+    int stride = t->stride;
+    int padding = t->padding;
+    int out_height = t->dst->dim3;
+    int out_width = t->dst->dim4;
 
-    if (dst == NULL)
+    for (int job = begin; job < end; job++)
     {
-        dst = matrix4_init(batch_size, channels, height, width, NULL);
-    }
+        int i = job / t->out_blocks;
+        int ob = job % t->out_blocks;
 
-    for (int b = 0; b < batch_size; b++)
-    {
-        for (int f = 0; f < num_filters; f++)
+        for (int k = 0; k < out_height; k++)
         {
-            for (int h = 0; h < out_height; h++)
+            float *out = &t->dst->data[((job * out_height) + k) * out_width * block];
+            for (int l = 0; l < out_width * block; l++)
+                out[l] = 0.0f;
+
+            for (int m = 0; m < in_channels; m++)
             {
-                for (int w = 0; w < out_width; w++)
+                const float *plane = &input->data[((i * in_blocks + m / block) * height) * width * block + m % block];
+
+                for (int n = 0; n < kernel_height; n++)
                 {
-                    // calculate input height and width for current output
-                    int in_h = h * stride - padding;
-                    int in_w = w * stride - padding;
+                    int x = k * stride + n - padding;
+                    if (x < 0 || x >= height)
+                        continue;
 
-                    // loop over channels, filter height and filter width
-                    for (int c = 0; c < channels; c++)
+                    for (int o = 0; o < kernel_width; o++)
                     {
-                        for (int fh = 0; fh < filter_height; fh++)
+                        const float *w = &t->packed[((ob * in_channels + m) * kernel_height * kernel_width + n * kernel_width + o) * block];
+
+                        for (int l = 0; l < out_width; l++)
                         {
-                            for (int fw = 0; fw < filter_width; fw++)
-                            {
-                                // skip entries that are out of bounds
-                                if (in_h < 0 || in_h >= height || in_w < 0 || in_w >= width)
-                                    continue;
-
-                                // calculate grad_in by summing over channels, filter height, and filter width
-                                dst->data[b * channels * height * width + c * height * width + in_h * width + in_w] +=
-                                    weights->data[f * channels * filter_height * filter_width + c * filter_height * filter_width + fh * filter_width + fw] *
-                                    grad_output->data[b * num_filters * out_height * out_width + f * out_height * out_width + h * out_width + w];
-                            }
+                            int y = l * stride + o - padding;
+                            if (y < 0 || y >= width)
+                                continue;
+
+                            float value = plane[(x * width + y) * block];
+                            float *acc = &out[l * block];
+                            for (int c = 0; c < block; c++)
+                                acc[c] += value * w[c];
                         }
                     }
                 }
             }
+
+            // epilogue, while the row is still in cache. The padding
+            // channels of the last block stay at zero.
+            if (t->bias == NULL && t->activation == ACTIVATION_IDENTITY)
+                continue;
+
+            int channels = t->out_channels - ob * block < block ? t->out_channels - ob * block : block;
+            for (int l = 0; l < out_width; l++)
+            {
+                float *acc = &out[l * block];
+                for (int c = 0; c < channels; c++)
+                {
+                    float bias = t->bias == NULL ? 0.0f : t->bias[ob * block + c];
+                    acc[c] = simd_activate(t->activation, acc[c] + bias);
+                }
+            }
         }
     }
+}
 
-    return dst;
+static void convolve_nchw8c_range(void *ctx, int begin, int end)
+{
+    convolve_blocked_range(ctx, begin, end, 8);
 }
 
-// Function: matrix4_multiply_scalar
-// ---------------------------------
+static void convolve_nchw16c_range(void *ctx, int begin, int end)
+{
+    convolve_blocked_range(ctx, begin, end, 16);
+}
+
+// Direct convolution on channel blocked matrices (NCHW8C / NCHW16C) with
+// weights packed by matrix4_blocked_weights: every input value is broadcast
+// against one block of output channels, the innermost loop over the block
+// being a single vector operation. Each output row of a block is accumulated
+// in place in dst, then gets its bias and activation.
+static Matrix4 *convolve_blocked(Matrix4 *packed, Matrix4 *input, Matrix4 *dst, int stride, int padding,
+                                 Matrix *bias, int activation)
+{
+    int block = matrix4_channel_block(input->layout);
+    int out_blocks = packed->dim1;
+
+    BlockedConvTask task = {input, dst, packed->data, packed->dim3, packed->dim4 / block, stride, padding,
+                            dst->dim2, out_blocks, bias == NULL ? NULL : bias->data, activation};
+    threadpool_parallel_for(input->dim1 * out_blocks, 1,
+                            block == 8 ? convolve_nchw8c_range : convolve_nchw16c_range, &task);
+
+    return dst;
+}
+
+// Arguments of the im2col convolution, split over the images of the batch
+typedef struct
+{
+    const void *weights; // (out_channels, patch) matrix stored as storage
+    int storage;
+    int out_channels;
+    int kernel_height;
+    int kernel_width;
+    Matrix4 *input;
+    Matrix4 *dst;
+    int stride;
+    int padding;
+    const GemmEpilogue *epilogue;
+} ConvTask;
+
+// Convolves the images [begin, end) of the batch
+static void convolve_images(void *ctx, int begin, int end)
+{
+    ConvTask *t = ctx;
+    Matrix4 *input = t->input;
+
+    int out_channels = t->out_channels;
+    int kernel_height = t->kernel_height;
+    int kernel_width = t->kernel_width;
+    int patch = input->dim2 * kernel_height * kernel_width;
+    int positions = t->dst->dim3 * t->dst->dim4;
+    bool pointwise = kernel_height == 1 && kernel_width == 1 && t->stride == 1 && t->padding == 0;
+
+    // the column buffer is pooled: the same layer needs it at every batch
+    Matrix *col_buffer = pointwise ? NULL : matrix_arena_get(patch, positions);
+    float *col = pointwise ? NULL : col_buffer->data;
+
+    for (int i = begin; i < end; i++)
+    {
+        float *image_col = &input->data[i * input->dim2 * input->dim3 * input->dim4];
+        if (!pointwise)
+        {
+            matrix4_im2col(input, i, kernel_height, kernel_width, t->stride, t->padding, col);
+            image_col = col;
+        }
+
+        // dst[i] = act(weights * col + bias): (out_channels, patch) x (patch, positions)
+        sgemm_mixed(false, false, out_channels, positions, patch,
+                    1.0f, t->weights, t->storage, patch,
+                    image_col, FLOAT_STORAGE_FP32, positions,
+                    0.0f, &t->dst->data[i * out_channels * positions], positions,
+                    t->epilogue);
+    }
+
+    if (col_buffer != NULL)
+        matrix_arena_put(col_buffer);
+}
+
+// Convolves an NCHW input with weights seen as an (out_channels, patch) matrix
+static void convolve_im2col(const void *weights, int storage, int kernel_height, int kernel_width,
+                            Matrix4 *input, Matrix4 *dst, int stride, int padding, Matrix *bias, int activation)
+{
+    assert_nchw(input, "matrix4_convolve");
+
+    // output channels are the rows of each image's product
+    GemmEpilogue epilogue = {bias == NULL ? NULL : bias->data, true, activation};
+
+    // a batch with an image per thread is split over the images, smaller
+    // batches are convolved one image at a time by the parallel GEMM
+    ConvTask task = {weights, storage, dst->dim2, kernel_height, kernel_width,
+                     input, dst, stride, padding, &epilogue};
+    if (input->dim1 >= matrix_get_num_threads())
+        threadpool_parallel_for(input->dim1, 1, convolve_images, &task);
+    else
+        convolve_images(&task, 0, input->dim1);
+}
+
+// Function: matrix4_convolve
+// --------------------------
+// Convolves a 4D matrix with a 4D kernel.
+// Each image is lowered with im2col and multiplied with the weights, seen as
+// an (out_channels, in_channels * kernel_height * kernel_width) matrix, by the
+// blocked GEMM. 1x1 kernels without stride or padding skip the lowering.
+// Large batches are split over the thread pool, one range of images per thread.
+//
+// Parameters:
+//   weights - pointer to the weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
+//   input - pointer to the matrix of shape: (batch_size, in_channels, height, width)
+//           in the NCHW, NCHW8C or NCHW16C layout
+//   dst - pointer to the destination matrix, same layout as the input (overwritten)
+//   stride - stride of the convolution
+//   padding - padding of the convolution
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding)
+{
+    return matrix4_convolve_fused(weights, input, dst, stride, padding, NULL, ACTIVATION_IDENTITY);
+}
+
+// Function: matrix4_convolve_fused
+// --------------------------------
+// matrix4_convolve followed by matrix4_add_bias and an activation, both
+// applied to the output tiles as they are produced instead of in two more
+// passes over dst.
+//
+// Parameters:
+//   weights, input, dst, stride, padding - see matrix4_convolve
+//   bias - pointer to the bias of shape: (out_channels, 1), or NULL
+//   activation - one of ActivationKind
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve_fused(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding, Matrix *bias, int activation)
+{
+
+    int batch_size = input->dim1;
+    int in_channels = input->dim2;
+    int height = input->dim3;
+    int width = input->dim4;
+
+    int out_channels = weights->dim1;
+    int kernel_height = weights->dim3;
+    int kernel_width = weights->dim4;
+
+    int out_height = (height + 2 * padding - kernel_height) / stride + 1;
+    int out_width = (width + 2 * padding - kernel_width) / stride + 1;
+
+    if (dst == NULL)
+    {
+        dst = matrix4_init_layout(batch_size, out_channels, out_height, out_width, input->layout);
+    }
+
+    if (weights->dim2 != in_channels)
+    {
+        printf("weights: %d %d %d %d\n", weights->dim1, weights->dim2, weights->dim3, weights->dim4);
+        printf("input: %d %d %d %d\n", input->dim1, input->dim2, input->dim3, input->dim4);
+        errx(EXIT_FAILURE, "matrix4_convolve: input channels do not match\n");
+    }
+
+    if (dst->dim1 != batch_size || dst->dim2 != out_channels || dst->dim3 != out_height || dst->dim4 != out_width)
+    {
+        errx(EXIT_FAILURE, "matrix4_convolve: output dimensions do not match\n");
+    }
+
+    if (input->layout != dst->layout)
+        errx(EXIT_FAILURE, "matrix4_convolve: input and output layouts do not match\n");
+
+    if (bias != NULL && bias->size != out_channels)
+        errx(EXIT_FAILURE, "matrix4_convolve: bias size does not match the output channels\n");
+
+    if (input->layout == MATRIX4_NCHW8C || input->layout == MATRIX4_NCHW16C)
+    {
+        // packed for this call only, layers keep them, see ConvLayer
+        int block = matrix4_channel_block(input->layout);
+        Matrix4 *packed = matrix4_arena_get((out_channels + block - 1) / block, in_channels,
+                                            kernel_height, kernel_width * block, MATRIX4_NCHW);
+        matrix4_blocked_weights(weights, input->layout, packed);
+        convolve_blocked(packed, input, dst, stride, padding, bias, activation);
+        matrix4_arena_put(packed);
+        return dst;
+    }
+
+    convolve_im2col(weights->data, FLOAT_STORAGE_FP32, kernel_height, kernel_width,
+                    input, dst, stride, padding, bias, activation);
+    return dst;
+}
+
+// Function: matrix4_blocked_weights
+// ---------------------------------
+// Packs convolution weights for the direct convolution of a channel blocked
+// layout: the output channels are split in blocks of the layout and made
+// innermost, so that each (input channel, kernel position) holds one block of
+// filters. The last block is padded with zero filters.
+//
+// Parameters:
+//   weights - pointer to the weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
+//   layout - MATRIX4_NCHW8C or MATRIX4_NCHW16C
+//   dst - pointer to the destination of shape:
+//         (out_blocks, in_channels, kernel_height, kernel_width * block)
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_blocked_weights(Matrix4 *weights, int layout, Matrix4 *dst)
+{
+    int out_channels = weights->dim1;
+    int in_channels = weights->dim2;
+    int kernel_height = weights->dim3;
+    int kernel_width = weights->dim4;
+
+    int block = matrix4_channel_block(layout);
+    if (block == 1)
+        errx(EXIT_FAILURE, "matrix4_blocked_weights: the layout is not channel blocked\n");
+    int out_blocks = (out_channels + block - 1) / block;
+
+    if (dst == NULL)
+        dst = matrix4_init(out_blocks, in_channels, kernel_height, kernel_width * block, NULL);
+
+    if (dst->dim1 != out_blocks || dst->dim2 != in_channels || dst->dim3 != kernel_height ||
+        dst->dim4 != kernel_width * block)
+        errx(EXIT_FAILURE, "matrix4_blocked_weights: matrix dimensions do not match\n");
+
+    int kernel_size = in_channels * kernel_height * kernel_width;
+    for (int i = 0; i < dst->size; i++)
+        dst->data[i] = 0.0f;
+
+    for (int f = 0; f < out_channels; f++)
+        for (int p = 0; p < kernel_size; p++)
+            dst->data[((f / block) * kernel_size + p) * block + f % block] = weights->data[f * kernel_size + p];
+
+    return dst;
+}
+
+// Function: matrix4_convolve_blocked_fused
+// ----------------------------------------
+// matrix4_convolve_fused on a channel blocked input with weights already
+// packed by matrix4_blocked_weights, which layers repack only when their
+// weights change.
+//
+// Parameters:
+//   packed - weights packed by matrix4_blocked_weights for the layout of the input
+//   input - pointer to the matrix of shape: (batch_size, in_channels, height, width)
+//           in the NCHW8C or NCHW16C layout
+//   dst - pointer to the destination matrix, same layout as the input
+//         (overwritten), required: it gives the number of output channels
+//   stride, padding, bias, activation - see matrix4_convolve_fused
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve_blocked_fused(Matrix4 *packed, Matrix4 *input, Matrix4 *dst, int stride, int padding, Matrix *bias, int activation)
+{
+    int block = matrix4_channel_block(input->layout);
+    if (block == 1)
+        errx(EXIT_FAILURE, "matrix4_convolve_blocked: the input is not channel blocked\n");
+
+    if (dst == NULL)
+        errx(EXIT_FAILURE, "matrix4_convolve_blocked: the destination is required\n");
+
+    int out_channels = dst->dim2;
+    int kernel_height = packed->dim3;
+    int kernel_width = packed->dim4 / block;
+    int out_height = (input->dim3 + 2 * padding - kernel_height) / stride + 1;
+    int out_width = (input->dim4 + 2 * padding - kernel_width) / stride + 1;
+
+    if (packed->dim1 != (out_channels + block - 1) / block || packed->dim2 != input->dim2 ||
+        packed->dim4 != kernel_width * block)
+        errx(EXIT_FAILURE, "matrix4_convolve_blocked: packed weights do not match\n");
+
+    if (dst->dim1 != input->dim1 || dst->dim3 != out_height || dst->dim4 != out_width)
+        errx(EXIT_FAILURE, "matrix4_convolve_blocked: output dimensions do not match\n");
+
+    if (input->layout != dst->layout)
+        errx(EXIT_FAILURE, "matrix4_convolve_blocked: input and output layouts do not match\n");
+
+    if (bias != NULL && bias->size != out_channels)
+        errx(EXIT_FAILURE, "matrix4_convolve_blocked: bias size does not match the output channels\n");
+
+    return convolve_blocked(packed, input, dst, stride, padding, bias, activation);
+}
+
+// Function: matrix4_winograd_weights
+// ----------------------------------
+// Transforms 3x3 convolution weights for the Winograd F(2x2, 3x3) algorithm:
+// U = G g G^T for every (filter, channel) pair. The result is stored position
+// major so that each of the 16 transformed positions is a contiguous
+// (out_channels, in_channels) matrix.
+//
+// Parameters:
+//   weights - pointer to the weights of shape: (out_channels, in_channels, 3, 3)
+//   dst - pointer to the destination of shape: (4, 4, out_channels, in_channels)
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_winograd_weights(Matrix4 *weights, Matrix4 *dst)
+{
+    int out_channels = weights->dim1;
+    int in_channels = weights->dim2;
+
+    if (weights->dim3 != 3 || weights->dim4 != 3)
+        errx(EXIT_FAILURE, "matrix4_winograd_weights: only 3x3 kernels are supported\n");
+
+    if (dst == NULL)
+        dst = matrix4_init(4, 4, out_channels, in_channels, NULL);
+
+    if (dst->dim1 != 4 || dst->dim2 != 4 || dst->dim3 != out_channels || dst->dim4 != in_channels)
+        errx(EXIT_FAILURE, "matrix4_winograd_weights: matrix dimensions do not match\n");
+
+    int plane = out_channels * in_channels;
+
+    for (int f = 0; f < out_channels; f++)
+    {
+        for (int c = 0; c < in_channels; c++)
+        {
+            float *g = &weights->data[(f * in_channels + c) * 9];
+
+            // Gg: (4x3)
+            float t[4][3];
+            for (int j = 0; j < 3; j++)
+            {
+                t[0][j] = g[j];
+                t[1][j] = 0.5f * (g[j] + g[3 + j] + g[6 + j]);
+                t[2][j] = 0.5f * (g[j] - g[3 + j] + g[6 + j]);
+                t[3][j] = g[6 + j];
+            }
+
+            // (Gg)G^T: (4x4)
+            for (int i = 0; i < 4; i++)
+            {
+                float u[4] = {
+                    t[i][0],
+                    0.5f * (t[i][0] + t[i][1] + t[i][2]),
+                    0.5f * (t[i][0] - t[i][1] + t[i][2]),
+                    t[i][2],
+                };
+                for (int j = 0; j < 4; j++)
+                    dst->data[(i * 4 + j) * plane + f * in_channels + c] = u[j];
+            }
+        }
+    }
+
+    return dst;
+}
+
+// Function: matrix4_convolve_winograd
+// -----------------------------------
+// 3x3 stride 1 convolution with the Winograd F(2x2, 3x3) algorithm.
+// The output is computed by 2x2 tiles: each 4x4 input tile is transformed
+// (V = B^T d B), the 16 transformed positions are multiplied with the
+// transformed weights as 16 independent GEMMs summing over input channels,
+// and the products are transformed back (Y = A^T M A). This needs 16
+// multiplies per tile and channel instead of 36.
+//
+// Parameters:
+//   transformed - weights transformed by matrix4_winograd_weights
+//   input - pointer to the matrix of shape: (batch_size, in_channels, height, width)
+//   dst - pointer to the destination matrix (overwritten)
+//   padding - padding of the convolution
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve_winograd(Matrix4 *transformed, Matrix4 *input, Matrix4 *dst, int padding)
+{
+    return matrix4_convolve_winograd_fused(transformed, input, dst, padding, NULL, ACTIVATION_IDENTITY);
+}
+
+// Function: matrix4_convolve_winograd_fused
+// -----------------------------------------
+// matrix4_convolve_winograd with the bias and the activation applied by the
+// output transform, as each 2x2 tile is written.
+//
+// Parameters:
+//   transformed, input, dst, padding - see matrix4_convolve_winograd
+//   bias - pointer to the bias of shape: (out_channels, 1), or NULL
+//   activation - one of ActivationKind
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve_winograd_fused(Matrix4 *transformed, Matrix4 *input, Matrix4 *dst, int padding, Matrix *bias, int activation)
+{
+    int batch_size = input->dim1;
+    int in_channels = input->dim2;
+    int height = input->dim3;
+    int width = input->dim4;
+
+    int out_channels = transformed->dim3;
+
+    int out_height = height + 2 * padding - 2;
+    int out_width = width + 2 * padding - 2;
+
+    if (dst == NULL)
+        dst = matrix4_init(batch_size, out_channels, out_height, out_width, NULL);
+
+    if (transformed->dim1 != 4 || transformed->dim2 != 4 || transformed->dim4 != in_channels)
+        errx(EXIT_FAILURE, "matrix4_convolve_winograd: input channels do not match\n");
+
+    if (dst->dim1 != batch_size || dst->dim2 != out_channels || dst->dim3 != out_height || dst->dim4 != out_width)
+        errx(EXIT_FAILURE, "matrix4_convolve_winograd: output dimensions do not match\n");
+
+    if (bias != NULL && bias->size != out_channels)
+        errx(EXIT_FAILURE, "matrix4_convolve_winograd: bias size does not match the output channels\n");
+
+    assert_nchw(input, "matrix4_convolve_winograd");
+    assert_nchw(dst, "matrix4_convolve_winograd");
+
+    int tiles_h = (out_height + 1) / 2;
+    int tiles_w = (out_width + 1) / 2;
+    int tiles = tiles_h * tiles_w;
+
+    // V: (16, in_channels, tiles), M: (16, out_channels, tiles)
+    Matrix *V_buffer = matrix_arena_get(16 * in_channels, tiles);
+    Matrix *M_buffer = matrix_arena_get(16 * out_channels, tiles);
+    float *V = V_buffer->data;
+    float *M = M_buffer->data;
+
+    for (int b = 0; b < batch_size; b++)
+    {
+        // input transform
+        for (int c = 0; c < in_channels; c++)
+        {
+            float *image = &input->data[(b * in_channels + c) * height * width];
+            for (int th = 0; th < tiles_h; th++)
+            {
+                for (int tw = 0; tw < tiles_w; tw++)
+                {
+                    float d[4][4];
+                    for (int i = 0; i < 4; i++)
+                    {
+                        int x = th * 2 + i - padding;
+                        for (int j = 0; j < 4; j++)
+                        {
+                            int y = tw * 2 + j - padding;
+                            d[i][j] = x >= 0 && x < height && y >= 0 && y < width ? image[x * width + y] : 0.0f;
+                        }
+                    }
+
+                    // B^T d
+                    float t[4][4];
+                    for (int j = 0; j < 4; j++)
+                    {
+                        t[0][j] = d[0][j] - d[2][j];
+                        t[1][j] = d[1][j] + d[2][j];
+                        t[2][j] = d[2][j] - d[1][j];
+                        t[3][j] = d[1][j] - d[3][j];
+                    }
+
+                    // (B^T d) B
+                    int tile = th * tiles_w + tw;
+                    for (int i = 0; i < 4; i++)
+                    {
+                        float v[4] = {
+                            t[i][0] - t[i][2],
+                            t[i][1] + t[i][2],
+                            t[i][2] - t[i][1],
+                            t[i][1] - t[i][3],
+                        };
+                        for (int j = 0; j < 4; j++)
+                            V[((i * 4 + j) * in_channels + c) * tiles + tile] = v[j];
+                    }
+                }
+            }
+        }
+
+        // elementwise products summed over channels, one GEMM per position
+        for (int xi = 0; xi < 16; xi++)
+        {
+            sgemm(false, false, out_channels, tiles, in_channels,
+                  1.0f, &transformed->data[xi * out_channels * in_channels], in_channels,
+                  &V[xi * in_channels * tiles], tiles,
+                  0.0f, &M[xi * out_channels * tiles], tiles);
+        }
+
+        // output transform
+        for (int f = 0; f < out_channels; f++)
+        {
+            float *out = &dst->data[(b * out_channels + f) * out_height * out_width];
+            float bias_f = bias == NULL ? 0.0f : bias->data[f];
+            for (int th = 0; th < tiles_h; th++)
+            {
+                for (int tw = 0; tw < tiles_w; tw++)
+                {
+                    int tile = th * tiles_w + tw;
+                    float m[4][4];
+                    for (int i = 0; i < 4; i++)
+                        for (int j = 0; j < 4; j++)
+                            m[i][j] = M[((i * 4 + j) * out_channels + f) * tiles + tile];
+
+                    // A^T m
+                    float t[2][4];
+                    for (int j = 0; j < 4; j++)
+                    {
+                        t[0][j] = m[0][j] + m[1][j] + m[2][j];
+                        t[1][j] = m[1][j] - m[2][j] - m[3][j];
+                    }
+
+                    // (A^T m) A, partial tiles on the border are cropped
+                    for (int i = 0; i < 2; i++)
+                    {
+                        int x = th * 2 + i;
+                        if (x >= out_height)
+                            break;
+
+                        float y0 = t[i][0] + t[i][1] + t[i][2];
+                        float y1 = t[i][1] - t[i][2] - t[i][3];
+
+                        out[x * out_width + tw * 2] = simd_activate(activation, y0 + bias_f);
+                        if (tw * 2 + 1 < out_width)
+                            out[x * out_width + tw * 2 + 1] = simd_activate(activation, y1 + bias_f);
+                    }
+                }
+            }
+        }
+    }
+
+    matrix_arena_put(V_buffer);
+    matrix_arena_put(M_buffer);
+
+    return dst;
+}
+
+// Function: matrix4_convolve_direct
+// ---------------------------------
+// Reference convolution computed with the direct nested loops.
+// Much slower than matrix4_convolve, kept to validate the fast paths.
+//
+// Parameters:
+//   weights - pointer to the weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
+//   input - pointer to the matrix of shape: (batch_size, in_channels, height, width)
+//   dst - pointer to the destination matrix (overwritten)
+//   stride - stride of the convolution
+//   padding - padding of the convolution
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve_direct(Matrix4 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding)
+{
+
+    int batch_size = input->dim1;
+    int in_channels = input->dim2;
+    int height = input->dim3;
+    int width = input->dim4;
+
+    int out_channels = weights->dim1;
+    int kernel_height = weights->dim3;
+    int kernel_width = weights->dim4;
+
+    int out_height = (height + 2 * padding - kernel_height) / stride + 1;
+    int out_width = (width + 2 * padding - kernel_width) / stride + 1;
+
+    if (dst == NULL)
+    {
+        dst = matrix4_init(batch_size, out_channels, out_height, out_width, NULL);
+    }
+
+    if (weights->dim2 != in_channels)
+    {
+        errx(EXIT_FAILURE, "matrix4_convolve_direct: input channels do not match\n");
+    }
+
+    if (dst->dim1 != batch_size || dst->dim2 != out_channels || dst->dim3 != out_height || dst->dim4 != out_width)
+    {
+        errx(EXIT_FAILURE, "matrix4_convolve_direct: output dimensions do not match\n");
+    }
+
+    assert_nchw(input, "matrix4_convolve_direct");
+    assert_nchw(dst, "matrix4_convolve_direct");
+
+    matrix4_zero(dst);
+
+    for (int i = 0; i < batch_size; i++)
+    {
+        for (int j = 0; j < out_channels; j++)
+        {
+            for (int k = 0; k < out_height; k++)
+            {
+                for (int l = 0; l < out_width; l++)
+                {
+                    for (int m = 0; m < in_channels; m++)
+                    {
+                        for (int n = 0; n < kernel_height; n++)
+                        {
+                            for (int o = 0; o < kernel_width; o++)
+                            {
+                                int x = k * stride + n - padding;
+                                int y = l * stride + o - padding;
+
+                                if (x >= 0 && x < height && y >= 0 && y < width)
+                                {
+                                    dst->data[i * out_channels * out_height * out_width + j * out_height * out_width + k * out_width + l] +=
+                                        weights->data[j * in_channels * kernel_height * kernel_width + m * kernel_height * kernel_width + n * kernel_width + o] *
+                                        input->data[i * in_channels * height * width + m * height * width + x * width + y];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return dst;
+}
+
+// Function: matrix4_col2im
+// ------------------------
+// Inverse of matrix4_im2col: scatters a column matrix back onto one image of
+// a batch, adding together the values of the kernel taps that overlap the
+// same input position. Values that fall on the padding are dropped.
+//
+// Parameters:
+//   col - source of shape: (in_channels * kernel_height * kernel_width, out_height * out_width)
+//   dst - pointer to the matrix of shape: (batch_size, in_channels, height, width)
+//   index - index of the image in the batch, added to (zero it first)
+//   kernel_height, kernel_width - size of the kernel
+//   stride - stride of the convolution
+//   padding - padding of the convolution
+//
+
+void matrix4_col2im(const float *col, Matrix4 *dst, int index, int kernel_height, int kernel_width, int stride, int padding)
+{
+    int in_channels = dst->dim2;
+    int height = dst->dim3;
+    int width = dst->dim4;
+
+    int out_height = (height + 2 * padding - kernel_height) / stride + 1;
+    int out_width = (width + 2 * padding - kernel_width) / stride + 1;
+
+    assert_nchw(dst, "matrix4_col2im");
+
+    float *image = &dst->data[index * in_channels * height * width];
+
+    for (int m = 0; m < in_channels; m++)
+    {
+        for (int n = 0; n < kernel_height; n++)
+        {
+            for (int o = 0; o < kernel_width; o++)
+            {
+                for (int k = 0; k < out_height; k++)
+                {
+                    int x = k * stride + n - padding;
+                    if (x < 0 || x >= height)
+                        continue;
+
+                    const float *row = &col[k * out_width];
+                    float *target = &image[m * height * width + x * width];
+                    for (int l = 0; l < out_width; l++)
+                    {
+                        int y = l * stride + o - padding;
+                        if (y >= 0 && y < width)
+                            target[y] += row[l];
+                    }
+                }
+                col += out_height * out_width;
+            }
+        }
+    }
+}
+
+// Function: matrix4_convolve_weights_grad
+// ---------------------------------------
+// Computes the gradient of the loss with respect to the weights of a
+// convolution. For every image, the output gradient, seen as an
+// (out_channels, out_height * out_width) matrix, is multiplied by the
+// transposed im2col lowering of the input and the products are summed over
+// the batch by the GEMM itself (beta = 1 after the first image).
+//
+// Parameters:
+//   input - pointer to the input of the convolution of shape: (batch_size, in_channels, height, width)
+//   grad_output - pointer to the gradient of the output of shape: (batch_size, out_channels, out_height, out_width)
+//   dst - pointer to the destination of shape: (out_channels, in_channels, kernel_height, kernel_width) (overwritten)
+//   stride - stride of the convolution
+//   padding - padding of the convolution
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve_weights_grad(Matrix4 *input, Matrix4 *grad_output, Matrix4 *dst, int stride, int padding)
+{
+    int batch_size = input->dim1;
+    int in_channels = input->dim2;
+    int out_channels = dst->dim1;
+    int kernel_height = dst->dim3;
+    int kernel_width = dst->dim4;
+
+    int out_height = (input->dim3 + 2 * padding - kernel_height) / stride + 1;
+    int out_width = (input->dim4 + 2 * padding - kernel_width) / stride + 1;
+
+    if (dst->dim2 != in_channels || grad_output->dim1 != batch_size || grad_output->dim2 != out_channels ||
+        grad_output->dim3 != out_height || grad_output->dim4 != out_width)
+    {
+        errx(EXIT_FAILURE, "matrix4_convolve_weights_grad: matrix dimensions do not match\n");
+    }
+
+    assert_nchw(input, "matrix4_convolve_weights_grad");
+    assert_nchw(grad_output, "matrix4_convolve_weights_grad");
+
+    int patch = in_channels * kernel_height * kernel_width;
+    int positions = out_height * out_width;
+    bool pointwise = kernel_height == 1 && kernel_width == 1 && stride == 1 && padding == 0;
+
+    Matrix *col_buffer = pointwise ? NULL : matrix_arena_get(patch, positions);
+
+    for (int i = 0; i < batch_size; i++)
+    {
+        float *image_col = &input->data[i * in_channels * input->dim3 * input->dim4];
+        if (!pointwise)
+        {
+            matrix4_im2col(input, i, kernel_height, kernel_width, stride, padding, col_buffer->data);
+            image_col = col_buffer->data;
+        }
+
+        // dst += grad_output[i] * col^T: (out_channels, positions) x (positions, patch)
+        sgemm(false, true, out_channels, patch, positions,
+              1.0f, &grad_output->data[i * out_channels * positions], positions,
+              image_col, positions,
+              i == 0 ? 0.0f : 1.0f, dst->data, patch);
+    }
+
+    if (batch_size == 0)
+        matrix4_zero(dst);
+    if (col_buffer != NULL)
+        matrix_arena_put(col_buffer);
+
+    return dst;
+}
+
+// Arguments of the input gradient, split over the images of the batch
+typedef struct
+{
+    Matrix4 *weights;
+    Matrix4 *grad_output;
+    Matrix4 *dst;
+    int stride;
+    int padding;
+} GradInputTask;
+
+// Computes the input gradient of the images [begin, end) of the batch
+static void grad_input_images(void *ctx, int begin, int end)
+{
+    GradInputTask *t = ctx;
+    Matrix4 *weights = t->weights;
+    Matrix4 *dst = t->dst;
+
+    int out_channels = weights->dim1;
+    int kernel_height = weights->dim3;
+    int kernel_width = weights->dim4;
+    int patch = weights->dim2 * kernel_height * kernel_width;
+    int positions = t->grad_output->dim3 * t->grad_output->dim4;
+    int image_size = dst->dim2 * dst->dim3 * dst->dim4;
+    bool pointwise = kernel_height == 1 && kernel_width == 1 && t->stride == 1 && t->padding == 0;
+
+    Matrix *col_buffer = pointwise ? NULL : matrix_arena_get(patch, positions);
+
+    for (int i = begin; i < end; i++)
+    {
+        // col = weights^T * grad_output[i]: (patch, out_channels) x (out_channels, positions)
+        float *col = pointwise ? &dst->data[i * image_size] : col_buffer->data;
+        sgemm(true, false, patch, positions, out_channels,
+              1.0f, weights->data, patch,
+              &t->grad_output->data[i * out_channels * positions], positions,
+              0.0f, col, positions);
+
+        if (!pointwise)
+        {
+            memset(&dst->data[i * image_size], 0, sizeof(float) * image_size);
+            matrix4_col2im(col, dst, i, kernel_height, kernel_width, t->stride, t->padding);
+        }
+    }
+
+    if (col_buffer != NULL)
+        matrix_arena_put(col_buffer);
+}
+
+// Function: matrix4_grad_input_convolve
+// -------------------------------------
+// Computes the gradient of the input of a convolution: every image of the
+// output gradient is multiplied by the transposed weights, seen as an
+// (in_channels * kernel_height * kernel_width, out_channels) matrix, and the
+// resulting columns are folded back onto the image with col2im.
+// Large batches are split over the thread pool like matrix4_convolve.
+//
+// Parameters:
+//   weights - pointer to the weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
+//   grad_output - pointer to the gradient of the output of shape: (batch_size, out_channels, out_height, out_width)
+//   dst - pointer to the destination of shape: (batch_size, in_channels, height, width) (overwritten),
+//         required since the input size cannot be recovered from a strided output
+//   stride - stride of the convolution
+//   padding - padding of the convolution
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_grad_input_convolve(Matrix4 *weights, Matrix4 *grad_output, Matrix4 *dst, int stride, int padding)
+{
+    if (dst == NULL)
+        errx(EXIT_FAILURE, "matrix4_grad_input_convolve: a destination matrix is required\n");
+
+    int batch_size = grad_output->dim1;
+    int out_height = (dst->dim3 + 2 * padding - weights->dim3) / stride + 1;
+    int out_width = (dst->dim4 + 2 * padding - weights->dim4) / stride + 1;
+
+    if (dst->dim1 != batch_size || dst->dim2 != weights->dim2 || grad_output->dim2 != weights->dim1 ||
+        grad_output->dim3 != out_height || grad_output->dim4 != out_width)
+    {
+        errx(EXIT_FAILURE, "matrix4_grad_input_convolve: matrix dimensions do not match\n");
+    }
+
+    assert_nchw(grad_output, "matrix4_grad_input_convolve");
+    assert_nchw(dst, "matrix4_grad_input_convolve");
+
+    GradInputTask task = {weights, grad_output, dst, stride, padding};
+    if (batch_size >= matrix_get_num_threads())
+        threadpool_parallel_for(batch_size, 1, grad_input_images, &task);
+    else
+        grad_input_images(&task, 0, batch_size);
+
+    return dst;
+}
+
+// Function: matrix4_multiply_scalar
+// ---------------------------------
 // Multiplies a matrix by a scalar.
 //
 // Parameters:
@@ -1111,8 +2483,7 @@ Matrix4 *matrix4_grad_input_convolve(Matrix4 *weights, Matrix4 *grad_output, Mat
 //
 void matrix4_multiply_scalar(Matrix4 *m, float s)
 {
-    for (int i = 0; i < m->size; i++)
-        m->data[i] *= s;
+    parallel_scalar(simd_kernels()->mul_scalar, m->data, s, m->data, m->size);
 }
 
 // Function: matrix4_map_function
@@ -1129,6 +2500,57 @@ void matrix4_map_function(Matrix4 *m, float(f)(float))
         m->data[i] = f(m->data[i]);
 }
 
+// shared by matrix4_activate and matrix4_activate_derivative
+static Matrix4 *activate4(Matrix4 *m, int kind, bool derivative, Matrix4 *dst, const char *name)
+{
+    SimdUnaryKernel kernel = activation_kernel(kind, derivative, name);
+
+    if (dst == NULL)
+        dst = matrix4_init_layout(m->dim1, m->dim2, m->dim3, m->dim4, m->layout);
+
+    if (m->dim1 != dst->dim1 || m->dim2 != dst->dim2 || m->dim3 != dst->dim3 || m->dim4 != dst->dim4 ||
+        m->layout != dst->layout)
+    {
+        errx(EXIT_FAILURE, "%s: matrix dimensions do not match\n", name);
+    }
+
+    parallel_unary(kernel, m->data, dst->data, dst->size);
+
+    return dst;
+}
+
+// Function: matrix4_activate
+// --------------------------
+// Applies a built-in activation with its vectorized kernel.
+//
+// Parameters:
+//   m - pointer to the matrix
+//   kind - one of ActivationKind, except ACTIVATION_CUSTOM
+//   dst - pointer to the destination matrix, may be m
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_activate(Matrix4 *m, int kind, Matrix4 *dst)
+{
+    return activate4(m, kind, false, dst, "matrix4_activate");
+}
+
+// Function: matrix4_activate_derivative
+// -------------------------------------
+// Computes the derivative of a built-in activation from its output.
+//
+// Parameters:
+//   m - pointer to the output of the activation
+//   kind - one of ActivationKind, except ACTIVATION_CUSTOM
+//   dst - pointer to the destination matrix, may be m
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_activate_derivative(Matrix4 *m, int kind, Matrix4 *dst)
+{
+    return activate4(m, kind, true, dst, "matrix4_activate_derivative");
+}
+
 // Function: matrix4_element_wise_equal
 // ------------------------------------
 // Checks if two matrices are element-wise equal.
@@ -1163,7 +2585,8 @@ bool matrix4_element_wise_equal(Matrix4 *m1, Matrix4 *m2)
 //
 void matrix4_destroy(Matrix4 *m)
 {
-    free(m->data);
+    if (m->owner)
+        aligned_free(m->data);
     free(m);
 }
 
@@ -1190,9 +2613,9 @@ void matrix4_print(Matrix4 *m)
                 printf("        [");
                 for (int l = 0; l < m->dim4 - 1; l++)
                 {
-                    printf("%f ", m->data[i * m->dim2 * m->dim3 * m->dim4 + j * m->dim3 * m->dim4 + k * m->dim4 + l]);
+                    printf("%f ", m->data[matrix4_offset(m, i, j, k, l)]);
                 }
-                printf("%f]\n", m->data[i * m->dim2 * m->dim3 * m->dim4 + j * m->dim3 * m->dim4 + k * m->dim4 + m->dim4 - 1]);
+                printf("%f]\n", m->data[matrix4_offset(m, i, j, k, m->dim4 - 1)]);
             }
             printf("        ]\n");
         }
@@ -1206,4 +2629,330 @@ void matrix4_printshape(Matrix4 *m)
     printf("dim1:%i, dim2:%i, dim3:%i, dim4:%i\n", m->dim1, m->dim2, m->dim3, m->dim4);
 }
 
-#pragma endregion matrix4
\ No newline at end of file
+#pragma endregion matrix4
+
+#pragma region matrix16
+
+// Function: matrix16_init
+// -----------------------
+// Allocates a matrix of 16-bit floats. 2D weights use dim3 = dim4 = 1.
+//
+// Parameters:
+//   dim1, dim2, dim3, dim4 - dimensions of the fp32 matrix it stands for
+//   storage - FLOAT_STORAGE_FP16 or FLOAT_STORAGE_BF16
+// Returns:
+//   pointer to a zeroed matrix
+
+Matrix16 *matrix16_init(int dim1, int dim2, int dim3, int dim4, int storage)
+{
+    if (storage != FLOAT_STORAGE_FP16 && storage != FLOAT_STORAGE_BF16)
+        errx(EXIT_FAILURE, "matrix16_init: storage must be fp16 or bf16\n");
+
+    Matrix16 *m = malloc(sizeof(Matrix16));
+    if (m == NULL)
+        malloc_error();
+
+    m->dim1 = dim1;
+    m->dim2 = dim2;
+    m->dim3 = dim3;
+    m->dim4 = dim4;
+    m->size = dim1 * dim2 * dim3 * dim4;
+    m->storage = storage;
+    m->data = (uint16_t *)aligned_floats((m->size + 1) / 2);
+
+    return m;
+}
+
+// Function: matrix16_convert
+// --------------------------
+// Rounds m->size fp32 values to the storage of m (to nearest even).
+//
+// Parameters:
+//   m - pointer to the destination matrix
+//   src - contiguous fp32 values, e.g. the data of a Matrix or Matrix4
+// Returns:
+//   m
+
+Matrix16 *matrix16_convert(Matrix16 *m, const float *src)
+{
+    const SimdKernels *simd = simd_kernels();
+    if (m->storage == FLOAT_STORAGE_FP16)
+        simd->to_fp16(src, m->data, m->size);
+    else
+        simd->to_bf16(src, m->data, m->size);
+    return m;
+}
+
+// Function: matrix16_widen
+// ------------------------
+// Converts the values of m back to fp32 (exactly).
+//
+// Parameters:
+//   m - pointer to the matrix
+//   dst - room for m->size floats
+// Returns:
+//   dst
+
+float *matrix16_widen(Matrix16 *m, float *dst)
+{
+    const SimdKernels *simd = simd_kernels();
+    if (m->storage == FLOAT_STORAGE_FP16)
+        simd->from_fp16(m->data, dst, m->size);
+    else
+        simd->from_bf16(m->data, dst, m->size);
+    return dst;
+}
+
+void matrix16_destroy(Matrix16 *m)
+{
+    aligned_free((float *)m->data);
+    free(m);
+}
+
+// Function: matrix_multiply_fused16
+// ---------------------------------
+// matrix_multiply_fused(m1, false, weights, true, bias, activation, dst) with
+// 16-bit weights: the GEMM widens each block of weights while packing it and
+// accumulates in fp32.
+//
+// Parameters:
+//   m1 - pointer to the input of shape: (batch_size, in_features)
+//   weights - pointer to the 16-bit weights of shape: (out_features, in_features)
+//   bias - contiguous matrix with out_features values, or NULL
+//   activation - one of ActivationKind
+//   dst - pointer to the destination of shape: (batch_size, out_features), or NULL
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix *matrix_multiply_fused16(Matrix *m1, Matrix16 *weights, Matrix *bias, int activation, Matrix *dst)
+{
+    if (dst == NULL)
+        dst = matrix_init(m1->dim1, weights->dim1, NULL);
+
+    if (weights->dim3 * weights->dim4 != 1 || m1->dim2 != weights->dim2 ||
+        dst->dim1 != m1->dim1 || dst->dim2 != weights->dim1)
+        errx(EXIT_FAILURE, "matrix_multiply_fused16: matrix dimensions do not match, expected output to be (%i, %i)\n",
+             m1->dim1, weights->dim1);
+
+    if (bias != NULL && (bias->size != weights->dim1 || (bias->stride != bias->dim2 && bias->dim1 != 1)))
+        errx(EXIT_FAILURE, "matrix_multiply_fused16: bias must be contiguous with %i values\n", weights->dim1);
+
+    GemmEpilogue epilogue = {bias == NULL ? NULL : bias->data, false, activation};
+    sgemm_mixed(false, true, m1->dim1, weights->dim1, m1->dim2,
+                1.0f, m1->data, FLOAT_STORAGE_FP32, m1->stride,
+                weights->data, weights->storage, weights->dim2,
+                0.0f, dst->data, dst->stride,
+                &epilogue);
+
+    return dst;
+}
+
+// Function: matrix4_convolve_fused16
+// ----------------------------------
+// matrix4_convolve_fused with 16-bit weights, through im2col and the GEMM
+// (fp32 accumulation). Only the NCHW layout is supported.
+//
+// Parameters:
+//   weights - pointer to the 16-bit weights of shape: (out_channels, in_channels, kernel_height, kernel_width)
+//   input, dst, stride, padding, bias, activation - see matrix4_convolve_fused
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix4 *matrix4_convolve_fused16(Matrix16 *weights, Matrix4 *input, Matrix4 *dst, int stride, int padding, Matrix *bias, int activation)
+{
+    int out_height = (input->dim3 + 2 * padding - weights->dim3) / stride + 1;
+    int out_width = (input->dim4 + 2 * padding - weights->dim4) / stride + 1;
+
+    if (dst == NULL)
+        dst = matrix4_init(input->dim1, weights->dim1, out_height, out_width, NULL);
+
+    if (weights->dim2 != input->dim2)
+        errx(EXIT_FAILURE, "matrix4_convolve_fused16: input channels do not match\n");
+
+    if (dst->dim1 != input->dim1 || dst->dim2 != weights->dim1 || dst->dim3 != out_height || dst->dim4 != out_width)
+        errx(EXIT_FAILURE, "matrix4_convolve_fused16: output dimensions do not match\n");
+
+    if (bias != NULL && bias->size != weights->dim1)
+        errx(EXIT_FAILURE, "matrix4_convolve_fused16: bias size does not match the output channels\n");
+
+    assert_nchw(dst, "matrix4_convolve_fused16");
+    convolve_im2col(weights->data, weights->storage, weights->dim3, weights->dim4,
+                    input, dst, stride, padding, bias, activation);
+    return dst;
+}
+
+#pragma endregion matrix16
+
+#pragma region sparse
+
+// rows of the transposed input accumulated together by the sparse_axpy kernel
+#define SPARSE_ROW_BLOCK SIMD_REDUCE_LANES
+
+// Function: sparse_matrix_from_dense
+// ----------------------------------
+// Builds the CSR form of a matrix, keeping only its non-zero elements.
+//
+// Parameters:
+//   m - pointer to the dense matrix (may be a view)
+// Returns:
+//   pointer to a new sparse matrix
+
+SparseMatrix *sparse_matrix_from_dense(Matrix *m)
+{
+    SparseMatrix *s = malloc(sizeof(SparseMatrix));
+    if (s == NULL)
+        malloc_error();
+
+    s->dim1 = m->dim1;
+    s->dim2 = m->dim2;
+    s->nnz = 0;
+    for (int i = 0; i < m->dim1; i++)
+        for (int j = 0; j < m->dim2; j++)
+            s->nnz += MAT(m, i, j) != 0.0f;
+
+    s->row_ptr = malloc(sizeof(int) * (m->dim1 + 1));
+    s->col_idx = malloc(sizeof(int) * (s->nnz > 0 ? s->nnz : 1));
+    s->values = malloc(sizeof(float) * (s->nnz > 0 ? s->nnz : 1));
+    if (s->row_ptr == NULL || s->col_idx == NULL || s->values == NULL)
+        malloc_error();
+
+    int p = 0;
+    for (int i = 0; i < m->dim1; i++)
+    {
+        s->row_ptr[i] = p;
+        for (int j = 0; j < m->dim2; j++)
+            if (MAT(m, i, j) != 0.0f)
+            {
+                s->col_idx[p] = j;
+                s->values[p] = MAT(m, i, j);
+                p++;
+            }
+    }
+    s->row_ptr[m->dim1] = p;
+
+    return s;
+}
+
+void sparse_matrix_destroy(SparseMatrix *m)
+{
+    free(m->row_ptr);
+    free(m->col_idx);
+    free(m->values);
+    free(m);
+}
+
+// Arguments of matrix_multiply_sparse_fused, split over the rows of the weights
+typedef struct
+{
+    SparseMatrix *weights;
+    const float *input; // (rows, cols), or (cols, padded rows) when transposed
+    int input_stride;
+    bool transposed;
+    int rows;
+    const float *bias;
+    int activation;
+    Matrix *dst;
+} SparseTask;
+
+// computes the output columns [begin, end) of every row
+static void sparse_outputs(void *ctx, int begin, int end)
+{
+    SparseTask *t = ctx;
+    SparseMatrix *w = t->weights;
+    Matrix *dst = t->dst;
+    const SimdKernels *simd = simd_kernels();
+
+    for (int o = begin; o < end; o++)
+    {
+        float bias = t->bias == NULL ? 0.0f : t->bias[o];
+        int start = w->row_ptr[o];
+        int stop = w->row_ptr[o + 1];
+
+        // a few rows: one gathered dot product per row
+        if (!t->transposed)
+        {
+            for (int i = 0; i < t->rows; i++)
+            {
+                const float *x = &t->input[i * t->input_stride];
+                float sum = 0.0f;
+                for (int p = start; p < stop; p++)
+                    sum += w->values[p] * x[w->col_idx[p]];
+                MAT(dst, i, o) = simd_activate(t->activation, sum + bias);
+            }
+            continue;
+        }
+
+        // batches: every non-zero scales a contiguous column of the
+        // transposed input, for a block of rows kept in registers
+        for (int r0 = 0; r0 < t->rows; r0 += SPARSE_ROW_BLOCK)
+        {
+            float acc[SPARSE_ROW_BLOCK] = {0.0f};
+            simd->sparse_axpy(&w->values[start], &w->col_idx[start], stop - start,
+                              &t->input[r0], t->input_stride, acc);
+
+            int rb = t->rows - r0 < SPARSE_ROW_BLOCK ? t->rows - r0 : SPARSE_ROW_BLOCK;
+            for (int r = 0; r < rb; r++)
+                MAT(dst, r0 + r, o) = simd_activate(t->activation, acc[r] + bias);
+        }
+    }
+}
+
+// Function: matrix_multiply_sparse_fused
+// --------------------------------------
+// matrix_multiply_fused(m1, false, weights, true, bias, activation, dst) with
+// CSR weights: only the non-zero weights are multiplied. Batches of
+// SPARSE_MIN_ROWS rows or more are transposed first so that the inner loop
+// runs over contiguous rows instead of gathering inputs.
+//
+// Parameters:
+//   m1 - pointer to the input of shape: (batch_size, in_features)
+//   weights - pointer to the sparse weights of shape: (out_features, in_features)
+//   bias - contiguous matrix with out_features values, or NULL
+//   activation - one of ActivationKind, ACTIVATION_CUSTOM is not supported
+//   dst - pointer to the destination of shape: (batch_size, out_features), or NULL
+// Returns:
+//   pointer to the resulting matrix
+
+Matrix *matrix_multiply_sparse_fused(Matrix *m1, SparseMatrix *weights, Matrix *bias, int activation, Matrix *dst)
+{
+    if (dst == NULL)
+        dst = matrix_init(m1->dim1, weights->dim1, NULL);
+
+    if (m1->dim2 != weights->dim2 || dst->dim1 != m1->dim1 || dst->dim2 != weights->dim1)
+        errx(EXIT_FAILURE, "matrix_multiply_sparse_fused: matrix dimensions do not match, expected output to be (%i, %i)\n",
+             m1->dim1, weights->dim1);
+
+    if (bias != NULL && (bias->size != weights->dim1 || (bias->stride != bias->dim2 && bias->dim1 != 1)))
+        errx(EXIT_FAILURE, "matrix_multiply_sparse_fused: bias must be contiguous with %i values\n", weights->dim1);
+
+    int rows = m1->dim1;
+    SparseTask task = {weights, m1->data, m1->stride, false, rows,
+                       bias == NULL ? NULL : bias->data, activation, dst};
+
+    Matrix *transposed = NULL;
+    if (rows >= SPARSE_MIN_ROWS)
+    {
+        // rows are padded to whole blocks so the inner loop has a fixed length
+        int padded = (rows + SPARSE_ROW_BLOCK - 1) / SPARSE_ROW_BLOCK * SPARSE_ROW_BLOCK;
+        transposed = matrix_arena_get(m1->dim2, padded);
+        for (int j = 0; j < m1->dim2; j++)
+        {
+            for (int i = 0; i < rows; i++)
+                transposed->data[j * padded + i] = MAT(m1, i, j);
+            for (int i = rows; i < padded; i++)
+                transposed->data[j * padded + i] = 0.0f;
+        }
+        task.input = transposed->data;
+        task.input_stride = padded;
+        task.transposed = true;
+    }
+
+    threadpool_parallel_for(weights->dim1, 8, sparse_outputs, &task);
+
+    if (transposed != NULL)
+        matrix_arena_put(transposed);
+
+    return dst;
+}
+
+#pragma endregion sparse
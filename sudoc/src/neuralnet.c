@@ -9,12 +9,35 @@ NN *nn_init(FCLayer **fc_layer, int num_fc_layers, ActivationLayer *output_layer
     neural_network->fc_layers = fc_layer;
     neural_network->num_fc_layers = num_fc_layers;
     neural_network->output_layer = output_layer;
+    neural_network->plan = NULL;
 
     return neural_network;
 }
 
+// the digit network of the solver, shared by the application, the training
+// and the quantization tools so that they all read the same weights
+NN *build_nn2(int batchsize)
+{
+    // define the layers
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *) * 4);
+    fc_layers[0] = fc_layer_init(28 * 28, 256, batchsize, relu, d_relu, "fc0");
+    fc_layers[1] = fc_layer_init(256, 256, batchsize, relu, d_relu, "fc1");
+    fc_layers[2] = fc_layer_init(256, 128, batchsize, relu, d_relu, "fc2");
+    fc_layers[3] = fc_layer_init(128, 10, batchsize, relu, d_relu, "fc3");
+
+    ActivationLayer *output_layer = activation_layer_init(10, batchsize, softmax, d_softmax);
+    int num_fc_layers = 4;
+
+    NN *network = nn_init(fc_layers, num_fc_layers, output_layer);
+    return network;
+}
+
 Matrix *nn_forward(NN *neural_network, Matrix *input)
 {
+    // the caller owns the result, compiled networks only copy the output
+    if (neural_network->plan != NULL)
+        return matrix_copy(nn_infer(neural_network, input), NULL);
+
     for (int i = 0; i < neural_network->num_fc_layers; i++)
         input = fc_layer_forward(neural_network->fc_layers[i], input);
 
@@ -30,27 +53,205 @@ int *nn_predict(NN *neural_network, Matrix *input)
     return pred;
 }
 
-void nn_backward(NN *neural_network, Matrix *input, Matrix *predictions, Matrix *labels, float learning_rate)
+// reallocates the buffers of every layer for batches of batch_size rows
+void nn_set_batch_size(NN *neural_network, int batch_size)
 {
-    Matrix *loss_deltas = matrix_subtract(predictions, labels, NULL);
-    Matrix *deltas = activation_layer_backward(neural_network->output_layer, loss_deltas);
+    if (neural_network->plan != NULL)
+        errx(EXIT_FAILURE, "nn_set_batch_size: the network is compiled for inference\n");
 
-    for (int i = neural_network->num_fc_layers - 1; i > 0; i--)
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_set_batch_size(neural_network->fc_layers[i], batch_size);
+    activation_layer_set_batch_size(neural_network->output_layer, batch_size);
+}
+
+// classifies the first n rows of inputs in a single forward pass, one GEMM
+// per layer for the whole batch. The network is resized to batches of n rows
+// if needed, compiled networks run batches of up to max_batch rows instead.
+// labels receives the predicted classes and confidences, if not NULL, their
+// probabilities.
+void nn_predict_batch(NN *neural_network, Matrix *inputs, int n, int *labels, float *confidences)
+{
+    if (n <= 0 || n > inputs->dim1)
+        errx(EXIT_FAILURE, "nn_predict_batch: cannot classify %d rows out of %d\n", n, inputs->dim1);
+
+    NNPlan *plan = neural_network->plan;
+    int batch = plan != NULL ? plan->max_batch : n;
+    if (plan == NULL)
+        nn_set_batch_size(neural_network, n);
+
+    for (int row = 0; row < n; row += batch)
+    {
+        int rows = n - row < batch ? n - row : batch;
+
+        // the output of the last layer is read in place, nothing is copied
+        Matrix input = matrix_view(inputs, row, 0, rows, inputs->dim2);
+        Matrix *y;
+        if (plan != NULL)
+            y = nn_infer(neural_network, &input);
+        else
+        {
+            Matrix *x = &input;
+            for (int i = 0; i < neural_network->num_fc_layers; i++)
+                x = fc_layer_forward(neural_network->fc_layers[i], x);
+            y = activation_layer_forward(neural_network->output_layer, x);
+        }
+
+        for (int i = 0; i < rows; i++)
+        {
+            int best = 0;
+            for (int j = 1; j < y->dim2; j++)
+                if (MAT(y, i, j) > MAT(y, i, best))
+                    best = j;
+            labels[row + i] = best;
+            if (confidences != NULL)
+                confidences[row + i] = MAT(y, i, best);
+        }
+    }
+}
+
+// Function: nn_compile_inference
+// ---
+// Turns the network into an inference-only one for batches of up to
+// max_batch rows. The activations, deltas and gradients of every layer are
+// freed and replaced by two buffers of max_batch rows of the widest layer,
+// which the layers use in turn. The weights are kept in place: their
+// (outputs, inputs) layout is already what the GEMM reads fastest for small
+// batches and what it packs for large ones.
+//
+// After the first call of nn_infer, which may convert the 16-bit or sparse
+// weights and size the GEMM scratch buffers, inference allocates nothing
+// (with a softmax output layer). The network cannot be trained anymore,
+// calling it again changes max_batch.
+//
+// Parameters:
+//   neural_network: network to compile
+//   max_batch: largest number of rows given to nn_infer
+void nn_compile_inference(NN *neural_network, int max_batch)
+{
+    if (max_batch <= 0)
+        errx(EXIT_FAILURE, "nn_compile_inference: invalid batch size %d\n", max_batch);
+
+    NNPlan *plan = neural_network->plan;
+    if (plan == NULL)
     {
-        deltas = fc_layer_backward(neural_network->fc_layers[i], neural_network->fc_layers[i - 1]->activations, deltas, learning_rate);
+        plan = malloc(sizeof(NNPlan));
+        if (plan == NULL)
+            errx(EXIT_FAILURE, "nn_compile_inference: failed to allocate the plan\n");
+        neural_network->plan = plan;
+    }
+    else
+    {
+        matrix_destroy(plan->buffers[0]);
+        matrix_destroy(plan->buffers[1]);
     }
-    deltas = fc_layer_backward(neural_network->fc_layers[0], input, deltas, learning_rate);
 
-    matrix_destroy(loss_deltas);
+    plan->max_batch = max_batch;
+    plan->width = 0;
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+    {
+        FCLayer *layer = neural_network->fc_layers[i];
+        if (layer->output_size > plan->width)
+            plan->width = layer->output_size;
+        fc_layer_release_training(layer);
+    }
+    activation_layer_release_training(neural_network->output_layer);
+
+    plan->buffers[0] = matrix_init(max_batch, plan->width, NULL);
+    plan->buffers[1] = matrix_init(max_batch, plan->width, NULL);
+    plan->output = (Matrix){0, 0, 0, plan->buffers[0]->data, 0, false};
+}
+
+// Function: nn_infer
+// ---
+// Forward pass of a compiled network, see nn_compile_inference.
+//
+// Parameters:
+//   neural_network: compiled network
+//   input: up to max_batch rows
+//
+// Returns:
+//   the output probabilities, inside the plan: valid until the next call,
+//   not to be destroyed
+Matrix *nn_infer(NN *neural_network, Matrix *input)
+{
+    NNPlan *plan = neural_network->plan;
+    if (plan == NULL)
+        errx(EXIT_FAILURE, "nn_infer: the network is not compiled for inference\n");
+    if (input->dim1 > plan->max_batch)
+        errx(EXIT_FAILURE, "nn_infer: %d rows for a plan of at most %d\n", input->dim1, plan->max_batch);
+
+    // contiguous (rows, outputs) matrices over the two buffers
+    int rows = input->dim1;
+    Matrix outputs[2];
+    Matrix *x = input;
+    for (int i = 0; i <= neural_network->num_fc_layers; i++)
+    {
+        bool last = i == neural_network->num_fc_layers;
+        int width = last ? neural_network->output_layer->input_size : neural_network->fc_layers[i]->output_size;
+        Matrix *y = &outputs[i % 2];
+        *y = (Matrix){rows, width, rows * width, plan->buffers[i % 2]->data, width, false};
+
+        if (last)
+            activation_layer_infer(neural_network->output_layer, x, y);
+        else
+            fc_layer_infer(neural_network->fc_layers[i], x, y);
+        x = y;
+    }
+
+    plan->output = *x;
+    return &plan->output;
+}
+
+void nn_backward(NN *neural_network, Matrix *input, Matrix *predictions, Matrix *labels, float learning_rate)
+{
+    (void)predictions; // the output layer kept them from the forward pass
+    nn_gradients(neural_network, input, labels);
+    nn_update(neural_network, learning_rate);
+}
+
+// gradients of every layer for the last forward pass, without changing the
+// weights. Deltas go through the weights of that forward pass either way, so
+// updating afterwards gives the same weights as nn_backward.
+void nn_gradients(NN *neural_network, Matrix *input, Matrix *labels)
+{
+    if (neural_network->plan != NULL)
+        errx(EXIT_FAILURE, "nn_gradients: the network is compiled for inference\n");
+
+    Matrix *deltas = activation_layer_loss_backward(neural_network->output_layer, labels);
+
+    for (int i = neural_network->num_fc_layers - 1; i > 0; i--)
+        deltas = fc_layer_gradients(neural_network->fc_layers[i], neural_network->fc_layers[i - 1]->activations, deltas);
+    fc_layer_gradients(neural_network->fc_layers[0], input, deltas);
+}
+
+// applies the gradients of nn_gradients to the weights
+void nn_update(NN *neural_network, float learning_rate)
+{
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_update(neural_network->fc_layers[i], learning_rate);
+}
+
+// applies the gradients of nn_gradients with an optimizer, see optimizer.c
+void nn_optimize(NN *neural_network, Optimizer *optimizer)
+{
+    if (neural_network->plan != NULL)
+        errx(EXIT_FAILURE, "nn_optimize: the network is compiled for inference\n");
+
+    optimizer_begin_step(optimizer);
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_apply(neural_network->fc_layers[i], optimizer);
 }
 
 double nn_train_batch(NN *neural_network, Matrix *input, Matrix *labels, float learning_rate)
 {
+    // scratch matrices of the batch are pooled and reused by the next one
+    matrix_arena_begin();
     Matrix *predictions = nn_forward(neural_network, input);
     // matrix_print(predictions);
     double loss = cross_entropy_loss(predictions, labels);
     nn_backward(neural_network, input, predictions, labels, learning_rate);
     matrix_destroy(predictions);
+    matrix_arena_end();
     return loss;
 }
 
@@ -60,10 +261,31 @@ void nn_destroy(NN *neural_network)
         fc_layer_destroy(neural_network->fc_layers[i]);
     activation_layer_destroy(neural_network->output_layer);
 
+    if (neural_network->plan != NULL)
+    {
+        matrix_destroy(neural_network->plan->buffers[0]);
+        matrix_destroy(neural_network->plan->buffers[1]);
+        free(neural_network->plan);
+    }
+
     free(neural_network->fc_layers);
     free(neural_network);
 }
 
+// stores the weights read by inference as storage, one of FloatStorage
+void nn_set_weight_storage(NN *neural_network, int storage)
+{
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_set_weight_storage(neural_network->fc_layers[i], storage);
+}
+
+// prunes the fully connected layer i to sparsity[i], see fc_layer_prune
+void nn_prune(NN *neural_network, const float *sparsity)
+{
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_prune(neural_network->fc_layers[i], sparsity[i]);
+}
+
 #pragma endregion nn
 
 #pragma region cnn
@@ -94,50 +316,87 @@ Matrix *cnn_forward(CNN *neural_network, Matrix4 *input)
     for (int i = 0; i < neural_network->num_conv_layers; i++)
         input = conv_layer_forward(neural_network->conv_layers[i], input);
 
-    Matrix *flattenned = matrix4_flatten(input, NULL);
-    Matrix *y = flattenned; // keep track of the matrix so we can free it later
+    // blocked conv layers only go back to NCHW once, before the dense part
+    Matrix4 *reordered = NULL;
+    if (input->layout != MATRIX4_NCHW)
+    {
+        reordered = matrix4_arena_get(input->dim1, input->dim2, input->dim3, input->dim4, MATRIX4_NCHW);
+        input = matrix4_reorder(input, MATRIX4_NCHW, reordered);
+    }
+
+    // the dense layers read the conv output in place
+    Matrix flattenned = matrix4_flatten_view(input);
+    Matrix *y = &flattenned;
 
     for (int i = 0; i < neural_network->num_fc_layers; i++)
         y = fc_layer_forward(neural_network->fc_layers[i], y);
 
     y = activation_layer_forward(neural_network->output_layer, y);
 
-    matrix_destroy(flattenned);
+    if (reordered != NULL)
+        matrix4_arena_put(reordered);
     return matrix_copy(y, NULL);
 }
 
 void cnn_backward(CNN *neural_network, Matrix4 *input, Matrix *predictions, Matrix *labels, float learning_rate)
 {
-    Matrix *loss_deltas = matrix_subtract(predictions, labels, NULL);
-    Matrix *deltas = activation_layer_backward(neural_network->output_layer, loss_deltas);
+    (void)predictions; // the output layer kept them from the forward pass
+    cnn_gradients(neural_network, input, labels);
+    cnn_update(neural_network, learning_rate);
+}
+
+// gradients of every layer for the last forward pass, see nn_gradients
+void cnn_gradients(CNN *neural_network, Matrix4 *input, Matrix *labels)
+{
+    Matrix *deltas = activation_layer_loss_backward(neural_network->output_layer, labels);
 
     for (int i = neural_network->num_fc_layers - 1; i > 0; i--)
-        deltas = fc_layer_backward(neural_network->fc_layers[i], neural_network->fc_layers[i - 1]->activations, deltas, learning_rate);
+        deltas = fc_layer_gradients(neural_network->fc_layers[i], neural_network->fc_layers[i - 1]->activations, deltas);
 
     // fc_input is the output of conv layers forward
-    Matrix *fc_input = matrix4_flatten(neural_network->conv_layers[neural_network->num_conv_layers - 1]->activations, NULL);
-    deltas = fc_layer_backward(neural_network->fc_layers[0], fc_input, deltas, learning_rate);
-
     ConvLayer *last_conv_layer = neural_network->conv_layers[neural_network->num_conv_layers - 1];
+    Matrix fc_input = matrix4_flatten_view(last_conv_layer->activations);
+    deltas = fc_layer_gradients(neural_network->fc_layers[0], &fc_input, deltas);
 
-    Matrix4 *deltas4 = matrix4_unflatten(deltas, last_conv_layer->outgrad);
+    // the deltas of the first dense layer are read in place as conv deltas
+    Matrix4 deltas_view = matrix4_unflatten_view(deltas, last_conv_layer->n_filters, last_conv_layer->output_height, last_conv_layer->output_width);
+    Matrix4 *deltas4 = &deltas_view;
     for (int i = neural_network->num_conv_layers - 1; i > 0; i--)
-        deltas4 = conv_layer_backward(neural_network->conv_layers[i], neural_network->conv_layers[i - 1]->activations, deltas4, learning_rate);
+        deltas4 = conv_layer_gradients(neural_network->conv_layers[i], neural_network->conv_layers[i - 1]->activations, deltas4);
+
+    conv_layer_gradients(neural_network->conv_layers[0], input, deltas4);
+}
 
-    deltas4 = conv_layer_backward(neural_network->conv_layers[0], input, deltas4, learning_rate);
+// applies the gradients of cnn_gradients to the weights
+void cnn_update(CNN *neural_network, float learning_rate)
+{
+    for (int i = 0; i < neural_network->num_conv_layers; i++)
+        conv_layer_update(neural_network->conv_layers[i], learning_rate);
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_update(neural_network->fc_layers[i], learning_rate);
+}
 
-    matrix_destroy(fc_input);
-    matrix_destroy(loss_deltas);
+// applies the gradients of cnn_gradients with an optimizer, see nn_optimize
+void cnn_optimize(CNN *neural_network, Optimizer *optimizer)
+{
+    optimizer_begin_step(optimizer);
+    for (int i = 0; i < neural_network->num_conv_layers; i++)
+        conv_layer_apply(neural_network->conv_layers[i], optimizer);
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_apply(neural_network->fc_layers[i], optimizer);
 }
 
 double cnn_train_batch(CNN *neural_network, Matrix4 *input, Matrix *labels, float learning_rate)
 {
+    // scratch matrices of the batch are pooled and reused by the next one
+    matrix_arena_begin();
     Matrix *predictions = cnn_forward(neural_network, input);
     // matrix_print(predictions);
     double loss = mean_squared_error(predictions, labels);
     // printf("loss: %f\n", loss);
     cnn_backward(neural_network, input, predictions, labels, learning_rate);
     matrix_destroy(predictions);
+    matrix_arena_end();
     return loss;
 }
 
@@ -155,6 +414,15 @@ void cnn_destroy(CNN *neural_network)
     free(neural_network);
 }
 
+// stores the weights read by inference as storage, see nn_set_weight_storage
+void cnn_set_weight_storage(CNN *neural_network, int storage)
+{
+    for (int i = 0; i < neural_network->num_conv_layers; i++)
+        conv_layer_set_weight_storage(neural_network->conv_layers[i], storage);
+    for (int i = 0; i < neural_network->num_fc_layers; i++)
+        fc_layer_set_weight_storage(neural_network->fc_layers[i], storage);
+}
+
 #pragma endregion cnn
 
 #pragma region load_save
@@ -219,6 +487,8 @@ bool fc_layer_load_weights(const char *filename, FCLayer *layer)
     }
 
     fclose(fp);
+    layer->weights16_stale = true;
+    layer->sparse_stale = true;
     return true;
 }
 
@@ -280,6 +550,9 @@ bool conv_layer_load_weights(const char *filename, ConvLayer *layer)
     }
 
     fclose(fp);
+    layer->winograd_stale = true;
+    layer->weights16_stale = true;
+    layer->blocked_stale = true;
     return true;
 }
 
@@ -0,0 +1,170 @@
+#include "../include/optimizer.h"
+
+/*
+Optimizers of the training steps.
+
+An Optimizer holds the update rule and its hyperparameters, the layers keep
+the state of their parameters (OptimizerState) next to them, and one call of
+nn_optimize / cnn_optimize applies the gradients of the last nn_gradients:
+
+    Optimizer adam = optimizer_adam(0.001f, 0.9f, 0.999f, 1e-8f);
+    for (...)
+    {
+        Matrix *predictions = nn_forward(network, input);
+        nn_gradients(network, input, labels);
+        nn_optimize(network, &adam);
+        matrix_destroy(predictions);
+    }
+
+Every rule is a single fused pass over a parameter tensor, which reads the
+gradient and the state once and writes the parameters and the state back,
+instead of one pass per matrix operation. The SIMD levels give the same
+results, see simd.h.
+
+With v the velocity and m, v the moments of Adam:
+
+    SGD         p = p - lr * g
+    momentum    v = momentum * v + g, p = p - lr * v
+    Nesterov    v = momentum * v + g, p = p - lr * (g + momentum * v)
+    Adam        m = beta1 * m + (1 - beta1) * g
+                v = beta2 * v + (1 - beta2) * g^2
+                p = p - lr * m_hat / (sqrt(v_hat) + epsilon)
+
+where m_hat and v_hat are the moments divided by 1 - beta^t at step t. The
+weight decay is decoupled (AdamW): the weights are first scaled by
+1 - lr * weight_decay, the biases are not decayed.
+*/
+
+static Optimizer optimizer_new(int kind, float learning_rate)
+{
+    Optimizer optimizer = {0};
+    optimizer.kind = kind;
+    optimizer.learning_rate = learning_rate;
+    return optimizer;
+}
+
+/// @brief Plain SGD, the update of nn_train_batch.
+Optimizer optimizer_sgd(float learning_rate)
+{
+    return optimizer_new(OPTIMIZER_SGD, learning_rate);
+}
+
+/// @brief SGD with momentum, 0.9 is the usual momentum.
+/// @param nesterov whether the step looks ahead along the velocity
+Optimizer optimizer_momentum(float learning_rate, float momentum, bool nesterov)
+{
+    Optimizer optimizer = optimizer_new(nesterov ? OPTIMIZER_NESTEROV : OPTIMIZER_MOMENTUM, learning_rate);
+    optimizer.momentum = momentum;
+    return optimizer;
+}
+
+/// @brief Adam, usually with beta1 0.9, beta2 0.999 and epsilon 1e-8.
+Optimizer optimizer_adam(float learning_rate, float beta1, float beta2, float epsilon)
+{
+    Optimizer optimizer = optimizer_new(OPTIMIZER_ADAM, learning_rate);
+    optimizer.beta1 = beta1;
+    optimizer.beta2 = beta2;
+    optimizer.epsilon = epsilon;
+    return optimizer;
+}
+
+/// @brief Adam with decoupled weight decay.
+Optimizer optimizer_adamw(float learning_rate, float beta1, float beta2, float epsilon, float weight_decay)
+{
+    Optimizer optimizer = optimizer_adam(learning_rate, beta1, beta2, epsilon);
+    optimizer.weight_decay = weight_decay;
+    return optimizer;
+}
+
+/// @brief Starts a step: computes the coefficients of the kernels for the
+/// current learning rate and the bias correction of Adam.
+void optimizer_begin_step(Optimizer *optimizer)
+{
+    optimizer->step++;
+
+    SimdOptimizerStep *s = &optimizer->coefficients;
+    s->learning_rate = optimizer->learning_rate;
+    s->decay = 1.0f - optimizer->learning_rate * optimizer->weight_decay;
+    s->momentum = optimizer->kind == OPTIMIZER_ADAM ? optimizer->beta1 : optimizer->momentum;
+    s->beta2 = optimizer->beta2;
+    s->epsilon = optimizer->epsilon;
+    s->step_size = optimizer->learning_rate;
+    s->correction2 = 1.0f;
+    if (optimizer->kind == OPTIMIZER_ADAM)
+    {
+        s->step_size = optimizer->learning_rate / (1.0 - pow(optimizer->beta1, optimizer->step));
+        s->correction2 = 1.0 / (1.0 - pow(optimizer->beta2, optimizer->step));
+    }
+}
+
+// Arguments of step_range
+typedef struct
+{
+    const Optimizer *optimizer;
+    SimdOptimizerStep coefficients;
+    float *params;
+    const float *gradient;
+    float **moments;
+} StepTask;
+
+static void step_range(void *ctx, int begin, int end)
+{
+    StepTask *task = ctx;
+    const SimdKernels *simd = simd_kernels();
+    const SimdOptimizerStep *s = &task->coefficients;
+    float *params = &task->params[begin];
+    const float *gradient = &task->gradient[begin];
+    int n = end - begin;
+
+    switch (task->optimizer->kind)
+    {
+    case OPTIMIZER_SGD:
+        simd->sgd_step(params, gradient, n, s);
+        break;
+    case OPTIMIZER_MOMENTUM:
+        simd->momentum_step(params, gradient, &task->moments[0][begin], n, s);
+        break;
+    case OPTIMIZER_NESTEROV:
+        simd->nesterov_step(params, gradient, &task->moments[0][begin], n, s);
+        break;
+    case OPTIMIZER_ADAM:
+        simd->adam_step(params, gradient, &task->moments[0][begin], &task->moments[1][begin], n, s);
+        break;
+    }
+}
+
+/// @brief Applies the step started by optimizer_begin_step to a parameter tensor.
+/// @param params the size parameters, updated in place
+/// @param gradient their gradient, left unchanged
+/// @param state state of the parameters for this optimizer
+/// @param decays whether the weight decay applies (weights, not biases)
+void optimizer_step(Optimizer *optimizer, float *params, const float *gradient, int size,
+                    OptimizerState *state, bool decays)
+{
+    if (optimizer->step == 0)
+        errx(EXIT_FAILURE, "optimizer_step: optimizer_begin_step was not called\n");
+
+    int num_moments = optimizer->kind == OPTIMIZER_ADAM ? 2 : optimizer->kind == OPTIMIZER_SGD ? 0 : 1;
+    for (int i = 0; i < num_moments; i++)
+        if (state->moments[i] == NULL)
+        {
+            state->moments[i] = calloc(size, sizeof(float));
+            if (state->moments[i] == NULL)
+                errx(EXIT_FAILURE, "optimizer_step: failed to allocate the state\n");
+        }
+
+    StepTask task = {optimizer, optimizer->coefficients, params, gradient, state->moments};
+    if (!decays)
+        task.coefficients.decay = 1.0f;
+    threadpool_parallel_for(size, OPTIMIZER_MIN_CHUNK, step_range, &task);
+}
+
+/// @brief Frees the state, the next step starts from zero moments.
+void optimizer_state_reset(OptimizerState *state)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        free(state->moments[i]);
+        state->moments[i] = NULL;
+    }
+}
@@ -0,0 +1,405 @@
+#include <string.h>
+#include "../include/quantize.h"
+
+/*
+Post-training int8 quantization of an NN.
+
+Weights are quantized symmetrically, w ~= q * scale with q in [-127, 127],
+with one scale per output neuron (per channel) or a single one per layer.
+The input of every layer is quantized the same way with one scale,
+calibrated as the largest absolute value the layer receives when the fp32
+network runs on sample inputs.
+
+qnn_forward() multiplies int8 inputs and weights with int32 accumulation.
+Each accumulator is rescaled once (input scale * weight scale), the fp32
+bias and the activation are applied, and the result is requantized with
+the input scale of the next layer. Only the last layer outputs fp32, for
+the output activation (softmax).
+*/
+
+// longest input whose int8 dot products can not overflow an int32
+#define QUANTIZE_MAX_INPUT (INT32_MAX / (QUANTIZE_MAX * QUANTIZE_MAX))
+
+// scale mapping [-max, max] to [-QUANTIZE_MAX, QUANTIZE_MAX]
+static float scale_of(float max)
+{
+    return max > 0.0f ? max / QUANTIZE_MAX : 1.0f;
+}
+
+// rounds x / scale to the nearest int8, saturating
+static int8_t quantize_value(float x, float inv_scale)
+{
+    float q = nearbyintf(x * inv_scale);
+    q = q > QUANTIZE_MAX ? QUANTIZE_MAX : q;
+    q = q < -QUANTIZE_MAX ? -QUANTIZE_MAX : q;
+    return (int8_t)q;
+}
+
+static float max_abs(const float *data, int n)
+{
+    float max = 0.0f;
+    for (int i = 0; i < n; i++)
+        max = fabsf(data[i]) > max ? fabsf(data[i]) : max;
+    return max;
+}
+
+static float matrix_max_abs(Matrix *m)
+{
+    float max = 0.0f;
+    for (int i = 0; i < m->dim1; i++)
+    {
+        float row = max_abs(&m->data[i * m->stride], m->dim2);
+        max = row > max ? row : max;
+    }
+    return max;
+}
+
+static void quantize_layer(FCLayer *layer, float input_range, bool per_channel, QFCLayer *q)
+{
+    if (layer->input_size > QUANTIZE_MAX_INPUT)
+        errx(EXIT_FAILURE, "qnn_quantize: %s has too many inputs for int32 accumulation\n", layer->name);
+
+    q->input_size = layer->input_size;
+    q->output_size = layer->output_size;
+    q->activation = layer->activation;
+    q->activation_func = layer->activation_func;
+    q->input_scale = scale_of(input_range);
+
+    q->weights = malloc(sizeof(int8_t) * layer->weights->size);
+    q->weight_scales = malloc(sizeof(float) * q->output_size);
+    q->biases = malloc(sizeof(float) * q->output_size);
+    if (q->weights == NULL || q->weight_scales == NULL || q->biases == NULL)
+        errx(EXIT_FAILURE, "qnn_quantize: failed to allocate %s\n", layer->name);
+
+    memcpy(q->biases, layer->biases->data, sizeof(float) * q->output_size);
+
+    float layer_max = matrix_max_abs(layer->weights);
+    for (int o = 0; o < q->output_size; o++)
+    {
+        const float *row = &layer->weights->data[o * layer->weights->stride];
+        q->weight_scales[o] = scale_of(per_channel ? max_abs(row, q->input_size) : layer_max);
+
+        float inv_scale = 1.0f / q->weight_scales[o];
+        for (int k = 0; k < q->input_size; k++)
+            q->weights[o * q->input_size + k] = quantize_value(row[k], inv_scale);
+    }
+}
+
+/// @brief Quantizes the weights of a network to int8 and calibrates the
+/// scales of the layer inputs by running the fp32 network on samples.
+/// @param network fp32 network, left unchanged
+/// @param calibration sample inputs, one per row, run in batches of the
+/// network's batch size (at least one full batch)
+/// @param per_channel one weight scale per output neuron instead of per layer
+/// @return the int8 network, to free with qnn_destroy
+QNN *qnn_quantize(NN *network, Matrix *calibration, bool per_channel)
+{
+    if (network->plan != NULL)
+        errx(EXIT_FAILURE, "qnn_quantize: calibration needs the activations of a network not compiled for inference\n");
+
+    int num_layers = network->num_fc_layers;
+    int batch_size = network->fc_layers[0]->activations->dim1;
+    if (calibration->dim1 < batch_size)
+        errx(EXIT_FAILURE, "qnn_quantize: at least %d calibration samples are needed\n", batch_size);
+
+    float *ranges = calloc(num_layers, sizeof(float));
+    if (ranges == NULL)
+        errx(EXIT_FAILURE, "qnn_quantize: failed to allocate the ranges\n");
+
+    for (int row = 0; row + batch_size <= calibration->dim1; row += batch_size)
+    {
+        Matrix batch = matrix_view(calibration, row, 0, batch_size, calibration->dim2);
+        matrix_destroy(nn_forward(network, &batch));
+
+        // the layers keep their outputs, which are the inputs of the next ones
+        for (int l = 0; l < num_layers; l++)
+        {
+            float range = matrix_max_abs(l == 0 ? &batch : network->fc_layers[l - 1]->activations);
+            ranges[l] = range > ranges[l] ? range : ranges[l];
+        }
+    }
+
+    QNN *q = malloc(sizeof(QNN));
+    if (q == NULL)
+        errx(EXIT_FAILURE, "qnn_quantize: failed to allocate the network\n");
+
+    q->num_layers = num_layers;
+    q->output_func = network->output_layer->activation_func;
+    q->layers = malloc(sizeof(QFCLayer) * num_layers);
+    if (q->layers == NULL)
+        errx(EXIT_FAILURE, "qnn_quantize: failed to allocate the layers\n");
+
+    for (int l = 0; l < num_layers; l++)
+        quantize_layer(network->fc_layers[l], ranges[l], per_channel, &q->layers[l]);
+
+    free(ranges);
+    return q;
+}
+
+// Arguments of a layer of qnn_forward, split over the outputs
+typedef struct
+{
+    QFCLayer *layer;
+    const int8_t *input; // (rows, input_size)
+    int rows;
+    int8_t *output;       // (rows, output_size), requantized for the next layer
+    float next_inv_scale; // 1 / input scale of the next layer
+    float *logits;        // fp32 output of the last layer instead of output
+} QLayerTask;
+
+// computes the outputs [begin, end) of every row
+static void qfc_outputs(void *ctx, int begin, int end)
+{
+    QLayerTask *t = ctx;
+    QFCLayer *l = t->layer;
+    const SimdKernels *simd = simd_kernels();
+
+    for (int o = begin; o < end; o++)
+    {
+        const int8_t *w = &l->weights[o * l->input_size];
+        float scale = l->input_scale * l->weight_scales[o];
+
+        for (int i = 0; i < t->rows; i++)
+        {
+            int32_t acc = simd->dot_i8(&t->input[i * l->input_size], w, l->input_size);
+            float y = (float)acc * scale + l->biases[o];
+            y = l->activation == ACTIVATION_CUSTOM ? l->activation_func(y) : simd_activate(l->activation, y);
+
+            if (t->logits != NULL)
+                t->logits[i * l->output_size + o] = y;
+            else
+                t->output[i * l->output_size + o] = quantize_value(y, t->next_inv_scale);
+        }
+    }
+}
+
+/// @brief Runs the int8 network on a batch of any size.
+/// @param input fp32 inputs, one per row
+/// @return a new matrix with the outputs of the network, one row per input
+Matrix *qnn_forward(QNN *network, Matrix *input)
+{
+    QFCLayer *first = &network->layers[0];
+    QFCLayer *last = &network->layers[network->num_layers - 1];
+    if (input->dim2 != first->input_size)
+        errx(EXIT_FAILURE, "qnn_forward: expected %d inputs, got %d\n", first->input_size, input->dim2);
+
+    int rows = input->dim1;
+    int width = 0;
+    for (int l = 0; l < network->num_layers; l++)
+    {
+        QFCLayer *layer = &network->layers[l];
+        width = layer->input_size > width ? layer->input_size : width;
+        width = layer->output_size > width ? layer->output_size : width;
+    }
+
+    int8_t *a = malloc(sizeof(int8_t) * rows * width);
+    int8_t *b = malloc(sizeof(int8_t) * rows * width);
+    if (a == NULL || b == NULL)
+        errx(EXIT_FAILURE, "qnn_forward: failed to allocate the activations\n");
+
+    float inv_scale = 1.0f / first->input_scale;
+    for (int i = 0; i < rows; i++)
+        for (int k = 0; k < input->dim2; k++)
+            a[i * first->input_size + k] = quantize_value(input->data[i * input->stride + k], inv_scale);
+
+    Matrix *logits = matrix_init(rows, last->output_size, NULL);
+    for (int l = 0; l < network->num_layers; l++)
+    {
+        QFCLayer *layer = &network->layers[l];
+        bool is_last = l == network->num_layers - 1;
+        QLayerTask task = {layer, a, rows, b,
+                           is_last ? 0.0f : 1.0f / network->layers[l + 1].input_scale,
+                           is_last ? logits->data : NULL};
+        threadpool_parallel_for(layer->output_size, 16, qfc_outputs, &task);
+
+        int8_t *tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    free(a);
+    free(b);
+
+    if (network->output_func == NULL)
+        return logits;
+
+    Matrix *y = network->output_func(logits);
+    matrix_destroy(logits);
+    return y;
+}
+
+int *qnn_predict(QNN *network, Matrix *input)
+{
+    Matrix *predictions = qnn_forward(network, input);
+    int *pred = matrix_argmax(predictions);
+    matrix_destroy(predictions);
+    return pred;
+}
+
+/// @brief Compares the int8 network with the fp32 one it comes from.
+/// @param inputs samples, one per row, run in batches of the reference's
+/// batch size (rows past the last full batch are ignored)
+/// @param labels expected class of each sample
+QuantizeReport qnn_evaluate(QNN *network, NN *reference, Matrix *inputs, const int *labels)
+{
+    QuantizeReport report = {0};
+    int batch_size = reference->fc_layers[0]->activations->dim1;
+    int fp32_correct = 0, int8_correct = 0, agree = 0;
+
+    for (int row = 0; row + batch_size <= inputs->dim1; row += batch_size)
+    {
+        Matrix batch = matrix_view(inputs, row, 0, batch_size, inputs->dim2);
+        Matrix *expected = nn_forward(reference, &batch);
+        Matrix *got = qnn_forward(network, &batch);
+        int *expected_class = matrix_argmax(expected);
+        int *got_class = matrix_argmax(got);
+
+        for (int i = 0; i < batch_size; i++)
+        {
+            fp32_correct += expected_class[i] == labels[row + i];
+            int8_correct += got_class[i] == labels[row + i];
+            agree += expected_class[i] == got_class[i];
+        }
+        for (int i = 0; i < got->size; i++)
+        {
+            float diff = fabsf(got->data[i] - expected->data[i]);
+            report.max_abs_diff = diff > report.max_abs_diff ? diff : report.max_abs_diff;
+        }
+        report.samples += batch_size;
+
+        matrix_destroy(expected);
+        matrix_destroy(got);
+        free(expected_class);
+        free(got_class);
+    }
+
+    if (report.samples > 0)
+    {
+        report.fp32_accuracy = (float)fp32_correct / report.samples;
+        report.int8_accuracy = (float)int8_correct / report.samples;
+        report.agreement = (float)agree / report.samples;
+    }
+    return report;
+}
+
+// Every layer is saved in basename/qfc_<index>.weights as text:
+//   input_size output_size activation input_scale
+//   weight_scales
+//   weights
+//   biases
+// scales and biases are written with all their digits so that a loaded
+// network computes exactly the same outputs.
+void qnn_save(QNN *network, const char *basename)
+{
+    mkdir(basename, 0777);
+
+    for (int l = 0; l < network->num_layers; l++)
+    {
+        QFCLayer *layer = &network->layers[l];
+        if (layer->activation == ACTIVATION_CUSTOM)
+            errx(EXIT_FAILURE, "qnn_save: layer %d has a custom activation\n", l);
+
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s/qfc_%d.weights", basename, l);
+        FILE *fp = fopen(filename, "w");
+        if (fp == NULL)
+            err(1, "qnn_save: fopen");
+
+        fprintf(fp, "%d %d %d %.9g\n", layer->input_size, layer->output_size, layer->activation, layer->input_scale);
+        for (int o = 0; o < layer->output_size; o++)
+            fprintf(fp, o + 1 < layer->output_size ? "%.9g " : "%.9g\n", layer->weight_scales[o]);
+        for (int i = 0; i < layer->output_size * layer->input_size; i++)
+            fprintf(fp, i + 1 < layer->output_size * layer->input_size ? "%d " : "%d\n", layer->weights[i]);
+        for (int o = 0; o < layer->output_size; o++)
+            fprintf(fp, o + 1 < layer->output_size ? "%.9g " : "%.9g\n", layer->biases[o]);
+
+        fclose(fp);
+    }
+}
+
+static bool load_layer(FILE *fp, QFCLayer *layer)
+{
+    if (fscanf(fp, "%d %d %d %f", &layer->input_size, &layer->output_size, &layer->activation, &layer->input_scale) != 4 ||
+        layer->input_size <= 0 || layer->output_size <= 0 ||
+        layer->activation < 0 || layer->activation >= ACTIVATION_CUSTOM)
+        return false;
+
+    int size = layer->output_size * layer->input_size;
+    layer->activation_func = NULL;
+    layer->weights = malloc(sizeof(int8_t) * size);
+    layer->weight_scales = malloc(sizeof(float) * layer->output_size);
+    layer->biases = malloc(sizeof(float) * layer->output_size);
+    if (layer->weights == NULL || layer->weight_scales == NULL || layer->biases == NULL)
+        errx(EXIT_FAILURE, "qnn_load: failed to allocate a layer\n");
+
+    bool ok = true;
+    for (int o = 0; o < layer->output_size && ok; o++)
+        ok = fscanf(fp, "%f", &layer->weight_scales[o]) == 1;
+    for (int i = 0; i < size && ok; i++)
+    {
+        int value;
+        ok = fscanf(fp, "%d", &value) == 1 && value >= -QUANTIZE_MAX && value <= QUANTIZE_MAX;
+        layer->weights[i] = (int8_t)value;
+    }
+    for (int o = 0; o < layer->output_size && ok; o++)
+        ok = fscanf(fp, "%f", &layer->biases[o]) == 1;
+
+    return ok;
+}
+
+/// @brief Loads a network saved by qnn_save.
+/// @param output_func output activation of the network (not saved), or NULL
+/// @return the network, or NULL if it could not be read
+QNN *qnn_load(const char *basename, Matrix *(*output_func)(Matrix *))
+{
+    QNN *network = malloc(sizeof(QNN));
+    if (network == NULL)
+        errx(EXIT_FAILURE, "qnn_load: failed to allocate the network\n");
+    network->layers = NULL;
+    network->num_layers = 0;
+    network->output_func = output_func;
+
+    while (true)
+    {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s/qfc_%d.weights", basename, network->num_layers);
+        FILE *fp = fopen(filename, "r");
+        if (fp == NULL)
+            break;
+
+        network->layers = realloc(network->layers, sizeof(QFCLayer) * (network->num_layers + 1));
+        if (network->layers == NULL)
+            errx(EXIT_FAILURE, "qnn_load: failed to allocate the layers\n");
+
+        QFCLayer *layer = &network->layers[network->num_layers++];
+        memset(layer, 0, sizeof(QFCLayer));
+        bool ok = load_layer(fp, layer);
+        fclose(fp);
+
+        bool chained = network->num_layers == 1 || layer[-1].output_size == layer->input_size;
+        if (!ok || !chained)
+        {
+            qnn_destroy(network);
+            return NULL;
+        }
+    }
+
+    if (network->num_layers == 0)
+    {
+        qnn_destroy(network);
+        return NULL;
+    }
+    return network;
+}
+
+void qnn_destroy(QNN *network)
+{
+    for (int l = 0; l < network->num_layers; l++)
+    {
+        free(network->layers[l].weights);
+        free(network->layers[l].weight_scales);
+        free(network->layers[l].biases);
+    }
+    free(network->layers);
+    free(network);
+}
@@ -0,0 +1,835 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "../include/simd.h"
+
+/*
+Elementwise kernels selected at runtime.
+
+Every instruction set gets its own table of kernels compiled with a GCC
+target attribute, so the binary runs on any x86-64 CPU and still uses the
+widest vectors available. The table is chosen by CPUID the first time
+simd_kernels() is called, once even when pool workers get there together;
+simd_set_level() overrides the choice (tests use it to compare every path
+against the scalar one).
+
+All kernels only use exactly rounded IEEE operations (no FMA), so every
+level produces bit-identical results. Reductions keep SIMD_REDUCE_LANES
+partial sums whatever the vector width for the same reason. This includes
+exp and the activations: the vector versions repeat, lane by lane, the
+operations of the scalar references simd_exp, simd_activate and
+simd_derivative.
+
+Integer dot products are exact, so their vector versions only have to
+avoid overflows: int8 pairs are multiplied and added in int16 x int16 ->
+int32 madd instructions. The AVX-512 table reuses the AVX2 one, the byte
+instructions of AVX-512 need AVX-512BW.
+
+The 16-bit conversions use F16C / AVX-512 for fp16 and integer shifts for
+widening bf16. Narrowing to bf16 only happens when weights are converted,
+so it stays scalar on every level.
+*/
+
+#pragma region scalar
+
+static void scalar_add(const float *a, const float *b, float *dst, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = a[i] + b[i];
+}
+
+static void scalar_sub(const float *a, const float *b, float *dst, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = a[i] - b[i];
+}
+
+static void scalar_mul(const float *a, const float *b, float *dst, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = a[i] * b[i];
+}
+
+static void scalar_add_scalar(const float *a, float s, float *dst, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = a[i] + s;
+}
+
+static void scalar_mul_scalar(const float *a, float s, float *dst, int n)
+{
+    for (int i = 0; i < n; i++)
+        dst[i] = a[i] * s;
+}
+
+// Adds the tail [i, n) to the lanes (as products when b is not NULL) and
+// folds them by halves: the end of every sum and dot kernel
+static inline float fold_lanes(float *lanes, const float *a, const float *b, int i, int n)
+{
+    for (int k = 0; i + k < n; k++)
+        lanes[k] += b == NULL ? a[i + k] : a[i + k] * b[i + k];
+
+    for (int half = SIMD_REDUCE_LANES / 2; half > 0; half /= 2)
+        for (int k = 0; k < half; k++)
+            lanes[k] += lanes[k + half];
+
+    return lanes[0];
+}
+
+static float scalar_sum(const float *a, int n)
+{
+    float lanes[SIMD_REDUCE_LANES] = {0};
+    int i = 0;
+    for (; i + SIMD_REDUCE_LANES <= n; i += SIMD_REDUCE_LANES)
+        for (int k = 0; k < SIMD_REDUCE_LANES; k++)
+            lanes[k] += a[i + k];
+    return fold_lanes(lanes, a, NULL, i, n);
+}
+
+static float scalar_dot(const float *a, const float *b, int n)
+{
+    float lanes[SIMD_REDUCE_LANES] = {0};
+    int i = 0;
+    for (; i + SIMD_REDUCE_LANES <= n; i += SIMD_REDUCE_LANES)
+        for (int k = 0; k < SIMD_REDUCE_LANES; k++)
+            lanes[k] += a[i + k] * b[i + k];
+    return fold_lanes(lanes, a, b, i, n);
+}
+
+// single element references, inlined in the scalar kernels and the vector tails
+static inline float identity_value(float x) { return simd_activate(ACTIVATION_IDENTITY, x); }
+static inline float relu_value(float x) { return simd_activate(ACTIVATION_RELU, x); }
+static inline float leaky_relu_value(float x) { return simd_activate(ACTIVATION_LEAKY_RELU, x); }
+static inline float sigmoid_value(float x) { return simd_activate(ACTIVATION_SIGMOID, x); }
+static inline float d_identity_value(float y) { return simd_derivative(ACTIVATION_IDENTITY, y); }
+static inline float d_relu_value(float y) { return simd_derivative(ACTIVATION_RELU, y); }
+static inline float d_leaky_relu_value(float y) { return simd_derivative(ACTIVATION_LEAKY_RELU, y); }
+static inline float d_sigmoid_value(float y) { return simd_derivative(ACTIVATION_SIGMOID, y); }
+
+// Generates a scalar unary kernel from a single element function
+#define SCALAR_UNARY(name, f)                                \
+    static void name(const float *a, float *dst, int n)      \
+    {                                                        \
+        for (int i = 0; i < n; i++)                          \
+            dst[i] = f(a[i]);                                \
+    }
+
+SCALAR_UNARY(scalar_exp, simd_exp)
+SCALAR_UNARY(scalar_identity, identity_value)
+SCALAR_UNARY(scalar_relu, relu_value)
+SCALAR_UNARY(scalar_leaky_relu, leaky_relu_value)
+SCALAR_UNARY(scalar_sigmoid, sigmoid_value)
+SCALAR_UNARY(scalar_d_identity, d_identity_value)
+SCALAR_UNARY(scalar_d_relu, d_relu_value)
+SCALAR_UNARY(scalar_d_leaky_relu, d_leaky_relu_value)
+SCALAR_UNARY(scalar_d_sigmoid, d_sigmoid_value)
+
+// Generates a scalar conversion kernel from a single element function
+#define SCALAR_CONVERT(name, src_type, dst_type, f)                \
+    static void name(const src_type *a, dst_type *dst, int n)      \
+    {                                                              \
+        for (int i = 0; i < n; i++)                                \
+            dst[i] = f(a[i]);                                      \
+    }
+
+SCALAR_CONVERT(scalar_from_fp16, uint16_t, float, simd_fp16_to_fp32)
+SCALAR_CONVERT(scalar_to_fp16, float, uint16_t, simd_fp32_to_fp16)
+SCALAR_CONVERT(scalar_from_bf16, uint16_t, float, simd_bf16_to_fp32)
+SCALAR_CONVERT(scalar_to_bf16, float, uint16_t, simd_fp32_to_bf16)
+
+static int32_t scalar_dot_i8(const int8_t *a, const int8_t *b, int n)
+{
+    int32_t sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += (int32_t)a[i] * b[i];
+    return sum;
+}
+
+static void scalar_sparse_axpy(const float *values, const int *index, int n, const float *x, int stride, float *acc)
+{
+    for (int p = 0; p < n; p++)
+    {
+        const float *row = &x[index[p] * stride];
+        for (int r = 0; r < SIMD_REDUCE_LANES; r++)
+            acc[r] += values[p] * row[r];
+    }
+}
+
+static void scalar_sgd_step(float *param, const float *grad, int n, const SimdOptimizerStep *s)
+{
+    for (int i = 0; i < n; i++)
+        param[i] = simd_sgd_update(param[i], grad[i], s);
+}
+
+static void scalar_momentum_step(float *param, const float *grad, float *velocity, int n, const SimdOptimizerStep *s)
+{
+    for (int i = 0; i < n; i++)
+        param[i] = simd_momentum_update(param[i], grad[i], &velocity[i], s);
+}
+
+static void scalar_nesterov_step(float *param, const float *grad, float *velocity, int n, const SimdOptimizerStep *s)
+{
+    for (int i = 0; i < n; i++)
+        param[i] = simd_nesterov_update(param[i], grad[i], &velocity[i], s);
+}
+
+static void scalar_adam_step(float *param, const float *grad, float *m, float *v, int n, const SimdOptimizerStep *s)
+{
+    for (int i = 0; i < n; i++)
+        param[i] = simd_adam_update(param[i], grad[i], &m[i], &v[i], s);
+}
+
+static const SimdKernels scalar_kernels = {
+    "scalar",
+    scalar_add,
+    scalar_sub,
+    scalar_mul,
+    scalar_add_scalar,
+    scalar_mul_scalar,
+    scalar_sum,
+    scalar_dot,
+    scalar_exp,
+    {scalar_identity, scalar_relu, scalar_leaky_relu, scalar_sigmoid},
+    {scalar_d_identity, scalar_d_relu, scalar_d_leaky_relu, scalar_d_sigmoid},
+    scalar_from_fp16,
+    scalar_to_fp16,
+    scalar_from_bf16,
+    scalar_to_bf16,
+    scalar_dot_i8,
+    scalar_sparse_axpy,
+    scalar_sgd_step,
+    scalar_momentum_step,
+    scalar_nesterov_step,
+    scalar_adam_step,
+};
+
+#pragma endregion scalar
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Generates the vector body of a binary kernel, the tail is done in scalar
+#define SIMD_BINARY(name, isa, width, vtype, load, store, vop, op) \
+    __attribute__((target(isa))) static void name(                 \
+        const float *a, const float *b, float *dst, int n)         \
+    {                                                              \
+        int i = 0;                                                 \
+        for (; i + (width) <= n; i += (width))                     \
+        {                                                          \
+            vtype va = load(&a[i]);                                \
+            vtype vb = load(&b[i]);                                \
+            store(&dst[i], vop(va, vb));                           \
+        }                                                          \
+        for (; i < n; i++)                                         \
+            dst[i] = a[i] op b[i];                                 \
+    }
+
+// Same as SIMD_BINARY with a scalar broadcast as second operand
+#define SIMD_BINARY_SCALAR(name, isa, width, vtype, load, store, set1, vop, op) \
+    __attribute__((target(isa))) static void name(                              \
+        const float *a, float s, float *dst, int n)                             \
+    {                                                                           \
+        vtype vs = set1(s);                                                     \
+        int i = 0;                                                              \
+        for (; i + (width) <= n; i += (width))                                  \
+            store(&dst[i], vop(load(&a[i]), vs));                               \
+        for (; i < n; i++)                                                      \
+            dst[i] = a[i] op s;                                                 \
+    }
+
+// Generates the sum and dot kernels, SIMD_REDUCE_LANES / width vectors hold the lanes
+#define SIMD_REDUCE(prefix, isa, width, vtype, load, store, setzero, add, mul)         \
+    __attribute__((target(isa))) static float prefix##_sum(const float *a, int n)      \
+    {                                                                                  \
+        vtype acc[SIMD_REDUCE_LANES / (width)];                                        \
+        for (int k = 0; k < SIMD_REDUCE_LANES / (width); k++)                          \
+            acc[k] = setzero();                                                        \
+        int i = 0;                                                                     \
+        for (; i + SIMD_REDUCE_LANES <= n; i += SIMD_REDUCE_LANES)                     \
+            for (int k = 0; k < SIMD_REDUCE_LANES / (width); k++)                      \
+                acc[k] = add(acc[k], load(&a[i + k * (width)]));                       \
+        float lanes[SIMD_REDUCE_LANES];                                                \
+        for (int k = 0; k < SIMD_REDUCE_LANES / (width); k++)                          \
+            store(&lanes[k * (width)], acc[k]);                                        \
+        return fold_lanes(lanes, a, NULL, i, n);                                       \
+    }                                                                                  \
+    __attribute__((target(isa))) static float prefix##_dot(const float *a, const float *b, int n) \
+    {                                                                                  \
+        vtype acc[SIMD_REDUCE_LANES / (width)];                                        \
+        for (int k = 0; k < SIMD_REDUCE_LANES / (width); k++)                          \
+            acc[k] = setzero();                                                        \
+        int i = 0;                                                                     \
+        for (; i + SIMD_REDUCE_LANES <= n; i += SIMD_REDUCE_LANES)                     \
+            for (int k = 0; k < SIMD_REDUCE_LANES / (width); k++)                      \
+                acc[k] = add(acc[k], mul(load(&a[i + k * (width)]), load(&b[i + k * (width)]))); \
+        float lanes[SIMD_REDUCE_LANES];                                                \
+        for (int k = 0; k < SIMD_REDUCE_LANES / (width); k++)                          \
+            store(&lanes[k * (width)], acc[k]);                                        \
+        return fold_lanes(lanes, a, b, i, n);                                          \
+    }
+
+// Generates the optimizer kernels, lane by lane the operations of the scalar
+// references simd_sgd_update... in the same order
+#define SIMD_OPTIMIZER(prefix, isa, width, vtype, load, store, set1, add, sub, mul, div, sqrt)               \
+    __attribute__((target(isa))) static void prefix##_sgd_step(                                             \
+        float *param, const float *grad, int n, const SimdOptimizerStep *s)                                 \
+    {                                                                                                       \
+        vtype decay = set1(s->decay), lr = set1(s->learning_rate);                                          \
+        int i = 0;                                                                                          \
+        for (; i + (width) <= n; i += (width))                                                              \
+            store(&param[i], sub(mul(load(&param[i]), decay), mul(lr, load(&grad[i]))));                    \
+        for (; i < n; i++)                                                                                  \
+            param[i] = simd_sgd_update(param[i], grad[i], s);                                               \
+    }                                                                                                       \
+    __attribute__((target(isa))) static void prefix##_momentum_step(                                        \
+        float *param, const float *grad, float *velocity, int n, const SimdOptimizerStep *s)                \
+    {                                                                                                       \
+        vtype decay = set1(s->decay), lr = set1(s->learning_rate), mu = set1(s->momentum);                  \
+        int i = 0;                                                                                          \
+        for (; i + (width) <= n; i += (width))                                                              \
+        {                                                                                                   \
+            vtype v = add(mul(mu, load(&velocity[i])), load(&grad[i]));                                     \
+            store(&velocity[i], v);                                                                         \
+            store(&param[i], sub(mul(load(&param[i]), decay), mul(lr, v)));                                 \
+        }                                                                                                   \
+        for (; i < n; i++)                                                                                  \
+            param[i] = simd_momentum_update(param[i], grad[i], &velocity[i], s);                            \
+    }                                                                                                       \
+    __attribute__((target(isa))) static void prefix##_nesterov_step(                                        \
+        float *param, const float *grad, float *velocity, int n, const SimdOptimizerStep *s)                \
+    {                                                                                                       \
+        vtype decay = set1(s->decay), lr = set1(s->learning_rate), mu = set1(s->momentum);                  \
+        int i = 0;                                                                                          \
+        for (; i + (width) <= n; i += (width))                                                              \
+        {                                                                                                   \
+            vtype g = load(&grad[i]);                                                                       \
+            vtype v = add(mul(mu, load(&velocity[i])), g);                                                  \
+            store(&velocity[i], v);                                                                         \
+            store(&param[i], sub(mul(load(&param[i]), decay), mul(lr, add(g, mul(mu, v)))));                \
+        }                                                                                                   \
+        for (; i < n; i++)                                                                                  \
+            param[i] = simd_nesterov_update(param[i], grad[i], &velocity[i], s);                            \
+    }                                                                                                       \
+    __attribute__((target(isa))) static void prefix##_adam_step(                                            \
+        float *param, const float *grad, float *m, float *v, int n, const SimdOptimizerStep *s)             \
+    {                                                                                                       \
+        vtype decay = set1(s->decay), b1 = set1(s->momentum), b2 = set1(s->beta2);                          \
+        vtype c1 = set1(1.0f - s->momentum), c2 = set1(1.0f - s->beta2);                                    \
+        vtype step = set1(s->step_size), correction = set1(s->correction2), eps = set1(s->epsilon);         \
+        int i = 0;                                                                                          \
+        for (; i + (width) <= n; i += (width))                                                              \
+        {                                                                                                   \
+            vtype g = load(&grad[i]);                                                                       \
+            vtype vm = add(mul(b1, load(&m[i])), mul(c1, g));                                               \
+            vtype vv = add(mul(b2, load(&v[i])), mul(c2, mul(g, g)));                                       \
+            store(&m[i], vm);                                                                               \
+            store(&v[i], vv);                                                                               \
+            vtype denominator = add(sqrt(mul(vv, correction)), eps);                                        \
+            store(&param[i], sub(mul(load(&param[i]), decay), div(mul(step, vm), denominator)));            \
+        }                                                                                                   \
+        for (; i < n; i++)                                                                                  \
+            param[i] = simd_adam_update(param[i], grad[i], &m[i], &v[i], s);                                \
+    }
+
+// Generates a unary kernel: vexpr computes the lanes of x, the tail calls f
+#define SIMD_UNARY(name, isa, width, vtype, load, store, vexpr, f) \
+    __attribute__((target(isa))) static void name(                 \
+        const float *a, float *dst, int n)                         \
+    {                                                              \
+        int i = 0;                                                 \
+        for (; i + (width) <= n; i += (width))                     \
+        {                                                          \
+            vtype x = load(&a[i]);                                 \
+            store(&dst[i], vexpr);                                 \
+        }                                                          \
+        for (; i < n; i++)                                         \
+            dst[i] = f(a[i]);                                      \
+    }
+
+#pragma region sse2
+
+SIMD_BINARY(sse2_add, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_add_ps, +)
+SIMD_BINARY(sse2_sub, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_sub_ps, -)
+SIMD_BINARY(sse2_mul, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_mul_ps, *)
+SIMD_BINARY_SCALAR(sse2_add_scalar, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, +)
+SIMD_BINARY_SCALAR(sse2_mul_scalar, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_mul_ps, *)
+SIMD_REDUCE(sse2, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_setzero_ps, _mm_add_ps, _mm_mul_ps)
+SIMD_OPTIMIZER(sse2, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_div_ps, _mm_sqrt_ps)
+
+// a > b ? x : y, lane by lane
+__attribute__((target("sse2"))) static inline __m128 sse2_select_gt(__m128 a, __m128 b, __m128 x, __m128 y)
+{
+    __m128 mask = _mm_cmpgt_ps(a, b);
+    return _mm_or_ps(_mm_and_ps(mask, x), _mm_andnot_ps(mask, y));
+}
+
+// exp(x) with the same operations as simd_exp
+__attribute__((target("sse2"))) static inline __m128 sse2_exp_ps(__m128 x)
+{
+    x = _mm_min_ps(x, _mm_set1_ps(88.0f));
+    x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+
+    __m128 t = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+    __m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+    n = sse2_select_gt(n, t, _mm_sub_ps(n, _mm_set1_ps(1.0f)), n);
+
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 p = _mm_set1_ps(1.9875691500e-4f);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.3981999507e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(8.3334519073e-3f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(4.1665795894e-2f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(1.6666665459e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(5.0000001201e-1f));
+    p = _mm_add_ps(_mm_mul_ps(p, _mm_mul_ps(r, r)), r);
+    p = _mm_add_ps(p, _mm_set1_ps(1.0f));
+
+    __m128i bits = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+}
+
+__attribute__((target("sse2"))) static inline __m128 sse2_sigmoid_ps(__m128 x)
+{
+    __m128 one = _mm_set1_ps(1.0f);
+    return _mm_div_ps(one, _mm_add_ps(one, sse2_exp_ps(_mm_sub_ps(_mm_setzero_ps(), x))));
+}
+
+SIMD_UNARY(sse2_exp, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, sse2_exp_ps(x), simd_exp)
+SIMD_UNARY(sse2_identity, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, x, identity_value)
+SIMD_UNARY(sse2_relu, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_max_ps(x, _mm_setzero_ps()), relu_value)
+SIMD_UNARY(sse2_leaky_relu, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, sse2_select_gt(x, _mm_setzero_ps(), x, _mm_mul_ps(x, _mm_set1_ps(0.1f))), leaky_relu_value)
+SIMD_UNARY(sse2_sigmoid, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, sse2_sigmoid_ps(x), sigmoid_value)
+SIMD_UNARY(sse2_d_identity, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps(1.0f), d_identity_value)
+SIMD_UNARY(sse2_d_relu, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, sse2_select_gt(x, _mm_setzero_ps(), _mm_set1_ps(1.0f), _mm_setzero_ps()), d_relu_value)
+SIMD_UNARY(sse2_d_leaky_relu, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, sse2_select_gt(x, _mm_setzero_ps(), _mm_set1_ps(1.0f), _mm_set1_ps(0.1f)), d_leaky_relu_value)
+SIMD_UNARY(sse2_d_sigmoid, "sse2", 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_mul_ps(x, _mm_sub_ps(_mm_set1_ps(1.0f), x)), d_sigmoid_value)
+
+__attribute__((target("sse2"))) static void sse2_from_bf16(const uint16_t *a, float *dst, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i h = _mm_loadl_epi64((const __m128i *)&a[i]);
+        _mm_storeu_ps(&dst[i], _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), h)));
+    }
+    for (; i < n; i++)
+        dst[i] = simd_bf16_to_fp32(a[i]);
+}
+
+// sign extends the low / high 8 bytes of x to int16
+#define SSE2_LO_I16(x) _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8)
+#define SSE2_HI_I16(x) _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8)
+
+__attribute__((target("sse2"))) static int32_t sse2_dot_i8(const int8_t *a, const int8_t *b, int n)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i vb = _mm_loadu_si128((const __m128i *)&b[i]);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(SSE2_LO_I16(va), SSE2_LO_I16(vb)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(SSE2_HI_I16(va), SSE2_HI_I16(vb)));
+    }
+
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + scalar_dot_i8(&a[i], &b[i], n - i);
+}
+
+__attribute__((target("sse2"))) static void sse2_sparse_axpy(const float *values, const int *index, int n, const float *x, int stride, float *acc)
+{
+    __m128 acc0 = _mm_loadu_ps(&acc[0]), acc1 = _mm_loadu_ps(&acc[4]);
+    __m128 acc2 = _mm_loadu_ps(&acc[8]), acc3 = _mm_loadu_ps(&acc[12]);
+    for (int p = 0; p < n; p++)
+    {
+        const float *row = &x[index[p] * stride];
+        __m128 v = _mm_set1_ps(values[p]);
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(v, _mm_loadu_ps(&row[0])));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(v, _mm_loadu_ps(&row[4])));
+        acc2 = _mm_add_ps(acc2, _mm_mul_ps(v, _mm_loadu_ps(&row[8])));
+        acc3 = _mm_add_ps(acc3, _mm_mul_ps(v, _mm_loadu_ps(&row[12])));
+    }
+    _mm_storeu_ps(&acc[0], acc0);
+    _mm_storeu_ps(&acc[4], acc1);
+    _mm_storeu_ps(&acc[8], acc2);
+    _mm_storeu_ps(&acc[12], acc3);
+}
+
+static const SimdKernels sse2_kernels = {
+    "sse2",
+    sse2_add,
+    sse2_sub,
+    sse2_mul,
+    sse2_add_scalar,
+    sse2_mul_scalar,
+    sse2_sum,
+    sse2_dot,
+    sse2_exp,
+    {sse2_identity, sse2_relu, sse2_leaky_relu, sse2_sigmoid},
+    {sse2_d_identity, sse2_d_relu, sse2_d_leaky_relu, sse2_d_sigmoid},
+    scalar_from_fp16,
+    scalar_to_fp16,
+    sse2_from_bf16,
+    scalar_to_bf16,
+    sse2_dot_i8,
+    sse2_sparse_axpy,
+    sse2_sgd_step,
+    sse2_momentum_step,
+    sse2_nesterov_step,
+    sse2_adam_step,
+};
+
+#pragma endregion sse2
+
+#pragma region avx2
+
+SIMD_BINARY(avx2_add, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, +)
+SIMD_BINARY(avx2_sub, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_sub_ps, -)
+SIMD_BINARY(avx2_mul, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_mul_ps, *)
+SIMD_BINARY_SCALAR(avx2_add_scalar, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, +)
+SIMD_BINARY_SCALAR(avx2_mul_scalar, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_mul_ps, *)
+SIMD_REDUCE(avx2, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_setzero_ps, _mm256_add_ps, _mm256_mul_ps)
+SIMD_OPTIMIZER(avx2, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps, _mm256_sqrt_ps)
+
+// a > b ? x : y, lane by lane
+__attribute__((target("avx2"))) static inline __m256 avx2_select_gt(__m256 a, __m256 b, __m256 x, __m256 y)
+{
+    return _mm256_blendv_ps(y, x, _mm256_cmp_ps(a, b, _CMP_GT_OQ));
+}
+
+// exp(x) with the same operations as simd_exp
+__attribute__((target("avx2"))) static inline __m256 avx2_exp_ps(__m256 x)
+{
+    x = _mm256_min_ps(x, _mm256_set1_ps(88.0f));
+    x = _mm256_max_ps(x, _mm256_set1_ps(-87.0f));
+
+    __m256 t = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f));
+    __m256 n = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(t));
+    n = avx2_select_gt(n, t, _mm256_sub_ps(n, _mm256_set1_ps(1.0f)), n);
+
+    __m256 r = _mm256_sub_ps(x, _mm256_mul_ps(n, _mm256_set1_ps(0.693359375f)));
+    r = _mm256_sub_ps(r, _mm256_mul_ps(n, _mm256_set1_ps(-2.12194440e-4f)));
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, r), _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_add_ps(_mm256_mul_ps(p, _mm256_mul_ps(r, r)), r);
+    p = _mm256_add_ps(p, _mm256_set1_ps(1.0f));
+
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2"))) static inline __m256 avx2_sigmoid_ps(__m256 x)
+{
+    __m256 one = _mm256_set1_ps(1.0f);
+    return _mm256_div_ps(one, _mm256_add_ps(one, avx2_exp_ps(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+}
+
+SIMD_UNARY(avx2_exp, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, avx2_exp_ps(x), simd_exp)
+SIMD_UNARY(avx2_identity, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, x, identity_value)
+SIMD_UNARY(avx2_relu, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_max_ps(x, _mm256_setzero_ps()), relu_value)
+SIMD_UNARY(avx2_leaky_relu, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, avx2_select_gt(x, _mm256_setzero_ps(), x, _mm256_mul_ps(x, _mm256_set1_ps(0.1f))), leaky_relu_value)
+SIMD_UNARY(avx2_sigmoid, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, avx2_sigmoid_ps(x), sigmoid_value)
+SIMD_UNARY(avx2_d_identity, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps(1.0f), d_identity_value)
+SIMD_UNARY(avx2_d_relu, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, avx2_select_gt(x, _mm256_setzero_ps(), _mm256_set1_ps(1.0f), _mm256_setzero_ps()), d_relu_value)
+SIMD_UNARY(avx2_d_leaky_relu, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, avx2_select_gt(x, _mm256_setzero_ps(), _mm256_set1_ps(1.0f), _mm256_set1_ps(0.1f)), d_leaky_relu_value)
+SIMD_UNARY(avx2_d_sigmoid, "avx2", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_mul_ps(x, _mm256_sub_ps(_mm256_set1_ps(1.0f), x)), d_sigmoid_value)
+
+__attribute__((target("avx2,f16c"))) static void avx2_from_fp16(const uint16_t *a, float *dst, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(&dst[i], _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)&a[i])));
+    for (; i < n; i++)
+        dst[i] = simd_fp16_to_fp32(a[i]);
+}
+
+__attribute__((target("avx2,f16c"))) static void avx2_to_fp16(const float *a, uint16_t *dst, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i *)&dst[i], _mm256_cvtps_ph(_mm256_loadu_ps(&a[i]), _MM_FROUND_TO_NEAREST_INT));
+    for (; i < n; i++)
+        dst[i] = simd_fp32_to_fp16(a[i]);
+}
+
+__attribute__((target("avx2"))) static void avx2_from_bf16(const uint16_t *a, float *dst, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&a[i]));
+        _mm256_storeu_ps(&dst[i], _mm256_castsi256_ps(_mm256_slli_epi32(h, 16)));
+    }
+    for (; i < n; i++)
+        dst[i] = simd_bf16_to_fp32(a[i]);
+}
+
+__attribute__((target("avx2"))) static int32_t avx2_dot_i8(const int8_t *a, const int8_t *b, int n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)&a[i]));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)&b[i]));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    int32_t sum = 0;
+    for (int k = 0; k < 8; k++)
+        sum += lanes[k];
+    return sum + scalar_dot_i8(&a[i], &b[i], n - i);
+}
+
+__attribute__((target("avx2"))) static void avx2_sparse_axpy(const float *values, const int *index, int n, const float *x, int stride, float *acc)
+{
+    __m256 acc0 = _mm256_loadu_ps(&acc[0]), acc1 = _mm256_loadu_ps(&acc[8]);
+    for (int p = 0; p < n; p++)
+    {
+        const float *row = &x[index[p] * stride];
+        __m256 v = _mm256_set1_ps(values[p]);
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(v, _mm256_loadu_ps(&row[0])));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(v, _mm256_loadu_ps(&row[8])));
+    }
+    _mm256_storeu_ps(&acc[0], acc0);
+    _mm256_storeu_ps(&acc[8], acc1);
+}
+
+static const SimdKernels avx2_kernels = {
+    "avx2",
+    avx2_add,
+    avx2_sub,
+    avx2_mul,
+    avx2_add_scalar,
+    avx2_mul_scalar,
+    avx2_sum,
+    avx2_dot,
+    avx2_exp,
+    {avx2_identity, avx2_relu, avx2_leaky_relu, avx2_sigmoid},
+    {avx2_d_identity, avx2_d_relu, avx2_d_leaky_relu, avx2_d_sigmoid},
+    avx2_from_fp16,
+    avx2_to_fp16,
+    avx2_from_bf16,
+    scalar_to_bf16,
+    avx2_dot_i8,
+    avx2_sparse_axpy,
+    avx2_sgd_step,
+    avx2_momentum_step,
+    avx2_nesterov_step,
+    avx2_adam_step,
+};
+
+#pragma endregion avx2
+
+#pragma region avx512
+
+SIMD_BINARY(avx512_add, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_add_ps, +)
+SIMD_BINARY(avx512_sub, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_sub_ps, -)
+SIMD_BINARY(avx512_mul, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_mul_ps, *)
+SIMD_BINARY_SCALAR(avx512_add_scalar, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_add_ps, +)
+SIMD_BINARY_SCALAR(avx512_mul_scalar, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_mul_ps, *)
+SIMD_REDUCE(avx512, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_setzero_ps, _mm512_add_ps, _mm512_mul_ps)
+SIMD_OPTIMIZER(avx512, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps, _mm512_div_ps, _mm512_sqrt_ps)
+
+// a > b ? x : y, lane by lane
+__attribute__((target("avx512f"))) static inline __m512 avx512_select_gt(__m512 a, __m512 b, __m512 x, __m512 y)
+{
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ), y, x);
+}
+
+// exp(x) with the same operations as simd_exp
+__attribute__((target("avx512f"))) static inline __m512 avx512_exp_ps(__m512 x)
+{
+    x = _mm512_min_ps(x, _mm512_set1_ps(88.0f));
+    x = _mm512_max_ps(x, _mm512_set1_ps(-87.0f));
+
+    __m512 t = _mm512_add_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)), _mm512_set1_ps(0.5f));
+    __m512 n = _mm512_cvtepi32_ps(_mm512_cvttps_epi32(t));
+    n = avx512_select_gt(n, t, _mm512_sub_ps(n, _mm512_set1_ps(1.0f)), n);
+
+    __m512 r = _mm512_sub_ps(x, _mm512_mul_ps(n, _mm512_set1_ps(0.693359375f)));
+    r = _mm512_sub_ps(r, _mm512_mul_ps(n, _mm512_set1_ps(-2.12194440e-4f)));
+
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, r), _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_add_ps(_mm512_mul_ps(p, _mm512_mul_ps(r, r)), r);
+    p = _mm512_add_ps(p, _mm512_set1_ps(1.0f));
+
+    __m512i bits = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(n), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(p, _mm512_castsi512_ps(bits));
+}
+
+__attribute__((target("avx512f"))) static inline __m512 avx512_sigmoid_ps(__m512 x)
+{
+    __m512 one = _mm512_set1_ps(1.0f);
+    return _mm512_div_ps(one, _mm512_add_ps(one, avx512_exp_ps(_mm512_sub_ps(_mm512_setzero_ps(), x))));
+}
+
+SIMD_UNARY(avx512_exp, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, avx512_exp_ps(x), simd_exp)
+SIMD_UNARY(avx512_identity, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, x, identity_value)
+SIMD_UNARY(avx512_relu, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_max_ps(x, _mm512_setzero_ps()), relu_value)
+SIMD_UNARY(avx512_leaky_relu, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, avx512_select_gt(x, _mm512_setzero_ps(), x, _mm512_mul_ps(x, _mm512_set1_ps(0.1f))), leaky_relu_value)
+SIMD_UNARY(avx512_sigmoid, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, avx512_sigmoid_ps(x), sigmoid_value)
+SIMD_UNARY(avx512_d_identity, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps(1.0f), d_identity_value)
+SIMD_UNARY(avx512_d_relu, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, avx512_select_gt(x, _mm512_setzero_ps(), _mm512_set1_ps(1.0f), _mm512_setzero_ps()), d_relu_value)
+SIMD_UNARY(avx512_d_leaky_relu, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, avx512_select_gt(x, _mm512_setzero_ps(), _mm512_set1_ps(1.0f), _mm512_set1_ps(0.1f)), d_leaky_relu_value)
+SIMD_UNARY(avx512_d_sigmoid, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_mul_ps(x, _mm512_sub_ps(_mm512_set1_ps(1.0f), x)), d_sigmoid_value)
+
+__attribute__((target("avx512f"))) static void avx512_from_fp16(const uint16_t *a, float *dst, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(&dst[i], _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)&a[i])));
+    for (; i < n; i++)
+        dst[i] = simd_fp16_to_fp32(a[i]);
+}
+
+__attribute__((target("avx512f"))) static void avx512_to_fp16(const float *a, uint16_t *dst, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm256_storeu_si256((__m256i *)&dst[i], _mm512_cvtps_ph(_mm512_loadu_ps(&a[i]), _MM_FROUND_TO_NEAREST_INT));
+    for (; i < n; i++)
+        dst[i] = simd_fp32_to_fp16(a[i]);
+}
+
+__attribute__((target("avx512f"))) static void avx512_from_bf16(const uint16_t *a, float *dst, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i h = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)&a[i]));
+        _mm512_storeu_ps(&dst[i], _mm512_castsi512_ps(_mm512_slli_epi32(h, 16)));
+    }
+    for (; i < n; i++)
+        dst[i] = simd_bf16_to_fp32(a[i]);
+}
+
+__attribute__((target("avx512f"))) static void avx512_sparse_axpy(const float *values, const int *index, int n, const float *x, int stride, float *acc)
+{
+    __m512 sum = _mm512_loadu_ps(acc);
+    for (int p = 0; p < n; p++)
+    {
+        __m512 v = _mm512_set1_ps(values[p]);
+        sum = _mm512_add_ps(sum, _mm512_mul_ps(v, _mm512_loadu_ps(&x[index[p] * stride])));
+    }
+    _mm512_storeu_ps(acc, sum);
+}
+
+static const SimdKernels avx512_kernels = {
+    "avx512",
+    avx512_add,
+    avx512_sub,
+    avx512_mul,
+    avx512_add_scalar,
+    avx512_mul_scalar,
+    avx512_sum,
+    avx512_dot,
+    avx512_exp,
+    {avx512_identity, avx512_relu, avx512_leaky_relu, avx512_sigmoid},
+    {avx512_d_identity, avx512_d_relu, avx512_d_leaky_relu, avx512_d_sigmoid},
+    avx512_from_fp16,
+    avx512_to_fp16,
+    avx512_from_bf16,
+    scalar_to_bf16,
+    avx2_dot_i8,
+    avx512_sparse_axpy,
+    avx512_sgd_step,
+    avx512_momentum_step,
+    avx512_nesterov_step,
+    avx512_adam_step,
+};
+
+#pragma endregion avx512
+
+static const SimdKernels *level_kernels[SIMD_LEVEL_COUNT] = {
+    &scalar_kernels,
+    &sse2_kernels,
+    &avx2_kernels,
+    &avx512_kernels,
+};
+
+#else
+
+static const SimdKernels *level_kernels[SIMD_LEVEL_COUNT] = {
+    &scalar_kernels,
+    NULL,
+    NULL,
+    NULL,
+};
+
+#endif
+
+static int active_level = -1;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+
+/// @brief Checks if the CPU running the program supports an instruction set.
+/// @param level one of SimdLevel
+/// @return true if the kernels of this level can run
+bool simd_supported(int level)
+{
+    if (level < 0 || level >= SIMD_LEVEL_COUNT || level_kernels[level] == NULL)
+        return false;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (level)
+    {
+    case SIMD_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case SIMD_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+    case SIMD_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    }
+#endif
+
+    return level == SIMD_SCALAR;
+}
+
+// picks the widest instruction set of the CPU, run once by pthread_once
+static void detect_level()
+{
+    int level = SIMD_LEVEL_COUNT - 1;
+    while (!simd_supported(level))
+        level--;
+    active_level = level;
+}
+
+/// @brief Forces the kernels of a given instruction set.
+/// @param level one of SimdLevel, must be supported by the CPU
+void simd_set_level(int level)
+{
+    if (!simd_supported(level))
+        errx(EXIT_FAILURE, "simd_set_level: level %d is not supported by this CPU", level);
+
+    // a later first call of simd_level must not undo the choice
+    pthread_once(&detect_once, detect_level);
+    active_level = level;
+}
+
+/// @brief Returns the instruction set in use, detecting the best one on first call.
+int simd_level()
+{
+    pthread_once(&detect_once, detect_level);
+    return active_level;
+}
+
+/// @brief Returns the kernel table of the instruction set in use.
+const SimdKernels *simd_kernels()
+{
+    return level_kernels[simd_level()];
+}
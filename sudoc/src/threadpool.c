@@ -0,0 +1,205 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../include/threadpool.h"
+#include "../include/gemm.h"
+#include "../include/arena.h"
+
+/*
+Persistent thread pool used by the matrix kernels.
+
+threadpool_parallel_for() cuts a loop into one contiguous piece per thread:
+the caller runs the first piece and the workers, started once and sleeping
+on a condition variable between loops, run the others. The split is static,
+so a kernel always computes an element the same way whatever the number of
+threads and results stay bit-identical to the serial ones.
+
+Loops that are too small for min_chunk iterations per thread run serially in
+the caller, as do loops started from inside a parallel loop (a nested GEMM in
+a parallel convolution) or while another thread already uses the pool.
+
+The thread count comes from SUDOC_NUM_THREADS, or the number of online CPUs,
+and can be changed with matrix_set_num_threads().
+*/
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+// held for the whole duration of a parallel loop
+static pthread_mutex_t dispatch = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static pthread_t workers[THREADPOOL_MAX_THREADS];
+static int num_threads = 1; // workers + the calling thread
+static bool shutting_down = false;
+
+// loop being run, written under lock while no piece is pending
+static ParallelTask job_task;
+static void *job_ctx;
+static int job_n;
+static int job_pieces;
+static long generation = 0;
+static long start_generation = 0; // generation when the workers were started
+static int pending = 0;
+
+static __thread bool in_worker = false;
+
+static void run_piece(int piece)
+{
+    int begin = (long)job_n * piece / job_pieces;
+    int end = (long)job_n * (piece + 1) / job_pieces;
+    if (begin < end)
+        job_task(job_ctx, begin, end);
+}
+
+// worker i runs the piece i + 1 of every loop
+static void *worker_main(void *arg)
+{
+    int piece = (int)(intptr_t)arg + 1;
+    long seen = start_generation;
+    in_worker = true;
+
+    pthread_mutex_lock(&lock);
+    while (true)
+    {
+        while (generation == seen && !shutting_down)
+            pthread_cond_wait(&work_ready, &lock);
+        if (shutting_down)
+            break;
+
+        seen = generation;
+        if (piece >= job_pieces)
+            continue;
+
+        pthread_mutex_unlock(&lock);
+        run_piece(piece);
+        pthread_mutex_lock(&lock);
+
+        if (--pending == 0)
+            pthread_cond_signal(&work_done);
+    }
+    pthread_mutex_unlock(&lock);
+
+    // scratch memory of the kernels is per thread
+    sgemm_release_buffers();
+    matrix_arena_release();
+
+    return NULL;
+}
+
+static void stop_workers()
+{
+    pthread_mutex_lock(&lock);
+    shutting_down = true;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < num_threads - 1; i++)
+        pthread_join(workers[i], NULL);
+
+    shutting_down = false;
+    num_threads = 1;
+}
+
+static void start_workers(int count)
+{
+    // no loop runs while the workers start, so none of them can miss one
+    start_generation = generation;
+    for (int i = 0; i < count - 1; i++)
+        if (pthread_create(&workers[i], NULL, worker_main, (void *)(intptr_t)i) != 0)
+            errx(EXIT_FAILURE, "threadpool: failed to start worker %d\n", i);
+
+    num_threads = count;
+}
+
+static void threadpool_init()
+{
+    const char *env = getenv("SUDOC_NUM_THREADS");
+    int count = env != NULL ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (count < 1)
+        count = 1;
+    if (count > THREADPOOL_MAX_THREADS)
+        count = THREADPOOL_MAX_THREADS;
+
+    start_workers(count);
+}
+
+/// @brief Sets the number of threads used by the matrix kernels (1 disables the pool).
+/// @param count number of threads, including the calling one
+void matrix_set_num_threads(int count)
+{
+    if (count < 1 || count > THREADPOOL_MAX_THREADS)
+        errx(EXIT_FAILURE, "matrix_set_num_threads: invalid thread count %d\n", count);
+
+    pthread_once(&init_once, threadpool_init);
+
+    pthread_mutex_lock(&dispatch);
+    if (count != num_threads)
+    {
+        stop_workers();
+        start_workers(count);
+    }
+    pthread_mutex_unlock(&dispatch);
+}
+
+/// @brief Returns the number of threads used by the matrix kernels.
+int matrix_get_num_threads()
+{
+    pthread_once(&init_once, threadpool_init);
+    return num_threads;
+}
+
+/// @brief Returns true when called from inside a parallel loop.
+bool threadpool_in_worker()
+{
+    return in_worker;
+}
+
+/// @brief Runs task over [0, n) split in one contiguous piece per thread.
+/// @param n number of iterations
+/// @param min_chunk minimum number of iterations worth giving to a thread
+/// @param task body of the loop, called once per piece
+/// @param ctx argument passed to task
+void threadpool_parallel_for(int n, int min_chunk, ParallelTask task, void *ctx)
+{
+    if (n <= 0)
+        return;
+
+    pthread_once(&init_once, threadpool_init);
+
+    int pieces = n / (min_chunk > 1 ? min_chunk : 1);
+    if (pieces > num_threads)
+        pieces = num_threads;
+
+    if (pieces <= 1 || in_worker || pthread_mutex_trylock(&dispatch) != 0)
+    {
+        task(ctx, 0, n);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    job_task = task;
+    job_ctx = ctx;
+    job_n = n;
+    job_pieces = pieces;
+    pending = pieces - 1;
+    generation++;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&lock);
+
+    // loops nested in the caller's piece run serially, like in the workers
+    in_worker = true;
+    run_piece(0);
+    in_worker = false;
+
+    pthread_mutex_lock(&lock);
+    while (pending > 0)
+        pthread_cond_wait(&work_done, &lock);
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_unlock(&dispatch);
+}
@@ -0,0 +1,449 @@
+#include "../include/trainer.h"
+
+/*
+Synchronous data-parallel training.
+
+A batch is cut into num_shards shards of consecutive rows. Every shard runs
+the forward pass and the gradients on its own replica of the network, one
+shard per thread of the pool, then the gradients of the shards are summed
+with a tree reduction and a single step of the optimizer (SGD by default,
+see trainer_set_optimizer) changes the weights:
+
+    Trainer *trainer = trainer_init_nn(network, 64, 0); // one shard per thread
+    double loss = trainer_nn_train_batch(trainer, input, labels, learning_rate);
+    ...
+    trainer_destroy(trainer);
+
+The replicas share the weights of the network, so the update only happens
+once, on the network, and there is nothing to broadcast back: the all-reduce
+is a reduce into the gradients of the network.
+
+The results only depend on the number of shards, not on the number of
+threads. With a single shard they are bit-identical to nn_train_batch and
+cnn_train_batch, with several ones they match them up to the order of the
+sums over the batch.
+*/
+
+// first row of the shard
+static int shard_row(Trainer *trainer, int shard)
+{
+    return (long)trainer->batch_size * shard / trainer->num_shards;
+}
+
+#pragma region replicas
+
+static FCLayer *fc_replica(FCLayer *layer, int rows, bool shares_gradients)
+{
+    FCLayer *replica = malloc(sizeof(FCLayer));
+    if (replica == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate a replica\n");
+
+    *replica = *layer;
+    replica->activations = matrix_init(rows, layer->output_size, NULL);
+    replica->deltas = matrix_init(rows, layer->input_size, NULL);
+    if (!shares_gradients)
+    {
+        replica->weights_gradient = matrix_init(layer->output_size, layer->input_size, NULL);
+        replica->biases_gradient = matrix_init(1, layer->output_size, NULL);
+    }
+    return replica;
+}
+
+// copies the parameters of the layer, which may have been converted or
+// pruned since the last step, and keeps the buffers of the replica
+static void fc_sync(FCLayer *replica, FCLayer *layer)
+{
+    FCLayer own = *replica;
+    *replica = *layer;
+    replica->activations = own.activations;
+    replica->deltas = own.deltas;
+    replica->weights_gradient = own.weights_gradient;
+    replica->biases_gradient = own.biases_gradient;
+}
+
+static void fc_replica_destroy(FCLayer *replica, bool shares_gradients)
+{
+    matrix_destroy(replica->activations);
+    matrix_destroy(replica->deltas);
+    if (!shares_gradients)
+    {
+        matrix_destroy(replica->weights_gradient);
+        matrix_destroy(replica->biases_gradient);
+    }
+    free(replica);
+}
+
+static ConvLayer *conv_replica(ConvLayer *layer, int rows, bool shares_gradients)
+{
+    ConvLayer *replica = malloc(sizeof(ConvLayer));
+    if (replica == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate a replica\n");
+
+    *replica = *layer;
+    replica->activations = matrix4_init(rows, layer->n_filters, layer->output_height, layer->output_width, NULL);
+    replica->deltas = matrix4_init(rows, layer->input_depth, layer->input_height, layer->input_width, NULL);
+    replica->outgrad = matrix4_init(rows, layer->n_filters, layer->output_height, layer->output_width, NULL);
+    if (!shares_gradients)
+    {
+        Matrix4 *w = layer->weights;
+        replica->weights_gradient = matrix4_init(w->dim1, w->dim2, w->dim3, w->dim4, NULL);
+        replica->biases_gradient = matrix_init(layer->n_filters, 1, NULL);
+    }
+    return replica;
+}
+
+// see fc_sync
+static void conv_sync(ConvLayer *replica, ConvLayer *layer)
+{
+    ConvLayer own = *replica;
+    *replica = *layer;
+    replica->activations = own.activations;
+    replica->deltas = own.deltas;
+    replica->outgrad = own.outgrad;
+    replica->weights_gradient = own.weights_gradient;
+    replica->biases_gradient = own.biases_gradient;
+}
+
+static void conv_replica_destroy(ConvLayer *replica, bool shares_gradients)
+{
+    matrix4_destroy(replica->activations);
+    matrix4_destroy(replica->deltas);
+    matrix4_destroy(replica->outgrad);
+    if (!shares_gradients)
+    {
+        matrix4_destroy(replica->weights_gradient);
+        matrix_destroy(replica->biases_gradient);
+    }
+    free(replica);
+}
+
+static ActivationLayer *output_replica(ActivationLayer *layer, int rows)
+{
+    ActivationLayer *replica = malloc(sizeof(ActivationLayer));
+    if (replica == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate a replica\n");
+
+    *replica = *layer;
+    replica->batch_size = rows;
+    replica->activations = matrix_init(rows, layer->input_size, NULL);
+    replica->deltas = matrix_init(rows, layer->input_size, NULL);
+    return replica;
+}
+
+static FCLayer **fc_replicas(FCLayer **layers, int num_layers, int rows, bool shares_gradients)
+{
+    FCLayer **replicas = malloc(sizeof(FCLayer *) * num_layers);
+    if (replicas == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate a replica\n");
+
+    for (int i = 0; i < num_layers; i++)
+        replicas[i] = fc_replica(layers[i], rows, shares_gradients);
+    return replicas;
+}
+
+#pragma endregion replicas
+
+static Trainer *trainer_alloc(int batch_size, int num_shards)
+{
+    if (num_shards == 0)
+        num_shards = matrix_get_num_threads();
+    if (num_shards > batch_size)
+        num_shards = batch_size;
+    if (num_shards <= 0)
+        errx(EXIT_FAILURE, "trainer: invalid shard count %d for batches of %d\n", num_shards, batch_size);
+
+    Trainer *trainer = calloc(1, sizeof(Trainer));
+    if (trainer == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate the trainer\n");
+
+    trainer->batch_size = batch_size;
+    trainer->num_shards = num_shards;
+    trainer->optimizer = optimizer_sgd(0.0f);
+    trainer->losses = malloc(sizeof(double) * num_shards);
+    trainer->shard_gradients = malloc(sizeof(float *) * num_shards);
+    if (trainer->losses == NULL || trainer->shard_gradients == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate the trainer\n");
+
+    return trainer;
+}
+
+/// @brief Prepares the data-parallel training of an NN.
+/// @param network network to train, its weights are updated in place
+/// @param batch_size number of rows of the batches
+/// @param num_shards number of shards of a batch, 0 for one per thread
+/// @return the trainer, to free with trainer_destroy before the network
+Trainer *trainer_init_nn(NN *network, int batch_size, int num_shards)
+{
+    if (network->plan != NULL)
+        errx(EXIT_FAILURE, "trainer_init_nn: the network is compiled for inference\n");
+
+    Trainer *trainer = trainer_alloc(batch_size, num_shards);
+    trainer->nn = network;
+    trainer->nn_replicas = malloc(sizeof(NN *) * trainer->num_shards);
+    if (trainer->nn_replicas == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate the replicas\n");
+
+    for (int s = 0; s < trainer->num_shards; s++)
+    {
+        int rows = shard_row(trainer, s + 1) - shard_row(trainer, s);
+        FCLayer **fc_layers = fc_replicas(network->fc_layers, network->num_fc_layers, rows, s == 0);
+        trainer->nn_replicas[s] = nn_init(fc_layers, network->num_fc_layers, output_replica(network->output_layer, rows));
+    }
+    return trainer;
+}
+
+/// @brief Prepares the data-parallel training of a CNN, see trainer_init_nn.
+/// The convolution layers must use the NCHW layout.
+Trainer *trainer_init_cnn(CNN *network, int batch_size, int num_shards)
+{
+    Trainer *trainer = trainer_alloc(batch_size, num_shards);
+    trainer->cnn = network;
+    trainer->cnn_replicas = malloc(sizeof(CNN *) * trainer->num_shards);
+    if (trainer->cnn_replicas == NULL)
+        errx(EXIT_FAILURE, "trainer: failed to allocate the replicas\n");
+
+    for (int s = 0; s < trainer->num_shards; s++)
+    {
+        int rows = shard_row(trainer, s + 1) - shard_row(trainer, s);
+        ConvLayer **conv_layers = malloc(sizeof(ConvLayer *) * network->num_conv_layers);
+        if (conv_layers == NULL)
+            errx(EXIT_FAILURE, "trainer: failed to allocate a replica\n");
+        for (int i = 0; i < network->num_conv_layers; i++)
+            conv_layers[i] = conv_replica(network->conv_layers[i], rows, s == 0);
+
+        FCLayer **fc_layers = fc_replicas(network->fc_layers, network->num_fc_layers, rows, s == 0);
+        trainer->cnn_replicas[s] = cnn_init(conv_layers, network->num_conv_layers, fc_layers, network->num_fc_layers,
+                                            output_replica(network->output_layer, rows));
+    }
+    return trainer;
+}
+
+/// @brief Sets the update rule of the next steps, the learning rate passed
+/// to every step replaces the one of the optimizer so schedules can change it.
+void trainer_set_optimizer(Trainer *trainer, Optimizer optimizer)
+{
+    trainer->optimizer = optimizer;
+}
+
+// forward pass and gradients of the shards [begin, end)
+static void train_shards(void *ctx, int begin, int end)
+{
+    Trainer *trainer = ctx;
+
+    for (int s = begin; s < end; s++)
+    {
+        int row = shard_row(trainer, s);
+        int rows = shard_row(trainer, s + 1) - row;
+        Matrix labels = matrix_view(trainer->labels, row, 0, rows, trainer->labels->dim2);
+
+        // the arena is per thread, every shard gives its temporaries back
+        matrix_arena_begin();
+        if (trainer->nn != NULL)
+        {
+            NN *replica = trainer->nn_replicas[s];
+            Matrix input = matrix_view(trainer->input, row, 0, rows, trainer->input->dim2);
+            Matrix *predictions = nn_forward(replica, &input);
+            trainer->losses[s] = cross_entropy_loss(predictions, &labels) * rows;
+            nn_gradients(replica, &input, &labels);
+            matrix_destroy(predictions);
+        }
+        else
+        {
+            CNN *replica = trainer->cnn_replicas[s];
+            Matrix4 input = matrix4_batch_view(trainer->input4, row, rows);
+            Matrix *predictions = cnn_forward(replica, &input);
+            trainer->losses[s] = mean_squared_error(predictions, &labels) * rows;
+            cnn_gradients(replica, &input, &labels);
+            matrix_destroy(predictions);
+        }
+        matrix_arena_end();
+    }
+}
+
+// Arguments of reduce_range
+typedef struct
+{
+    float **shards;
+    int num_shards;
+} ReduceTask;
+
+// sums the elements [begin, end) of every shard into shard 0, pairwise:
+// shard s + stride into shard s for stride = 1, 2, 4...
+static void reduce_range(void *ctx, int begin, int end)
+{
+    ReduceTask *task = ctx;
+    const SimdKernels *simd = simd_kernels();
+
+    for (int stride = 1; stride < task->num_shards; stride *= 2)
+        for (int s = 0; s + stride < task->num_shards; s += 2 * stride)
+            simd->add(&task->shards[s][begin], &task->shards[s + stride][begin], &task->shards[s][begin], end - begin);
+}
+
+// sums the gradient of size elements whose shard s copy is
+// trainer->shard_gradients[s] into the one of shard 0
+static void reduce_gradient(Trainer *trainer, int size)
+{
+    ReduceTask task = {trainer->shard_gradients, trainer->num_shards};
+    threadpool_parallel_for(size, TRAINER_REDUCE_MIN_CHUNK, reduce_range, &task);
+}
+
+static void reduce_fc(Trainer *trainer, FCLayer **(*layers_of)(Trainer *, int), int layer)
+{
+    for (int s = 0; s < trainer->num_shards; s++)
+        trainer->shard_gradients[s] = layers_of(trainer, s)[layer]->weights_gradient->data;
+    reduce_gradient(trainer, layers_of(trainer, 0)[layer]->weights_gradient->size);
+
+    for (int s = 0; s < trainer->num_shards; s++)
+        trainer->shard_gradients[s] = layers_of(trainer, s)[layer]->biases_gradient->data;
+    reduce_gradient(trainer, layers_of(trainer, 0)[layer]->biases_gradient->size);
+}
+
+static FCLayer **nn_fc_layers(Trainer *trainer, int shard)
+{
+    return trainer->nn_replicas[shard]->fc_layers;
+}
+
+static FCLayer **cnn_fc_layers(Trainer *trainer, int shard)
+{
+    return trainer->cnn_replicas[shard]->fc_layers;
+}
+
+// runs the shards of the batch and reduces their gradients, returns the
+// mean loss of the batch
+static double train_step(Trainer *trainer)
+{
+    // the shards run in parallel, none of the nested kernels does
+    threadpool_parallel_for(trainer->num_shards, 1, train_shards, trainer);
+
+    double loss = 0;
+    for (int s = 0; s < trainer->num_shards; s++)
+        loss += trainer->losses[s];
+
+    if (trainer->nn != NULL)
+        for (int l = 0; l < trainer->nn->num_fc_layers; l++)
+            reduce_fc(trainer, nn_fc_layers, l);
+    else
+    {
+        for (int l = 0; l < trainer->cnn->num_conv_layers; l++)
+        {
+            for (int s = 0; s < trainer->num_shards; s++)
+                trainer->shard_gradients[s] = trainer->cnn_replicas[s]->conv_layers[l]->weights_gradient->data;
+            reduce_gradient(trainer, trainer->cnn->conv_layers[l]->weights_gradient->size);
+
+            for (int s = 0; s < trainer->num_shards; s++)
+                trainer->shard_gradients[s] = trainer->cnn_replicas[s]->conv_layers[l]->biases_gradient->data;
+            reduce_gradient(trainer, trainer->cnn->conv_layers[l]->biases_gradient->size);
+        }
+        for (int l = 0; l < trainer->cnn->num_fc_layers; l++)
+            reduce_fc(trainer, cnn_fc_layers, l);
+    }
+
+    return loss / trainer->batch_size;
+}
+
+static void check_batch(Trainer *trainer, int rows, Matrix *labels, const char *name)
+{
+    if (rows != trainer->batch_size || labels->dim1 != trainer->batch_size)
+        errx(EXIT_FAILURE, "%s: expected batches of %d rows, got %d\n", name, trainer->batch_size, rows);
+}
+
+/// @brief Trains an NN on a batch, see nn_train_batch.
+/// @param trainer trainer of the network, from trainer_init_nn
+/// @param input batch_size rows
+/// @param labels one-hot labels of the rows
+/// @return the cross-entropy loss of the batch
+double trainer_nn_train_batch(Trainer *trainer, Matrix *input, Matrix *labels, float learning_rate)
+{
+    if (trainer->nn == NULL)
+        errx(EXIT_FAILURE, "trainer_nn_train_batch: the trainer is not for an NN\n");
+    check_batch(trainer, input->dim1, labels, "trainer_nn_train_batch");
+
+    // the 16-bit or CSR copies of the weights are converted once, before
+    // the replicas read them concurrently
+    NN *network = trainer->nn;
+    for (int l = 0; l < network->num_fc_layers; l++)
+    {
+        fc_layer_refresh_weights(network->fc_layers[l]);
+        for (int s = 0; s < trainer->num_shards; s++)
+            fc_sync(trainer->nn_replicas[s]->fc_layers[l], network->fc_layers[l]);
+    }
+
+    trainer->input = input;
+    trainer->labels = labels;
+    double loss = train_step(trainer);
+    trainer->optimizer.learning_rate = learning_rate;
+    nn_optimize(network, &trainer->optimizer);
+    return loss;
+}
+
+/// @brief Trains a CNN on a batch, see cnn_train_batch and trainer_nn_train_batch.
+/// @return the mean squared error of the batch
+double trainer_cnn_train_batch(Trainer *trainer, Matrix4 *input, Matrix *labels, float learning_rate)
+{
+    if (trainer->cnn == NULL)
+        errx(EXIT_FAILURE, "trainer_cnn_train_batch: the trainer is not for a CNN\n");
+    check_batch(trainer, input->dim1, labels, "trainer_cnn_train_batch");
+
+    CNN *network = trainer->cnn;
+    for (int l = 0; l < network->num_conv_layers; l++)
+    {
+        conv_layer_refresh_weights(network->conv_layers[l]);
+        for (int s = 0; s < trainer->num_shards; s++)
+            conv_sync(trainer->cnn_replicas[s]->conv_layers[l], network->conv_layers[l]);
+    }
+    for (int l = 0; l < network->num_fc_layers; l++)
+    {
+        fc_layer_refresh_weights(network->fc_layers[l]);
+        for (int s = 0; s < trainer->num_shards; s++)
+            fc_sync(trainer->cnn_replicas[s]->fc_layers[l], network->fc_layers[l]);
+    }
+
+    trainer->input4 = input;
+    trainer->labels = labels;
+    double loss = train_step(trainer);
+    trainer->optimizer.learning_rate = learning_rate;
+    cnn_optimize(network, &trainer->optimizer);
+    return loss;
+}
+
+/// @brief Frees the replicas, the network itself is left to its owner.
+void trainer_destroy(Trainer *trainer)
+{
+    for (int s = 0; s < trainer->num_shards; s++)
+    {
+        bool shares_gradients = s == 0;
+        FCLayer **fc_layers;
+        int num_fc_layers;
+        ActivationLayer *output_layer;
+        if (trainer->nn != NULL)
+        {
+            NN *replica = trainer->nn_replicas[s];
+            fc_layers = replica->fc_layers;
+            num_fc_layers = replica->num_fc_layers;
+            output_layer = replica->output_layer;
+            free(replica);
+        }
+        else
+        {
+            CNN *replica = trainer->cnn_replicas[s];
+            for (int i = 0; i < replica->num_conv_layers; i++)
+                conv_replica_destroy(replica->conv_layers[i], shares_gradients);
+            free(replica->conv_layers);
+            fc_layers = replica->fc_layers;
+            num_fc_layers = replica->num_fc_layers;
+            output_layer = replica->output_layer;
+            free(replica);
+        }
+
+        for (int i = 0; i < num_fc_layers; i++)
+            fc_replica_destroy(fc_layers[i], shares_gradients);
+        free(fc_layers);
+        activation_layer_destroy(output_layer);
+    }
+
+    free(trainer->nn_replicas);
+    free(trainer->cnn_replicas);
+    free(trainer->losses);
+    free(trainer->shard_gradients);
+    free(trainer);
+}
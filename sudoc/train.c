@@ -1,91 +1,186 @@
+// clock_gettime
+#define _POSIX_C_SOURCE 199309L
+
 #include "include/utils.h"
 #include "include/matrix.h"
 #include "include/layer.h"
 #include "include/neuralnet.h"
+#include "include/dataloader.h"
+#include "include/trainer.h"
 #include "include/cv.h"
 #include <string.h>
-
-NN *build_nn(int batchsize)
+#include <time.h>
+
+// Training of the digit network on the cell images of train_data/<digit>.
+//
+// usage: train [epochs] [batch size] [learning rate] [weights] [optimizer]
+//
+// Starts from the saved weights when there are some. Every epoch trains on
+// shuffled mini-batches decoded in the background and split over the cores,
+// then reports the loss, the accuracy on held out samples and the
+// throughput, and saves the weights.
+// The learning rate is per sample: the gradient of a batch is summed over it.
+// The optimizer is one of sgd, momentum, nesterov, adam and adamw.
+
+#define DEFAULT_EPOCHS 10
+#define DEFAULT_BATCH_SIZE 64
+#define DEFAULT_LEARNING_RATE 0.001f
+#define DEFAULT_OPTIMIZER "adam"
+#define WEIGHT_DECAY 0.01f
+
+// every VALIDATION_STRIDE-th image is held out
+#define VALIDATION_STRIDE 10
+#define LOADER_THREADS 2
+
+#define CELL_SIZE (28 * 28)
+
+// the optimizer of its command line name, false for an unknown one
+static bool parse_optimizer(const char *name, float learning_rate, Optimizer *optimizer)
 {
-    // define the layers
-    FCLayer **fc_layers = malloc(sizeof(FCLayer) * 2);
-    fc_layers[0] = fc_layer_init(28 * 28, 256, batchsize, relu, d_relu, "fc0");
-    fc_layers[1] = fc_layer_init(256, 128, batchsize, relu, d_relu, "fc1");
-    fc_layers[2] = fc_layer_init(128, 10, batchsize, relu, d_relu, "fc2");
-
-    ActivationLayer *output_layer = activation_layer_init(10, batchsize, softmax, d_softmax);
-    int num_fc_layers = 3;
-
-    NN *network = nn_init(fc_layers, num_fc_layers, output_layer);
-    return network;
+    if (strcmp(name, "sgd") == 0)
+        *optimizer = optimizer_sgd(learning_rate);
+    else if (strcmp(name, "momentum") == 0 || strcmp(name, "nesterov") == 0)
+        *optimizer = optimizer_momentum(learning_rate, 0.9f, strcmp(name, "nesterov") == 0);
+    else if (strcmp(name, "adam") == 0)
+        *optimizer = optimizer_adam(learning_rate, 0.9f, 0.999f, 1e-8f);
+    else if (strcmp(name, "adamw") == 0)
+        *optimizer = optimizer_adamw(learning_rate, 0.9f, 0.999f, 1e-8f, WEIGHT_DECAY);
+    else
+        return false;
+    return true;
 }
 
-int main()
+static double now()
 {
-    init_rand();
-    int batchsize = 1;
-
-    NN *network = build_nn(batchsize);
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
 
-    Matrix *input = matrix_init(batchsize, 28 * 28, NULL);
-    Matrix *output = matrix_init(batchsize, 10, NULL);
+// decodes the image of a sample, called from the loader threads
+static void read_cell(void *ctx, int sample, float *dst)
+{
+    char **paths = ctx;
+    Matrix row = {1, CELL_SIZE, CELL_SIZE, dst, CELL_SIZE, false};
+    CV_LOAD_MAT(paths[sample], &row, 1, GRAYSCALE);
+}
 
-    int *data_count = malloc(sizeof(int) * 10);
-    char ***filepaths = malloc(sizeof(char **) * 10);
+int main(int argc, char **argv)
+{
+    int epochs = argc > 1 ? atoi(argv[1]) : DEFAULT_EPOCHS;
+    int batchsize = argc > 2 ? atoi(argv[2]) : DEFAULT_BATCH_SIZE;
+    float learning_rate = argc > 3 ? atof(argv[3]) : DEFAULT_LEARNING_RATE;
+    const char *weights = argc > 4 ? argv[4] : "weights";
+    Optimizer optimizer;
+    bool known = parse_optimizer(argc > 5 ? argv[5] : DEFAULT_OPTIMIZER, learning_rate, &optimizer);
+    if (epochs <= 0 || batchsize <= 0 || learning_rate <= 0 || !known)
+    {
+        printf("usage: train [epochs] [batch size] [learning rate] [weights] [sgd|momentum|nesterov|adam|adamw]\n");
+        return 1;
+    }
 
+    init_rand();
+    NN *network = build_nn2(batchsize);
+    if (nn_load(network, weights))
+        printf("Resuming from %s\n", weights);
+
+    // split the images of every digit between training and validation
+    int data_count[10];
+    char **filepaths[10];
+    int total = 0;
     for (int i = 0; i < 10; i++)
     {
-        data_count[i] = 0;
-
-        char *path = malloc(sizeof(char) * 100);
-        sprintf(path, "train_data/%d", i);
-
+        char path[100];
+        snprintf(path, sizeof(path), "train_data/%d", i);
         filepaths[i] = CV_LIST_DIR(path, &data_count[i]);
-
-        free(path);
+        total += data_count[i];
     }
 
-    // load the weights: 
-    bool loaded = nn_load(network, "weights");
-    if (!loaded)
+    char **train_paths = malloc(sizeof(char *) * total);
+    int *train_labels = malloc(sizeof(int) * total);
+    char **validation_paths = malloc(sizeof(char *) * total);
+    int *validation_labels = malloc(sizeof(int) * total);
+    int num_train = 0, num_validation = 0;
+    for (int i = 0; i < 10; i++)
+        for (int j = 0; j < data_count[i]; j++)
+        {
+            if (j % VALIDATION_STRIDE == VALIDATION_STRIDE - 1)
+            {
+                validation_paths[num_validation] = filepaths[i][j];
+                validation_labels[num_validation++] = i;
+            }
+            else
+            {
+                train_paths[num_train] = filepaths[i][j];
+                train_labels[num_train++] = i;
+            }
+        }
+
+    if (num_train < batchsize || num_validation == 0)
     {
-        printf("Failed to load the weights \n");
-        return 0;
+        printf("Not enough samples in train_data: %d\n", total);
+        return 1;
     }
 
-    // test the model using 1000 samples
-    int num_samples = 1000;
-    int correct = 0;
-
-    for (int i = 0; i < num_samples; i++)
+    // the validation images are decoded once. They are classified in
+    // chunks of batchsize rows, the size the network is set up for, so the
+    // last chunk is padded with blank rows.
+    int validation_rows = (num_validation + batchsize - 1) / batchsize * batchsize;
+    Matrix *validation = matrix_init(validation_rows, CELL_SIZE, NULL);
+    for (int i = 0; i < num_validation; i++)
+        read_cell(validation_paths, i, &validation->data[i * validation->stride]);
+    int *predictions = malloc(sizeof(int) * validation_rows);
+
+    DataLoader *loader = dataloader_init(num_train, CELL_SIZE, train_labels, 10, batchsize, read_cell, train_paths,
+                                         DATALOADER_PREFETCH, LOADER_THREADS, (unsigned long)time(NULL));
+    // one shard of every batch per thread
+    Trainer *trainer = trainer_init_nn(network, batchsize, 0);
+    trainer_set_optimizer(trainer, optimizer);
+    printf("Training on %d samples, %d batches of %d per epoch, validating on %d\n",
+           num_train, loader->batches_per_epoch, batchsize, num_validation);
+
+    for (int epoch = 0; epoch < epochs; epoch++)
     {
-        int digit = rand() % 10;
-        int file = rand() % data_count[digit];
-
-        CV_LOAD_MAT(filepaths[digit][file], input, batchsize, 1);
+        double start = now();
+        double loss = 0;
+        for (int b = 0; b < loader->batches_per_epoch; b++)
+        {
+            DataBatch *batch = dataloader_next(loader);
+            loss += trainer_nn_train_batch(trainer, batch->inputs, batch->labels, learning_rate);
+        }
+        double elapsed = now() - start;
 
-        int max_index = nn_predict(network, input);
-        
-        if (max_index == digit)
+        for (int row = 0; row < validation_rows; row += batchsize)
         {
-            correct++;
+            Matrix chunk = matrix_view(validation, row, 0, batchsize, CELL_SIZE);
+            nn_predict_batch(network, &chunk, batchsize, &predictions[row], NULL);
         }
+        int correct = 0;
+        for (int i = 0; i < num_validation; i++)
+            correct += predictions[i] == validation_labels[i];
+
+        printf("Epoch %d: loss %f, accuracy %f, %.0f samples/s\n", epoch + 1,
+               loss / loader->batches_per_epoch, (float)correct / num_validation,
+               loader->batches_per_epoch * batchsize / elapsed);
+        nn_save(network, weights);
     }
 
-    printf("Accuracy: %f \n", (float)correct / (float)num_samples);
-
     // free the memory
+    dataloader_destroy(loader);
+    trainer_destroy(trainer);
     nn_destroy(network);
-    matrix_destroy(input);
-    matrix_destroy(output);
+    matrix_destroy(validation);
+    free(predictions);
+    free(train_paths);
+    free(train_labels);
+    free(validation_paths);
+    free(validation_labels);
     for (int i = 0; i < 10; i++)
     {
         for (int j = 0; j < data_count[i]; j++)
-        {
             free(filepaths[i][j]);
-        }
         free(filepaths[i]);
     }
-    free(filepaths);
-    free(data_count);
-}
\ No newline at end of file
+
+    return 0;
+}
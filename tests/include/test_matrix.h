@@ -2,13 +2,34 @@
 
 #include "../../sudoc/include/utils.h"
 #include "../../sudoc/include/matrix.h"
+#include "../../sudoc/include/simd.h"
+#include "../../sudoc/include/arena.h"
+#include "../../sudoc/include/layer.h"
+#include "../../sudoc/include/linalg.h"
+#include <string.h>
+#include <stdint.h>
 
 int test_matrix_add();
 int test_matrix_subtract();
 int test_matrix_multiply();
+int test_matrix_multiply_large();
+int test_matrix_multiply_ex();
+int test_matrix_multiply_fused();
 int test_matrix_multiply_scalar();
 int test_matrix_transpose();
 int test_matrix_map_function();
+int test_matrix_activate();
+int test_simd_kernels();
+int test_matrix_det();
+int test_matrix_inverse();
+int test_matrix_solve();
+int test_linalg();
+int test_matrix_arena();
+int test_matrix_view();
+int test_matrix_threads();
+int test_matrix_reductions();
+int test_matrix16();
+int test_matrix_sparse();
 
 int test_matrix4_init();
 int test_matrix4_add();
@@ -18,6 +39,13 @@ int test_matrix4_multiply_scalar();
 int test_matrix4_transpose();
 int test_matrix4_map_function();
 int test_matrix4_convolve();
+int test_matrix4_convolve_im2col();
+int test_matrix4_convolve_winograd();
+int test_matrix4_reorder();
+int test_matrix4_convolve_blocked();
+int test_matrix4_convolve_grads();
+int test_matrix4_convolve_fused();
 int test_matrix4_add_bias();
 int test_matrix4_sum_rows();
 int test_matrix4_copy();
+int test_matrix4_slice();
@@ -2,9 +2,21 @@
 
 #include "../../sudoc/include/utils.h"
 #include "../../sudoc/include/neuralnet.h"
+#include "../../sudoc/include/quantize.h"
+#include "../../sudoc/include/dataloader.h"
+#include "../../sudoc/include/trainer.h"
 #include "../../sudoc/include/matrix.h"
 
 int test_nnxor();
 int test_nnxor_load();
 int test_cnn();
-int test_cnn_load();
\ No newline at end of file
+int test_cnn_load();
+int test_softmax_cross_entropy();
+int test_weight_storage();
+int test_nn_predict_batch();
+int test_nn_compile_inference();
+int test_prune();
+int test_quantize();
+int test_dataloader();
+int test_trainer();
+int test_optimizer();
@@ -100,6 +100,163 @@ int test_matrix_multiply()
     return assert(diff, true, "test_matrix_multiply");
 }
 
+// fills a matrix with random values in [-1, 1]
+void random_fill(float *data, int size)
+{
+    for (int i = 0; i < size; i++)
+        data[i] = (float)rand() / (float)(RAND_MAX / 2) - 1;
+}
+
+// naive i-j-k product used as the reference for the blocked implementations
+Matrix *reference_multiply(Matrix *m1, Matrix *m2)
+{
+    Matrix *dst = matrix_init(m1->dim1, m2->dim2, NULL);
+    for (int i = 0; i < m1->dim1; i++)
+        for (int j = 0; j < m2->dim2; j++)
+        {
+            double sum = 0;
+            for (int k = 0; k < m1->dim2; k++)
+                sum += m1->data[i * m1->dim2 + k] * m2->data[k * m2->dim2 + j];
+            dst->data[i * dst->dim2 + j] = sum;
+        }
+    return dst;
+}
+
+// checks that two matrices are equal within float tolerance
+bool matrix_close(Matrix *m1, Matrix *m2)
+{
+    if (m1->dim1 != m2->dim1 || m1->dim2 != m2->dim2)
+        return false;
+
+    for (int i = 0; i < m1->size; i++)
+        if (fabs(m1->data[i] - m2->data[i]) > 1e-3 * (1 + fabs(m2->data[i])))
+            return false;
+
+    return true;
+}
+
+int test_matrix_multiply_large()
+{
+    // odd shapes crossing every block and register tile boundary
+    int shapes[][3] = {
+        {1, 1, 1},
+        {3, 5, 7},
+        {1, 784, 256},
+        {131, 300, 1030},
+        {17, 513, 9},
+    };
+
+    bool diff = true;
+    for (int s = 0; s < 5; s++)
+    {
+        Matrix *m1 = matrix_init(shapes[s][0], shapes[s][1], NULL);
+        Matrix *m2 = matrix_init(shapes[s][1], shapes[s][2], NULL);
+        random_fill(m1->data, m1->size);
+        random_fill(m2->data, m2->size);
+
+        Matrix *m3 = matrix_multiply(m1, m2, NULL);
+        Matrix *expected = reference_multiply(m1, m2);
+
+        diff = diff && matrix_close(m3, expected);
+
+        matrix_destroy(m1);
+        matrix_destroy(m2);
+        matrix_destroy(m3);
+        matrix_destroy(expected);
+    }
+
+    return assert(diff, true, "test_matrix_multiply_large");
+}
+
+int test_matrix_multiply_ex()
+{
+    // (M, K, N) shapes, small and large enough to use the packed path
+    int shapes[][3] = {
+        {2, 3, 4},
+        {1, 784, 256},
+        {70, 300, 45},
+    };
+
+    bool diff = true;
+    for (int s = 0; s < 3; s++)
+    {
+        int M = shapes[s][0], K = shapes[s][1], N = shapes[s][2];
+        for (int t = 0; t < 4; t++)
+        {
+            bool trans1 = t & 1;
+            bool trans2 = t & 2;
+
+            Matrix *m1 = trans1 ? matrix_init(K, M, NULL) : matrix_init(M, K, NULL);
+            Matrix *m2 = trans2 ? matrix_init(N, K, NULL) : matrix_init(K, N, NULL);
+            Matrix *m3 = matrix_init(M, N, NULL);
+            random_fill(m1->data, m1->size);
+            random_fill(m2->data, m2->size);
+            random_fill(m3->data, m3->size);
+
+            // expected = 0.5 * op(m1) * op(m2) + 2 * m3
+            Matrix *op1 = trans1 ? matrix_transpose(m1) : matrix_copy(m1, NULL);
+            Matrix *op2 = trans2 ? matrix_transpose(m2) : matrix_copy(m2, NULL);
+            Matrix *expected = reference_multiply(op1, op2);
+            for (int i = 0; i < expected->size; i++)
+                expected->data[i] = 0.5f * expected->data[i] + 2.0f * m3->data[i];
+
+            matrix_multiply_ex(m1, trans1, m2, trans2, 0.5f, 2.0f, m3);
+            diff = diff && matrix_close(m3, expected);
+
+            matrix_destroy(m1);
+            matrix_destroy(m2);
+            matrix_destroy(m3);
+            matrix_destroy(op1);
+            matrix_destroy(op2);
+            matrix_destroy(expected);
+        }
+    }
+
+    return assert(diff, true, "test_matrix_multiply_ex");
+}
+
+int test_matrix_multiply_fused()
+{
+    // (M, K, N) shapes: skinny, split over several K blocks, parallel
+    int shapes[][3] = {
+        {2, 3, 4},
+        {9, 600, 37},
+        {128, 300, 250},
+    };
+
+    bool diff = true;
+    for (int s = 0; s < 3; s++)
+    {
+        int M = shapes[s][0], K = shapes[s][1], N = shapes[s][2];
+        Matrix *m1 = matrix_init(M, K, NULL);
+        Matrix *m2 = matrix_init(N, K, NULL);
+        Matrix *bias = matrix_init(1, N, NULL);
+        random_fill(m1->data, m1->size);
+        random_fill(m2->data, m2->size);
+        random_fill(bias->data, bias->size);
+
+        for (int activation = ACTIVATION_IDENTITY; activation <= ACTIVATION_SIGMOID; activation++)
+        {
+            Matrix *expected = matrix_multiply_ex(m1, false, m2, true, 1.0f, 0.0f, NULL);
+            matrix_add_bias(expected, bias, expected);
+            for (int i = 0; i < expected->size; i++)
+                expected->data[i] = simd_activate(activation, expected->data[i]);
+
+            Matrix *m3 = matrix_multiply_fused(m1, false, m2, true, bias, activation, NULL);
+            diff = diff && matrix_close(m3, expected);
+
+            matrix_destroy(expected);
+            matrix_destroy(m3);
+        }
+
+        matrix_destroy(m1);
+        matrix_destroy(m2);
+        matrix_destroy(bias);
+    }
+
+    return assert(diff, true, "test_matrix_multiply_fused");
+}
+
 int test_matrix_multiply_scalar()
 {
 
@@ -147,6 +304,41 @@ int test_matrix_transpose()
     return assert(diff, true, "test_matrix_transpose");
 }
 
+int test_matrix_activate()
+{
+    float (*functions[])(float) = {relu, leaky_relu, sigmoid};
+    float (*derivatives[])(float) = {d_relu, d_leaky_relu, d_sigmoid};
+
+    Matrix *m = matrix_init(37, 53, NULL);
+    random_fill(m->data, m->size);
+    matrix_multiply_scalar(m, 10.0f);
+
+    bool diff = true;
+    for (int f = 0; f < 3; f++)
+    {
+        int kind = activation_kind(functions[f], derivatives[f]);
+
+        // the kernels agree with the scalar functions
+        Matrix *expected = matrix_copy(m, NULL);
+        matrix_map_function(expected, functions[f]);
+        Matrix *output = matrix_activate(m, kind, NULL);
+        diff = diff && matrix_close(output, expected);
+
+        matrix_map_function(expected, derivatives[f]);
+        matrix_activate_derivative(output, kind, output);
+        diff = diff && matrix_close(output, expected);
+
+        matrix_destroy(expected);
+        matrix_destroy(output);
+    }
+
+    diff = diff && activation_kind(relu, d_sigmoid) == ACTIVATION_CUSTOM;
+
+    matrix_destroy(m);
+
+    return assert(diff, true, "test_matrix_activate");
+}
+
 int test_matrix_map_function()
 {
     float c[] = {
@@ -169,10 +361,650 @@ int test_matrix_map_function()
     return assert(diff, true, "test_matrix_map_function");
 }
 
+int test_simd_kernels()
+{
+    // odd length so every vector width also runs its scalar tail
+    int n = 1037;
+    float *a = malloc(sizeof(float) * n);
+    float *b = malloc(sizeof(float) * n);
+    int outputs = 6 + 2 * ACTIVATION_CUSTOM + 2 + 8;
+    // zeroed: the reductions leave the last value of their region unwritten
+    float *expected = calloc(n * outputs, sizeof(float));
+    float *got = calloc(n * outputs, sizeof(float));
+    random_fill(a, n);
+    random_fill(b, n);
+
+    // wide enough for exp to under/overflow and to hit its clamps
+    float *wide = malloc(sizeof(float) * n);
+    for (int i = 0; i < n; i++)
+        wide[i] = a[i] * 100.0f;
+
+    // shuffled rows of a seen as (n / SIMD_REDUCE_LANES, SIMD_REDUCE_LANES)
+    int blocks = n / SIMD_REDUCE_LANES;
+    int *index = malloc(sizeof(int) * blocks);
+    for (int i = 0; i < blocks; i++)
+        index[i] = i * 37 % blocks;
+
+    int detected = simd_level();
+    bool diff = true;
+
+    for (int level = SIMD_SCALAR; level < SIMD_LEVEL_COUNT; level++)
+    {
+        if (!simd_supported(level))
+            continue;
+
+        simd_set_level(level);
+        const SimdKernels *k = simd_kernels();
+        float *out = level == SIMD_SCALAR ? expected : got;
+
+        k->add(a, b, &out[0], n);
+        k->sub(a, b, &out[n], n);
+        k->mul(a, b, &out[2 * n], n);
+        k->add_scalar(a, 0.3f, &out[3 * n], n);
+        k->mul_scalar(a, -1.7f, &out[4 * n], n);
+        k->exp(wide, &out[5 * n], n);
+        for (int kind = 0; kind < ACTIVATION_CUSTOM; kind++)
+        {
+            k->activate[kind](wide, &out[(6 + kind) * n], n);
+            k->derivative[kind](a, &out[(6 + ACTIVATION_CUSTOM + kind) * n], n);
+        }
+
+        // reductions of every length up to a few lanes past the vectors
+        float *reduced = &out[(6 + 2 * ACTIVATION_CUSTOM) * n];
+        for (int len = 0; len < n / 2; len++)
+        {
+            reduced[2 * len] = k->sum(a, len);
+            reduced[2 * len + 1] = k->dot(a, b, len);
+        }
+
+        // sparse rows of every length times a
+        float *sparse = &out[(7 + 2 * ACTIVATION_CUSTOM) * n];
+        memset(sparse, 0, sizeof(float) * n);
+        for (int len = 0; len < blocks; len++)
+            k->sparse_axpy(b, index, len, a, SIMD_REDUCE_LANES, &sparse[len * SIMD_REDUCE_LANES]);
+
+        // optimizer steps of the parameters b with the gradient a, the
+        // states start from b, the second moment of Adam from a * a
+        SimdOptimizerStep step = {0.01f, 0.9f, 0.999f, 1e-8f, 0.99f, 0.05f, 3.0f};
+        float *optimized = &out[(8 + 2 * ACTIVATION_CUSTOM) * n];
+        for (int i = 0; i < 8; i++)
+            memcpy(&optimized[i * n], i == 7 ? a : b, sizeof(float) * n);
+        for (int i = 0; i < n; i++)
+            optimized[7 * n + i] *= optimized[7 * n + i];
+        k->sgd_step(&optimized[0], a, n, &step);
+        k->momentum_step(&optimized[n], a, &optimized[2 * n], n, &step);
+        k->nesterov_step(&optimized[3 * n], a, &optimized[4 * n], n, &step);
+        k->adam_step(&optimized[5 * n], a, &optimized[6 * n], &optimized[7 * n], n, &step);
+
+        // every level must match the scalar kernels bit for bit
+        if (level != SIMD_SCALAR)
+            diff = diff && memcmp(expected, got, sizeof(float) * n * outputs) == 0;
+    }
+
+    // int8 dot products are exact
+    int8_t *qa = malloc(n);
+    int8_t *qb = malloc(n);
+    for (int i = 0; i < n; i++)
+    {
+        qa[i] = (int8_t)(rand() % 255 - 127);
+        qb[i] = (int8_t)(rand() % 255 - 127);
+    }
+    for (int level = SIMD_SCALAR; level < SIMD_LEVEL_COUNT; level++)
+    {
+        if (!simd_supported(level))
+            continue;
+
+        simd_set_level(level);
+        for (int len = 0; len < 100; len++)
+        {
+            int32_t sum = 0;
+            for (int i = 0; i < len * 10; i++)
+                sum += qa[i] * qb[i];
+            diff = diff && simd_kernels()->dot_i8(qa, qb, len * 10) == sum;
+        }
+    }
+    free(qa);
+    free(qb);
+
+    simd_set_level(detected);
+
+    // exp stays within a few ulps of the C library
+    for (int i = 0; i < n; i++)
+    {
+        float x = wide[i] < 88.0f && wide[i] > -87.0f ? wide[i] : 0.0f;
+        diff = diff && fabsf(simd_exp(x) - expf(x)) <= 4e-7f * expf(x);
+    }
+    free(wide);
+    free(index);
+
+    free(a);
+    free(b);
+    free(expected);
+    free(got);
+
+    return assert(diff, true, "test_simd_kernels");
+}
+
+int test_matrix_det()
+{
+    // the first pivot is zero: needs a row swap
+    float c[] = {
+        0.0, 2.0, 1.0,
+        3.0, 1.0, 4.0,
+        2.0, 5.0, 3.0,
+    };
+
+    Matrix *m1 = matrix_init(3, 3, c);
+    Matrix *m2 = matrix_init(2, 2, a);
+
+    bool diff = fabs(matrix_det(m1) - 11.0) < 1e-5 && fabs(matrix_det(m2) + 2.0) < 1e-5;
+
+    matrix_destroy(m1);
+    matrix_destroy(m2);
+
+    return assert(diff, true, "test_matrix_det");
+}
+
+int test_matrix_inverse()
+{
+    // 20x20 does not fit in the stack scratch
+    int sizes[] = {3, 8, 20};
+
+    bool diff = true;
+    for (int s = 0; s < 3; s++)
+    {
+        int n = sizes[s];
+        Matrix *m1 = matrix_init(n, n, NULL);
+        random_fill(m1->data, m1->size);
+        for (int i = 0; i < n; i++)
+            m1->data[i * n + i] += n;
+
+        Matrix *m2 = matrix_inverse(m1);
+        Matrix *m3 = matrix_multiply(m1, m2, NULL);
+        Matrix *expected = matrix_init(n, n, NULL);
+        for (int i = 0; i < n; i++)
+            expected->data[i * n + i] = 1.0f;
+
+        diff = diff && matrix_close(m3, expected);
+
+        matrix_destroy(m1);
+        matrix_destroy(m2);
+        matrix_destroy(m3);
+        matrix_destroy(expected);
+    }
+
+    return assert(diff, true, "test_matrix_inverse");
+}
+
+int test_matrix_solve()
+{
+    Matrix *m1 = matrix_init(8, 8, NULL);
+    Matrix *x = matrix_init(8, 2, NULL);
+    random_fill(m1->data, m1->size);
+    random_fill(x->data, x->size);
+
+    Matrix *m2 = matrix_multiply(m1, x, NULL);
+    Matrix *m3 = matrix_solve(m1, m2, NULL);
+
+    bool diff = matrix_close(m3, x);
+
+    matrix_destroy(m1);
+    matrix_destroy(m2);
+    matrix_destroy(m3);
+    matrix_destroy(x);
+
+    return assert(diff, true, "test_matrix_solve");
+}
+
+int test_linalg()
+{
+    // a skewed quadrilateral onto a square, like a sudoku grid
+    Tupple src[4] = {{52, 31}, {431, 60}, {470, 402}, {18, 377}};
+    Tupple dst[4] = {{0, 0}, {252, 0}, {252, 252}, {0, 252}};
+
+    // the results are only written on success, the checks still read them
+    Mat3 H = mat3_identity();
+    bool diff = mat3_homography(src, dst, &H);
+    for (int p = 0; p < 4; p++)
+    {
+        Vec2 q = mat3_map(&H, src[p].x, src[p].y);
+        diff = diff && fabsf(q.x - dst[p].x) < 1e-2f && fabsf(q.y - dst[p].y) < 1e-2f;
+    }
+
+    // same inverse as the generic matrix code
+    Mat3 inv = mat3_identity();
+    bool inverted = mat3_inverse(&H, &inv);
+    diff = diff && inverted;
+    Matrix *m1 = mat3_to_matrix(&H, NULL);
+    Matrix *m2 = matrix_inverse(m1);
+    Matrix *m3 = mat3_to_matrix(&inv, NULL);
+    diff = diff && matrix_close(m3, m2);
+
+    Mat3 identity = mat3_identity();
+    Mat3 product = mat3_mul(&H, &inv);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            diff = diff && fabsf(product.m[i][j] - identity.m[i][j]) < 1e-4f;
+
+    // matrix_transformation maps the destination back onto the source
+    Matrix *m4 = matrix_transformation(src, dst);
+    diff = diff && matrix_close(m4, m3);
+
+    // three aligned points have no homography
+    Tupple aligned[4] = {{0, 0}, {10, 10}, {20, 20}, {0, 30}};
+    diff = diff && !mat3_homography(aligned, dst, &H);
+
+    matrix_destroy(m1);
+    matrix_destroy(m2);
+    matrix_destroy(m3);
+    matrix_destroy(m4);
+
+    return assert(diff, true, "test_linalg");
+}
+
+int test_matrix_arena()
+{
+    ArenaStats before = matrix_arena_stats();
+
+    matrix_arena_begin();
+    Matrix *m1 = matrix_arena_get(3, 5);
+    matrix_arena_put(m1);
+    Matrix *m2 = matrix_arena_get(3, 5);
+    Matrix4 *m3 = matrix4_arena_get(2, 3, 4, 5, MATRIX4_NCHW8C);
+    matrix_arena_end();
+
+    // m2 and m3 were reclaimed by matrix_arena_end
+    Matrix *m4 = matrix_arena_get(3, 5);
+    Matrix4 *m5 = matrix4_arena_get(2, 3, 4, 5, MATRIX4_NCHW8C);
+    Matrix4 *m6 = matrix4_arena_get(2, 3, 4, 5, MATRIX4_NCHW);
+    matrix_arena_put(m4);
+    matrix4_arena_put(m5);
+    matrix4_arena_put(m6);
+
+    ArenaStats after = matrix_arena_stats();
+
+    bool diff = m1 == m2 && m2 == m4 && m3 == m5 && (void *)m6 != (void *)m5;
+    diff = diff && m5->layout == MATRIX4_NCHW8C && m4->dim1 == 3 && m4->dim2 == 5;
+    diff = diff && after.requests - before.requests == 6 && after.live == before.live;
+    diff = diff && after.reused - before.reused >= 3;
+
+    return assert(diff, true, "test_matrix_arena");
+}
+
+int test_matrix_view()
+{
+    Matrix *m1 = matrix_init(9, 7, NULL);
+    Matrix *m2 = matrix_init(9, 7, NULL);
+    random_fill(m1->data, m1->size);
+    random_fill(m2->data, m2->size);
+
+    // 5x4 blocks starting at different offsets
+    Matrix v1 = matrix_view(m1, 2, 1, 5, 4);
+    Matrix v2 = matrix_view(m2, 4, 3, 5, 4);
+    Matrix *c1 = matrix_copy(&v1, NULL);
+    Matrix *c2 = matrix_copy(&v2, NULL);
+
+    Matrix *sum = matrix_add(&v1, &v2, NULL);
+    Matrix *expected_sum = matrix_add(c1, c2, NULL);
+
+    // product written into a view of a larger matrix
+    Matrix *m3 = matrix_init(6, 8, NULL);
+    Matrix v3 = matrix_view(m3, 1, 2, 5, 5);
+    matrix_multiply_ex(&v1, false, &v2, true, 1.0f, 0.0f, &v3);
+    Matrix *expected_product = matrix_multiply_ex(c1, false, c2, true, 1.0f, 0.0f, NULL);
+    Matrix *product = matrix_copy(&v3, NULL);
+
+    bool diff = matrix_element_wise_equal(sum, expected_sum) && matrix_close(product, expected_product);
+    diff = diff && v1.data == &m1->data[2 * 7 + 1] && m3->data[0] == 0.0f && m3->data[7] == 0.0f;
+    diff = diff && (uintptr_t)m1->data % MATRIX_ALIGNMENT == 0;
+
+    matrix_destroy(m1);
+    matrix_destroy(m2);
+    matrix_destroy(m3);
+    matrix_destroy(c1);
+    matrix_destroy(c2);
+    matrix_destroy(sum);
+    matrix_destroy(expected_sum);
+    matrix_destroy(product);
+    matrix_destroy(expected_product);
+
+    return assert(diff, true, "test_matrix_view");
+}
+
+int test_matrix_threads()
+{
+    int threads = matrix_get_num_threads();
+
+    Matrix *m1 = matrix_init(300, 200, NULL);
+    Matrix *m2 = matrix_init(200, 250, NULL);
+    Matrix4 *weights = matrix4_init(16, 8, 3, 3, NULL);
+    Matrix4 *input = matrix4_init(6, 8, 20, 20, NULL);
+    random_fill(m1->data, m1->size);
+    random_fill(m2->data, m2->size);
+    random_fill(weights->data, weights->size);
+    random_fill(input->data, input->size);
+
+    Matrix4 *input_blocked = matrix4_reorder(input, MATRIX4_NCHW8C, NULL);
+    Matrix *big = matrix_init(1, 1 << 17, NULL);
+    random_fill(big->data, big->size);
+
+    // every result computed with several threads must equal the serial one
+    Matrix *product[2], *sum[2];
+    Matrix4 *conv[2], *conv_blocked[2];
+    int counts[] = {1, 4};
+    for (int t = 0; t < 2; t++)
+    {
+        matrix_set_num_threads(counts[t]);
+        product[t] = matrix_multiply(m1, m2, NULL);
+        sum[t] = matrix_add(big, big, NULL);
+        conv[t] = matrix4_convolve(weights, input, NULL, 1, 1);
+        conv_blocked[t] = matrix4_convolve(weights, input_blocked, NULL, 2, 1);
+    }
+    matrix_set_num_threads(threads);
+
+    bool diff = memcmp(product[0]->data, product[1]->data, sizeof(float) * product[0]->size) == 0;
+    diff = diff && memcmp(sum[0]->data, sum[1]->data, sizeof(float) * sum[0]->size) == 0;
+    diff = diff && memcmp(conv[0]->data, conv[1]->data, sizeof(float) * conv[0]->size) == 0;
+    diff = diff && memcmp(conv_blocked[0]->data, conv_blocked[1]->data, sizeof(float) * conv_blocked[0]->size) == 0;
+
+    for (int t = 0; t < 2; t++)
+    {
+        matrix_destroy(product[t]);
+        matrix_destroy(sum[t]);
+        matrix4_destroy(conv[t]);
+        matrix4_destroy(conv_blocked[t]);
+    }
+    matrix_destroy(m1);
+    matrix_destroy(m2);
+    matrix_destroy(big);
+    matrix4_destroy(weights);
+    matrix4_destroy(input);
+    matrix4_destroy(input_blocked);
+
+    return assert(diff, true, "test_matrix_threads");
+}
+
 #pragma endregion matrix_tests
 
 #pragma region matrix_4_tests
 
+int test_matrix_reductions()
+{
+    int threads = matrix_get_num_threads();
+
+    Matrix *m = matrix_init(1031, 70, NULL);
+    Matrix *labels = matrix_init(1031, 70, NULL);
+    Matrix4 *m4 = matrix4_init(37, 12, 30, 30, NULL);
+    random_fill(m->data, m->size);
+    random_fill(m4->data, m4->size);
+    for (int i = 0; i < m->size; i++)
+        m->data[i] = m->data[i] * 0.5f + 0.5f;
+    for (int i = 0; i < m->dim1; i++)
+        m_set(labels, i, (i * 7) % m->dim2, 1);
+
+    // every reduction computed with several threads must equal the serial one
+    Matrix *rows[2], *channels[2];
+    int *argmax[2];
+    double ce[2], mse[2];
+    int counts[] = {1, 4};
+    for (int t = 0; t < 2; t++)
+    {
+        matrix_set_num_threads(counts[t]);
+        rows[t] = matrix_sum_rows(m, NULL);
+        channels[t] = matrix4_sum_channels(m4, NULL);
+        argmax[t] = matrix_argmax(m);
+        ce[t] = cross_entropy_loss(m, labels);
+        mse[t] = mean_squared_error(m, labels);
+    }
+    matrix_set_num_threads(threads);
+
+    bool diff = memcmp(rows[0]->data, rows[1]->data, sizeof(float) * rows[0]->size) == 0;
+    diff = diff && memcmp(channels[0]->data, channels[1]->data, sizeof(float) * channels[0]->size) == 0;
+    diff = diff && memcmp(argmax[0], argmax[1], sizeof(int) * m->dim1) == 0;
+    diff = diff && ce[0] == ce[1] && mse[0] == mse[1];
+
+    // and match a double precision reference
+    for (int j = 0; j < m->dim2; j++)
+    {
+        double sum = 0;
+        for (int i = 0; i < m->dim1; i++)
+            sum += m_get(m, i, j);
+        diff = diff && fabs(rows[0]->data[j] - sum) < 1e-3;
+    }
+    for (int c = 0; c < m4->dim2; c++)
+    {
+        double sum = 0;
+        for (int i = 0; i < m4->dim1; i++)
+            for (int k = 0; k < m4->dim3 * m4->dim4; k++)
+                sum += m4->data[(i * m4->dim2 + c) * m4->dim3 * m4->dim4 + k];
+        diff = diff && fabs(channels[0]->data[c] - sum) < 1e-2;
+    }
+    double expected_ce = 0, expected_mse = 0;
+    for (int i = 0; i < m->dim1; i++)
+    {
+        int best = 0;
+        for (int j = 0; j < m->dim2; j++)
+        {
+            double error = m_get(m, i, j) - m_get(labels, i, j);
+            expected_mse += error * error;
+            if (m_get(labels, i, j) != 0)
+                expected_ce -= log(m_get(m, i, j));
+            if (m_get(m, i, j) > m_get(m, i, best))
+                best = j;
+        }
+        diff = diff && argmax[0][i] == best;
+    }
+    diff = diff && fabs(ce[0] - expected_ce / m->dim1) < 1e-6 * fabs(ce[0]);
+    diff = diff && fabs(mse[0] - expected_mse / m->dim1) < 1e-5 * fabs(mse[0]);
+
+    for (int t = 0; t < 2; t++)
+    {
+        matrix_destroy(rows[t]);
+        matrix_destroy(channels[t]);
+        free(argmax[t]);
+    }
+    matrix_destroy(m);
+    matrix_destroy(labels);
+    matrix4_destroy(m4);
+
+    return assert(diff, true, "test_matrix_reductions");
+}
+
+int test_matrix16()
+{
+    bool diff = true;
+
+    // rounding to nearest even, fp16 subnormals and overflow
+    diff = diff && simd_fp32_to_fp16(1.0f) == 0x3c00 && simd_fp32_to_fp16(-2.0f) == 0xc000;
+    diff = diff && simd_fp32_to_fp16(1.0f + 1.0f / 2048) == 0x3c00;
+    diff = diff && simd_fp32_to_fp16(65504.0f) == 0x7bff && simd_fp32_to_fp16(65520.0f) == 0x7c00;
+    diff = diff && simd_fp32_to_fp16(5.9604645e-8f) == 0x0001 && simd_fp16_to_fp32(0x0001) == 5.9604645e-8f;
+    diff = diff && simd_fp32_to_bf16(1.0f + 1.0f / 256) == 0x3f80 && simd_bf16_to_fp32(0x3f81) == 1.0078125f;
+
+    // every 16-bit value but NaNs survives a round trip through fp32
+    for (int h = 0; h < 65536; h++)
+    {
+        if ((h & 0x7c00) != 0x7c00 || (h & 0x3ff) == 0)
+            diff = diff && simd_fp32_to_fp16(simd_fp16_to_fp32(h)) == h;
+        if ((h & 0x7f80) != 0x7f80 || (h & 0x7f) == 0)
+            diff = diff && simd_fp32_to_bf16(simd_bf16_to_fp32(h)) == h;
+    }
+
+    // every level converts like the scalar references, over a wide exponent range
+    int n = 1037;
+    float *values = malloc(sizeof(float) * n);
+    random_fill(values, n);
+    for (int i = 0; i < n; i++)
+        values[i] = ldexpf(values[i], i % 48 - 32);
+
+    uint16_t *narrow = malloc(sizeof(uint16_t) * n * 2);
+    float *wide = malloc(sizeof(float) * n * 2);
+    uint16_t *expected_narrow = malloc(sizeof(uint16_t) * n * 2);
+    float *expected_wide = malloc(sizeof(float) * n * 2);
+    for (int i = 0; i < n; i++)
+    {
+        expected_narrow[i] = simd_fp32_to_fp16(values[i]);
+        expected_narrow[n + i] = simd_fp32_to_bf16(values[i]);
+        expected_wide[i] = simd_fp16_to_fp32(expected_narrow[i]);
+        expected_wide[n + i] = simd_bf16_to_fp32(expected_narrow[n + i]);
+    }
+
+    int detected = simd_level();
+    for (int level = SIMD_SCALAR; level < SIMD_LEVEL_COUNT; level++)
+    {
+        if (!simd_supported(level))
+            continue;
+
+        simd_set_level(level);
+        const SimdKernels *k = simd_kernels();
+        k->to_fp16(values, narrow, n);
+        k->to_bf16(values, &narrow[n], n);
+        k->from_fp16(expected_narrow, wide, n);
+        k->from_bf16(&expected_narrow[n], &wide[n], n);
+
+        diff = diff && memcmp(narrow, expected_narrow, sizeof(uint16_t) * n * 2) == 0;
+        diff = diff && memcmp(wide, expected_wide, sizeof(float) * n * 2) == 0;
+    }
+    simd_set_level(detected);
+
+    free(values);
+    free(narrow);
+    free(wide);
+    free(expected_narrow);
+    free(expected_wide);
+
+    // products with 16-bit weights are the fp32 products with the rounded
+    // weights: same packed GEMM, so bit for bit, also when split over threads
+    // (rows, out_features, in_features)
+    int shapes[][3] = {{9, 37, 300}, {64, 200, 300}};
+    int threads = matrix_get_num_threads();
+    matrix_set_num_threads(3);
+
+    for (int storage = FLOAT_STORAGE_FP16; storage <= FLOAT_STORAGE_BF16; storage++)
+        for (int s = 0; s < 2; s++)
+        {
+            int *sh = shapes[s];
+            Matrix *input = matrix_init(sh[0], sh[2], NULL);
+            Matrix *weights = matrix_init(sh[1], sh[2], NULL);
+            Matrix *bias = matrix_init(1, sh[1], NULL);
+            random_fill(input->data, input->size);
+            random_fill(weights->data, weights->size);
+            random_fill(bias->data, bias->size);
+
+            Matrix16 *weights16 = matrix16_convert(matrix16_init(sh[1], sh[2], 1, 1, storage), weights->data);
+            Matrix *rounded = matrix_init(sh[1], sh[2], NULL);
+            matrix16_widen(weights16, rounded->data);
+
+            // relative rounding error of the storage: 2^-11 for fp16, 2^-8 for bf16
+            float epsilon = storage == FLOAT_STORAGE_FP16 ? 1.0f / 2048 : 1.0f / 256;
+            for (int i = 0; i < weights->size; i++)
+                diff = diff && fabsf(rounded->data[i] - weights->data[i]) <= epsilon * fabsf(weights->data[i]);
+
+            Matrix *expected = matrix_multiply_fused(input, false, rounded, true, bias, ACTIVATION_RELU, NULL);
+            Matrix *m3 = matrix_multiply_fused16(input, weights16, bias, ACTIVATION_RELU, NULL);
+            diff = diff && memcmp(m3->data, expected->data, sizeof(float) * m3->size) == 0;
+
+            // a single row skips the packing in fp32 but not in 16 bits
+            Matrix row = matrix_view(input, 0, 0, 1, sh[2]);
+            Matrix *single = matrix_multiply_fused16(&row, weights16, bias, ACTIVATION_RELU, NULL);
+            Matrix first = matrix_view(expected, 0, 0, 1, sh[1]);
+            Matrix *first_copy = matrix_copy(&first, NULL);
+            diff = diff && matrix_close(single, first_copy);
+
+            matrix_destroy(input);
+            matrix_destroy(weights);
+            matrix_destroy(bias);
+            matrix16_destroy(weights16);
+            matrix_destroy(rounded);
+            matrix_destroy(expected);
+            matrix_destroy(m3);
+            matrix_destroy(single);
+            matrix_destroy(first_copy);
+        }
+
+    matrix_set_num_threads(threads);
+
+    // convolution through im2col
+    Matrix4 *weights = matrix4_init(5, 3, 3, 3, NULL);
+    Matrix4 *input = matrix4_init(2, 3, 9, 9, NULL);
+    Matrix *bias = matrix_init(5, 1, NULL);
+    random_fill(weights->data, weights->size);
+    random_fill(input->data, input->size);
+    random_fill(bias->data, bias->size);
+
+    for (int storage = FLOAT_STORAGE_FP16; storage <= FLOAT_STORAGE_BF16; storage++)
+    {
+        Matrix16 *weights16 = matrix16_convert(matrix16_init(5, 3, 3, 3, storage), weights->data);
+        Matrix4 *rounded = matrix4_init(5, 3, 3, 3, NULL);
+        matrix16_widen(weights16, rounded->data);
+
+        Matrix4 *expected = matrix4_convolve_fused(rounded, input, NULL, 1, 1, bias, ACTIVATION_SIGMOID);
+        Matrix4 *m3 = matrix4_convolve_fused16(weights16, input, NULL, 1, 1, bias, ACTIVATION_SIGMOID);
+        diff = diff && memcmp(m3->data, expected->data, sizeof(float) * m3->size) == 0;
+
+        matrix16_destroy(weights16);
+        matrix4_destroy(rounded);
+        matrix4_destroy(expected);
+        matrix4_destroy(m3);
+    }
+
+    matrix4_destroy(weights);
+    matrix4_destroy(input);
+    matrix_destroy(bias);
+
+    return assert(diff, true, "test_matrix16");
+}
+
+int test_matrix_sparse()
+{
+    bool diff = true;
+
+    // products with pruned weights, from a single row to transposed batches
+    // with a partial block of rows, split over threads
+    // (rows, out_features, in_features)
+    int shapes[][3] = {{1, 37, 300}, {3, 37, 300}, {41, 200, 300}};
+    int threads = matrix_get_num_threads();
+    matrix_set_num_threads(3);
+
+    for (int s = 0; s < 3; s++)
+    {
+        int *sh = shapes[s];
+        Matrix *input = matrix_init(sh[0], sh[2], NULL);
+        Matrix *weights = matrix_init(sh[1], sh[2], NULL);
+        Matrix *bias = matrix_init(1, sh[1], NULL);
+        random_fill(input->data, input->size);
+        random_fill(weights->data, weights->size);
+        random_fill(bias->data, bias->size);
+
+        // about 80% of zeros and an empty row
+        for (int i = 0; i < weights->size; i++)
+            if (rand() % 5 != 0 || i < sh[2])
+                weights->data[i] = 0.0f;
+
+        SparseMatrix *sparse = sparse_matrix_from_dense(weights);
+        int nnz = 0;
+        for (int i = 0; i < weights->size; i++)
+            nnz += weights->data[i] != 0.0f;
+        diff = diff && sparse->nnz == nnz && sparse->row_ptr[1] == 0 && sparse->row_ptr[sh[1]] == nnz;
+
+        // the sums are done in another order, so up to rounding
+        Matrix *expected = matrix_multiply_fused(input, false, weights, true, bias, ACTIVATION_SIGMOID, NULL);
+        Matrix *m3 = matrix_multiply_sparse_fused(input, sparse, bias, ACTIVATION_SIGMOID, NULL);
+        diff = diff && matrix_close(m3, expected);
+
+        matrix_destroy(input);
+        matrix_destroy(weights);
+        matrix_destroy(bias);
+        sparse_matrix_destroy(sparse);
+        matrix_destroy(expected);
+        matrix_destroy(m3);
+    }
+
+    matrix_set_num_threads(threads);
+
+    return assert(diff, true, "test_matrix_sparse");
+}
+
 int test_matrix4_init()
 {
     Matrix4 *m = matrix4_init(5, 1000, 1000, 3, NULL);
@@ -348,6 +1180,313 @@ int test_matrix4_convolve()
     return assert(diff, true, "test_matrix4_convolve");
 }
 
+// checks that two 4d matrices are equal within float tolerance
+bool matrix4_close(Matrix4 *m1, Matrix4 *m2)
+{
+    if (m1->dim1 != m2->dim1 || m1->dim2 != m2->dim2 || m1->dim3 != m2->dim3 || m1->dim4 != m2->dim4)
+        return false;
+
+    for (int i = 0; i < m1->size; i++)
+        if (fabs(m1->data[i] - m2->data[i]) > 1e-3 * (1 + fabs(m2->data[i])))
+            return false;
+
+    return true;
+}
+
+int test_matrix4_convolve_im2col()
+{
+    // batch, in_channels, size, out_channels, kernel, stride, padding
+    int shapes[][7] = {
+        {1, 1, 3, 1, 2, 2, 1},
+        {2, 3, 9, 5, 3, 1, 1},
+        {4, 1, 28, 8, 3, 2, 1},
+        {1, 6, 7, 4, 1, 1, 0},
+        {3, 2, 11, 7, 5, 2, 2},
+    };
+
+    bool diff = true;
+    for (int s = 0; s < 5; s++)
+    {
+        int *sh = shapes[s];
+        Matrix4 *weights = matrix4_init(sh[3], sh[1], sh[4], sh[4], NULL);
+        Matrix4 *input = matrix4_init(sh[0], sh[1], sh[2], sh[2], NULL);
+        random_fill(weights->data, weights->size);
+        random_fill(input->data, input->size);
+
+        Matrix4 *m3 = matrix4_convolve(weights, input, NULL, sh[5], sh[6]);
+        Matrix4 *expected = matrix4_convolve_direct(weights, input, NULL, sh[5], sh[6]);
+
+        // dst is overwritten, not accumulated into
+        matrix4_convolve(weights, input, m3, sh[5], sh[6]);
+
+        diff = diff && matrix4_close(m3, expected);
+
+        matrix4_destroy(weights);
+        matrix4_destroy(input);
+        matrix4_destroy(m3);
+        matrix4_destroy(expected);
+    }
+
+    return assert(diff, true, "test_matrix4_convolve_im2col");
+}
+
+int test_matrix4_convolve_winograd()
+{
+    // batch, in_channels, size, out_channels, padding
+    int shapes[][5] = {
+        {1, 1, 4, 1, 0},
+        {2, 3, 9, 5, 1},
+        {4, 1, 28, 8, 1},
+        {1, 6, 7, 4, 0},
+    };
+
+    bool diff = true;
+    for (int s = 0; s < 4; s++)
+    {
+        int *sh = shapes[s];
+        Matrix4 *weights = matrix4_init(sh[3], sh[1], 3, 3, NULL);
+        Matrix4 *input = matrix4_init(sh[0], sh[1], sh[2], sh[2], NULL);
+        random_fill(weights->data, weights->size);
+        random_fill(input->data, input->size);
+
+        Matrix4 *transformed = matrix4_winograd_weights(weights, NULL);
+        Matrix4 *m3 = matrix4_convolve_winograd(transformed, input, NULL, sh[4]);
+        Matrix4 *expected = matrix4_convolve_direct(weights, input, NULL, 1, sh[4]);
+
+        diff = diff && matrix4_close(m3, expected);
+
+        matrix4_destroy(weights);
+        matrix4_destroy(input);
+        matrix4_destroy(transformed);
+        matrix4_destroy(m3);
+        matrix4_destroy(expected);
+    }
+
+    return assert(diff, true, "test_matrix4_convolve_winograd");
+}
+
+int test_matrix4_convolve_fused()
+{
+    // batch, in_channels, size, out_channels, kernel, stride, padding
+    int shapes[][7] = {
+        {2, 3, 9, 5, 3, 1, 1},
+        {3, 2, 11, 7, 5, 2, 2},
+        {1, 17, 8, 20, 1, 1, 0},
+    };
+
+    bool diff = true;
+    for (int s = 0; s < 3; s++)
+    {
+        int *sh = shapes[s];
+        Matrix4 *weights = matrix4_init(sh[3], sh[1], sh[4], sh[4], NULL);
+        Matrix4 *input = matrix4_init(sh[0], sh[1], sh[2], sh[2], NULL);
+        Matrix *bias = matrix_init(sh[3], 1, NULL);
+        random_fill(weights->data, weights->size);
+        random_fill(input->data, input->size);
+        random_fill(bias->data, bias->size);
+
+        for (int activation = ACTIVATION_RELU; activation <= ACTIVATION_SIGMOID; activation++)
+        {
+            Matrix4 *expected = matrix4_convolve_direct(weights, input, NULL, sh[5], sh[6]);
+            matrix4_add_bias(expected, bias, expected);
+            for (int i = 0; i < expected->size; i++)
+                expected->data[i] = simd_activate(activation, expected->data[i]);
+
+            Matrix4 *m3 = matrix4_convolve_fused(weights, input, NULL, sh[5], sh[6], bias, activation);
+            diff = diff && matrix4_close(m3, expected);
+
+            // channel blocked path
+            Matrix4 *blocked = matrix4_reorder(input, MATRIX4_NCHW8C, NULL);
+            Matrix4 *m4 = matrix4_convolve_fused(weights, blocked, NULL, sh[5], sh[6], bias, activation);
+            matrix4_reorder(m4, MATRIX4_NCHW, m3);
+            diff = diff && matrix4_close(m3, expected);
+
+            // the padding channels of the last block stay at zero
+            int plane = m4->dim3 * m4->dim4 * 8;
+            for (int i = 0; i < m4->size; i++)
+                if ((i / plane) % ((sh[3] + 7) / 8) * 8 + i % 8 >= sh[3])
+                    diff = diff && m4->data[i] == 0.0f;
+
+            // Winograd path
+            if (sh[4] == 3 && sh[5] == 1)
+            {
+                Matrix4 *transformed = matrix4_winograd_weights(weights, NULL);
+                matrix4_convolve_winograd_fused(transformed, input, m3, sh[6], bias, activation);
+                diff = diff && matrix4_close(m3, expected);
+                matrix4_destroy(transformed);
+            }
+
+            matrix4_destroy(expected);
+            matrix4_destroy(m3);
+            matrix4_destroy(blocked);
+            matrix4_destroy(m4);
+        }
+
+        matrix4_destroy(weights);
+        matrix4_destroy(input);
+        matrix_destroy(bias);
+    }
+
+    return assert(diff, true, "test_matrix4_convolve_fused");
+}
+
+int test_matrix4_reorder()
+{
+    int layouts[] = {MATRIX4_NHWC, MATRIX4_NCHW8C, MATRIX4_NCHW16C};
+
+    Matrix4 *m1 = matrix4_init(2, 11, 3, 5, NULL);
+    random_fill(m1->data, m1->size);
+
+    bool diff = true;
+    for (int t = 0; t < 3; t++)
+    {
+        Matrix4 *m2 = matrix4_reorder(m1, layouts[t], NULL);
+        Matrix4 *m3 = matrix4_reorder(m2, MATRIX4_NCHW, NULL);
+
+        diff = diff && m2->layout == layouts[t] && matrix4_element_wise_equal(m1, m3);
+        diff = diff && m4_get(m2, 1, 9, 2, 4) == m4_get(m1, 1, 9, 2, 4);
+
+        matrix4_destroy(m2);
+        matrix4_destroy(m3);
+    }
+
+    matrix4_destroy(m1);
+
+    return assert(diff, true, "test_matrix4_reorder");
+}
+
+int test_matrix4_convolve_blocked()
+{
+    // batch, in_channels, size, out_channels, kernel, stride, padding
+    int shapes[][7] = {
+        {1, 1, 5, 1, 3, 1, 0},
+        {2, 3, 9, 10, 3, 2, 1},
+        {1, 17, 8, 20, 1, 1, 0},
+        {2, 8, 12, 16, 5, 1, 2},
+    };
+    int layouts[] = {MATRIX4_NCHW8C, MATRIX4_NCHW16C};
+
+    bool diff = true;
+    for (int s = 0; s < 4; s++)
+    {
+        int *sh = shapes[s];
+        Matrix4 *weights = matrix4_init(sh[3], sh[1], sh[4], sh[4], NULL);
+        Matrix4 *input = matrix4_init(sh[0], sh[1], sh[2], sh[2], NULL);
+        Matrix *bias = matrix_init(sh[3], 1, NULL);
+        random_fill(weights->data, weights->size);
+        random_fill(input->data, input->size);
+        random_fill(bias->data, bias->size);
+
+        Matrix4 *expected = matrix4_convolve_direct(weights, input, NULL, sh[5], sh[6]);
+        matrix4_add_bias(expected, bias, expected);
+
+        for (int t = 0; t < 2; t++)
+        {
+            Matrix4 *blocked = matrix4_reorder(input, layouts[t], NULL);
+            Matrix4 *m3 = matrix4_convolve(weights, blocked, NULL, sh[5], sh[6]);
+            matrix4_add_bias(m3, bias, m3);
+            Matrix4 *m4 = matrix4_reorder(m3, MATRIX4_NCHW, NULL);
+
+            diff = diff && m3->layout == layouts[t] && matrix4_close(m4, expected);
+
+            // weights packed once, as the layers keep them
+            Matrix4 *packed = matrix4_blocked_weights(weights, layouts[t], NULL);
+            matrix4_convolve_blocked_fused(packed, blocked, m3, sh[5], sh[6], bias, ACTIVATION_IDENTITY);
+            matrix4_reorder(m3, MATRIX4_NCHW, m4);
+            diff = diff && matrix4_close(m4, expected);
+
+            matrix4_destroy(packed);
+            matrix4_destroy(blocked);
+            matrix4_destroy(m3);
+            matrix4_destroy(m4);
+        }
+
+        matrix4_destroy(weights);
+        matrix4_destroy(input);
+        matrix4_destroy(expected);
+        matrix_destroy(bias);
+    }
+
+    return assert(diff, true, "test_matrix4_convolve_blocked");
+}
+
+// reference loops of the convolution gradients: every (output, tap) pair
+// contributes weight * grad to the input and input * grad to the weight
+static void conv_grads_reference(Matrix4 *weights, Matrix4 *input, Matrix4 *grad_output,
+                                 Matrix4 *grad_weights, Matrix4 *grad_input, int stride, int padding)
+{
+    matrix4_zero(grad_weights);
+    matrix4_zero(grad_input);
+
+    for (int b = 0; b < grad_output->dim1; b++)
+        for (int f = 0; f < grad_output->dim2; f++)
+            for (int h = 0; h < grad_output->dim3; h++)
+                for (int w = 0; w < grad_output->dim4; w++)
+                    for (int c = 0; c < weights->dim2; c++)
+                        for (int fh = 0; fh < weights->dim3; fh++)
+                            for (int fw = 0; fw < weights->dim4; fw++)
+                            {
+                                int x = h * stride + fh - padding;
+                                int y = w * stride + fw - padding;
+                                if (x < 0 || x >= input->dim3 || y < 0 || y >= input->dim4)
+                                    continue;
+
+                                float g = m4_get(grad_output, b, f, h, w);
+                                m4_set(grad_input, b, c, x, y, m4_get(grad_input, b, c, x, y) + m4_get(weights, f, c, fh, fw) * g);
+                                m4_set(grad_weights, f, c, fh, fw, m4_get(grad_weights, f, c, fh, fw) + m4_get(input, b, c, x, y) * g);
+                            }
+}
+
+int test_matrix4_convolve_grads()
+{
+    // batch, in_channels, size, out_channels, kernel, stride, padding
+    int shapes[][7] = {
+        {1, 1, 3, 1, 2, 2, 1},
+        {2, 3, 9, 5, 3, 1, 1},
+        {4, 1, 12, 8, 3, 2, 1},
+        {1, 6, 7, 4, 1, 1, 0},
+        {3, 2, 11, 7, 5, 2, 2},
+    };
+
+    bool diff = true;
+    for (int s = 0; s < 5; s++)
+    {
+        int *sh = shapes[s];
+        int out_size = (sh[2] + 2 * sh[6] - sh[4]) / sh[5] + 1;
+        Matrix4 *weights = matrix4_init(sh[3], sh[1], sh[4], sh[4], NULL);
+        Matrix4 *input = matrix4_init(sh[0], sh[1], sh[2], sh[2], NULL);
+        Matrix4 *grad_output = matrix4_init(sh[0], sh[3], out_size, out_size, NULL);
+        random_fill(weights->data, weights->size);
+        random_fill(input->data, input->size);
+        random_fill(grad_output->data, grad_output->size);
+
+        Matrix4 *grad_weights = matrix4_init(sh[3], sh[1], sh[4], sh[4], NULL);
+        Matrix4 *grad_input = matrix4_init(sh[0], sh[1], sh[2], sh[2], NULL);
+        Matrix4 *expected_weights = matrix4_init(sh[3], sh[1], sh[4], sh[4], NULL);
+        Matrix4 *expected_input = matrix4_init(sh[0], sh[1], sh[2], sh[2], NULL);
+        conv_grads_reference(weights, input, grad_output, expected_weights, expected_input, sh[5], sh[6]);
+
+        // both destinations are overwritten, not accumulated into
+        for (int run = 0; run < 2; run++)
+        {
+            matrix4_convolve_weights_grad(input, grad_output, grad_weights, sh[5], sh[6]);
+            matrix4_grad_input_convolve(weights, grad_output, grad_input, sh[5], sh[6]);
+        }
+
+        diff = diff && matrix4_close(grad_weights, expected_weights) && matrix4_close(grad_input, expected_input);
+
+        matrix4_destroy(weights);
+        matrix4_destroy(input);
+        matrix4_destroy(grad_output);
+        matrix4_destroy(grad_weights);
+        matrix4_destroy(grad_input);
+        matrix4_destroy(expected_weights);
+        matrix4_destroy(expected_input);
+    }
+
+    return assert(diff, true, "test_matrix4_convolve_grads");
+}
+
 int test_matrix4_add_bias()
 {
     float bias[] = {
@@ -410,6 +1549,27 @@ int test_matrix4_copy()
     return assert(diff, true, "test_matrix4_copy");
 }
 
+int test_matrix4_slice()
+{
+    Matrix4 *m1 = matrix4_init(3, 2, 4, 5, NULL);
+    random_fill(m1->data, m1->size);
+
+    Matrix4 slice = matrix4_slice(m1, 2);
+    Matrix flat = matrix4_flatten_view(m1);
+    Matrix *copy = matrix4_flatten(m1, NULL);
+    Matrix4 unflat = matrix4_unflatten_view(copy, 2, 4, 5);
+
+    bool diff = slice.dim1 == 1 && slice.data == &m1->data[2 * 40] && !slice.owner;
+    diff = diff && m4_get(&slice, 0, 1, 3, 4) == m4_get(m1, 2, 1, 3, 4);
+    diff = diff && flat.data == m1->data && matrix_element_wise_equal(&flat, copy);
+    diff = diff && matrix4_element_wise_equal(&unflat, m1);
+
+    matrix4_destroy(m1);
+    matrix_destroy(copy);
+
+    return assert(diff, true, "test_matrix4_slice");
+}
+
 // TODO: more tests on the new matrix functions
 
 #pragma endregion matrix_4_tests
\ No newline at end of file
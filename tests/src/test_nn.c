@@ -280,4 +280,674 @@ int test_cnn_load()
     matrix_destroy(predictions);
 
     return assert(1, 1, "test_cnn_load");
-}
\ No newline at end of file
+}
+
+int test_softmax_cross_entropy()
+{
+    int batchsize = 3;
+    ActivationLayer *layer = activation_layer_init(10, batchsize, softmax, d_softmax);
+
+    Matrix *logits = matrix_init(batchsize, 10, NULL);
+    Matrix *labels = matrix_init(batchsize, 10, NULL);
+    for (int i = 0; i < logits->size; i++)
+        logits->data[i] = (float)(i * 7 % 23) - 11.0f;
+    for (int i = 0; i < batchsize; i++)
+        m_set(labels, i, (i * 3) % 10, 1);
+
+    Matrix *probabilities = activation_layer_forward(layer, logits);
+    Matrix *deltas = activation_layer_loss_backward(layer, labels);
+
+    // written in place, against a double precision softmax
+    bool diff = layer->softmax_cross_entropy && probabilities == layer->activations && deltas == layer->deltas;
+    for (int i = 0; i < batchsize; i++)
+    {
+        double max = -INFINITY, sum = 0;
+        for (int j = 0; j < 10; j++)
+            max = fmax(max, m_get(logits, i, j));
+        for (int j = 0; j < 10; j++)
+            sum += exp(m_get(logits, i, j) - max);
+
+        for (int j = 0; j < 10; j++)
+        {
+            double p = exp(m_get(logits, i, j) - max) / sum;
+            diff = diff && fabs(m_get(probabilities, i, j) - p) < 1e-6;
+            diff = diff && fabs(m_get(deltas, i, j) - (p - m_get(labels, i, j))) < 1e-6;
+        }
+    }
+
+    matrix_destroy(logits);
+    matrix_destroy(labels);
+    activation_layer_destroy(layer);
+
+    return assert(diff, true, "test_softmax_cross_entropy");
+}
+
+int test_weight_storage()
+{
+    int batchsize = 3;
+
+    ConvLayer **conv_layers = malloc(sizeof(ConvLayer *));
+    conv_layers[0] = conv_layer_init(8, 8, 2, 4, 3, 1, 1, batchsize, relu, d_relu, "conv0");
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *));
+    fc_layers[0] = fc_layer_init(4 * 8 * 8, 10, batchsize, sigmoid, d_sigmoid, "fc0");
+    ActivationLayer *output_layer = activation_layer_init(10, batchsize, softmax, d_softmax);
+    CNN *network = cnn_init(conv_layers, 1, fc_layers, 1, output_layer);
+
+    Matrix4 *input = matrix4_init(batchsize, 2, 8, 8, NULL);
+    for (int i = 0; i < input->size; i++)
+        input->data[i] = (rand() % 255) / 255.0;
+
+    Matrix *expected = cnn_forward(network, input);
+
+    // 16-bit weights stay close to the fp32 network, bf16 having 3 fewer mantissa bits
+    bool diff = true;
+    float tolerance[] = {0.0f, 2e-3f, 2e-2f};
+    for (int storage = FLOAT_STORAGE_FP16; storage <= FLOAT_STORAGE_BF16; storage++)
+    {
+        cnn_set_weight_storage(network, storage);
+        Matrix *predictions = cnn_forward(network, input);
+        for (int i = 0; i < expected->size; i++)
+            diff = diff && fabsf(predictions->data[i] - expected->data[i]) < tolerance[storage];
+        matrix_destroy(predictions);
+    }
+
+    // training updates the fp32 weights, the 16-bit copy follows them
+    Matrix *labels = matrix_init(batchsize, 10, NULL);
+    for (int i = 0; i < batchsize; i++)
+        m_set(labels, i, i, 1);
+    cnn_train_batch(network, input, labels, 0.01);
+
+    Matrix *bf16 = cnn_forward(network, input);
+    cnn_set_weight_storage(network, FLOAT_STORAGE_FP32);
+    Matrix *fp32 = cnn_forward(network, input);
+    for (int i = 0; i < fp32->size; i++)
+        diff = diff && fabsf(bf16->data[i] - fp32->data[i]) < tolerance[FLOAT_STORAGE_BF16];
+    diff = diff && network->fc_layers[0]->weights16 == NULL;
+
+    matrix_destroy(expected);
+    matrix_destroy(labels);
+    matrix_destroy(bf16);
+    matrix_destroy(fp32);
+    matrix4_destroy(input);
+    cnn_destroy(network);
+
+    return assert(diff, true, "test_weight_storage");
+}
+
+int test_nn_predict_batch()
+{
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *) * 2);
+    fc_layers[0] = fc_layer_init(28 * 28, 32, 1, relu, d_relu, "fc0");
+    fc_layers[1] = fc_layer_init(32, 10, 1, relu, d_relu, "fc1");
+    ActivationLayer *output_layer = activation_layer_init(10, 1, softmax, d_softmax);
+    NN *network = nn_init(fc_layers, 2, output_layer);
+    for (int l = 0; l < 2; l++)
+        matrix_multiply_scalar(fc_layers[l]->weights, 0.1f);
+
+    // one row per cell of a grid
+    Matrix *cells = matrix_init(81, 28 * 28, NULL);
+    for (int i = 0; i < cells->size; i++)
+        cells->data[i] = (rand() % 255) / 255.0;
+
+    int expected[81];
+    float expected_confidences[81];
+    for (int i = 0; i < 81; i++)
+    {
+        Matrix row = matrix_view(cells, i, 0, 1, 28 * 28);
+        Matrix *output = nn_forward(network, &row);
+        int *prediction = matrix_argmax(output);
+        expected[i] = prediction[0];
+        expected_confidences[i] = m_get(output, 0, prediction[0]);
+        free(prediction);
+        matrix_destroy(output);
+    }
+
+    // the same predictions from a single batch
+    int labels[81];
+    float confidences[81];
+    nn_predict_batch(network, cells, 81, labels, confidences);
+
+    bool diff = fc_layers[0]->activations->dim1 == 81;
+    for (int i = 0; i < 81; i++)
+        diff = diff && labels[i] == expected[i] && fabsf(confidences[i] - expected_confidences[i]) < 1e-5f;
+
+    // and back to batches of one
+    nn_set_batch_size(network, 1);
+    Matrix last = matrix_view(cells, 80, 0, 1, 28 * 28);
+    int *prediction = nn_predict(network, &last);
+    diff = diff && prediction[0] == expected[80];
+
+    free(prediction);
+    matrix_destroy(cells);
+    nn_destroy(network);
+
+    return assert(diff, true, "test_nn_predict_batch");
+}
+
+int test_nn_compile_inference()
+{
+    int batchsize = 4;
+
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *) * 3);
+    fc_layers[0] = fc_layer_init(40, 32, batchsize, relu, d_relu, "fc0");
+    fc_layers[1] = fc_layer_init(32, 64, batchsize, sigmoid, d_sigmoid, "fc1");
+    fc_layers[2] = fc_layer_init(64, 10, batchsize, relu, d_relu, "fc2");
+    ActivationLayer *output_layer = activation_layer_init(10, batchsize, softmax, d_softmax);
+    NN *network = nn_init(fc_layers, 3, output_layer);
+    for (int l = 0; l < 3; l++)
+        matrix_multiply_scalar(fc_layers[l]->weights, 0.1f);
+
+    Matrix *samples = matrix_init(20, 40, NULL);
+    for (int i = 0; i < samples->size; i++)
+        samples->data[i] = (rand() % 255) / 255.0;
+
+    // reference outputs of the training-mode network
+    Matrix *expected = matrix_init(20, 10, NULL);
+    for (int row = 0; row < 20; row += batchsize)
+    {
+        Matrix batch = matrix_view(samples, row, 0, batchsize, 40);
+        Matrix *output = nn_forward(network, &batch);
+        Matrix dst = matrix_view(expected, row, 0, batchsize, 10);
+        matrix_copy(output, &dst);
+        matrix_destroy(output);
+    }
+
+    nn_compile_inference(network, 8);
+    bool diff = network->plan != NULL && fc_layers[0]->weights_gradient == NULL &&
+                fc_layers[2]->activations == NULL && output_layer->deltas == NULL;
+
+    // batches of any size up to max_batch, written inside the plan
+    Matrix first = matrix_view(samples, 0, 0, 8, 40);
+    Matrix *y = nn_infer(network, &first);
+    diff = diff && y->dim1 == 8 && y->dim2 == 10;
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 10; j++)
+            diff = diff && fabsf(MAT(y, i, j) - MAT(expected, i, j)) < 1e-5f;
+
+    // no arena temporary once warm
+    matrix_arena_reset_stats();
+    Matrix three = matrix_view(samples, 5, 0, 3, 40);
+    y = nn_infer(network, &three);
+    diff = diff && matrix_arena_stats().requests == 0;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 10; j++)
+            diff = diff && fabsf(MAT(y, i, j) - MAT(expected, 5 + i, j)) < 1e-5f;
+
+    // nn_forward keeps returning a copy owned by the caller
+    Matrix *copy = nn_forward(network, &three);
+    diff = diff && copy->data != y->data && fabsf(copy->data[0] - MAT(expected, 5, 0)) < 1e-5f;
+    matrix_destroy(copy);
+
+    // nn_predict_batch splits the rows in batches of max_batch
+    int labels[20];
+    nn_predict_batch(network, samples, 20, labels, NULL);
+    int *expected_labels = matrix_argmax(expected);
+    for (int i = 0; i < 20; i++)
+        diff = diff && labels[i] == expected_labels[i];
+
+    free(expected_labels);
+    matrix_destroy(expected);
+    matrix_destroy(samples);
+    nn_destroy(network);
+
+    return assert(diff, true, "test_nn_compile_inference");
+}
+
+int test_prune()
+{
+    int batchsize = 6;
+
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *) * 2);
+    fc_layers[0] = fc_layer_init(40, 32, batchsize, relu, d_relu, "fc0");
+    fc_layers[1] = fc_layer_init(32, 5, batchsize, sigmoid, d_sigmoid, "fc1");
+    ActivationLayer *output_layer = activation_layer_init(5, batchsize, softmax, d_softmax);
+    NN *network = nn_init(fc_layers, 2, output_layer);
+
+    // the first layer goes sparse, the second one stays dense
+    float sparsity[] = {0.75f, 0.3f};
+    nn_prune(network, sparsity);
+
+    bool diff = true;
+    for (int l = 0; l < 2; l++)
+    {
+        int zeros = 0;
+        for (int i = 0; i < fc_layers[l]->weights->size; i++)
+            zeros += fc_layers[l]->weights->data[i] == 0.0f;
+        diff = diff && zeros == (int)(sparsity[l] * fc_layers[l]->weights->size);
+    }
+
+    Matrix *input = matrix_init(batchsize, 40, NULL);
+    Matrix *labels = matrix_init(batchsize, 5, NULL);
+    for (int i = 0; i < input->size; i++)
+        input->data[i] = (rand() % 255) / 255.0;
+    for (int i = 0; i < batchsize; i++)
+        m_set(labels, i, i % 5, 1);
+
+    // training keeps the pruned weights at zero and the CSR copy up to date
+    for (int step = 0; step < 2; step++)
+    {
+        Matrix *expected = matrix_multiply_fused(input, false, fc_layers[0]->weights, true,
+                                                 fc_layers[0]->biases, ACTIVATION_RELU, NULL);
+        Matrix *activations = fc_layer_forward(fc_layers[0], input);
+        for (int i = 0; i < expected->size; i++)
+            diff = diff && fabsf(activations->data[i] - expected->data[i]) < 1e-4f;
+        diff = diff && fc_layers[0]->sparse_weights->nnz == 40 * 32 - (int)(0.75f * 40 * 32);
+        matrix_destroy(expected);
+
+        nn_train_batch(network, input, labels, 0.1);
+        for (int i = 0; i < fc_layers[0]->weights->size; i++)
+            diff = diff && (fc_layers[0]->prune_mask->data[i] != 0.0f || fc_layers[0]->weights->data[i] == 0.0f);
+    }
+
+    // sparsity 0 makes the layer dense again
+    fc_layer_prune(fc_layers[0], 0.0f);
+    diff = diff && fc_layers[0]->prune_mask == NULL;
+
+    matrix_destroy(input);
+    matrix_destroy(labels);
+    nn_destroy(network);
+
+    return assert(diff, true, "test_prune");
+}
+
+int test_quantize()
+{
+    int batchsize = 4;
+    int num_samples = 64;
+
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *) * 2);
+    fc_layers[0] = fc_layer_init(40, 32, batchsize, relu, d_relu, "fc0");
+    fc_layers[1] = fc_layer_init(32, 5, batchsize, leaky_relu, d_leaky_relu, "fc1");
+    ActivationLayer *output_layer = activation_layer_init(5, batchsize, softmax, d_softmax);
+    NN *network = nn_init(fc_layers, 2, output_layer);
+
+    // smaller weights keep the softmax away from saturation
+    for (int l = 0; l < 2; l++)
+        matrix_multiply_scalar(fc_layers[l]->weights, 0.2f);
+
+    Matrix *samples = matrix_init(num_samples, 40, NULL);
+    int *labels = malloc(sizeof(int) * num_samples);
+    for (int i = 0; i < samples->size; i++)
+        samples->data[i] = (rand() % 255) / 255.0;
+
+    // the fp32 predictions as labels: the accuracy of int8 is its agreement
+    Matrix *expected = matrix_init(num_samples, 5, NULL);
+    for (int row = 0; row < num_samples; row += batchsize)
+    {
+        Matrix batch = matrix_view(samples, row, 0, batchsize, 40);
+        Matrix *output = nn_forward(network, &batch);
+        int *classes = matrix_argmax(output);
+        for (int i = 0; i < batchsize; i++)
+        {
+            labels[row + i] = classes[i];
+            for (int j = 0; j < 5; j++)
+                m_set(expected, row + i, j, m_get(output, i, j));
+        }
+        free(classes);
+        matrix_destroy(output);
+    }
+
+    bool diff = true;
+    for (int per_channel = 0; per_channel <= 1; per_channel++)
+    {
+        QNN *quantized = qnn_quantize(network, samples, per_channel);
+
+        // any batch size, outputs close to the fp32 network
+        Matrix *got = qnn_forward(quantized, samples);
+        for (int i = 0; i < got->size; i++)
+            diff = diff && fabsf(got->data[i] - expected->data[i]) < 0.05f;
+
+        QuantizeReport report = qnn_evaluate(quantized, network, samples, labels);
+        diff = diff && report.samples == num_samples && report.fp32_accuracy == 1.0f;
+        diff = diff && report.agreement == report.int8_accuracy && report.int8_accuracy >= 0.9f;
+        diff = diff && report.max_abs_diff < 0.05f;
+
+        // a saved network computes the same outputs
+        qnn_save(quantized, "tests/out/qnn-test");
+        QNN *loaded = qnn_load("tests/out/qnn-test", softmax);
+        Matrix *reloaded = qnn_forward(loaded, samples);
+        diff = diff && loaded->num_layers == 2 && memcmp(got->data, reloaded->data, sizeof(float) * got->size) == 0;
+
+        matrix_destroy(got);
+        matrix_destroy(reloaded);
+        qnn_destroy(quantized);
+        qnn_destroy(loaded);
+    }
+
+    diff = diff && qnn_load("tests/out/missing", softmax) == NULL;
+
+    matrix_destroy(samples);
+    matrix_destroy(expected);
+    free(labels);
+    nn_destroy(network);
+
+    return assert(diff, true, "test_quantize");
+}
+
+// sample i is a row of i, with the label i % 3
+static void read_sample(void *ctx, int sample, float *dst)
+{
+    (void)ctx;
+    for (int j = 0; j < 4; j++)
+        dst[j] = sample;
+}
+
+int test_dataloader()
+{
+    int labels[10];
+    for (int i = 0; i < 10; i++)
+        labels[i] = i % 3;
+
+    // 3 batches of 3 per epoch, the same order with 1 or 3 threads
+    DataLoader *loader = dataloader_init(10, 4, labels, 3, 3, read_sample, NULL, DATALOADER_PREFETCH, 3, 42);
+    DataLoader *serial = dataloader_init(10, 4, labels, 3, 3, read_sample, NULL, 0, 1, 42);
+    bool diff = loader->batches_per_epoch == 3;
+
+    int orders[4][9];
+    for (int epoch = 0; epoch < 4; epoch++)
+    {
+        bool seen[10] = {false};
+        for (int b = 0; b < 3; b++)
+        {
+            DataBatch *batch = dataloader_next(loader);
+            DataBatch *expected = dataloader_next(serial);
+            diff = diff && batch->index == epoch * 3 + b;
+
+            for (int i = 0; i < 3; i++)
+            {
+                int sample = (int)MAT(batch->inputs, i, 0);
+                diff = diff && !seen[sample] && MAT(batch->inputs, i, 3) == sample;
+                diff = diff && MAT(expected->inputs, i, 0) == sample;
+                for (int c = 0; c < 3; c++)
+                    diff = diff && MAT(batch->labels, i, c) == (c == labels[sample] ? 1.0f : 0.0f);
+                seen[sample] = true;
+                orders[epoch][b * 3 + i] = sample;
+            }
+        }
+    }
+
+    // every epoch is shuffled again
+    bool reshuffled = false;
+    for (int i = 0; i < 9; i++)
+        reshuffled = reshuffled || orders[0][i] != orders[1][i] || orders[0][i] != orders[2][i];
+    diff = diff && reshuffled;
+
+    dataloader_destroy(loader);
+    dataloader_destroy(serial);
+
+    return assert(diff, true, "test_dataloader");
+}
+
+static NN *trainer_test_nn(int batchsize)
+{
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *) * 2);
+    fc_layers[0] = fc_layer_init(40, 32, batchsize, relu, d_relu, "fc0");
+    fc_layers[1] = fc_layer_init(32, 5, batchsize, sigmoid, d_sigmoid, "fc1");
+    ActivationLayer *output_layer = activation_layer_init(5, batchsize, softmax, d_softmax);
+    return nn_init(fc_layers, 2, output_layer);
+}
+
+// copies the weights of src into dst
+static void trainer_test_copy(NN *src, NN *dst)
+{
+    for (int l = 0; l < src->num_fc_layers; l++)
+    {
+        matrix_copy(src->fc_layers[l]->weights, dst->fc_layers[l]->weights);
+        matrix_copy(src->fc_layers[l]->biases, dst->fc_layers[l]->biases);
+    }
+}
+
+static bool trainer_test_close(NN *a, NN *b, float tolerance)
+{
+    bool close = true;
+    for (int l = 0; l < a->num_fc_layers; l++)
+        for (int i = 0; i < a->fc_layers[l]->weights->size; i++)
+            close = close && fabsf(a->fc_layers[l]->weights->data[i] - b->fc_layers[l]->weights->data[i]) <= tolerance;
+    return close;
+}
+
+int test_trainer()
+{
+    int batchsize = 12;
+    int threads = matrix_get_num_threads();
+
+    // the same network trained serially, in 1 shard and in 4 shards with
+    // the pool and without
+    NN *reference = trainer_test_nn(batchsize);
+    NN *single = trainer_test_nn(batchsize);
+    NN *sharded = trainer_test_nn(batchsize);
+    NN *serial = trainer_test_nn(batchsize);
+    for (int l = 0; l < 2; l++)
+        matrix_multiply_scalar(reference->fc_layers[l]->weights, 0.1f);
+    trainer_test_copy(reference, single);
+    trainer_test_copy(reference, sharded);
+    trainer_test_copy(reference, serial);
+
+    Trainer *single_trainer = trainer_init_nn(single, batchsize, 1);
+    Trainer *sharded_trainer = trainer_init_nn(sharded, batchsize, 4);
+    Trainer *serial_trainer = trainer_init_nn(serial, batchsize, 4);
+    bool diff = sharded_trainer->num_shards == 4;
+
+    Matrix *input = matrix_init(batchsize, 40, NULL);
+    Matrix *labels = matrix_init(batchsize, 5, NULL);
+    for (int step = 0; step < 3; step++)
+    {
+        matrix_zero(labels);
+        for (int i = 0; i < input->size; i++)
+            input->data[i] = (rand() % 255) / 255.0;
+        for (int i = 0; i < batchsize; i++)
+            m_set(labels, i, rand() % 5, 1);
+
+        double expected = nn_train_batch(reference, input, labels, 0.05);
+        diff = diff && fabs(trainer_nn_train_batch(single_trainer, input, labels, 0.05) - expected) < 1e-9;
+        diff = diff && fabs(trainer_nn_train_batch(sharded_trainer, input, labels, 0.05) - expected) < 1e-5;
+        matrix_set_num_threads(1);
+        trainer_nn_train_batch(serial_trainer, input, labels, 0.05);
+        matrix_set_num_threads(threads);
+    }
+
+    // one shard is the serial computation, shards only change the order of
+    // the sums and the threads nothing
+    diff = diff && trainer_test_close(reference, single, 0.0f);
+    diff = diff && trainer_test_close(reference, sharded, 1e-5f);
+    diff = diff && trainer_test_close(sharded, serial, 0.0f);
+
+    trainer_destroy(single_trainer);
+    trainer_destroy(sharded_trainer);
+    trainer_destroy(serial_trainer);
+    nn_destroy(reference);
+    nn_destroy(single);
+    nn_destroy(sharded);
+    nn_destroy(serial);
+
+    // a CNN in 2 shards follows cnn_train_batch
+    ConvLayer **conv_layers = malloc(sizeof(ConvLayer *));
+    conv_layers[0] = conv_layer_init(8, 8, 1, 4, 3, 1, 1, 4, relu, d_relu, "conv0");
+    FCLayer **fc_layers = malloc(sizeof(FCLayer *));
+    fc_layers[0] = fc_layer_init(4 * 8 * 8, 3, 4, sigmoid, d_sigmoid, "fc0");
+    CNN *cnn = cnn_init(conv_layers, 1, fc_layers, 1, activation_layer_init(3, 4, softmax, d_softmax));
+
+    ConvLayer **conv_copy = malloc(sizeof(ConvLayer *));
+    conv_copy[0] = conv_layer_init(8, 8, 1, 4, 3, 1, 1, 4, relu, d_relu, "conv0");
+    FCLayer **fc_copy = malloc(sizeof(FCLayer *));
+    fc_copy[0] = fc_layer_init(4 * 8 * 8, 3, 4, sigmoid, d_sigmoid, "fc0");
+    CNN *cnn_sharded = cnn_init(conv_copy, 1, fc_copy, 1, activation_layer_init(3, 4, softmax, d_softmax));
+    matrix4_multiply_scalar(conv_layers[0]->weights, 0.1f);
+    matrix_multiply_scalar(fc_layers[0]->weights, 0.01f);
+    matrix4_copy(conv_layers[0]->weights, conv_copy[0]->weights);
+    matrix_copy(fc_layers[0]->weights, fc_copy[0]->weights);
+
+    Matrix4 *images = matrix4_init(4, 1, 8, 8, NULL);
+    Matrix *cnn_labels = matrix_init(4, 3, NULL);
+    for (int i = 0; i < images->size; i++)
+        images->data[i] = (rand() % 255) / 255.0;
+    for (int i = 0; i < 4; i++)
+        m_set(cnn_labels, i, i % 3, 1);
+
+    Trainer *cnn_trainer = trainer_init_cnn(cnn_sharded, 4, 2);
+    for (int step = 0; step < 3; step++)
+    {
+        double expected = cnn_train_batch(cnn, images, cnn_labels, 0.05);
+        diff = diff && fabs(trainer_cnn_train_batch(cnn_trainer, images, cnn_labels, 0.05) - expected) < 1e-5;
+    }
+    for (int i = 0; i < conv_layers[0]->weights->size; i++)
+        diff = diff && fabsf(conv_layers[0]->weights->data[i] - conv_copy[0]->weights->data[i]) < 1e-5f;
+    for (int i = 0; i < fc_layers[0]->weights->size; i++)
+        diff = diff && fabsf(fc_layers[0]->weights->data[i] - fc_copy[0]->weights->data[i]) < 1e-5f;
+
+    trainer_destroy(cnn_trainer);
+    cnn_destroy(cnn);
+    cnn_destroy(cnn_sharded);
+    matrix4_destroy(images);
+    matrix_destroy(cnn_labels);
+    matrix_destroy(input);
+    matrix_destroy(labels);
+
+    return assert(diff, true, "test_trainer");
+}
+
+// one step of the optimizer on a single parameter, in double
+static double optimizer_test_update(Optimizer *optimizer, double p, double g, double *m, double *v, bool decays)
+{
+    double lr = optimizer->learning_rate;
+    double decay = decays ? 1.0 - lr * optimizer->weight_decay : 1.0;
+    switch (optimizer->kind)
+    {
+    case OPTIMIZER_MOMENTUM:
+        *m = optimizer->momentum * *m + g;
+        return p * decay - lr * *m;
+    case OPTIMIZER_NESTEROV:
+        *m = optimizer->momentum * *m + g;
+        return p * decay - lr * (g + optimizer->momentum * *m);
+    case OPTIMIZER_ADAM:
+        *m = optimizer->beta1 * *m + (1 - optimizer->beta1) * g;
+        *v = optimizer->beta2 * *v + (1 - optimizer->beta2) * g * g;
+        double m_hat = *m / (1 - pow(optimizer->beta1, optimizer->step));
+        double v_hat = *v / (1 - pow(optimizer->beta2, optimizer->step));
+        return p * decay - lr * m_hat / (sqrt(v_hat) + optimizer->epsilon);
+    default:
+        return p * decay - lr * g;
+    }
+}
+
+int test_optimizer()
+{
+    int batchsize = 8;
+    bool diff = true;
+
+    Matrix *input = matrix_init(batchsize, 40, NULL);
+    Matrix *labels = matrix_init(batchsize, 5, NULL);
+    for (int i = 0; i < input->size; i++)
+        input->data[i] = (rand() % 255) / 255.0;
+    for (int i = 0; i < batchsize; i++)
+        m_set(labels, i, i % 5, 1);
+
+    // SGD through the optimizer is the update of nn_train_batch
+    NN *reference = trainer_test_nn(batchsize);
+    NN *network = trainer_test_nn(batchsize);
+    for (int l = 0; l < 2; l++)
+        matrix_multiply_scalar(reference->fc_layers[l]->weights, 0.1f);
+    trainer_test_copy(reference, network);
+    Optimizer sgd = optimizer_sgd(0.05f);
+    for (int step = 0; step < 3; step++)
+    {
+        nn_train_batch(reference, input, labels, 0.05f);
+        Matrix *predictions = nn_forward(network, input);
+        nn_gradients(network, input, labels);
+        nn_optimize(network, &sgd);
+        matrix_destroy(predictions);
+    }
+    diff = diff && trainer_test_close(reference, network, 0.0f);
+    nn_destroy(network);
+
+    // every rule follows its formula, with the state kept across steps
+    Optimizer optimizers[] = {
+        optimizer_momentum(0.05f, 0.9f, false),
+        optimizer_momentum(0.05f, 0.9f, true),
+        optimizer_adam(0.01f, 0.9f, 0.999f, 1e-8f),
+        optimizer_adamw(0.01f, 0.9f, 0.999f, 1e-8f, 0.1f),
+    };
+    for (int o = 0; o < 4; o++)
+    {
+        Optimizer *optimizer = &optimizers[o];
+        network = trainer_test_nn(batchsize);
+        trainer_test_copy(reference, network);
+
+        // weights then biases of both layers
+        Matrix *params[4], *gradients[4];
+        double *expected[4], *m[4], *v[4];
+        for (int l = 0; l < 2; l++)
+        {
+            params[2 * l] = network->fc_layers[l]->weights;
+            params[2 * l + 1] = network->fc_layers[l]->biases;
+            gradients[2 * l] = network->fc_layers[l]->weights_gradient;
+            gradients[2 * l + 1] = network->fc_layers[l]->biases_gradient;
+        }
+        for (int t = 0; t < 4; t++)
+        {
+            expected[t] = malloc(sizeof(double) * params[t]->size);
+            m[t] = calloc(params[t]->size, sizeof(double));
+            v[t] = calloc(params[t]->size, sizeof(double));
+            for (int i = 0; i < params[t]->size; i++)
+                expected[t][i] = params[t]->data[i];
+        }
+
+        double first_loss = 0, loss = 0;
+        for (int step = 0; step < 20; step++)
+        {
+            Matrix *predictions = nn_forward(network, input);
+            loss = cross_entropy_loss(predictions, labels);
+            if (step == 0)
+                first_loss = loss;
+            nn_gradients(network, input, labels);
+            nn_optimize(network, optimizer);
+            matrix_destroy(predictions);
+
+            for (int t = 0; t < 4; t++)
+                for (int i = 0; i < params[t]->size; i++)
+                {
+                    expected[t][i] = optimizer_test_update(optimizer, expected[t][i], gradients[t]->data[i],
+                                                           &m[t][i], &v[t][i], t % 2 == 0);
+                    diff = diff && fabs(params[t]->data[i] - expected[t][i]) < 1e-4;
+                    // the reference goes on from the network so the errors do not add up
+                    expected[t][i] = params[t]->data[i];
+                }
+        }
+        diff = diff && optimizer->step == 20 && loss < first_loss;
+
+        for (int t = 0; t < 4; t++)
+        {
+            free(expected[t]);
+            free(m[t]);
+            free(v[t]);
+        }
+        nn_destroy(network);
+    }
+
+    // the trainer runs the optimizer once per batch, whatever the shards
+    network = trainer_test_nn(batchsize);
+    NN *sharded = trainer_test_nn(batchsize);
+    trainer_test_copy(reference, network);
+    trainer_test_copy(reference, sharded);
+    Trainer *trainer = trainer_init_nn(sharded, batchsize, 2);
+    trainer_set_optimizer(trainer, optimizer_adam(0.0f, 0.9f, 0.999f, 1e-8f));
+    Optimizer adam = optimizer_adam(0.01f, 0.9f, 0.999f, 1e-8f);
+    for (int step = 0; step < 3; step++)
+    {
+        Matrix *predictions = nn_forward(network, input);
+        nn_gradients(network, input, labels);
+        nn_optimize(network, &adam);
+        matrix_destroy(predictions);
+        trainer_nn_train_batch(trainer, input, labels, 0.01f);
+    }
+    diff = diff && trainer_test_close(network, sharded, 1e-5f);
+
+    trainer_destroy(trainer);
+    nn_destroy(sharded);
+    nn_destroy(network);
+    nn_destroy(reference);
+    matrix_destroy(input);
+    matrix_destroy(labels);
+
+    return assert(diff, true, "test_optimizer");
+}
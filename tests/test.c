@@ -51,9 +51,24 @@ int (*tests_matrix[])() = {
     test_matrix_add,
     test_matrix_subtract,
     test_matrix_multiply,
+    test_matrix_multiply_large,
+    test_matrix_multiply_ex,
+    test_matrix_multiply_fused,
     test_matrix_multiply_scalar,
     test_matrix_transpose,
     test_matrix_map_function,
+    test_matrix_activate,
+    test_simd_kernels,
+    test_matrix_det,
+    test_matrix_inverse,
+    test_matrix_solve,
+    test_linalg,
+    test_matrix_arena,
+    test_matrix_view,
+    test_matrix_threads,
+    test_matrix_reductions,
+    test_matrix16,
+    test_matrix_sparse,
     test_matrix4_init,
     test_matrix4_add,
     test_matrix4_subtract,
@@ -61,9 +76,16 @@ int (*tests_matrix[])() = {
     test_matrix4_transpose,
     test_matrix4_map_function,
     test_matrix4_convolve,
+    test_matrix4_convolve_im2col,
+    test_matrix4_convolve_winograd,
+    test_matrix4_reorder,
+    test_matrix4_convolve_blocked,
+    test_matrix4_convolve_grads,
+    test_matrix4_convolve_fused,
     test_matrix4_add_bias,
     test_matrix4_sum_rows,
     test_matrix4_copy,
+    test_matrix4_slice,
 };
 
 int (*tests_nn[])() = {
@@ -71,6 +93,15 @@ int (*tests_nn[])() = {
     test_nnxor_load,
     test_cnn,
     test_cnn_load,
+    test_softmax_cross_entropy,
+    test_weight_storage,
+    test_nn_predict_batch,
+    test_nn_compile_inference,
+    test_prune,
+    test_quantize,
+    test_dataloader,
+    test_trainer,
+    test_optimizer,
 };
 
 int main()